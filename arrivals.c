@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "arrivals.h"
+#include "rng.h"
+
+
+int arrival_ring_init(struct arrival_ring *ring, size_t capacity)
+{
+  size_t size = 1;
+  while (size < capacity)
+    size <<= 1;
+  ring->times = malloc(size * sizeof(uint64_t));
+  if (ring->times == NULL) {
+    perror("Failed to allocate arrival ring");
+    return -1;
+  }
+  ring->capacity = size;
+  ring->count = 0;
+  ring->resolution_ns = 0;
+  return 0;
+}
+
+void arrival_ring_free(struct arrival_ring *ring)
+{
+  free(ring->times);
+  ring->times = NULL;
+}
+
+static uint64_t _timespec_to_ns(const struct timespec *ts)
+{
+  return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+void arrival_sample_take(struct arrival_sample *sample, const struct arrival_ring *ring, uint64_t start_count,
+			 const struct timespec *start, const struct timespec *end,
+			 double target_start, double target_end)
+{
+  uint64_t first = start_count;
+  size_t mask = ring->capacity - 1;
+  memset(sample, 0, sizeof(struct arrival_sample));
+  sample->start_ns = _timespec_to_ns(start);
+  sample->end_ns = _timespec_to_ns(end);
+  sample->target_start = target_start;
+  sample->target_end = target_end;
+  sample->resolution_ns = ring->resolution_ns;
+  if (ring->count - first > ring->capacity) {
+    first = ring->count - ring->capacity;
+    sample->truncated = 1;
+  }
+  sample->nb_times = ring->count - first;
+  if (sample->nb_times == 0)
+    return;
+  sample->times = malloc(sample->nb_times * sizeof(uint64_t));
+  if (sample->times == NULL) {
+    sample->nb_times = 0;
+    return;
+  }
+  /* At most two contiguous chunks */
+  size_t head = first & mask;
+  size_t len1 = ring->capacity - head < sample->nb_times ? ring->capacity - head : sample->nb_times;
+  memcpy(sample->times, ring->times + head, len1 * sizeof(uint64_t));
+  memcpy(sample->times + len1, ring->times, (sample->nb_times - len1) * sizeof(uint64_t));
+  if (sample->truncated) {
+    /* Only analyse from the first arrival still in the ring, at the
+       target rate of that time. */
+    double duration = sample->end_ns - sample->start_ns;
+    double elapsed = sample->times[0] - sample->start_ns;
+    if (duration > 0.)
+      sample->target_start += (target_end - target_start) * elapsed / duration;
+    sample->start_ns = sample->times[0];
+  }
+}
+
+void arrival_sample_free(struct arrival_sample *sample)
+{
+  free(sample->times);
+  sample->times = NULL;
+  sample->nb_times = 0;
+}
+
+/* Integrated target rate between the start of the sample and [t_ns]
+   after it, i.e. the expected number of arrivals. */
+static double _integrated_rate(const struct arrival_sample *sample, double t_ns)
+{
+  double duration = (sample->end_ns - sample->start_ns) / 1e9;
+  double t = t_ns / 1e9;
+  double slope = duration > 0. ? (sample->target_end - sample->target_start) / duration : 0.;
+  return sample->target_start * t + slope * t * t / 2;
+}
+
+static int _compare_double(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+int arrival_check(const struct arrival_sample *sample, struct arrival_check *result)
+{
+  double *d, *t;
+  struct rng rng;
+  double sum = 0., sum_sq = 0., mean, ks = 0., ad = 0.;
+  double prev, tau, window_ns = ARRIVALS_WINDOW_MSEC * 1e6;
+  size_t n;
+  memset(result, 0, sizeof(struct arrival_check));
+  if (sample->nb_times < 21)
+    return -1;
+  n = sample->nb_times - 1;
+  result->nb_interarrivals = n;
+
+  /* A simulated clock has a resolution of sample->resolution_ns, so that
+     at high rates many arrivals fall on the same tick.  Spreading the
+     arrivals of each tick uniformly over it gives back a Poisson process,
+     since given the number of arrivals in an interval, their times are
+     independent and uniform.  Measured times are left as they are, so
+     that arrivals clumped by the event loop are caught. */
+  t = malloc(sample->nb_times * sizeof(double));
+  d = malloc(n * sizeof(double));
+  if (t == NULL || d == NULL) {
+    free(t);
+    free(d);
+    return -1;
+  }
+  rng_seed(&rng, sample->start_ns);
+  for (size_t i = 0; i < sample->nb_times; i++)
+    t[i] = (double) (sample->times[i] - sample->start_ns) + rng_double(&rng) * sample->resolution_ns;
+  qsort(t, sample->nb_times, sizeof(double), _compare_double);
+
+  /* Rescaled interarrivals, expected to be Exp(1) */
+  prev = _integrated_rate(sample, t[0]);
+  for (size_t i = 0; i < n; i++) {
+    tau = _integrated_rate(sample, t[i + 1]);
+    d[i] = tau - prev;
+    prev = tau;
+    sum += d[i];
+    sum_sq += d[i] * d[i];
+  }
+  mean = sum / n;
+  result->cv = mean > 0. ? sqrt(fmax(sum_sq / n - mean * mean, 0.)) / mean : 0.;
+
+  /* Kolmogorov-Smirnov and Anderson-Darling against Exp(1).  The CDF is
+     u = 1 - exp(-d), and log(1 - u) = -d is used directly for accuracy.
+     Arrivals at the same nanosecond have a CDF of 0, which is clamped. */
+  qsort(d, n, sizeof(double), _compare_double);
+  for (size_t i = 0; i < n; i++) {
+    double di = fmax(d[i], 1e-12);
+    double u = -expm1(-di);
+    double dn = fmax(d[n - 1 - i], 1e-12);
+    double below = u - (double) i / n;
+    double above = (double) (i + 1) / n - u;
+    if (below > ks)
+      ks = below;
+    if (above > ks)
+      ks = above;
+    ad += (2. * i + 1.) * (log(u) - dn);
+  }
+  result->ks = ks;
+  result->ks_critical = ARRIVALS_KS_COEFF_1PCT / sqrt(n);
+  result->ad = -(double) n - ad / n;
+  free(d);
+  free(t);
+
+  /* Arrivals per window, compared with the expected number */
+  result->nb_windows = (sample->end_ns - sample->start_ns) / window_ns;
+  if (result->nb_windows > 0) {
+    size_t i = 0;
+    double chi2 = 0., total = 0.;
+    result->window_min = UINT64_MAX;
+    for (unsigned int w = 0; w < result->nb_windows; w++) {
+      uint64_t w_start = sample->start_ns + w * window_ns;
+      uint64_t w_end = w_start + window_ns;
+      uint64_t count = 0;
+      double expected;
+      while (i < sample->nb_times && sample->times[i] < w_start)
+	i++;
+      while (i < sample->nb_times && sample->times[i] < w_end) {
+	count++;
+	i++;
+      }
+      expected = _integrated_rate(sample, w_end - sample->start_ns) - _integrated_rate(sample, w_start - sample->start_ns);
+      if (expected > 0.)
+	chi2 += (count - expected) * (count - expected) / expected;
+      total += count;
+      if (count < result->window_min)
+	result->window_min = count;
+      if (count > result->window_max)
+	result->window_max = count;
+    }
+    result->window_mean = total / result->nb_windows;
+    result->window_dispersion = chi2 / result->nb_windows;
+  }
+
+  result->pass = result->ks < result->ks_critical && result->ad < ARRIVALS_AD_CRITICAL_1PCT;
+  return 0;
+}
+
+void arrival_check_print(FILE *out, const struct arrival_sample *sample, const struct arrival_check *result)
+{
+  fprintf(out, "%lu interarrivals%s, CV %.3f", result->nb_interarrivals,
+	  sample->truncated ? " (end of phase only)" : "", result->cv);
+  if (result->nb_windows > 0)
+    fprintf(out, ", per %d ms: mean %.1f, min %lu, max %lu, dispersion %.2f", ARRIVALS_WINDOW_MSEC,
+	    result->window_mean, result->window_min, result->window_max, result->window_dispersion);
+  fprintf(out, ", KS %.4f (max %.4f), AD %.2f (max %.2f): %s\n",
+	  result->ks, result->ks_critical, result->ad, ARRIVALS_AD_CRITICAL_1PCT,
+	  result->pass ? "pass" : "FAIL");
+}
@@ -0,0 +1,101 @@
+#ifndef ARRIVALS_H
+#define ARRIVALS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Self-check of the arrival process generated by the Poisson processes.
+
+   The actual time of every Poisson event is recorded in a ring.  At the
+   end of each phase, the arrivals of the phase are copied out of the
+   ring, and are tested at the end of the run (never from the event loop)
+   against the target process: a Poisson process whose rate is constant
+   or varies linearly over the phase.  By the time-rescaling theorem,
+   interarrivals measured with the integrated target rate are then
+   exponential with mean 1. */
+
+/* Default capacity of the ring (samples), about 14 s at 300k qps */
+#define ARRIVALS_RING_SIZE (1 << 22)
+
+/* Length of the windows used to measure the rate variability */
+#define ARRIVALS_WINDOW_MSEC 100
+
+/* Critical values at the 1% significance level: asymptotic
+   Kolmogorov-Smirnov coefficient, and Anderson-Darling statistic for a
+   fully specified distribution. */
+#define ARRIVALS_KS_COEFF_1PCT 1.628
+#define ARRIVALS_AD_CRITICAL_1PCT 3.857
+
+struct arrival_ring {
+  /* Monotonic times in nanoseconds */
+  uint64_t *times;
+  /* Always a power of two */
+  size_t capacity;
+  /* Total number of recorded arrivals */
+  uint64_t count;
+  /* Resolution of the recorded times: 0 for measured times, or the tick
+     of a simulated clock (see simevent.h) */
+  uint32_t resolution_ns;
+};
+
+/* Arrivals of one phase, and the result of their analysis. */
+struct arrival_sample {
+  uint64_t *times;
+  size_t nb_times;
+  /* Whether the ring wrapped around during the phase, in which case only
+     the end of the phase is analysed */
+  short truncated;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  /* See struct arrival_ring */
+  uint32_t resolution_ns;
+  double target_start;
+  double target_end;
+};
+
+struct arrival_check {
+  size_t nb_interarrivals;
+  /* Coefficient of variation of the rescaled interarrivals (1 for a
+     Poisson process) */
+  double cv;
+  /* Number of arrivals per window: mean, extremes, and index of
+     dispersion (variance over mean, 1 for a Poisson process) */
+  unsigned int nb_windows;
+  double window_mean;
+  uint64_t window_min;
+  uint64_t window_max;
+  double window_dispersion;
+  double ks;
+  double ks_critical;
+  double ad;
+  short pass;
+};
+
+/* Allocate a ring of [capacity] samples, rounded up to a power of two.
+   Returns -1 in case of error. */
+int arrival_ring_init(struct arrival_ring *ring, size_t capacity);
+
+void arrival_ring_free(struct arrival_ring *ring);
+
+static inline void arrival_ring_record(struct arrival_ring *ring, const struct timespec *now)
+{
+  ring->times[ring->count++ & (ring->capacity - 1)] = now->tv_sec * 1000000000ULL + now->tv_nsec;
+}
+
+/* Copy the arrivals since [start_count] (value of ring->count at the
+   start of the phase) into [sample]. */
+void arrival_sample_take(struct arrival_sample *sample, const struct arrival_ring *ring, uint64_t start_count,
+			 const struct timespec *start, const struct timespec *end,
+			 double target_start, double target_end);
+
+void arrival_sample_free(struct arrival_sample *sample);
+
+/* Analyse [sample].  Returns -1 if there are too few arrivals. */
+int arrival_check(const struct arrival_sample *sample, struct arrival_check *result);
+
+/* Print the result of the analysis on one line. */
+void arrival_check_print(FILE *out, const struct arrival_sample *sample, const struct arrival_check *result);
+
+#endif
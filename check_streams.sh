@@ -0,0 +1,64 @@
+#!/bin/sh
+# Check that each Poisson process has its own random streams (make check):
+# with the same seed, the send times and connections of the first
+# processes must not change when the load changes around them, and must
+# change with another seed.  Runs simclient in virtual time.
+
+set -e
+
+SIMCLIENT=${SIMCLIENT:-./simclient}
+RATE=1000
+CONNS=10
+DURATION_S=3
+# Processes started with the run (one per qps at 1 query/s each)
+NB_PROCESSES=$RATE
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Per-process sequences of (time since the first query, connection) of
+# the first processes, over the first 2.5 s of the run
+sequences() {
+  awk -F, -v nb=$NB_PROCESSES '
+    $1 == "Q" && $5 != "" && $5 < nb {
+      split($2, t, ".");
+      if (first_sec == "") { first_sec = t[1]; first_nsec = t[2] }
+      ns = (t[1] - first_sec) * 1000000000 + (t[2] - first_nsec);
+      if (ns < 2500000000)
+        printf "%d %.0f %d\n", $5, ns, $3
+    }' | sort -s -n -k1,1
+}
+
+run() {
+  "$SIMCLIENT" -R -c $CONNS "$@" 2>/dev/null | sequences
+}
+
+run -s 7 -r $RATE -t $DURATION_S > "$tmp/constant"
+run -s 7 -r $RATE -t $DURATION_S > "$tmp/again"
+printf "1\n%d 2000\n" $((DURATION_S * 1000)) | run -s 7 -r $RATE --stdin-rateslope > "$tmp/slope"
+run -s 8 -r $RATE -t $DURATION_S > "$tmp/other_seed"
+
+status=0
+if [ ! -s "$tmp/constant" ]; then
+  echo "FAIL: no query sent by simclient"
+  exit 1
+fi
+if cmp -s "$tmp/constant" "$tmp/again"; then
+  echo "ok: same seed, same sequences"
+else
+  echo "FAIL: two runs with the same seed differ"
+  status=1
+fi
+if cmp -s "$tmp/constant" "$tmp/slope"; then
+  echo "ok: sequences of the first $NB_PROCESSES processes unchanged by a rate slope"
+else
+  echo "FAIL: a rate slope changed the sequences of the first $NB_PROCESSES processes"
+  diff "$tmp/constant" "$tmp/slope" | head -5
+  status=1
+fi
+if cmp -s "$tmp/constant" "$tmp/other_seed"; then
+  echo "FAIL: another seed gives the same sequences"
+  status=1
+else
+  echo "ok: another seed gives other sequences"
+fi
+exit $status
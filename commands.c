@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "commands.h"
+
+
+/* Read more input into the buffer.  Returns 0 when no data is available
+   yet (non-blocking input), 1 otherwise, possibly at the end of the
+   input. */
+static int _fill(struct command_stream *stream)
+{
+  ssize_t len;
+  do {
+    len = read(stream->fd, stream->buffer + stream->buffer_len, sizeof(stream->buffer) - stream->buffer_len);
+  } while (len == -1 && errno == EINTR);
+  if (len == -1 && errno == EAGAIN)
+    return 0;
+  if (len == -1)
+    perror("Failed to read commands");
+  if (len <= 0)
+    stream->eof = 1;
+  else
+    stream->buffer_len += len;
+  return 1;
+}
+
+/* Take the next line of the buffer into [line].  Returns 1 if a line
+   was complete, 0 if more input is needed, -1 if the line is too long. */
+static int _take_line(struct command_stream *stream, char *line)
+{
+  char *eol = memchr(stream->buffer, '\n', stream->buffer_len);
+  size_t len = eol != NULL ? eol - stream->buffer : stream->buffer_len;
+  if (eol == NULL && !(stream->eof && len > 0)) {
+    if (stream->buffer_len < sizeof(stream->buffer))
+      return 0;
+    len = sizeof(stream->buffer);
+  }
+  stream->line_no++;
+  if (len >= COMMANDS_MAX_LINE) {
+    fprintf(stderr, "Error: line %lu of the input is too long\n", stream->line_no);
+    return -1;
+  }
+  memcpy(line, stream->buffer, len);
+  line[len] = '\0';
+  if (eol != NULL)
+    len++;
+  stream->buffer_len -= len;
+  memmove(stream->buffer, stream->buffer + len, stream->buffer_len);
+  return 1;
+}
+
+/* Read the next non-empty, non-comment line into [line].  Returns 1 if
+   there is one, 0 at the end of the input or if it is not available yet
+   (non-blocking input), -1 on a line too long. */
+static int _next_line(struct command_stream *stream, char *line)
+{
+  const char *p;
+  int ret;
+  while (1) {
+    ret = _take_line(stream, line);
+    if (ret == -1)
+      return -1;
+    if (ret == 1) {
+      p = line + strspn(line, " \t\r\n");
+      if (*p != '\0' && *p != '#')
+	return 1;
+      continue;
+    }
+    if (stream->eof || !_fill(stream))
+      return 0;
+  }
+}
+
+/* Parse [line] into [command].  Returns -1 if it is not a valid
+   command. */
+static int _parse_line(struct command_stream *stream, const char *line, struct command *command)
+{
+  char extra;
+  if (sscanf(line, "%u %d %c", &command->duration_ms, &command->value, &extra) != 2 ||
+      (!stream->slopes && command->value < 0)) {
+    fprintf(stderr, "Error parsing command on line %lu of the input\n", stream->line_no);
+    return -1;
+  }
+  if (!stream->slopes && command->value > stream->max_value) {
+    fprintf(stderr, "Error: rate of %d qps on line %lu of the input is above the maximum of %d qps\n",
+	    command->value, stream->line_no, stream->max_value);
+    return -1;
+  }
+  return 0;
+}
+
+/* Append one command to the window.  Returns 1 if a command was read,
+   0 otherwise: at the end of the stream (stream->ended), after an
+   error, or if the input has no complete line yet. */
+static int _read_command(struct command_stream *stream)
+{
+  struct command *command;
+  char line[COMMANDS_MAX_LINE];
+  int ret;
+  if (stream->ended)
+    return 0;
+  if (stream->remaining == 0) {
+    stream->ended = 1;
+    return 0;
+  }
+  ret = _next_line(stream, line);
+  if (ret == 0 && stream->eof)
+    stream->ended = 1;
+  if (ret == 1) {
+    command = &stream->window[(stream->head + stream->count) % COMMANDS_LOOKAHEAD];
+    if (_parse_line(stream, line, command) != 0)
+      ret = -1;
+  }
+  if (ret == -1) {
+    /* Ignore the rest of the input */
+    stream->ended = 1;
+    stream->failed = 1;
+  }
+  if (ret != 1)
+    return 0;
+  stream->count++;
+  stream->nb_read++;
+  if (stream->remaining > 0)
+    stream->remaining--;
+  return 1;
+}
+
+/* Fill the window with the commands available */
+static void _refill(struct command_stream *stream)
+{
+  while (stream->count < COMMANDS_LOOKAHEAD && _read_command(stream));
+}
+
+/* Watch the input only while the window has room */
+static void _update_event(struct command_stream *stream)
+{
+  if (stream->ev == NULL)
+    return;
+  if (stream->ended || stream->count == COMMANDS_LOOKAHEAD)
+    event_del(stream->ev);
+  else
+    event_add(stream->ev, NULL);
+}
+
+static void _read_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct command_stream *stream = ctx;
+  int was_empty = stream->count == 0;
+  _refill(stream);
+  _update_event(stream);
+  if (was_empty && (stream->count > 0 || stream->ended) && stream->ready != NULL)
+    stream->ready(stream->ready_arg);
+}
+
+int command_stream_open(struct command_stream *stream, int fd, short slopes, unsigned int nb_first)
+{
+  char line[COMMANDS_MAX_LINE];
+  unsigned long nb;
+  char extra;
+  int ret;
+  memset(stream, 0, sizeof(struct command_stream));
+  stream->fd = fd;
+  stream->slopes = slopes;
+  stream->max_value = INT_MAX;
+  stream->remaining = -1;
+  ret = _next_line(stream, line);
+  if (ret == -1)
+    return -1;
+  if (ret == 0) {
+    fprintf(stderr, "Error: at least one command expected\n");
+    return -1;
+  }
+  /* Optional number of commands, alone on the first line */
+  if (sscanf(line, "%lu %c", &nb, &extra) == 1) {
+    if (nb == 0) {
+      fprintf(stderr, "Error: at least one command expected\n");
+      return -1;
+    }
+    stream->remaining = nb;
+  } else {
+    /* The first line is already a command */
+    if (_parse_line(stream, line, &stream->window[0]) != 0)
+      return -1;
+    stream->count = 1;
+    stream->nb_read = 1;
+  }
+  if (nb_first > COMMANDS_LOOKAHEAD)
+    nb_first = COMMANDS_LOOKAHEAD;
+  while (stream->count < nb_first && _read_command(stream));
+  if (stream->failed)
+    return -1;
+  if (stream->count == 0) {
+    fprintf(stderr, "Error: at least one command expected\n");
+    return -1;
+  }
+  return 0;
+}
+
+int command_stream_limit(struct command_stream *stream, int max_value)
+{
+  const struct command *command;
+  for (unsigned int i = 0; i < stream->count; i++) {
+    command = &stream->window[(stream->head + i) % COMMANDS_LOOKAHEAD];
+    if (!stream->slopes && command->value > max_value) {
+      fprintf(stderr, "Error: rate of %d qps in the first commands is above the maximum of %d qps\n",
+	      command->value, max_value);
+      return -1;
+    }
+  }
+  stream->max_value = max_value;
+  return 0;
+}
+
+int command_stream_watch(struct command_stream *stream, struct event_base *base,
+			 void (*ready)(void *arg), void *arg)
+{
+  struct stat st;
+  int flags;
+  /* Reads of a regular file never wait */
+  if (stream->ended || (fstat(stream->fd, &st) == 0 && S_ISREG(st.st_mode)))
+    return 0;
+  flags = fcntl(stream->fd, F_GETFL);
+  if (flags == -1 || fcntl(stream->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("Failed to make the input of commands non-blocking");
+    return -1;
+  }
+  stream->ev = event_new(base, stream->fd, EV_READ | EV_PERSIST, _read_cb, stream);
+  if (stream->ev == NULL || event_add(stream->ev, NULL) != 0) {
+    fprintf(stderr, "Warning: cannot watch the input of commands, reading it with blocking reads\n");
+    if (stream->ev != NULL)
+      event_free(stream->ev);
+    stream->ev = NULL;
+    fcntl(stream->fd, F_SETFL, flags);
+    return -1;
+  }
+  stream->saved_flags = flags;
+  stream->ready = ready;
+  stream->ready_arg = arg;
+  _refill(stream);
+  _update_event(stream);
+  return 0;
+}
+
+void command_stream_pop(struct command_stream *stream)
+{
+  if (stream->count == 0)
+    return;
+  stream->head = (stream->head + 1) % COMMANDS_LOOKAHEAD;
+  stream->count--;
+  _refill(stream);
+  _update_event(stream);
+}
+
+void command_stream_range(const struct command_stream *stream, int *min, int *max)
+{
+  const struct command *command;
+  for (unsigned int i = 0; i < stream->count; i++) {
+    command = &stream->window[(stream->head + i) % COMMANDS_LOOKAHEAD];
+    if (i == 0 || command->value < *min)
+      *min = command->value;
+    if (i == 0 || command->value > *max)
+      *max = command->value;
+  }
+}
+
+void command_stream_close(struct command_stream *stream)
+{
+  if (stream->ev == NULL)
+    return;
+  event_free(stream->ev);
+  stream->ev = NULL;
+  fcntl(stream->fd, F_SETFL, stream->saved_flags);
+}
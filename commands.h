@@ -0,0 +1,111 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <event2/event.h>
+
+/* Stream of rate commands (--stdin) or rate slope commands
+   (--stdin-rateslope), read incrementally as the run goes.
+
+   Each line is "<duration_ms> <value>", where value is a rate in qps or
+   a slope in qps/s.  Empty lines and lines starting with '#' are
+   ignored.  The first line may give the number of commands, in which
+   case reading stops after that many commands; otherwise commands are
+   read until the end of the input.
+
+   Only a window of COMMANDS_LOOKAHEAD commands is kept in memory, and
+   refilled as commands are consumed, so schedules of any length run in
+   constant memory.  The first commands are read with blocking reads,
+   before the run.  Then, once the stream is watched by an event loop,
+   the input is made non-blocking and read when it has data, with
+   partial lines kept in a buffer: when the input is a pipe, its writer
+   may lag behind the run without ever blocking the event loop.
+   Without an event loop (or when the input is a regular file), the
+   window is refilled with blocking reads. */
+
+#define COMMANDS_LOOKAHEAD 64
+
+/* Maximum length of a command line: longer lines are invalid */
+#define COMMANDS_MAX_LINE 256
+
+struct command {
+  unsigned int duration_ms;
+  /* Query rate (qps), or slope of the query rate (qps per second) */
+  int value;
+};
+
+struct command_stream {
+  int fd;
+  /* Whether values are slopes, which may be negative */
+  short slopes;
+  /* Largest rate accepted, for rate commands */
+  int max_value;
+  /* Commands left to read if the input gave their number, or -1 */
+  int64_t remaining;
+  /* Ring of the next commands */
+  struct command window[COMMANDS_LOOKAHEAD];
+  unsigned int head;
+  unsigned int count;
+  /* Commands read so far, and line number for error messages */
+  uint64_t nb_read;
+  uint64_t line_no;
+  /* Input read but not parsed yet, and whether the input ended */
+  char buffer[4 * COMMANDS_MAX_LINE];
+  size_t buffer_len;
+  short eof;
+  /* No more commands will be read, and whether because of an invalid
+     line */
+  short ended;
+  short failed;
+  /* Reading from an event loop: the read event, its callback when
+     commands arrive in an empty window or the stream ends, and the
+     flags of the input to restore */
+  struct event *ev;
+  void (*ready)(void *arg);
+  void *ready_arg;
+  int saved_flags;
+};
+
+/* Start reading commands from [fd], and read at least [nb_first] of
+   them (all of them if the stream is shorter), with blocking reads.
+   Returns -1 if the input has no valid command. */
+int command_stream_open(struct command_stream *stream, int fd, short slopes, unsigned int nb_first);
+
+/* Refuse rates above [max_value] (only for rate commands): a later
+   command above it ends the stream, with an error message.  Returns -1
+   if a command already read is above it. */
+int command_stream_limit(struct command_stream *stream, int max_value);
+
+/* Read the rest of the stream without blocking, from the event loop of
+   [base].  [ready] is called with [arg] when a command is read while the
+   window was empty, or when the stream ends with an empty window.
+   Returns -1 in case of error, in which case the stream is still read
+   with blocking reads. */
+int command_stream_watch(struct command_stream *stream, struct event_base *base,
+			 void (*ready)(void *arg), void *arg);
+
+/* Next command, or NULL if the window is empty: at the end of the
+   stream, or while waiting for the input of a watched stream. */
+static inline const struct command *command_stream_peek(const struct command_stream *stream)
+{
+  return stream->count > 0 ? &stream->window[stream->head] : NULL;
+}
+
+/* Whether all commands have been consumed */
+static inline int command_stream_finished(const struct command_stream *stream)
+{
+  return stream->count == 0 && stream->ended;
+}
+
+/* Consume the next command, and refill the window.  A malformed line
+   ends the stream, with an error message. */
+void command_stream_pop(struct command_stream *stream);
+
+/* Smallest and largest value among the commands of the window. */
+void command_stream_range(const struct command_stream *stream, int *min, int *max);
+
+/* Stop watching the input, and restore its flags. */
+void command_stream_close(struct command_stream *stream);
+
+#endif
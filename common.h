@@ -1,5 +1,20 @@
 #include "poisson.h"
 #include "utils.h"
+#include "query.h"
+#include "label.h"
+#include "histogram.h"
+#include "stats.h"
+#include "shmstats.h"
+#include "metrics.h"
+#include "schedule.h"
+#include "search.h"
+#include "control.h"
+#include "commands.h"
+#include "scenario.h"
+#include "rttlog.h"
+#include "rttsample.h"
+#include "heatmap.h"
+#include "perfcount.h"
 
 /* Maximum expected response time for a query.  This is used to compute
    how many queries in flight we should expect on each connection, and
@@ -22,18 +37,71 @@
    integral number of poisson process at each update. */
 #define RATE_SLOPE_UPDATE_INTERVAL_MSEC 100
 
-/* How many commands we are prepared to accept on stdin. */
-#define MAX_STDIN_COMMANDS 256
+/* Interval between two updates of the rate function, connection ramp
+   and churn of a scenario phase (--scenario). */
+#define SCENARIO_TICK_MSEC 100
+
+/* Default delay between the setup of the client and the start of the
+   run, so that no query deadline is missed even before we start the
+   event loop.  Without this, the first queries all go out at the same
+   time, creating a large burst. */
+#define START_DELAY_MSEC 5000
+
+/* Default interval between two reports of statistics (--stats) */
+#define STATS_INTERVAL_MSEC 1000
+
+/* Default time to wait for answers to the queries in flight at the end of
+   the run (--drain), and interval between two checks during this time. */
+#define DRAIN_TIMEOUT_MSEC 2000
+#define DRAIN_CHECK_INTERVAL_MSEC 10
+
+/* Interval between two checks for connections that need a query to stay
+   open, when the server advertises an idle timeout (edns-tcp-keepalive). */
+#define KEEPALIVE_SWEEP_INTERVAL_MSEC 1000
 
 
 
 struct event_base *base;
 static short verbose;
 static short print_rtt;
+/* Binary per-query log (--rtt-log) instead of CSV on stdout */
+static struct rtt_log_writer *rtt_log;
+static const char *rtt_log_path;
+/* enum rtt_log_format (--rtt-log-format) */
+static int rtt_log_format = RTT_LOG_BINARY;
+/* Sampling of the per-query log (--rtt-sample) */
+static struct rtt_sampler rtt_sampler;
 /* Whether we take commands from stdin (sequence of duration and query rate) */
 static short stdin_commands;
 /* Whether we take slope commands from stdin (sequence of duration and query rate slope) */
 static short stdin_rateslope_commands;
+/* Highest rate that the --stdin commands may set (--stdin-max-rate), 0
+   for the highest rate of the first commands */
+static unsigned int stdin_max_rate;
+/* Commands read from stdin as the run goes, and the timer of the next
+   one, which starts commands_next_ms after commands_start.  The next
+   command is late when it was not read by then. */
+static struct command_stream command_stream;
+static struct event *command_ev;
+static struct timespec commands_start;
+static uint64_t commands_next_ms;
+static short commands_late;
+/* Read the commands with blocking reads, instead of from the event loop
+   (simclient, whose event loop only has timers) */
+static short commands_blocking;
+/* Rate slope of the current --stdin-rateslope command, and the event
+   that stops it at the end of the command */
+static struct event *command_slope_ev;
+static struct event *command_slope_stop_ev;
+static int *command_slope_change;
+/* Start of the run on the monotonic clock, and the absolute time at
+   which it was requested (--start-at), if any */
+static struct timespec run_start;
+static short start_at;
+static struct timespec start_at_realtime;
+/* Local address that all sockets are bound to (--source), if any */
+static struct sockaddr_storage source_addr;
+static socklen_t source_len;
 /* Maximum number of queries "in flight" on a given UDP or TCP connection.
    Computed from MAX_RTT, rate, and nb_conn. */
 static uint16_t max_queries_in_flight;
@@ -41,85 +109,542 @@ static uint16_t max_queries_in_flight;
 static double poisson_rate = 1000. / (double) POISSON_PROCESS_PERIOD_MSEC;
 /* How many UDP or TCP connections we maintain. */
 static uint32_t nb_conn = 0;
+/* Size of the array of connections, up to which connections can be added
+   during the run through the control socket (--control-max-conn). */
+static uint32_t max_conn = 0;
+/* Pre-encoded queries to send. */
+static struct query_corpus corpus;
+/* Generator of random labels, when corpus.label_len is not 0 */
+static struct label_gen label_gen;
+
+/* Counters and histograms of the client, and their periodic report */
+static struct client_stats stats;
+static struct stats_reporter stats_reporter;
+/* Whether statistics are reported periodically, as JSON lines or in
+   shared memory (needs RTT measurement) */
+static short report_stats;
+static struct event *stats_ev;
+/* Live statistics in shared memory (--shm-stats), also read by the
+   metrics exporter (--metrics) */
+static struct shm_stats *shm_stats;
+static struct event *shm_stats_ev;
+/* Latency heatmap (--heatmap) */
+static const char *heatmap_path;
+/* enum heatmap_format (--heatmap-format) */
+static int heatmap_format = HEATMAP_BINARY;
+static struct heatmap_writer heatmap_writer;
+static struct event *heatmap_ev;
+
+/* Summary of the run, printed at exit unless --no-summary is given */
+static struct run_summary run_summary;
+static short print_summary = 1;
+/* Whether sending has stopped, and we are only waiting for answers */
+static short draining;
+static unsigned int drain_timeout_ms = DRAIN_TIMEOUT_MSEC;
+static struct event *drain_ev;
+/* Times of the Poisson events, when the arrival process is checked
+   (--check-arrivals) */
+static short check_arrivals;
+static struct arrival_ring arrival_ring;
 
+/* Precomputed send schedule, played back instead of running Poisson
+   processes (--schedule) */
+static short playback;
+static struct schedule send_schedule;
+static struct schedule_entry playback_next;
+static struct timespec playback_start;
+static struct event *playback_ev;
 
-struct command {
-  unsigned int duration_ms;
-  unsigned int query_rate;
+/* Saturation search (--search), its SLO (--slo) and the duration of
+   its steps */
+static short search_mode;
+static struct search search;
+static struct slo slo;
+static unsigned int search_step_ms = SEARCH_STEP_MSEC;
+static unsigned int search_settle_ms = SEARCH_SETTLE_MSEC;
+
+/* Runtime control socket (--control), the highest rate it may set
+   (--control-max-rate), the highest rate per connection that the
+   in-flight tables are sized for, and the rate slope it started, if
+   any */
+static short control;
+static unsigned int control_max_rate;
+static double control_max_conn_rate;
+static struct event *control_slope_ev;
+static int *control_slope_change;
+
+/* Scenario of the run (--scenario): its start and the offset of the
+   next phase, the start of the current phase, the target rate in force
+   and since when, and the connections at the start of the phase, for
+   connection ramps, the counters at the start of the phase, and the
+   random stream of the churned connections */
+static short scenario_mode;
+static struct scenario scenario;
+static struct event *scenario_phase_ev;
+static struct event *scenario_tick_ev;
+static struct timespec scenario_start;
+static uint64_t scenario_next_ms;
+static short scenario_in_phase;
+static struct timespec scenario_phase_start;
+static double scenario_rate;
+static struct timespec scenario_rate_since;
+static uint32_t scenario_conns_start;
+static struct run_snapshot *scenario_snapshot;
+static struct rng scenario_churn_rng;
+
+/* Whether we classify responses (rcode, TC bit, question match) */
+static short validate_responses;
+
+/* Number of responses and latency distribution (in µs) of each class of
+   responses, when validating responses. */
+struct response_stats {
+  uint64_t count[DNS_RESPONSE_NB_CLASSES];
+  struct histogram latency[DNS_RESPONSE_NB_CLASSES];
 };
+static struct response_stats response_stats;
 
-struct rateslope_command {
-  unsigned int duration_ms;
-  /* Slope of the query rate increase/decrease, in qps per second */
-  int query_rate_slope;
+/* Options controlling which queries are sent. */
+struct query_options {
+  /* Text or pre-encoded corpus, NULL for the default query */
+  char *corpus_file;
+  char *policy;
+  /* Where to save the encoded corpus, if not NULL */
+  char *save_file;
+  /* Length, encoding and uniqueness of random labels (cache busting) */
+  unsigned int label_len;
+  char *label_encoding;
+  char label_unique;
+  /* Whether to add an OPT record to queries, and its content */
+  char edns;
+  struct edns_options edns_opts;
+};
+static struct query_options query_opts = {
+  .edns_opts = {
+    /* Recommended by the DNS flag day 2020 to avoid fragmentation */
+    .bufsize = 1232,
+  },
 };
 
+
 static void add_poisson_sender();
+static void send_scheduled_query(uint32_t conn_id, uint32_t query_index);
+/* Open or close connections so that [n] (at most max_conn) are in use.
+   Returns -1 in case of error. */
+static int set_nb_connections(uint32_t n);
+/* Close connection [conn_id] and open it again (scenario churn).
+   Returns -1 in case of error. */
+static int reopen_connection(uint32_t conn_id);
 
-int read_nb_commands(unsigned int *nb_commands)
+/* Load the query corpus (or build the default one), turn it into
+   templates if random labels are requested, set its selection policy,
+   and optionally save it in encoded form. */
+int setup_query_corpus(const struct query_options *opts, unsigned long int seed)
 {
-  int ret = scanf("%u", nb_commands);
-  if (ret != 1) {
-    fprintf(stderr, "Error: expected number of commands on first line of stdin\n");
+  int ret;
+  if (opts->corpus_file == NULL)
+    ret = query_corpus_init_default(&corpus);
+  else
+    ret = query_corpus_load(&corpus, opts->corpus_file);
+  if (ret != 0)
     return -1;
+  info("Loaded %u queries (%lu bytes)\n", corpus.nb_queries, corpus.header->arena_len);
+  if (opts->label_len > 0) {
+    if (label_gen_init(&label_gen, opts->label_len, opts->label_encoding, opts->label_unique, seed) != 0)
+      return -1;
+    if (query_corpus_add_label(&corpus, opts->label_len) != 0)
+      return -1;
+    info("Prepending random %u-characters labels to %u query names\n", opts->label_len, corpus.nb_queries);
+  }
+  if (opts->edns) {
+    if (query_corpus_add_edns(&corpus, &opts->edns_opts) != 0)
+      return -1;
+    info("Added EDNS0 OPT record (bufsize %hu, DO %d, padding %hu, keepalive %d)\n",
+	 opts->edns_opts.bufsize, opts->edns_opts.do_bit,
+	 opts->edns_opts.padding_block, opts->edns_opts.keepalive);
   }
-  if (*nb_commands > MAX_STDIN_COMMANDS) {
-    fprintf(stderr, "Error: maximum number of allowed commands is %u\n", MAX_STDIN_COMMANDS);
+  info("Average query size on the wire: %.1f bytes (%.1f bytes with TCP length prefix)\n",
+       query_corpus_avg_len(&corpus) - 2, query_corpus_avg_len(&corpus));
+  if (opts->policy != NULL && query_corpus_set_policy(&corpus, opts->policy) != 0)
+    return -1;
+  if (opts->save_file != NULL && query_corpus_save(&corpus, opts->save_file) != 0)
     return -1;
+  return 0;
+}
+
+/* Returns the length-prefixed query with the given index in the corpus,
+   with a fresh random label if needed.  The query ID is left to the
+   caller. */
+static inline unsigned char *prepare_query(uint32_t index)
+{
+  unsigned char *query = query_corpus_get(&corpus, index);
+  if (corpus.label_len > 0)
+    label_gen_fill(&label_gen, query + QUERY_LABEL_OFFSET);
+  return query;
+}
+
+/* Returns the next length-prefixed query to send, and stores its index in
+   the corpus in [index].  The query ID is left to the caller. */
+static inline unsigned char *next_query(uint32_t *index)
+{
+  *index = query_corpus_select(&corpus);
+  return prepare_query(*index);
+}
+
+/* Write [record] to the per-query log, or as CSV on stdout (-R) */
+static inline void write_rtt_record(const struct rtt_record *record)
+{
+  unsigned long sec = record->time_ns / 1000000000, nsec = record->time_ns % 1000000000;
+  if (rtt_log != NULL) {
+    rtt_log_append(rtt_log, record);
+    return;
   }
-  if (*nb_commands == 0) {
-    fprintf(stderr, "Error: at least one command expected\n");
+  /* CSV format for queries: type (Query), timestamp, connection ID, query
+     ID, Poisson ID (if any), poisson interval (in µs, unused), unused.
+     For answers: type, timestamp at the time of reception, connection ID,
+     query ID, unused, unused, computed RTT in µs (empty for late
+     answers) */
+  if (record->type != RTT_QUERY && record->rtt_us == RTT_NONE)
+    printf("%c,%lu.%.9lu,%u,%u,,,\n", record->type, sec, nsec, record->connection_id, record->query_id);
+  else if (record->type != RTT_QUERY)
+    printf("%c,%lu.%.9lu,%u,%u,,,%u\n", record->type, sec, nsec, record->connection_id,
+	   record->query_id, record->rtt_us);
+  else if (record->poisson_id != RTT_NONE)
+    printf("Q,%lu.%.9lu,%u,%u,%u,,\n", sec, nsec, record->connection_id, record->query_id, record->poisson_id);
+  else
+    printf("Q,%lu.%.9lu,%u,%u,,,\n", sec, nsec, record->connection_id, record->query_id);
+}
+
+/* Write an answer drawn by reservoir sampling (--rtt-sample), preceded
+   by its query, sent [rtt_us] before it, so that the log can still be
+   analyzed as pairs of queries and answers. */
+static inline void write_rtt_sample(const struct rtt_record *answer)
+{
+  struct rtt_record query = *answer;
+  query.time_ns -= answer->rtt_us * 1000ULL;
+  query.type = RTT_QUERY;
+  query.rtt_us = RTT_NONE;
+  write_rtt_record(&query);
+  write_rtt_record(answer);
+}
+
+/* Whether to log the query [query_id] of connection [conn_id] and its
+   answers (-R or --rtt-log, with --rtt-sample).  Callers check it before
+   taking the timestamp of a query. */
+static inline int rtt_sampled(uint32_t conn_id, uint16_t query_id)
+{
+  return rtt_sampler_keep(&rtt_sampler, conn_id, query_id);
+}
+
+/* Log a query sent at [now] (-R or --rtt-log).  [poisson_id] is
+   RTT_NONE for queries not sent by a Poisson process. */
+static inline void log_query(const struct timespec *now, uint32_t conn_id, uint16_t query_id, uint32_t poisson_id)
+{
+  struct rtt_record record;
+  record.time_ns = now->tv_sec * 1000000000ULL + now->tv_nsec;
+  record.connection_id = conn_id;
+  record.query_id = query_id;
+  record.type = RTT_QUERY;
+  record.unused = 0;
+  record.rtt_us = RTT_NONE;
+  record.poisson_id = poisson_id;
+  write_rtt_record(&record);
+}
+
+/* Log an answer of [type] (RTT_ANSWER or RTT_TCP_ANSWER) received at
+   [now] (-R or --rtt-log), if it is sampled.  [rtt_us] is RTT_NONE for
+   a late answer: the timestamp of its slot belongs to a newer query, so
+   that analyzers match it with its query instead.  Reservoir sampling
+   (which logs answers with a query rebuilt from their RTT) skips late
+   answers. */
+static inline void log_answer(const struct timespec *now, enum rtt_record_type type, uint32_t conn_id,
+			      uint16_t query_id, uint64_t rtt_us)
+{
+  struct rtt_record record;
+  if (rtt_sampler.mode == RTT_SAMPLE_HASH && !rtt_sampled(conn_id, query_id))
+    return;
+  if (rtt_sampler.mode == RTT_SAMPLE_RESERVOIR && rtt_us == RTT_NONE)
+    return;
+  record.time_ns = now->tv_sec * 1000000000ULL + now->tv_nsec;
+  record.connection_id = conn_id;
+  record.query_id = query_id;
+  record.type = type;
+  record.unused = 0;
+  record.rtt_us = rtt_us == RTT_NONE || rtt_us < RTT_NONE - 1 ? rtt_us : RTT_NONE - 1;
+  record.poisson_id = RTT_NONE;
+  if (rtt_sampler.mode == RTT_SAMPLE_RESERVOIR)
+    rtt_sampler_offer(&rtt_sampler, &record, write_rtt_sample);
+  else
+    write_rtt_record(&record);
+}
+
+/* Open the binary per-query log (--rtt-log) in the format of
+   --rtt-log-format.  Returns -1 in case of error. */
+int open_rtt_log()
+{
+  rtt_log = rtt_log_create(rtt_log_path, rtt_log_format);
+  if (rtt_log == NULL)
     return -1;
+  print_rtt = 1;
+  return 0;
+}
+
+/* Write the pending samples (--rtt-sample) and close the per-query log */
+void close_rtt_log()
+{
+  if (rtt_sampler.mode == RTT_SAMPLE_RESERVOIR && print_rtt) {
+    rtt_sampler_flush(&rtt_sampler, write_rtt_sample);
+    info("Sampled %lu answers out of %lu\n", rtt_sampler.total_kept, rtt_sampler.total_seen);
   }
-  return ret;
+  rtt_sampler_free(&rtt_sampler);
+  if (rtt_log != NULL)
+    rtt_log_close(rtt_log);
+  rtt_log = NULL;
 }
 
-int read_commands(struct command *commands, unsigned int *min_rate, unsigned int *max_rate, unsigned int nb_commands)
+/* Classify the response [msg] to the query with the given index in the
+   corpus, and account for its RTT. */
+static inline void record_response(const unsigned char *msg, size_t len, uint32_t query_index, uint64_t rtt_us)
 {
-  int ret = 2;
-  *min_rate = 0xffffffff;
-  *max_rate = 0;
-  for (int i = 0; i < nb_commands; ++i) {
-    ret = scanf("%u %u", &commands[i].duration_ms, &commands[i].query_rate);
-    if (ret != 2) {
-      fprintf(stderr, "Error parsing command input\n");
-      return -1;
-    }
-    /* Find smallest and largest query rate */
-    if (commands[i].query_rate > *max_rate)
-      *max_rate = commands[i].query_rate;
-    if (commands[i].query_rate < *min_rate)
-      *min_rate = commands[i].query_rate;
+  const unsigned char *query = query_corpus_get(&corpus, query_index);
+  uint16_t query_len;
+  enum dns_response_class class;
+  DO_NTOHS(query_len, query);
+  class = dns_classify_response(msg, len, query + 2, query_len, corpus.label_len);
+  response_stats.count[class]++;
+  histogram_record(&response_stats.latency[class], rtt_us);
+}
+
+void print_response_stats()
+{
+  uint64_t total = 0;
+  for (int i = 0; i < DNS_RESPONSE_NB_CLASSES; i++)
+    total += response_stats.count[i];
+  fprintf(stderr, "Responses: %lu\n", total);
+  if (total == 0)
+    return;
+  fprintf(stderr, "%-12s %12s %8s %10s %10s %10s\n", "class", "count", "share", "p50_us", "p99_us", "max_us");
+  for (int i = DNS_RESPONSE_NB_CLASSES - 1; i >= 0; i--) {
+    const struct histogram *h = &response_stats.latency[i];
+    if (response_stats.count[i] == 0)
+      continue;
+    fprintf(stderr, "%-12s %12lu %7.3f%% %10lu %10lu %10lu\n",
+	    dns_response_class_names[i], response_stats.count[i],
+	    100. * response_stats.count[i] / total,
+	    histogram_percentile(h, 50.), histogram_percentile(h, 99.), h->max);
+  }
+}
+
+static void stats_timer_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  stats_report(&stats_reporter, &stats);
+}
+
+/* Open the destination of periodic statistics ([path], or [fd] if path
+   is NULL) and start reporting every [interval_ms] milliseconds. */
+int start_stats_reporting(const char *path, int fd, unsigned int interval_ms)
+{
+  struct timeval interval = {0, 0};
+  FILE *out;
+  if (path != NULL)
+    out = fopen(path, "w");
+  else
+    out = fdopen(fd, "w");
+  if (out == NULL) {
+    perror("Failed to open statistics output");
+    return -1;
   }
+  stats_reporter_init(&stats_reporter, out);
+  poisson_set_lag_histogram(&stats.lag);
+  timeval_add_ms(&interval, interval_ms);
+  stats_ev = event_new(base, -1, EV_PERSIST, stats_timer_cb, NULL);
+  event_add(stats_ev, &interval);
+  report_stats = 1;
+  return 0;
+}
+
+/* Emit a last report covering the end of the run, and close the output. */
+void stop_stats_reporting()
+{
+  if (stats_reporter.out == NULL)
+    return;
+  event_free(stats_ev);
+  stats_report(&stats_reporter, &stats);
+  fclose(stats_reporter.out);
+}
+
+/* Fill [data] with the current statistics.  The latency and lag
+   histograms of [stats] only cover the current report interval when
+   --stats is also used, so add the totals of the reporter to get
+   cumulative histograms. */
+static void snapshot_stats(struct shm_stats_data *data)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  data->update_time_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  data->queries_sent = stats.queries_sent;
+  data->answers_received = stats.answers_received;
+  data->timeouts = stats.timeouts;
+  data->bytes_out = stats.bytes_out;
+  data->bytes_in = stats.bytes_in;
+  data->connections_opened = stats.connections_opened;
+  data->live_connections = stats.live_connections;
+  data->target_rate = poisson_rate * poisson_nb_processes();
+  data->latency = stats_reporter.latency_total;
+  histogram_merge(&data->latency, &stats.latency);
+  data->lag = stats_reporter.lag_total;
+  histogram_merge(&data->lag, &stats.lag);
+}
+
+static void publish_shm_stats(int finished)
+{
+  shm_stats_write_begin(shm_stats);
+  snapshot_stats(&shm_stats->data);
+  shm_stats->data.finished = finished;
+  shm_stats_write_end(shm_stats);
+}
+
+static void shm_stats_timer_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  publish_shm_stats(0);
+}
+
+/* Create the shared memory segment [name] (anonymous if NULL) and
+   publish statistics into it every [interval_ms] milliseconds. */
+int start_shm_stats(const char *name, const char *program, unsigned int interval_ms)
+{
+  struct timeval interval = {0, 0};
+  shm_stats = shm_stats_create(name, SHM_STATS_CLIENT, program);
+  if (shm_stats == NULL)
+    return -1;
+  poisson_set_lag_histogram(&stats.lag);
+  timeval_add_ms(&interval, interval_ms);
+  shm_stats_ev = event_new(base, -1, EV_PERSIST, shm_stats_timer_cb, NULL);
+  event_add(shm_stats_ev, &interval);
+  report_stats = 1;
+  return 0;
+}
+
+/* Publish the final statistics.  The segment is left in place, so that
+   the final values can still be read after the end of the run. */
+void stop_shm_stats()
+{
+  if (shm_stats == NULL)
+    return;
+  event_free(shm_stats_ev);
+  publish_shm_stats(1);
+  shm_stats_close(shm_stats);
+}
+
+/* Cumulative latency histogram since the start of the run into [latency] */
+static void cumulative_latency(struct histogram *latency)
+{
+  *latency = stats_reporter.latency_total;
+  histogram_merge(latency, &stats.latency);
+}
+
+static void write_heatmap_row()
+{
+  /* Too large for the stack, and only used from the event loop */
+  static struct histogram latency;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  cumulative_latency(&latency);
+  heatmap_writer_row(&heatmap_writer, now.tv_sec * 1000000000ULL + now.tv_nsec, &latency);
+}
+
+static void heatmap_timer_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  write_heatmap_row();
+}
+
+/* Create the latency heatmap (--heatmap) and add a row to it every
+   [interval_ms] milliseconds.  Returns -1 in case of error. */
+int start_heatmap(unsigned int interval_ms)
+{
+  struct timeval interval = {0, 0};
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (heatmap_writer_open(&heatmap_writer, heatmap_path, heatmap_format, interval_ms,
+			  now.tv_sec * 1000000000ULL + now.tv_nsec) != 0)
+    return -1;
+  timeval_add_ms(&interval, interval_ms);
+  heatmap_ev = event_new(base, -1, EV_PERSIST, heatmap_timer_cb, NULL);
+  event_add(heatmap_ev, &interval);
+  report_stats = 1;
   return 0;
 }
 
-int read_rateslope_commands(struct rateslope_command *commands, unsigned int nb_commands)
+/* Add the last, partial, row of the heatmap and close it */
+void stop_heatmap()
+{
+  if (heatmap_writer.out == NULL)
+    return;
+  event_free(heatmap_ev);
+  write_heatmap_row();
+  if (heatmap_writer_close(&heatmap_writer) == 0)
+    info("Wrote %lu rows of latency heatmap to %s\n", heatmap_writer.nb_rows, heatmap_path);
+}
+
+/* Start reading the stdin commands (--stdin or --stdin-rateslope), and
+   give the smallest rate of the first commands and the highest rate of
+   the run: --stdin-max-rate if given, or else the highest rate of the
+   first window of commands.  Later commands above it are refused.
+   Returns -1 in case of error. */
+int open_commands(unsigned int *min_rate, unsigned int *max_rate)
 {
-  int ret = 2;
-  for (int i = 0; i < nb_commands; ++i) {
-    ret = scanf("%u %d", &commands[i].duration_ms, &commands[i].query_rate_slope);
-    if (ret != 2) {
-      fprintf(stderr, "Error parsing command input\n");
+  int min, max;
+  /* Without an explicit bound, the first window of commands gives it */
+  unsigned int nb_first = stdin_commands && stdin_max_rate == 0 ? COMMANDS_LOOKAHEAD : 1;
+  if (command_stream_open(&command_stream, STDIN_FILENO, stdin_rateslope_commands, nb_first) != 0)
+    return -1;
+  if (stdin_commands) {
+    command_stream_range(&command_stream, &min, &max);
+    if (stdin_max_rate > 0)
+      max = stdin_max_rate;
+    if (command_stream_limit(&command_stream, max) != 0)
       return -1;
-    }
+    *min_rate = min;
+    *max_rate = max;
+    debug("Minimum query rate: %u\n", *min_rate);
+    debug("Maximum query rate: %u\n", *max_rate);
   }
   return 0;
 }
 
-static void change_query_rate(evutil_socket_t fd, short events, void *ctx)
+/* Current target rate, in queries per second */
+static double target_rate()
+{
+  struct timespec now, elapsed;
+  if (playback) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    subtract_timespec(&elapsed, &now, &playback_start);
+    return schedule_target_rate(&send_schedule, elapsed.tv_sec * 1000000000ULL + elapsed.tv_nsec);
+  }
+  return poisson_rate * poisson_nb_processes();
+}
+
+static void begin_phase(evutil_socket_t fd, short events, void *ctx)
+{
+  run_summary_begin_phase(&run_summary, &stats, target_rate());
+}
+
+/* Change the total query rate of the existing Poisson processes, in a
+   new phase. */
+static void set_query_rate(double new_rate)
 {
-  unsigned int *new_rate = ctx;
-  poisson_rate = (double) *new_rate / (double) poisson_nb_processes();
-  /* TODO: apply this rate to all processes. */
+  run_summary_end_phase(&run_summary, &stats, target_rate());
+  poisson_rate = new_rate / (double) poisson_nb_processes();
+  poisson_set_rate_all(poisson_rate);
   info("Changed Poisson rate to %f\n", poisson_rate);
+  run_summary_begin_phase(&run_summary, &stats, target_rate());
 }
 
-static void stop_event(evutil_socket_t fd, short events, void *ctx)
+/* Highest rate that the control socket may set with [n] connections,
+   without overflowing the in-flight tables of each connection */
+static inline double control_rate_limit(uint32_t n)
 {
-  struct event *event_to_stop = ctx;
-  event_del(event_to_stop);
-  event_free(event_to_stop);
+  double limit = control_max_conn_rate * n;
+  return limit < control_max_rate ? limit : control_max_rate;
 }
 
 /* Adds or removes Poisson processes to update the query rate. */
@@ -127,6 +652,11 @@ static void add_remove_poisson_processes(evutil_socket_t fd, short events, void
 {
   /* How many (positive or negative) poisson processes should we create? */
   int *nb_poisson_change = ctx;
+  if (draining)
+    return;
+  /* Slopes of the control socket stop at the highest rate it allows */
+  if (control && *nb_poisson_change > 0 && target_rate() >= control_rate_limit(nb_conn))
+    return;
   if (*nb_poisson_change > 0) {
     debug("Adding %d poisson processes\n", *nb_poisson_change);
     for (int i = 0; i < *nb_poisson_change; i++) {
@@ -141,44 +671,969 @@ static void add_remove_poisson_processes(evutil_socket_t fd, short events, void
   }
 }
 
-/* Called once, and starts a recurrent event that periodically adds or
-   removes Poisson processes to implement a rate slope change. */
-static void change_query_rate_slope(evutil_socket_t fd, short events, void *ctx)
+/* Start a recurrent event that periodically adds or removes Poisson
+   processes to implement a rate slope of [slope] qps/s, and return it.
+   The number of processes changed at each update is stored in
+   [*nb_poisson_change], the argument of the event. */
+static struct event *start_rate_slope(int slope, int **nb_poisson_change)
 {
-  struct rateslope_command *command = ctx;
   struct event *recurr_ev;
   unsigned long int repeat_interval_us;
   struct timeval repeat_interval = {0, 0};
-  struct event *stop_ev;
-  struct timeval stop_delay = {0, 0};
-  /* Instructed to do nothing, let's do it. */
-  if (command->query_rate_slope == 0) {
-    info("Resetting query slope to 0 qps/s\n");
-    return;
-  }
-  /* TODO: where should we free nb_poisson_change? */
-  int *nb_poisson_change = malloc(sizeof(int));
-  /* Schedule recurrent event to add or remove poisson processes */
+  /* Slope in Poisson processes per second: each process sends
+     poisson_rate queries per second (1 unless the control socket changed
+     the rate). */
+  int process_slope = lround(slope / poisson_rate);
+  if (process_slope == 0)
+    process_slope = slope > 0 ? 1 : -1;
+  *nb_poisson_change = malloc(sizeof(int));
   /* Compute jointly the interval between updates, and the number of
      poisson processes to add/remove at each update point.  The goal is to
      target an update interval of 100 ms (RATE_SLOPE_UPDATE_INTERVAL_MSEC)
      but the actual value will be slightly different: for instance, to
      reach a slope of +42 qps/s, we add 4 poisson processes every 95.2 ms. */
-  *nb_poisson_change = divide_closest(command->query_rate_slope * RATE_SLOPE_UPDATE_INTERVAL_MSEC, 1000);
-  if (*nb_poisson_change == 0)
-    *nb_poisson_change = command->query_rate_slope > 0 ? 1 : -1;
-  repeat_interval_us = 1000 * 1000 * (*nb_poisson_change) / command->query_rate_slope;
+  **nb_poisson_change = divide_closest(process_slope * RATE_SLOPE_UPDATE_INTERVAL_MSEC, 1000);
+  if (**nb_poisson_change == 0)
+    **nb_poisson_change = process_slope > 0 ? 1 : -1;
+  repeat_interval_us = 1000 * 1000 * (**nb_poisson_change) / process_slope;
   info("Changing query rate slope to %d qps/s (%d Poisson processes every %lu.%.3lu ms)\n",
-       command->query_rate_slope,
-       *nb_poisson_change,
+       slope,
+       **nb_poisson_change,
        repeat_interval_us / 1000,
        repeat_interval_us % 1000);
-  recurr_ev = event_new(base, -1, EV_PERSIST, add_remove_poisson_processes, nb_poisson_change);
+  recurr_ev = event_new(base, -1, EV_PERSIST, add_remove_poisson_processes, *nb_poisson_change);
   timeval_add_us(&repeat_interval, repeat_interval_us);
   event_add(recurr_ev, &repeat_interval);
+  return recurr_ev;
+}
+
+/* Stop the rate slope of the current stdin command, if any, and free
+   its events. */
+static void stop_command_slope()
+{
+  if (command_slope_ev != NULL) {
+    event_free(command_slope_ev);
+    free(command_slope_change);
+    command_slope_ev = NULL;
+    command_slope_change = NULL;
+  }
+  if (command_slope_stop_ev != NULL) {
+    event_free(command_slope_stop_ev);
+    command_slope_stop_ev = NULL;
+  }
+}
+
+static void command_slope_stop_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  stop_command_slope();
+}
+
+/* Starts a recurrent event that periodically adds or removes Poisson
+   processes to implement the rate slope change [command], until the
+   end of the command. */
+static void change_query_rate_slope(const struct command *command)
+{
+  struct timeval stop_delay = {0, 0};
+  if (draining)
+    return;
+  stop_command_slope();
+  run_summary_begin_phase(&run_summary, &stats, target_rate());
+  /* Instructed to do nothing, let's do it. */
+  if (command->value == 0) {
+    info("Resetting query slope to 0 qps/s\n");
+    return;
+  }
+  /* Schedule recurrent event to add or remove poisson processes */
+  command_slope_ev = start_rate_slope(command->value, &command_slope_change);
   /* Schedule removal of the repeating event */
-  stop_ev = event_new(base, -1, 0, stop_event, recurr_ev);
+  command_slope_stop_ev = event_new(base, -1, 0, command_slope_stop_cb, NULL);
   timeval_add_ms(&stop_delay, command->duration_ms);
-  event_add(stop_ev, &stop_delay);
-  /* TODO: where should we free stop_ev? */
+  event_add(command_slope_stop_ev, &stop_delay);
+}
+
+static void drain_check(evutil_socket_t fd, short events, void *ctx)
+{
+  struct timespec now, elapsed;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  subtract_timespec(&elapsed, &now, &run_summary.drain_start);
+  if (stats_in_flight(&stats) > 0 &&
+      elapsed.tv_sec * 1000 + elapsed.tv_nsec / 1000000 < drain_timeout_ms)
+    return;
+  run_summary.drain_end = now;
+  event_free(drain_ev);
+  drain_ev = NULL;
+  event_base_loopexit(base, NULL);
+}
+
+/* Stop sending queries, and wait up to drain_timeout_ms for the answers
+   to the queries still in flight before leaving the event loop. */
+static void end_of_run(evutil_socket_t fd, short events, void *ctx)
+{
+  struct timeval interval = {0, 0};
+  draining = 1;
+  poisson_stop_all();
+  if (playback_ev != NULL)
+    event_del(playback_ev);
+  run_summary_end_phase(&run_summary, &stats, target_rate());
+  clock_gettime(CLOCK_MONOTONIC, &run_summary.drain_start);
+  run_summary.drain_end = run_summary.drain_start;
+  run_summary.drain_answered_start = stats.answers_received;
+  run_summary.drain_in_flight_start = stats_in_flight(&stats);
+  info("Stopped sending, waiting up to %u ms for %lu answers\n",
+       drain_timeout_ms, run_summary.drain_in_flight_start);
+  timeval_add_ms(&interval, DRAIN_CHECK_INTERVAL_MSEC);
+  drain_ev = event_new(base, -1, EV_PERSIST, drain_check, NULL);
+  event_add(drain_ev, &interval);
+  drain_check(-1, 0, NULL);
+}
+
+/* Schedule the end of the run after [delay]. */
+void schedule_end_of_run(const struct timeval *delay)
+{
+  event_base_once(base, -1, EV_TIMEOUT, end_of_run, NULL, delay);
+}
+
+/* Start collecting the statistics needed for the summary. */
+void start_run_summary()
+{
+  if (!print_summary)
+    return;
+  run_summary_init(&run_summary);
+  poisson_set_lag_histogram(&stats.lag);
+  report_stats = 1;
+  if (check_arrivals && arrival_ring_init(&arrival_ring, ARRIVALS_RING_SIZE) == 0) {
+    run_summary.arrivals = &arrival_ring;
+    poisson_set_arrival_ring(&arrival_ring);
+  }
+}
+
+void print_run_summary()
+{
+  struct histogram *latency, *lag;
+  if (!print_summary)
+    return;
+  /* Merge with the histograms already reported with --stats, if any */
+  latency = malloc(sizeof(struct histogram));
+  lag = malloc(sizeof(struct histogram));
+  run_summary_end_phase(&run_summary, &stats, target_rate());
+  if (latency == NULL || lag == NULL) {
+    perror("Failed to print run summary");
+  } else {
+    *latency = stats_reporter.latency_total;
+    histogram_merge(latency, &stats.latency);
+    *lag = stats_reporter.lag_total;
+    histogram_merge(lag, &stats.lag);
+    run_summary_print(stderr, &run_summary, &stats, latency, lag, nb_conn);
+  }
+  free(latency);
+  free(lag);
+  for (unsigned int i = 0; i < run_summary.nb_phases; i++)
+    arrival_sample_free(&run_summary.phases[i].arrivals);
+  free(run_summary.phases);
+  if (run_summary.arrivals != NULL)
+    arrival_ring_free(&arrival_ring);
+}
+
+/* Delay from now until [deadline] (monotonic clock), rounded up so that
+   a timer never fires early, or 0 if the deadline is already past. */
+static void delay_until(struct timeval *delay, const struct timespec *deadline)
+{
+  struct timespec now, diff;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  subtract_timespec(&diff, deadline, &now);
+  delay->tv_sec = diff.tv_sec;
+  delay->tv_usec = 0;
+  timeval_add_us(delay, (diff.tv_nsec + 999) / 1000);
+}
+
+/* Arm the one-shot timer [ev] to fire [offset_ms] after [start], an
+   absolute time so that lag does not accumulate over long runs. */
+static void arm_timer_at(struct event *ev, const struct timespec *start, uint64_t offset_ms)
+{
+  struct timespec deadline = *start;
+  struct timeval delay;
+  deadline.tv_sec += offset_ms / 1000;
+  deadline.tv_nsec += (offset_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  delay_until(&delay, &deadline);
+  event_add(ev, &delay);
+}
+
+/* Signed difference a - b, in nanoseconds */
+static int64_t _timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+  return (int64_t) (a->tv_sec - b->tv_sec) * 1000000000 + (a->tv_nsec - b->tv_nsec);
+}
+
+/* Parse the absolute start time [spec] (--start-at), in seconds since
+   the Epoch with an optional fraction, e.g. "1700000000.25".  Returns -1
+   if it is invalid. */
+int parse_start_at(const char *spec)
+{
+  char *end;
+  long nsec = 0;
+  int digits = 0;
+  start_at_realtime.tv_sec = strtol(spec, &end, 10);
+  if (end == spec || start_at_realtime.tv_sec <= 0)
+    goto invalid;
+  if (*end == '.') {
+    /* Digits beyond the nanosecond are ignored */
+    for (end++; *end >= '0' && *end <= '9'; end++, digits++) {
+      if (digits < 9)
+	nsec = nsec * 10 + (*end - '0');
+    }
+    for (; digits < 9; digits++)
+      nsec *= 10;
+  }
+  if (*end != '\0')
+    goto invalid;
+  start_at_realtime.tv_nsec = nsec;
+  start_at = 1;
+  return 0;
+ invalid:
+  fprintf(stderr, "Error: invalid start time '%s', expected seconds since the Epoch (e.g. $(date +%%s -d '+1 min'))\n", spec);
+  return -1;
+}
+
+/* Report the residual skew of the start of the run, compared to the
+   time requested with --start-at. */
+static void start_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  fprintf(stderr, "Started the run at %ld.%.9ld, %+.3f ms from the requested start time\n",
+	  now.tv_sec, now.tv_nsec, _timespec_diff_ns(&now, &start_at_realtime) / 1e6);
+}
+
+/* Set the start of the run, from which the first Poisson events and all
+   phases are scheduled: the time requested with --start-at, or
+   [default_delay_ms] from now. */
+void set_run_start(unsigned int default_delay_ms)
+{
+  struct timespec before, real, after;
+  struct timeval delay;
+  int64_t until_ns;
+  if (!start_at) {
+    clock_gettime(CLOCK_MONOTONIC, &run_start);
+    run_start.tv_sec += default_delay_ms / 1000;
+    run_start.tv_nsec += (default_delay_ms % 1000) * 1000000;
+    if (run_start.tv_nsec >= 1000000000) {
+      run_start.tv_sec++;
+      run_start.tv_nsec -= 1000000000;
+    }
+    return;
+  }
+  /* Map the requested time onto the monotonic clock, which is not
+     affected by clock adjustments during the run.  The realtime clock is
+     read between two readings of the monotonic clock, taken as the
+     midpoint of both. */
+  clock_gettime(CLOCK_MONOTONIC, &before);
+  clock_gettime(CLOCK_REALTIME, &real);
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  until_ns = _timespec_diff_ns(&start_at_realtime, &real) + _timespec_diff_ns(&after, &before) / 2;
+  if (until_ns < 0) {
+    fprintf(stderr, "Warning: the requested start time is %.3f s in the past, starting now\n", -until_ns / 1e9);
+    until_ns = 0;
+  }
+  run_start.tv_sec = before.tv_sec + until_ns / 1000000000;
+  run_start.tv_nsec = before.tv_nsec + until_ns % 1000000000;
+  if (run_start.tv_nsec >= 1000000000) {
+    run_start.tv_sec++;
+    run_start.tv_nsec -= 1000000000;
+  }
+  info("Starting the run in %.3f s\n", until_ns / 1e9);
+  delay_until(&delay, &run_start);
+  event_base_once(base, -1, EV_TIMEOUT, start_cb, NULL, &delay);
+}
+
+/* Parse the local address [spec] (--source), a numeric IPv4 or IPv6
+   address.  Returns -1 if it is invalid. */
+int set_source_address(const char *spec)
+{
+  struct addrinfo hints, *res;
+  int ret;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+  ret = getaddrinfo(spec, NULL, &hints, &res);
+  if (ret != 0) {
+    fprintf(stderr, "Error: invalid source address '%s': %s\n", spec, gai_strerror(ret));
+    return -1;
+  }
+  memcpy(&source_addr, res->ai_addr, res->ai_addrlen);
+  source_len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+}
+
+/* Bind [sock] to the source address given with --source, if any.
+   Returns -1 in case of error. */
+int bind_source(int sock)
+{
+  if (source_len == 0)
+    return 0;
+#ifdef IP_BIND_ADDRESS_NO_PORT
+  /* Let connect() choose the port, so that ports only need to be unique
+     per destination, as without --source */
+  int on = 1;
+  setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+#endif
+  if (bind(sock, (struct sockaddr*)&source_addr, source_len) != 0) {
+    perror("Failed to bind to the source address");
+    return -1;
+  }
+  return 0;
+}
+
+/* Apply the next stdin command, read one more, and arm the timer of the
+   following one.  At the end of the stream, end the run.  If the next
+   command has not been read yet, the current one goes on until it is. */
+static void command_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  const struct command *command = command_stream_peek(&command_stream);
+  if (draining)
+    return;
+  if (command_stream_finished(&command_stream)) {
+    end_of_run(-1, 0, NULL);
+    return;
+  }
+  if (command == NULL) {
+    if (!commands_late)
+      fprintf(stderr, "Warning: command %lu is late on stdin, keeping the current rate until it arrives\n",
+	      command_stream.nb_read + 1);
+    commands_late = 1;
+    return;
+  }
+  commands_late = 0;
+  if (stdin_commands)
+    set_query_rate(command->value);
+  else
+    change_query_rate_slope(command);
+  commands_next_ms += command->duration_ms;
+  command_stream_pop(&command_stream);
+  arm_timer_at(command_ev, &commands_start, commands_next_ms);
+}
+
+/* A command was read, or the stream ended, while the window was empty */
+static void commands_ready(void *arg)
+{
+  if (commands_late)
+    command_cb(-1, 0, NULL);
+}
+
+/* Schedule the phases of the run, either a constant rate for [duration]
+   seconds (forever if 0), or the stdin commands, streamed as the run
+   goes.  All phases are relative to the start of the run, like the
+   first events of the Poisson processes. */
+void schedule_run(long duration)
+{
+  struct timeval delay_timeval;
+  delay_until(&delay_timeval, &run_start);
+  if (stdin_commands == 1 || stdin_rateslope_commands == 1) {
+    debug("Scheduling query rate%s changes according to stdin commands.\n",
+	  stdin_rateslope_commands ? " slope" : "");
+    commands_start = run_start;
+    commands_next_ms = 0;
+    command_ev = event_new(base, -1, 0, command_cb, NULL);
+    arm_timer_at(command_ev, &commands_start, commands_next_ms);
+    if (!commands_blocking)
+      command_stream_watch(&command_stream, base, commands_ready, NULL);
+  } else {
+    /* With a constant rate, the run has a single phase */
+    event_base_once(base, -1, EV_TIMEOUT, begin_phase, NULL, &delay_timeval);
+    if (duration > 0) {
+      info("Scheduling stop event in %ld seconds.\n", duration);
+      delay_timeval.tv_sec += duration;
+      schedule_end_of_run(&delay_timeval);
+    }
+  }
+}
+
+void close_commands()
+{
+  if (command_ev != NULL)
+    event_free(command_ev);
+  stop_command_slope();
+  command_stream_close(&command_stream);
+}
+
+/* Map the schedule [path] for playback (--schedule), and check that it
+   matches the query corpus and the number of connections, which is taken
+   from the schedule if not given.  Returns -1 in case of error. */
+int open_playback(const char *path)
+{
+  if (schedule_open(&send_schedule, path) != 0)
+    return -1;
+  if (send_schedule.header->nb_templates != corpus.nb_queries) {
+    fprintf(stderr, "Error: schedule %s was generated for %u queries, but the corpus has %u\n",
+	    path, send_schedule.header->nb_templates, corpus.nb_queries);
+    return -1;
+  }
+  if (nb_conn == 0)
+    nb_conn = send_schedule.header->nb_conn;
+  if (nb_conn != send_schedule.header->nb_conn) {
+    fprintf(stderr, "Error: schedule %s was generated for %u connections, not %u\n",
+	    path, send_schedule.header->nb_conn, nb_conn);
+    return -1;
+  }
+  info("Loaded schedule of %lu queries over %.3f s (%lu bytes)\n", send_schedule.header->nb_entries,
+       send_schedule.header->end_ns / 1e9, send_schedule.header->entries_len);
+  playback = 1;
+  return 0;
+}
+
+/* Delay from [elapsed_ns] to [time_ns], rounded up so that the timer
+   never fires early. */
+static void _playback_delay(struct timeval *delay, uint64_t time_ns, uint64_t elapsed_ns)
+{
+  uint64_t us = (time_ns - elapsed_ns + 999) / 1000;
+  delay->tv_sec = us / 1000000;
+  delay->tv_usec = us % 1000000;
+}
+
+/* Start a phase of the schedule, ending the previous one at its own
+   final target. */
+static void playback_phase_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  const struct schedule_phase *phase = ctx;
+  if (draining)
+    return;
+  if (run_summary.in_phase)
+    run_summary_end_phase(&run_summary, &stats, (phase - 1)->target_end);
+  run_summary_begin_phase(&run_summary, &stats, phase->target_start);
+}
+
+/* Send all the queries of the schedule that are due, and wait for the
+   next one. */
+static void playback_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct timespec now, elapsed;
+  struct timeval delay;
+  uint64_t elapsed_ns;
+  if (draining)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  subtract_timespec(&elapsed, &now, &playback_start);
+  elapsed_ns = elapsed.tv_sec * 1000000000ULL + elapsed.tv_nsec;
+  while (playback_next.time_ns <= elapsed_ns) {
+    if (playback_next.conn_id >= nb_conn || playback_next.template_id >= corpus.nb_queries) {
+      fprintf(stderr, "Error: invalid entry %lu in schedule, stopping playback\n", send_schedule.nb_read);
+      return;
+    }
+    if (report_stats)
+      histogram_record(&stats.lag, (elapsed_ns - playback_next.time_ns) / 1000);
+    if (run_summary.arrivals != NULL)
+      arrival_ring_record(&arrival_ring, &now);
+    send_scheduled_query(playback_next.conn_id, playback_next.template_id);
+    if (!schedule_next(&send_schedule, &playback_next))
+      return;
+  }
+  _playback_delay(&delay, playback_next.time_ns, elapsed_ns);
+  event_add(playback_ev, &delay);
+}
+
+/* Start the playback of the schedule at the start of the run, and
+   schedule its phases and the end of the run. */
+void schedule_playback()
+{
+  const struct schedule_phase *phase;
+  struct timespec now, lead;
+  struct timeval delay;
+  uint64_t lead_ns;
+  playback_start = run_start;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  subtract_timespec(&lead, &run_start, &now);
+  lead_ns = lead.tv_sec * 1000000000ULL + lead.tv_nsec;
+  for (uint32_t i = 0; i < send_schedule.header->nb_phases; i++) {
+    phase = &send_schedule.phases[i];
+    _playback_delay(&delay, lead_ns + phase->start_ns, 0);
+    event_base_once(base, -1, EV_TIMEOUT, playback_phase_cb, (void *) phase, &delay);
+  }
+  _playback_delay(&delay, lead_ns + send_schedule.header->end_ns, 0);
+  schedule_end_of_run(&delay);
+  if (!schedule_next(&send_schedule, &playback_next))
+    return;
+  playback_ev = event_new(base, -1, 0, playback_cb, NULL);
+  _playback_delay(&delay, lead_ns + playback_next.time_ns, 0);
+  event_add(playback_ev, &delay);
+}
+
+void close_playback()
+{
+  if (!playback)
+    return;
+  if (playback_ev != NULL)
+    event_free(playback_ev);
+  schedule_close(&send_schedule);
+}
+
+/* Counters and cumulative histograms of the run at some point, to
+   measure a step of the saturation search or a phase of a scenario */
+struct run_snapshot {
+  struct timespec time;
+  uint64_t sent;
+  uint64_t answered;
+  uint64_t responses;
+  uint64_t errors;
+  struct histogram latency;
+  struct histogram lag;
+};
+
+static void take_snapshot(struct run_snapshot *snap)
+{
+  clock_gettime(CLOCK_MONOTONIC, &snap->time);
+  snap->sent = stats.queries_sent;
+  snap->answered = stats.answers_received;
+  snap->responses = 0;
+  for (int i = 0; i < DNS_RESPONSE_NB_CLASSES; i++)
+    snap->responses += response_stats.count[i];
+  snap->errors = response_stats.count[DNS_RESPONSE_MALFORMED] + response_stats.count[DNS_RESPONSE_MISMATCH] +
+    response_stats.count[DNS_RESPONSE_SERVFAIL] + response_stats.count[DNS_RESPONSE_REFUSED] +
+    response_stats.count[DNS_RESPONSE_OTHER_RCODE];
+  /* Histograms since the start, including those already reported */
+  snap->latency = stats_reporter.latency_total;
+  histogram_merge(&snap->latency, &stats.latency);
+  snap->lag = stats_reporter.lag_total;
+  histogram_merge(&snap->lag, &stats.lag);
+}
+
+/* Start of the measurement of the current step of the saturation search */
+static struct run_snapshot *search_start;
+
+static void search_step_cb(evutil_socket_t fd, short events, void *ctx);
+
+/* End of the settling time of a step: start measuring. */
+static void search_measure_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct timeval delay = {0, 0};
+  if (draining)
+    return;
+  take_snapshot(search_start);
+  timeval_add_ms(&delay, search_step_ms);
+  event_base_once(base, -1, EV_TIMEOUT, search_step_cb, NULL, &delay);
+}
+
+/* End of a step: check it against the SLO, and move to the next rate or
+   end the run. */
+static void search_step_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct run_snapshot *end;
+  struct search_step step;
+  struct timespec elapsed;
+  struct timeval delay = {0, 0};
+  double seconds, next_rate;
+  if (draining)
+    return;
+  end = malloc(sizeof(struct run_snapshot));
+  if (end == NULL) {
+    perror("Failed to measure search step");
+    end_of_run(-1, 0, NULL);
+    return;
+  }
+  take_snapshot(end);
+  histogram_subtract(&end->latency, &search_start->latency);
+  histogram_subtract(&end->lag, &search_start->lag);
+  subtract_timespec(&elapsed, &end->time, &search_start->time);
+  seconds = elapsed.tv_sec + elapsed.tv_nsec / 1e9;
+  step.rate = search.rate;
+  step.achieved = (end->sent - search_start->sent) / seconds;
+  step.p99_ms = histogram_percentile(&end->latency, 99.) / 1000.;
+  step.lag_ms = histogram_percentile(&end->lag, 99.) / 1000.;
+  step.loss_pct = 0.;
+  if (end->sent > search_start->sent && end->answered - search_start->answered < end->sent - search_start->sent)
+    step.loss_pct = 100. * (1. - (double) (end->answered - search_start->answered) / (end->sent - search_start->sent));
+  step.errors_pct = -1.;
+  if (validate_responses)
+    step.errors_pct = end->responses > search_start->responses ?
+      100. * (end->errors - search_start->errors) / (end->responses - search_start->responses) : 0.;
+  slo_check(&slo, &step);
+  free(end);
+  info("Search step at %.1f qps: achieved %.1f qps, p99 %.3f ms, loss %.3f%%, lag p99 %.3f ms: %s\n",
+       step.rate, step.achieved, step.p99_ms, step.loss_pct, step.lag_ms, step.pass ? "pass" : "FAIL");
+  next_rate = search_next(&search, &step);
+  if (next_rate == 0.) {
+    end_of_run(-1, 0, NULL);
+    return;
+  }
+  set_query_rate(next_rate);
+  timeval_add_ms(&delay, search_settle_ms);
+  event_base_once(base, -1, EV_TIMEOUT, search_measure_cb, NULL, &delay);
+}
+
+/* Start the saturation search, at the start rate of the search which the
+   Poisson processes must already have.  Like schedule_run(), the search
+   begins at the start of the run. */
+void schedule_search()
+{
+  struct timeval delay;
+  delay_until(&delay, &run_start);
+  search_start = malloc(sizeof(struct run_snapshot));
+  /* Steps are evaluated on latency and lag */
+  report_stats = 1;
+  poisson_set_lag_histogram(&stats.lag);
+  event_base_once(base, -1, EV_TIMEOUT, begin_phase, NULL, &delay);
+  timeval_add_ms(&delay, search_settle_ms);
+  event_base_once(base, -1, EV_TIMEOUT, search_measure_cb, NULL, &delay);
+}
+
+void print_search()
+{
+  if (!search_mode)
+    return;
+  search_print(stderr, &search, &slo);
+  search_free(&search);
+  free(search_start);
+}
+
+/* Read the scenario [path] (--scenario), check its query policies, and
+   give its smallest and largest rate.  The connections opened before
+   the first phase default to those of the first phase, unless it ramps
+   them up.  Connections to churn are drawn from a stream of [seed] that
+   no Poisson process uses.  Returns -1 in case of error. */
+int open_scenario(const char *path, uint64_t seed, unsigned int *min_rate, unsigned int *max_rate)
+{
+  struct query_corpus check = corpus;
+  const struct scenario_phase *first;
+  double min, max;
+  uint32_t max_conns;
+  if (scenario_load(&scenario, path) != 0)
+    return -1;
+  for (unsigned int i = 0; i < scenario.nb_phases; i++) {
+    if (scenario.phases[i].policy[0] != '\0' && query_corpus_set_policy(&check, scenario.phases[i].policy) != 0)
+      return -1;
+  }
+  scenario_range(&scenario, &min, &max, &max_conns);
+  *min_rate = floor(min);
+  *max_rate = ceil(max);
+  first = &scenario.phases[0];
+  if (nb_conn == 0)
+    nb_conn = first->conns > 0 && first->conn_rate == 0. ? first->conns : 1;
+  if (max_conn < max_conns)
+    max_conn = max_conns;
+  scenario_rate = first->rate_start;
+  rng_seed(&scenario_churn_rng, seed ^ rng_mix64(UINT64_MAX));
+  info("Loaded scenario of %u phases, from %u to %u qps and up to %u connections\n",
+       scenario.nb_phases, *min_rate, *max_rate, max_conns > nb_conn ? max_conns : nb_conn);
+  scenario_mode = 1;
+  return 0;
+}
+
+static double _elapsed_seconds(const struct timespec *since)
+{
+  struct timespec now, elapsed;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  subtract_timespec(&elapsed, &now, since);
+  return elapsed.tv_sec + elapsed.tv_nsec / 1e9;
+}
+
+/* Change the target rate of the scenario, keeping track of the queries
+   expected in the current phase. */
+static void _scenario_set_rate(double rate)
+{
+  struct scenario_phase *phase = &scenario.phases[scenario.current];
+  if (rate == scenario_rate)
+    return;
+  phase->result.expected += scenario_rate * _elapsed_seconds(&scenario_rate_since);
+  clock_gettime(CLOCK_MONOTONIC, &scenario_rate_since);
+  scenario_rate = rate;
+  poisson_rate = rate / (double) poisson_nb_processes();
+  poisson_set_rate_all(poisson_rate);
+  run_summary_set_target(&run_summary, target_rate());
+}
+
+static void _scenario_begin_phase()
+{
+  struct scenario_phase *phase = &scenario.phases[scenario.current];
+  info("Starting scenario phase '%s' (%u ms)\n", phase->name, phase->duration_ms);
+  clock_gettime(CLOCK_MONOTONIC, &scenario_phase_start);
+  scenario_rate_since = scenario_phase_start;
+  take_snapshot(scenario_snapshot);
+  if (phase->policy[0] != '\0')
+    query_corpus_set_policy(&corpus, phase->policy);
+  scenario_conns_start = nb_conn;
+  if (phase->conns > 0 && phase->conn_rate == 0.)
+    set_nb_connections(phase->conns);
+  _scenario_set_rate(scenario_phase_rate(phase, 0));
+  run_summary_begin_phase(&run_summary, &stats, target_rate());
+  scenario_in_phase = 1;
+}
+
+/* Returns -1 if the phase could not be measured. */
+static int _scenario_end_phase()
+{
+  struct run_snapshot *start = scenario_snapshot;
+  struct scenario_phase *phase = &scenario.phases[scenario.current];
+  struct scenario_result *result = &phase->result;
+  struct run_snapshot *end = malloc(sizeof(struct run_snapshot));
+  struct timespec elapsed;
+  scenario_in_phase = 0;
+  scenario.current++;
+  /* The run summary still gets its phase */
+  run_summary_end_phase(&run_summary, &stats, target_rate());
+  if (end == NULL) {
+    perror("Failed to measure scenario phase");
+    return -1;
+  }
+  take_snapshot(end);
+  subtract_timespec(&elapsed, &end->time, &start->time);
+  result->seconds = elapsed.tv_sec + elapsed.tv_nsec / 1e9;
+  result->expected += scenario_rate * _elapsed_seconds(&scenario_rate_since);
+  result->sent = end->sent - start->sent;
+  result->answered = end->answered - start->answered;
+  result->responses = end->responses - start->responses;
+  result->errors = end->errors - start->errors;
+  result->conns_end = nb_conn;
+  result->latency = end->latency;
+  histogram_subtract(&result->latency, &start->latency);
+  result->lag = end->lag;
+  histogram_subtract(&result->lag, &start->lag);
+  free(end);
+  return 0;
+}
+
+/* End the current phase of the scenario, and start the next one or end
+   the run. */
+static void scenario_phase_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  if (draining)
+    return;
+  if (scenario_in_phase && _scenario_end_phase() != 0) {
+    end_of_run(-1, 0, NULL);
+    return;
+  }
+  if (scenario.current == scenario.nb_phases) {
+    end_of_run(-1, 0, NULL);
+    return;
+  }
+  _scenario_begin_phase();
+  scenario_next_ms += scenario.phases[scenario.current].duration_ms;
+  arm_timer_at(scenario_phase_ev, &scenario_start, scenario_next_ms);
+}
+
+/* Follow the rate function, connection ramp and churn of the current
+   phase, from the time elapsed since its start. */
+static void scenario_tick_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct scenario_phase *phase = &scenario.phases[scenario.current];
+  unsigned int elapsed_ms;
+  uint64_t churn_due;
+  double step;
+  uint32_t conns;
+  if (draining || !scenario_in_phase)
+    return;
+  elapsed_ms = _elapsed_seconds(&scenario_phase_start) * 1000.;
+  _scenario_set_rate(scenario_phase_rate(phase, elapsed_ms));
+  if (phase->conns > 0 && phase->conn_rate > 0. && nb_conn != phase->conns) {
+    step = phase->conn_rate * elapsed_ms / 1000.;
+    if (phase->conns > scenario_conns_start)
+      conns = step < phase->conns - scenario_conns_start ? scenario_conns_start + (uint32_t) step : phase->conns;
+    else
+      conns = step < scenario_conns_start - phase->conns ? scenario_conns_start - (uint32_t) step : phase->conns;
+    if (conns != nb_conn)
+      set_nb_connections(conns);
+  }
+  /* Connections are picked at random, and may be churned several times */
+  churn_due = phase->churn * elapsed_ms / 1000.;
+  while (phase->result.churned < churn_due) {
+    /* The connection would be left closed */
+    if (reopen_connection(rng_below(&scenario_churn_rng, nb_conn)) != 0) {
+      fprintf(stderr, "Error: failed to reopen a connection, stopping the scenario\n");
+      _scenario_end_phase();
+      end_of_run(-1, 0, NULL);
+      return;
+    }
+    phase->result.churned++;
+  }
+}
+
+/* Start the scenario.  Like schedule_run(), the first phase begins at
+   the start of the run. */
+void schedule_scenario()
+{
+  struct timeval interval = {0, 0};
+  scenario_snapshot = malloc(sizeof(struct run_snapshot));
+  /* Phases are measured on latency and lag */
+  report_stats = 1;
+  poisson_set_lag_histogram(&stats.lag);
+  scenario_start = run_start;
+  scenario_next_ms = 0;
+  scenario_phase_ev = event_new(base, -1, 0, scenario_phase_cb, NULL);
+  arm_timer_at(scenario_phase_ev, &scenario_start, 0);
+  timeval_add_ms(&interval, SCENARIO_TICK_MSEC);
+  scenario_tick_ev = event_new(base, -1, EV_PERSIST, scenario_tick_cb, NULL);
+  event_add(scenario_tick_ev, &interval);
+}
+
+void print_scenario()
+{
+  if (!scenario_mode)
+    return;
+  scenario_print(stderr, &scenario, validate_responses);
+  scenario_free(&scenario);
+  free(scenario_snapshot);
+  event_free(scenario_phase_ev);
+  event_free(scenario_tick_ev);
+}
+
+/* Commands of the control socket (--control), see control.h */
+
+static int _control_rate(int argc, char **argv, char *reply, size_t reply_len)
+{
+  char *end;
+  double rate;
+  if (argc != 2) {
+    snprintf(reply, reply_len, "usage: rate <qps>");
+    return -1;
+  }
+  rate = strtod(argv[1], &end);
+  if (*end != '\0' || end == argv[1] || rate <= 0. || rate > control_rate_limit(nb_conn)) {
+    snprintf(reply, reply_len, "rate must be above 0 and at most %.0f qps with %u connections (--control-max-rate)",
+	     control_rate_limit(nb_conn), nb_conn);
+    return -1;
+  }
+  if (draining) {
+    snprintf(reply, reply_len, "the run is over");
+    return -1;
+  }
+  /* A negative slope may have removed all processes */
+  if (poisson_nb_processes() == 0)
+    add_poisson_sender();
+  set_query_rate(rate);
+  snprintf(reply, reply_len, "%.1f", target_rate());
+  return 0;
+}
+
+static int _control_slope(int argc, char **argv, char *reply, size_t reply_len)
+{
+  char *end;
+  long slope;
+  if (argc != 2) {
+    snprintf(reply, reply_len, "usage: slope <qps/s>");
+    return -1;
+  }
+  slope = strtol(argv[1], &end, 10);
+  if (*end != '\0' || end == argv[1] || labs(slope) > (long) control_max_rate) {
+    snprintf(reply, reply_len, "invalid slope '%s'", argv[1]);
+    return -1;
+  }
+  if (draining) {
+    snprintf(reply, reply_len, "the run is over");
+    return -1;
+  }
+  /* The slope replaces the previous one, until the next slope command */
+  if (control_slope_ev != NULL) {
+    event_free(control_slope_ev);
+    free(control_slope_change);
+    control_slope_ev = NULL;
+  }
+  run_summary_end_phase(&run_summary, &stats, target_rate());
+  run_summary_begin_phase(&run_summary, &stats, target_rate());
+  if (slope != 0)
+    control_slope_ev = start_rate_slope(slope, &control_slope_change);
+  return 0;
+}
+
+static int _control_conns(int argc, char **argv, char *reply, size_t reply_len)
+{
+  char *end;
+  unsigned long n;
+  int ret;
+  if (argc != 2) {
+    snprintf(reply, reply_len, "usage: conns <nb_conn>");
+    return -1;
+  }
+  n = strtoul(argv[1], &end, 10);
+  if (*end != '\0' || end == argv[1] || n == 0 || n > max_conn) {
+    snprintf(reply, reply_len, "number of connections must be between 1 and %u (--control-max-conn)", max_conn);
+    return -1;
+  }
+  if (target_rate() > control_rate_limit(n)) {
+    snprintf(reply, reply_len, "%lu connections cannot carry %.0f qps, lower the rate first", n, target_rate());
+    return -1;
+  }
+  if (draining) {
+    snprintf(reply, reply_len, "the run is over");
+    return -1;
+  }
+  ret = set_nb_connections(n);
+  snprintf(reply, reply_len, ret == 0 ? "%u" : "only %u connections", nb_conn);
+  return ret;
+}
+
+static int _control_queries(int argc, char **argv, char *reply, size_t reply_len)
+{
+  if (argc != 2 || query_corpus_set_policy(&corpus, argv[1]) != 0) {
+    snprintf(reply, reply_len, "usage: queries uniform|sequential|zipf[:<exponent>]");
+    return -1;
+  }
+  return 0;
+}
+
+static int _control_stats(int argc, char **argv, char *reply, size_t reply_len)
+{
+  struct shm_stats_data *data = malloc(sizeof(struct shm_stats_data));
+  if (data == NULL) {
+    snprintf(reply, reply_len, "out of memory");
+    return -1;
+  }
+  snapshot_stats(data);
+  snprintf(reply, reply_len,
+	   "{\"sent\":%lu,\"answered\":%lu,\"timeouts\":%lu,\"in_flight\":%lu,"
+	   "\"target_rate\":%.1f,\"poisson_processes\":%u,\"nb_conn\":%u,\"connections\":%lu,"
+	   "\"latency_us\":{\"count\":%lu,\"p50\":%lu,\"p99\":%lu,\"max\":%lu},"
+	   "\"lag_us\":{\"count\":%lu,\"p99\":%lu,\"max\":%lu},\"draining\":%d}",
+	   data->queries_sent, data->answers_received, data->timeouts, stats_in_flight(&stats),
+	   target_rate(), poisson_nb_processes(), nb_conn, data->live_connections,
+	   data->latency.total, histogram_percentile(&data->latency, 50.),
+	   histogram_percentile(&data->latency, 99.), data->latency.max,
+	   data->lag.total, histogram_percentile(&data->lag, 99.), data->lag.max,
+	   draining);
+  free(data);
+  return 0;
+}
+
+static int _control_stop(int argc, char **argv, char *reply, size_t reply_len)
+{
+  if (draining) {
+    snprintf(reply, reply_len, "already stopping");
+    return -1;
+  }
+  end_of_run(-1, 0, NULL);
+  return 0;
+}
+
+static const struct control_command control_commands[] = {
+  {"rate",    "<qps>",                               _control_rate},
+  {"slope",   "<qps/s>",                             _control_slope},
+  {"conns",   "<nb_conn>",                           _control_conns},
+  {"queries", "uniform|sequential|zipf[:<exponent>]", _control_queries},
+  {"stats",   "",                                    _control_stats},
+  {"stop",    "",                                    _control_stop},
+  {NULL,      NULL,                                  NULL}
+};
+
+/* Accept commands on the Unix socket [path] during the run. */
+int start_control(const char *path)
+{
+  if (control_open(base, path, control_commands) != 0)
+    return -1;
+  control = 1;
+  /* Stats replies include latency and lag */
+  report_stats = 1;
+  poisson_set_lag_histogram(&stats.lag);
+  return 0;
+}
+
+void stop_control()
+{
+  if (!control)
+    return;
+  control_close();
+  if (control_slope_ev != NULL) {
+    event_free(control_slope_ev);
+    free(control_slope_change);
+  }
 }
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+
+struct control_client {
+  int fd;
+  struct event *event;
+  /* Partial command line */
+  char line[CONTROL_MAX_LINE];
+  size_t line_len;
+  struct control_client *next;
+};
+
+static struct event_base *control_base;
+static const struct control_command *control_commands;
+static int control_fd = -1;
+static struct event *control_ev;
+static char control_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static struct control_client *control_clients;
+
+
+static void _client_free(struct control_client *client)
+{
+  struct control_client **p;
+  for (p = &control_clients; *p != NULL; p = &(*p)->next) {
+    if (*p == client) {
+      *p = client->next;
+      break;
+    }
+  }
+  event_free(client->event);
+  close(client->fd);
+  free(client);
+}
+
+/* Send a reply line without blocking.  Returns -1 if the client cannot
+   take it. */
+static int _client_reply(struct control_client *client, int ok, const char *result)
+{
+  char buf[CONTROL_MAX_REPLY + 16];
+  int len;
+  if (ok)
+    len = snprintf(buf, sizeof(buf), result[0] == '\0' ? "ok\n" : "ok %s\n", result);
+  else
+    len = snprintf(buf, sizeof(buf), "error: %s\n", result);
+  if (len >= sizeof(buf))
+    len = sizeof(buf) - 1;
+  return send(client->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+static void _help(char *reply, size_t reply_len)
+{
+  size_t len = snprintf(reply, reply_len, "commands:");
+  for (const struct control_command *c = control_commands; c->name != NULL && len < reply_len; c++)
+    len += snprintf(reply + len, reply_len - len, c->args[0] == '\0' ? " %s;" : " %s %s;", c->name, c->args);
+  if (len < reply_len)
+    snprintf(reply + len, reply_len - len, " help");
+}
+
+/* Run one command line, and reply to it.  Returns -1 if the client
+   should be disconnected. */
+static int _client_command(struct control_client *client, char *line)
+{
+  char reply[CONTROL_MAX_REPLY];
+  char *argv[CONTROL_MAX_ARGS];
+  char *saveptr;
+  const struct control_command *c;
+  int argc = 0;
+  for (char *word = strtok_r(line, " \t\r", &saveptr); word != NULL; word = strtok_r(NULL, " \t\r", &saveptr)) {
+    if (argc == CONTROL_MAX_ARGS)
+      return _client_reply(client, 0, "too many arguments");
+    argv[argc++] = word;
+  }
+  /* Ignore empty lines */
+  if (argc == 0)
+    return 0;
+  reply[0] = '\0';
+  if (strcmp(argv[0], "help") == 0) {
+    _help(reply, sizeof(reply));
+    return _client_reply(client, 1, reply);
+  }
+  for (c = control_commands; c->name != NULL; c++) {
+    if (strcmp(argv[0], c->name) == 0)
+      break;
+  }
+  if (c->name == NULL) {
+    snprintf(reply, sizeof(reply), "unknown command '%s', try 'help'", argv[0]);
+    return _client_reply(client, 0, reply);
+  }
+  if (c->handler(argc, argv, reply, sizeof(reply)) != 0)
+    return _client_reply(client, 0, reply[0] == '\0' ? "failed" : reply);
+  return _client_reply(client, 1, reply);
+}
+
+static void _client_read_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct control_client *client = ctx;
+  char buf[1024];
+  ssize_t len = read(fd, buf, sizeof(buf));
+  if (len <= 0) {
+    if (len == 0 || (errno != EAGAIN && errno != EINTR))
+      _client_free(client);
+    return;
+  }
+  for (ssize_t i = 0; i < len; i++) {
+    if (buf[i] != '\n') {
+      /* Overlong lines are truncated, and then rejected as invalid */
+      if (client->line_len < sizeof(client->line) - 1)
+	client->line[client->line_len++] = buf[i];
+      continue;
+    }
+    client->line[client->line_len] = '\0';
+    client->line_len = 0;
+    if (_client_command(client, client->line) != 0) {
+      _client_free(client);
+      return;
+    }
+  }
+}
+
+static void _accept_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct control_client *client;
+  int client_fd = accept(fd, NULL, NULL);
+  if (client_fd == -1)
+    return;
+  client = calloc(1, sizeof(struct control_client));
+  if (client == NULL) {
+    close(client_fd);
+    return;
+  }
+  fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+  client->fd = client_fd;
+  client->event = event_new(control_base, client_fd, EV_READ | EV_PERSIST, _client_read_cb, client);
+  event_add(client->event, NULL);
+  client->next = control_clients;
+  control_clients = client;
+}
+
+int control_open(struct event_base *base, const char *path, const struct control_command *commands)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Error: control socket path '%s' is too long\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  /* Remove a socket left behind by a previous run, but nothing else */
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "Error: '%s' exists and is not a socket, refusing to replace it\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+  control_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (control_fd == -1) {
+    perror("Failed to create control socket");
+    return -1;
+  }
+  if (bind(control_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(control_fd, 16) == -1) {
+    perror("Failed to listen on control socket");
+    close(control_fd);
+    control_fd = -1;
+    return -1;
+  }
+  fcntl(control_fd, F_SETFL, fcntl(control_fd, F_GETFL) | O_NONBLOCK);
+  strcpy(control_path, path);
+  control_base = base;
+  control_commands = commands;
+  control_ev = event_new(base, control_fd, EV_READ | EV_PERSIST, _accept_cb, NULL);
+  event_add(control_ev, NULL);
+  return 0;
+}
+
+void control_close()
+{
+  if (control_fd == -1)
+    return;
+  while (control_clients != NULL)
+    _client_free(control_clients);
+  event_free(control_ev);
+  close(control_fd);
+  control_fd = -1;
+  unlink(control_path);
+}
@@ -0,0 +1,46 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stddef.h>
+#include <event2/event.h>
+
+/* Runtime control socket.
+
+   A Unix-domain stream socket, handled inside the event loop of the
+   client, that accepts text commands from external scripts, e.g.:
+
+     printf 'rate 5000\n' | socat - UNIX-CONNECT:/tmp/client.sock
+
+   Each command is one line of whitespace-separated words, and gets
+   exactly one reply line, "ok" optionally followed by a result, or
+   "error: <reason>".  Several clients may be connected at the same
+   time.  Replies are sent without blocking the event loop: a client
+   that does not read its replies is disconnected. */
+
+/* Maximum length of a command line, and of a reply */
+#define CONTROL_MAX_LINE 256
+#define CONTROL_MAX_REPLY 2048
+#define CONTROL_MAX_ARGS 8
+
+/* Handler of a command.  [argv][0] is the command name.  On success,
+   returns 0 and may write a result to [reply]; on failure, returns -1
+   and writes the reason to [reply]. */
+typedef int (*control_handler)(int argc, char **argv, char *reply, size_t reply_len);
+
+struct control_command {
+  const char *name;
+  /* Arguments, for the help command */
+  const char *args;
+  control_handler handler;
+};
+
+/* Listen on the Unix socket [path], replacing any stale socket file,
+   and dispatch commands to [commands] (terminated by a NULL name).  A
+   "help" command listing [commands] is always available.  Returns -1
+   in case of error. */
+int control_open(struct event_base *base, const char *path, const struct control_command *commands);
+
+/* Disconnect all clients, and remove the socket file. */
+void control_close();
+
+#endif
@@ -0,0 +1,597 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+#include "shmstats.h"
+
+/* Runs several tcpclient or udpclient workers on the local machine, as
+   a single load generator: a client is bound to one core by its event
+   loop, so the workers split the rate, the connections, the source
+   addresses and the random seeds among them.  All workers start at the
+   same time (--start-at), publish their statistics in shared memory
+   (--shm-stats), and the coordinator aggregates them into one live view
+   and one final summary.  It never touches the data path. */
+
+/* Delay between the start of the workers and the start of the run */
+#define COORDINATOR_START_DELAY_MSEC 5000
+
+/* Interval between two readings of the worker segments */
+#define COORDINATOR_POLL_MSEC 100
+
+/* Client options that the coordinator sets itself, or that cannot be
+   split among workers */
+static const char *rejected_options[] = {
+  "--stdin", "--stdin-rateslope", "--schedule", "--search", "--control",
+  "--scenario", "--shm-stats", "--start-at", "--source", "--stats",
+  "--stats-fd", "--metrics", NULL
+};
+
+struct worker {
+  pid_t pid;
+  char shm_name[64];
+  const struct shm_stats *shm;
+  struct shm_stats_data data;
+  int running;
+  int status;
+};
+
+static short verbose;
+static volatile sig_atomic_t stop_signal;
+
+static void signal_handler(int sig)
+{
+  stop_signal = sig;
+}
+
+static uint64_t _now_ns(clockid_t clock)
+{
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void _sleep_ms(unsigned int ms)
+{
+  struct timespec interval;
+  interval.tv_sec = ms / 1000;
+  interval.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&interval, NULL);
+}
+
+/* Whether the segment of a worker is fully created: shm_stats_open()
+   would report an error if it is not yet. */
+static int _segment_ready(const char *name)
+{
+  char path[128];
+  char magic[8];
+  struct stat st;
+  int fd, ready;
+  snprintf(path, sizeof(path), "/dev/shm/%s", name);
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 0;
+  ready = fstat(fd, &st) == 0 && st.st_size >= sizeof(struct shm_stats) &&
+    pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+    memcmp(magic, SHM_STATS_MAGIC, sizeof(magic)) == 0;
+  close(fd);
+  return ready;
+}
+
+/* Find the value of the short option [opt] in the client arguments,
+   given either as "-r 100" or as "-r100".  Returns the index of the
+   argument holding the value, or -1. */
+static int _find_option(int argc, char **argv, char opt)
+{
+  for (int i = 0; i < argc; i++) {
+    if (argv[i][0] != '-' || argv[i][1] != opt)
+      continue;
+    if (argv[i][2] != '\0')
+      return i;
+    if (i + 1 < argc)
+      return i + 1;
+  }
+  return -1;
+}
+
+static const char *_option_value(char **argv, int index, char opt)
+{
+  if (argv[index][0] == '-' && argv[index][1] == opt && argv[index][2] != '\0')
+    return argv[index] + 2;
+  return argv[index];
+}
+
+/* Replace the value of the short option [opt] at [index] by [value],
+   keeping the form of the option. */
+static char *_replace_value(char **argv, int index, char opt, unsigned long value)
+{
+  char *arg = malloc(32);
+  if (arg == NULL)
+    return argv[index];
+  if (argv[index][0] == '-' && argv[index][1] == opt && argv[index][2] != '\0')
+    snprintf(arg, 32, "-%c%lu", opt, value);
+  else
+    snprintf(arg, 32, "%lu", value);
+  return arg;
+}
+
+/* [path] suffixed with the worker ID */
+static char *_worker_path(const char *path, unsigned int id)
+{
+  size_t len = strlen(path) + 16;
+  char *arg = malloc(len);
+  if (arg == NULL)
+    return (char *) path;
+  snprintf(arg, len, "%s.%u", path, id);
+  return arg;
+}
+
+/* Share of worker [i] out of [n] in [total], spreading the remainder
+   over the first workers */
+static unsigned long _share(unsigned long total, unsigned int n, unsigned int i)
+{
+  return total / n + (i < total % n ? 1 : 0);
+}
+
+static int _check_options(int argc, char **argv)
+{
+  for (int i = 0; i < argc; i++) {
+    for (const char **opt = rejected_options; *opt != NULL; opt++) {
+      size_t len = strlen(*opt);
+      if (strncmp(argv[i], *opt, len) == 0 && (argv[i][len] == '\0' || argv[i][len] == '=')) {
+	fprintf(stderr, "Error: client option %s is not supported by the coordinator\n", *opt);
+	return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Start worker [id]: the client with its share of the rate and
+   connections, its own seed, source address and segment, and the common
+   start time. */
+static pid_t start_worker(struct worker *worker, unsigned int id, unsigned int nb_workers,
+			  int argc, char **argv, const char *start_at, char **sources,
+			  unsigned int nb_sources, const int *cpus, unsigned int nb_cpus,
+			  const char *output_prefix)
+{
+  int rate_idx = _find_option(argc, argv, 'r');
+  int conn_idx = _find_option(argc, argv, 'c');
+  int seed_idx = _find_option(argc, argv, 's');
+  unsigned long rate = strtoul(_option_value(argv, rate_idx, 'r'), NULL, 10);
+  unsigned long conns = strtoul(_option_value(argv, conn_idx, 'c'), NULL, 10);
+  unsigned long seed = seed_idx == -1 ? 42 : strtoul(_option_value(argv, seed_idx, 's'), NULL, 10);
+  char seed_s[32], path[4096];
+  char **args;
+  int nb_args = 0, fd;
+  cpu_set_t cpu_set;
+  pid_t pid;
+
+  args = calloc(argc + 12, sizeof(char *));
+  if (args == NULL) {
+    perror("Failed to start worker");
+    return -1;
+  }
+  args[nb_args++] = argv[0];
+  for (int i = 1; i < argc; i++) {
+    /* Each worker writes its own per-query log, see rttmerge */
+    if (strcmp(argv[i], "--rtt-log") == 0 && i + 1 < argc) {
+      args[nb_args++] = argv[i++];
+      args[nb_args++] = _worker_path(argv[i], id);
+    } else if (strncmp(argv[i], "--rtt-log=", 10) == 0)
+      args[nb_args++] = _worker_path(argv[i], id);
+    else if (i == rate_idx)
+      args[nb_args++] = _replace_value(argv, i, 'r', _share(rate, nb_workers, id));
+    else if (i == conn_idx)
+      args[nb_args++] = _replace_value(argv, i, 'c', _share(conns, nb_workers, id));
+    else if (i == seed_idx)
+      args[nb_args++] = _replace_value(argv, i, 's', (seed + id) & 0xffffffff);
+    else
+      args[nb_args++] = argv[i];
+  }
+  /* The client permutes its arguments, so options can follow the host */
+  if (seed_idx == -1) {
+    snprintf(seed_s, sizeof(seed_s), "%lu", seed + id);
+    args[nb_args++] = "-s";
+    args[nb_args++] = seed_s;
+  }
+  args[nb_args++] = "--start-at";
+  args[nb_args++] = (char *) start_at;
+  args[nb_args++] = "--shm-stats";
+  args[nb_args++] = worker->shm_name;
+  if (nb_sources > 0) {
+    args[nb_args++] = "--source";
+    args[nb_args++] = sources[id % nb_sources];
+  }
+  args[nb_args] = NULL;
+
+  pid = fork();
+  if (pid != 0) {
+    if (pid == -1)
+      perror("Failed to start worker");
+    free(args);
+    return pid;
+  }
+  if (nb_cpus > 0) {
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpus[id % nb_cpus], &cpu_set);
+    if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0)
+      perror("Failed to pin worker");
+  }
+  if (output_prefix != NULL) {
+    snprintf(path, sizeof(path), "%s.%u.out", output_prefix, id);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1) {
+      perror(path);
+      _exit(127);
+    }
+    close(fd);
+    snprintf(path, sizeof(path), "%s.%u.err", output_prefix, id);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || dup2(fd, STDERR_FILENO) == -1) {
+      perror(path);
+      _exit(127);
+    }
+    close(fd);
+  }
+  execvp(args[0], args);
+  perror(args[0]);
+  _exit(127);
+}
+
+/* Aggregate the last snapshot of all workers into [total].  Returns the
+   number of workers with a segment. */
+static unsigned int aggregate(struct worker *workers, unsigned int nb_workers, struct shm_stats_data *total)
+{
+  unsigned int nb = 0;
+  for (unsigned int i = 0; i < nb_workers; i++) {
+    if (workers[i].shm == NULL && _segment_ready(workers[i].shm_name))
+      workers[i].shm = shm_stats_open(workers[i].shm_name);
+    if (workers[i].shm == NULL)
+      continue;
+    shm_stats_read(workers[i].shm, &workers[i].data);
+    if (nb++ == 0)
+      memcpy(total, &workers[i].data, sizeof(struct shm_stats_data));
+    else
+      shm_stats_merge(total, &workers[i].data);
+  }
+  return nb;
+}
+
+/* Print the live view: rates and percentiles over the last interval */
+static void print_live(const struct shm_stats_data *total, const struct shm_stats_data *last,
+		       uint64_t start_ns, unsigned int running, unsigned int nb_workers, short json)
+{
+  struct histogram *latency, *lag;
+  /* The first interval starts with the run */
+  uint64_t since_ns = last->update_time_ns > start_ns ? last->update_time_ns : start_ns;
+  double interval = ((int64_t) total->update_time_ns - (int64_t) since_ns) / 1e9;
+  double elapsed = ((int64_t) total->update_time_ns - (int64_t) start_ns) / 1e9;
+  double sent_rate = 0., answer_rate = 0.;
+  if (interval > 0.) {
+    sent_rate = (total->queries_sent - last->queries_sent) / interval;
+    answer_rate = (total->answers_received - last->answers_received) / interval;
+  }
+  latency = malloc(sizeof(struct histogram));
+  lag = malloc(sizeof(struct histogram));
+  if (latency == NULL || lag == NULL) {
+    free(latency);
+    free(lag);
+    return;
+  }
+  memcpy(latency, &total->latency, sizeof(struct histogram));
+  histogram_subtract(latency, &last->latency);
+  memcpy(lag, &total->lag, sizeof(struct histogram));
+  histogram_subtract(lag, &last->lag);
+  if (json) {
+    printf("{\"time\":%.6f,\"elapsed\":%.3f,\"workers\":%u,\"running\":%u,"
+	   "\"sent\":%lu,\"answered\":%lu,\"timeouts\":%lu,\"connections\":%lu,"
+	   "\"target_rate\":%.1f,\"sent_rate\":%.1f,\"answer_rate\":%.1f,"
+	   "\"latency_us\":{\"count\":%lu,\"p50\":%lu,\"p99\":%lu,\"max\":%lu},"
+	   "\"lag_us\":{\"count\":%lu,\"p50\":%lu,\"p99\":%lu,\"max\":%lu}}\n",
+	   total->update_time_ns / 1e9, elapsed, nb_workers, running,
+	   total->queries_sent, total->answers_received, total->timeouts, total->live_connections,
+	   total->target_rate, sent_rate, answer_rate,
+	   latency->total, histogram_percentile(latency, 50.), histogram_percentile(latency, 99.), latency->max,
+	   lag->total, histogram_percentile(lag, 50.), histogram_percentile(lag, 99.), lag->max);
+  } else {
+    printf("%8.1f s  %u/%u workers  target %.1f qps  sent %.1f qps  answered %.1f qps  %lu conns  "
+	   "latency p50 %.3f p99 %.3f ms  lag p99 %.3f ms\n",
+	   elapsed, running, nb_workers, total->target_rate, sent_rate, answer_rate, total->live_connections,
+	   histogram_percentile(latency, 50.) / 1000., histogram_percentile(latency, 99.) / 1000.,
+	   histogram_percentile(lag, 99.) / 1000.);
+  }
+  fflush(stdout);
+  free(latency);
+  free(lag);
+}
+
+static const char *_status(const struct worker *worker, char *buf, size_t buflen)
+{
+  if (worker->running)
+    return "running";
+  if (WIFEXITED(worker->status))
+    snprintf(buf, buflen, "exit %d", WEXITSTATUS(worker->status));
+  else if (WIFSIGNALED(worker->status))
+    snprintf(buf, buflen, "signal %d", WTERMSIG(worker->status));
+  else
+    snprintf(buf, buflen, "unknown");
+  return buf;
+}
+
+static void _print_row(FILE *out, const char *name, const char *pid, const char *status,
+		       const struct shm_stats_data *data, double seconds)
+{
+  double loss = 0.;
+  if (data->queries_sent > data->answers_received)
+    loss = 100. * (data->queries_sent - data->answers_received) / data->queries_sent;
+  fprintf(out, "%-8s %8s %10s %11.1f %11.1f %12lu %12lu %8.3f %9.3f %9.3f %9.3f %7lu\n",
+	  name, pid, status, data->target_rate, seconds > 0. ? data->queries_sent / seconds : 0.,
+	  data->queries_sent, data->answers_received, loss,
+	  histogram_percentile(&data->latency, 50.) / 1000., histogram_percentile(&data->latency, 99.) / 1000.,
+	  histogram_percentile(&data->lag, 99.) / 1000., data->connections_opened);
+}
+
+/* Final summary: one line per worker and their aggregate, from their
+   last snapshot. */
+static void print_summary(FILE *out, struct worker *workers, unsigned int nb_workers,
+			  const struct shm_stats_data *total, double seconds)
+{
+  char pid[16], status[32];
+  const struct histogram *latency = &total->latency, *lag = &total->lag;
+  fprintf(out, "Summary of %u workers over %.1f s of sending:\n", nb_workers, seconds);
+  fprintf(out, "%-8s %8s %10s %11s %11s %12s %12s %8s %9s %9s %9s %7s\n",
+	  "worker", "pid", "status", "target_qps", "achieved", "sent", "answered", "loss%",
+	  "p50_ms", "p99_ms", "lag_ms", "conns");
+  for (unsigned int i = 0; i < nb_workers; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "%u", i);
+    snprintf(pid, sizeof(pid), "%d", workers[i].pid);
+    _print_row(out, name, pid, _status(&workers[i], status, sizeof(status)), &workers[i].data, seconds);
+  }
+  _print_row(out, "total", "-", "-", total, seconds);
+  if (latency->total > 0)
+    fprintf(out, "Latency (ms): p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f\n",
+	    histogram_percentile(latency, 50.) / 1000., histogram_percentile(latency, 90.) / 1000.,
+	    histogram_percentile(latency, 99.) / 1000., histogram_percentile(latency, 99.9) / 1000.,
+	    latency->max / 1000.);
+  if (lag->total > 0)
+    fprintf(out, "Scheduling lag (ms): p50 %.3f, p99 %.3f, max %.3f\n",
+	    histogram_percentile(lag, 50.) / 1000., histogram_percentile(lag, 99.) / 1000.,
+	    lag->max / 1000.);
+}
+
+/* Parse the list of CPUs that the coordinator may run on, to pin each
+   worker to one of them.  Returns their number. */
+static unsigned int _allowed_cpus(int **cpus)
+{
+  cpu_set_t set;
+  unsigned int nb = 0;
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+    perror("Failed to get the CPU affinity");
+    return 0;
+  }
+  *cpus = calloc(CPU_COUNT(&set), sizeof(int));
+  for (int cpu = 0; cpu < CPU_SETSIZE && *cpus != NULL; cpu++) {
+    if (CPU_ISSET(cpu, &set))
+      (*cpus)[nb++] = cpu;
+  }
+  return nb;
+}
+
+void usage(char *progname)
+{
+  fprintf(stderr, "usage: %s [-h] [-v] [-j] [-w interval_ms] [-d start_delay_ms] [-o prefix] [-S name]  [--source addr[,addr]...]  [--pin]  -n <nb_workers>  [--] <client> <client options> <host>\n", progname);
+  fprintf(stderr, "Runs <nb_workers> instances of <client> (tcpclient or udpclient) on this machine as a single load generator.\n");
+  fprintf(stderr, "The rate (-r) and connections (-c) of the client options are split among workers, which must have\n");
+  fprintf(stderr, "-r and -c of at least <nb_workers>, given as separate options; worker i uses the seed '-s' + i (default 42 + i).\n");
+  fprintf(stderr, "All workers start their run at the same time, '-d' milliseconds (default %d) after they are started.\n", COORDINATOR_START_DELAY_MSEC);
+  fprintf(stderr, "Their shared memory statistics are aggregated and printed every '-w' milliseconds (default 1000, 0 to disable),\n");
+  fprintf(stderr, "as text or JSON ('-j'), with rates and percentiles over the last interval, and in a final summary.\n");
+  fprintf(stderr, "Option '-S' publishes the aggregate statistics in /dev/shm/<name>, for shmstat.\n");
+  fprintf(stderr, "Option '-o' writes the output and errors of worker i to <prefix>.i.out and <prefix>.i.err.\n");
+  fprintf(stderr, "With the client option '--rtt-log <file>', worker i writes its log to <file>.i (see rttmerge).\n");
+  fprintf(stderr, "Option '--source' binds worker i to the i-th local address of the list (modulo its length).\n");
+  fprintf(stderr, "Option '--pin' pins worker i to the i-th CPU that the coordinator may run on, e.g. with 'numactl -N 0'.\n");
+  fprintf(stderr, "Client options that cannot be split (--stdin, --schedule, --search, --control, --scenario, --stats, --metrics)\n");
+  fprintf(stderr, "are not supported.  The exit status is non-zero if any worker failed.\n");
+}
+
+int main(int argc, char **argv)
+{
+  static struct option long_options[] = {
+    {"source", required_argument, NULL, 0},
+    {"pin",    no_argument, NULL, 0},
+    {NULL,     0,         NULL, 0}
+  };
+  struct worker *workers;
+  struct shm_stats_data *total, *last;
+  struct shm_stats *published = NULL;
+  struct sigaction action;
+  char start_at[32], path[128];
+  char *sources_spec = NULL, *sources[256], *saveptr;
+  const char *output_prefix = NULL, *shm_name = NULL;
+  unsigned int nb_workers = 0, nb_sources = 0, nb_cpus = 0, running, nb_ready;
+  unsigned int interval_ms = 1000, start_delay_ms = COORDINATOR_START_DELAY_MSEC;
+  int *cpus = NULL;
+  int client_argc, opt, option_index = 0, failed = 0, duration_idx;
+  char **client_argv;
+  short json = 0, pin = 0, forwarded = 0;
+  uint64_t start_ns, start_mono_ns, next_print_ns, last_sent_ns = 0, now;
+  double seconds;
+
+  while ((opt = getopt_long(argc, argv, "+hvjw:d:o:S:n:", long_options, &option_index)) != -1) {
+    switch (opt) {
+    case 0: /* long option */
+      if (option_index == 0) { /* --source */
+	sources_spec = optarg;
+      }
+      if (option_index == 1) { /* --pin */
+	pin = 1;
+      }
+      break;
+    case 'n':
+      nb_workers = strtoul(optarg, NULL, 10);
+      break;
+    case 'j':
+      json = 1;
+      break;
+    case 'w':
+      interval_ms = strtoul(optarg, NULL, 10);
+      break;
+    case 'd':
+      start_delay_ms = strtoul(optarg, NULL, 10);
+      break;
+    case 'o':
+      output_prefix = optarg;
+      break;
+    case 'S':
+      shm_name = optarg;
+      break;
+    case 'v':
+      verbose += 1;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  client_argc = argc - optind;
+  client_argv = argv + optind;
+  if (nb_workers == 0 || client_argc < 2) {
+    fprintf(stderr, "Error: missing mandatory arguments\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (_check_options(client_argc, client_argv) != 0)
+    return 1;
+  {
+    int rate_idx = _find_option(client_argc, client_argv, 'r');
+    int conn_idx = _find_option(client_argc, client_argv, 'c');
+    if (rate_idx == -1 || conn_idx == -1 ||
+	strtoul(_option_value(client_argv, rate_idx, 'r'), NULL, 10) < nb_workers ||
+	strtoul(_option_value(client_argv, conn_idx, 'c'), NULL, 10) < nb_workers) {
+      fprintf(stderr, "Error: the client needs -r and -c of at least the number of workers (%u)\n", nb_workers);
+      return 1;
+    }
+  }
+  if (sources_spec != NULL) {
+    for (char *s = strtok_r(sources_spec, ",", &saveptr); s != NULL && nb_sources < 256;
+	 s = strtok_r(NULL, ",", &saveptr))
+      sources[nb_sources++] = s;
+  }
+  if (pin && (nb_cpus = _allowed_cpus(&cpus)) < nb_workers)
+    fprintf(stderr, "Warning: %u workers for %u CPUs, some of them share a CPU\n", nb_workers, nb_cpus);
+  if (shm_name != NULL) {
+    published = shm_stats_create(shm_name, SHM_STATS_CLIENT, "coordinator");
+    if (published == NULL)
+      return 1;
+  }
+
+  workers = calloc(nb_workers, sizeof(struct worker));
+  total = calloc(1, sizeof(struct shm_stats_data));
+  last = calloc(1, sizeof(struct shm_stats_data));
+  if (workers == NULL || total == NULL || last == NULL) {
+    perror("Failed to allocate workers");
+    return 1;
+  }
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = signal_handler;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  /* Common start of the run */
+  start_ns = _now_ns(CLOCK_REALTIME) + start_delay_ms * 1000000ULL;
+  start_mono_ns = _now_ns(CLOCK_MONOTONIC) + start_delay_ms * 1000000ULL;
+  snprintf(start_at, sizeof(start_at), "%lu.%09lu", start_ns / 1000000000, start_ns % 1000000000);
+  for (unsigned int i = 0; i < nb_workers; i++) {
+    snprintf(workers[i].shm_name, sizeof(workers[i].shm_name), "coordinator.%d.%u", getpid(), i);
+    /* Never read a stale segment of an earlier coordinator */
+    snprintf(path, sizeof(path), "/dev/shm/%s", workers[i].shm_name);
+    unlink(path);
+    workers[i].pid = start_worker(&workers[i], i, nb_workers, client_argc, client_argv, start_at,
+				  sources, nb_sources, cpus, nb_cpus, output_prefix);
+    if (workers[i].pid == -1) {
+      failed = 1;
+      break;
+    }
+    workers[i].running = 1;
+    if (verbose)
+      fprintf(stderr, "Started worker %u (pid %d)\n", i, workers[i].pid);
+  }
+
+  next_print_ns = start_mono_ns + interval_ms * 1000000ULL;
+  running = nb_workers;
+  while (running > 0) {
+    _sleep_ms(COORDINATOR_POLL_MSEC);
+    /* Forward the signal once, and let the workers exit */
+    if (stop_signal && !forwarded) {
+      for (unsigned int i = 0; i < nb_workers; i++) {
+	if (workers[i].running)
+	  kill(workers[i].pid, stop_signal);
+      }
+      forwarded = 1;
+    }
+    running = 0;
+    for (unsigned int i = 0; i < nb_workers; i++) {
+      if (workers[i].running && waitpid(workers[i].pid, &workers[i].status, WNOHANG) == workers[i].pid) {
+	workers[i].running = 0;
+	/* Workers stopped by the forwarded signal did not fail */
+	if (WIFSIGNALED(workers[i].status) ? !forwarded || WTERMSIG(workers[i].status) != stop_signal :
+	    WEXITSTATUS(workers[i].status) != 0)
+	  failed = 1;
+      }
+      running += workers[i].running;
+    }
+    nb_ready = aggregate(workers, nb_workers, total);
+    if (nb_ready == 0)
+      continue;
+    if (total->queries_sent > last->queries_sent && last_sent_ns < total->update_time_ns)
+      last_sent_ns = total->update_time_ns;
+    if (published != NULL) {
+      shm_stats_write_begin(published);
+      memcpy(&published->data, total, sizeof(struct shm_stats_data));
+      published->data.finished = running == 0;
+      shm_stats_write_end(published);
+    }
+    now = _now_ns(CLOCK_MONOTONIC);
+    if (interval_ms > 0 && now >= next_print_ns) {
+      print_live(total, last, start_ns, running, nb_workers, json);
+      memcpy(last, total, sizeof(struct shm_stats_data));
+      while (next_print_ns <= now)
+	next_print_ns += interval_ms * 1000000ULL;
+    } else if (interval_ms == 0) {
+      memcpy(last, total, sizeof(struct shm_stats_data));
+    }
+  }
+
+  /* The sending time is the duration of the run if it is given, or up
+     to the last snapshot in which queries were still sent */
+  duration_idx = _find_option(client_argc, client_argv, 't');
+  if (duration_idx != -1 && !forwarded)
+    seconds = strtoul(_option_value(client_argv, duration_idx, 't'), NULL, 10);
+  else
+    seconds = last_sent_ns > start_ns ? (last_sent_ns - start_ns) / 1e9 : 0.;
+  aggregate(workers, nb_workers, total);
+  print_summary(stdout, workers, nb_workers, total, seconds);
+  for (unsigned int i = 0; i < nb_workers; i++) {
+    snprintf(path, sizeof(path), "/dev/shm/%s", workers[i].shm_name);
+    unlink(path);
+  }
+  if (published != NULL)
+    shm_stats_close(published);
+  return failed ? 1 : 0;
+}
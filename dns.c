@@ -0,0 +1,300 @@
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dns.h"
+#include "utils.h"
+
+
+struct qtype_name {
+  const char *name;
+  uint16_t qtype;
+};
+
+static const struct qtype_name qtypes[] = {
+  {"A",          1},
+  {"NS",         2},
+  {"CNAME",      5},
+  {"SOA",        6},
+  {"PTR",       12},
+  {"MX",        15},
+  {"TXT",       16},
+  {"AAAA",      28},
+  {"SRV",       33},
+  {"NAPTR",     35},
+  {"DS",        43},
+  {"RRSIG",     46},
+  {"NSEC",      47},
+  {"DNSKEY",    48},
+  {"TLSA",      52},
+  {"SVCB",      64},
+  {"HTTPS",     65},
+  {"ANY",      255},
+  {"CAA",      257},
+  {NULL,         0}
+};
+
+const char *dns_response_class_names[DNS_RESPONSE_NB_CLASSES] = {
+  "malformed",
+  "mismatch",
+  "truncated",
+  "servfail",
+  "refused",
+  "nxdomain",
+  "other_rcode",
+  "noerror",
+};
+
+int dns_encode_name(unsigned char *buf, size_t buflen, const char *qname, size_t qname_len)
+{
+  size_t pos = 0;
+  size_t label_start = 0;
+  /* Root name */
+  if (qname_len == 0 || (qname_len == 1 && qname[0] == '.')) {
+    if (buflen < 1)
+      return -1;
+    buf[0] = 0;
+    return 1;
+  }
+  /* Ignore trailing dot */
+  if (qname[qname_len - 1] == '.')
+    qname_len--;
+  /* Wire format is one byte longer than the presentation format, plus
+     the final root label. */
+  if (qname_len + 2 > DNS_MAX_NAME_LEN || qname_len + 2 > buflen)
+    return -1;
+  for (size_t i = 0; i <= qname_len; i++) {
+    if (i == qname_len || qname[i] == '.') {
+      size_t label_len = i - label_start;
+      if (label_len == 0 || label_len > 63)
+	return -1;
+      buf[pos] = label_len;
+      memcpy(buf + pos + 1, qname + label_start, label_len);
+      pos += label_len + 1;
+      label_start = i + 1;
+    }
+  }
+  buf[pos++] = 0;
+  return pos;
+}
+
+int dns_encode_query(unsigned char *buf, size_t buflen, const char *qname, size_t qname_len, uint16_t qtype)
+{
+  /* Query ID 0, RD bit, one question, no other record. */
+  static const unsigned char header[DNS_HEADER_LEN] = {
+    0x00, 0x00, 0x01, 0x00, 0x00, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+  };
+  int name_len;
+  if (buflen < DNS_HEADER_LEN + 4)
+    return -1;
+  memcpy(buf, header, DNS_HEADER_LEN);
+  name_len = dns_encode_name(buf + DNS_HEADER_LEN, buflen - DNS_HEADER_LEN - 4, qname, qname_len);
+  if (name_len < 0)
+    return -1;
+  /* Type and class IN */
+  DO_HTONS(buf + DNS_HEADER_LEN + name_len, qtype);
+  DO_HTONS(buf + DNS_HEADER_LEN + name_len + 2, 1);
+  return DNS_HEADER_LEN + name_len + 4;
+}
+
+size_t dns_opt_max_len(const struct edns_options *opts)
+{
+  size_t len = DNS_OPT_RR_LEN;
+  if (opts->keepalive)
+    len += 4;
+  if (opts->padding_block > 0)
+    len += 4 + opts->padding_block - 1;
+  return len;
+}
+
+int dns_add_opt(unsigned char *buf, size_t buflen, size_t msg_len, const struct edns_options *opts)
+{
+  size_t pos = msg_len;
+  size_t rdlen_pos;
+  uint16_t arcount;
+  if (msg_len < DNS_HEADER_LEN || msg_len + dns_opt_max_len(opts) > buflen)
+    return -1;
+  /* Root name, type OPT, class is the UDP payload size, TTL holds the
+     extended RCODE, version and flags. */
+  buf[pos++] = 0;
+  DO_HTONS(buf + pos, 41);
+  DO_HTONS(buf + pos + 2, opts->bufsize);
+  buf[pos + 4] = 0;
+  buf[pos + 5] = 0;
+  DO_HTONS(buf + pos + 6, opts->do_bit ? 0x8000 : 0);
+  rdlen_pos = pos + 8;
+  pos += 10;
+  if (opts->keepalive) {
+    /* Empty option: clients must not send a timeout. */
+    DO_HTONS(buf + pos, DNS_EDNS_OPT_TCP_KEEPALIVE);
+    DO_HTONS(buf + pos + 2, 0);
+    pos += 4;
+  }
+  if (opts->padding_block > 0) {
+    size_t pad_len = (opts->padding_block - (pos + 4) % opts->padding_block) % opts->padding_block;
+    DO_HTONS(buf + pos, DNS_EDNS_OPT_PADDING);
+    DO_HTONS(buf + pos + 2, pad_len);
+    memset(buf + pos + 4, 0, pad_len);
+    pos += 4 + pad_len;
+  }
+  DO_HTONS(buf + rdlen_pos, pos - rdlen_pos - 2);
+  DO_NTOHS(arcount, buf + 10);
+  DO_HTONS(buf + 10, arcount + 1);
+  return pos;
+}
+
+/* Returns the offset right after the (possibly compressed) name starting
+   at [pos], or -1 if the name is malformed. */
+static int _skip_name(const unsigned char *msg, size_t len, size_t pos)
+{
+  while (pos < len) {
+    if (msg[pos] == 0)
+      return pos + 1;
+    if ((msg[pos] & 0xc0) == 0xc0)
+      return (pos + 2 <= len) ? (int) pos + 2 : -1;
+    if (msg[pos] > 63)
+      return -1;
+    pos += msg[pos] + 1;
+  }
+  return -1;
+}
+
+int dns_edns_keepalive(const unsigned char *msg, size_t len)
+{
+  uint16_t qdcount, ancount, nscount, arcount;
+  uint16_t type, rdlen, opt_code, opt_len;
+  int pos = DNS_HEADER_LEN;
+  if (len < DNS_HEADER_LEN)
+    return -1;
+  DO_NTOHS(qdcount, msg + 4);
+  DO_NTOHS(ancount, msg + 6);
+  DO_NTOHS(nscount, msg + 8);
+  DO_NTOHS(arcount, msg + 10);
+  if (arcount == 0)
+    return -1;
+  for (unsigned int i = 0; i < qdcount; i++) {
+    pos = _skip_name(msg, len, pos);
+    if (pos < 0 || pos + 4 > len)
+      return -1;
+    pos += 4;
+  }
+  for (unsigned int i = 0; i < (unsigned int) ancount + nscount + arcount; i++) {
+    pos = _skip_name(msg, len, pos);
+    if (pos < 0 || pos + 10 > len)
+      return -1;
+    DO_NTOHS(type, msg + pos);
+    DO_NTOHS(rdlen, msg + pos + 8);
+    pos += 10;
+    if (pos + rdlen > len)
+      return -1;
+    if (type != 41) {
+      pos += rdlen;
+      continue;
+    }
+    /* OPT record: walk its options */
+    for (int opt = pos; opt + 4 <= pos + rdlen; opt += 4 + opt_len) {
+      DO_NTOHS(opt_code, msg + opt);
+      DO_NTOHS(opt_len, msg + opt + 2);
+      if (opt_code == DNS_EDNS_OPT_TCP_KEEPALIVE && opt_len == 2 && opt + 6 <= pos + rdlen) {
+	uint16_t timeout;
+	DO_NTOHS(timeout, msg + opt + 4);
+	return timeout;
+      }
+    }
+    return -1;
+  }
+  return -1;
+}
+
+/* Compare two buffers 16 bytes at a time.  Questions are short, so this
+   mostly avoids the call and setup overhead of a generic memcmp(). */
+static int _memeq(const unsigned char *a, const unsigned char *b, size_t len)
+{
+#ifdef __SSE2__
+  while (len >= 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*) a);
+    __m128i y = _mm_loadu_si128((const __m128i*) b);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff)
+      return 0;
+    a += 16;
+    b += 16;
+    len -= 16;
+  }
+#endif
+  while (len > 0) {
+    if (*a++ != *b++)
+      return 0;
+    len--;
+  }
+  return 1;
+}
+
+enum dns_response_class dns_classify_response(const unsigned char *msg, size_t len,
+					      const unsigned char *query, size_t query_len,
+					      unsigned int label_len)
+{
+  int question_end;
+  size_t question_len;
+  const unsigned char *q = query + DNS_HEADER_LEN;
+  const unsigned char *r = msg + DNS_HEADER_LEN;
+  if (len < DNS_HEADER_LEN)
+    return DNS_RESPONSE_MALFORMED;
+  /* QR bit: a reflected query is not a response */
+  if ((msg[2] & 0x80) == 0)
+    return DNS_RESPONSE_MISMATCH;
+  /* Exactly one question, identical to ours. */
+  question_end = _skip_name(query, query_len, DNS_HEADER_LEN);
+  if (question_end < 0)
+    return DNS_RESPONSE_MALFORMED;
+  question_len = question_end + 4 - DNS_HEADER_LEN;
+  if (msg[4] != 0 || msg[5] != 1 || len < DNS_HEADER_LEN + question_len)
+    return DNS_RESPONSE_MISMATCH;
+  if (label_len > 0) {
+    if (r[0] != q[0] ||
+	!_memeq(r + 1 + label_len, q + 1 + label_len, question_len - 1 - label_len))
+      return DNS_RESPONSE_MISMATCH;
+  } else if (!_memeq(r, q, question_len)) {
+    return DNS_RESPONSE_MISMATCH;
+  }
+  /* TC bit */
+  if (msg[2] & 0x02)
+    return DNS_RESPONSE_TRUNCATED;
+  switch (msg[3] & 0x0f) {
+  case 0:
+    return DNS_RESPONSE_NOERROR;
+  case 2:
+    return DNS_RESPONSE_SERVFAIL;
+  case 3:
+    return DNS_RESPONSE_NXDOMAIN;
+  case 5:
+    return DNS_RESPONSE_REFUSED;
+  default:
+    return DNS_RESPONSE_OTHER_RCODE;
+  }
+}
+
+int dns_parse_qtype(const char *str, size_t len)
+{
+  char *start, *end;
+  unsigned long value;
+  char tmp[16];
+  if (len == 0 || len >= sizeof(tmp))
+    return -1;
+  memcpy(tmp, str, len);
+  tmp[len] = '\0';
+  for (const struct qtype_name *t = qtypes; t->name != NULL; t++) {
+    if (strcasecmp(tmp, t->name) == 0)
+      return t->qtype;
+  }
+  /* Generic syntax from RFC 3597, or plain number */
+  start = (strncasecmp(tmp, "TYPE", 4) == 0) ? tmp + 4 : tmp;
+  value = strtoul(start, &end, 10);
+  if (*end != '\0' || end == start || value > 65535)
+    return -1;
+  return value;
+}
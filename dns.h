@@ -0,0 +1,90 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of the fixed DNS header. */
+#define DNS_HEADER_LEN 12
+
+/* Maximum length of a domain name in wire format (RFC 1035). */
+#define DNS_MAX_NAME_LEN 255
+
+/* Maximum size of a query we are prepared to build: header, longest
+   possible question, and some room for additional records. */
+#define DNS_MAX_QUERY_LEN 512
+
+/* EDNS0 option codes */
+#define DNS_EDNS_OPT_TCP_KEEPALIVE 11
+#define DNS_EDNS_OPT_PADDING       12
+
+/* Size of an OPT record without any option */
+#define DNS_OPT_RR_LEN 11
+
+/* Parameters of the OPT record added to queries (RFC 6891). */
+struct edns_options {
+  /* Advertised UDP payload size */
+  uint16_t bufsize;
+  /* DNSSEC OK bit */
+  char do_bit;
+  /* Pad queries to a multiple of this size (RFC 7830, RFC 8467), or 0 */
+  uint16_t padding_block;
+  /* Add an empty edns-tcp-keepalive option (RFC 7828) */
+  char keepalive;
+};
+
+/* Classes of DNS responses, from the most to the least severe problem:
+   a malformed response, a response to another question, a truncated
+   response, and then the response code. */
+enum dns_response_class {
+  DNS_RESPONSE_MALFORMED,
+  DNS_RESPONSE_MISMATCH,
+  DNS_RESPONSE_TRUNCATED,
+  DNS_RESPONSE_SERVFAIL,
+  DNS_RESPONSE_REFUSED,
+  DNS_RESPONSE_NXDOMAIN,
+  DNS_RESPONSE_OTHER_RCODE,
+  DNS_RESPONSE_NOERROR,
+  DNS_RESPONSE_NB_CLASSES
+};
+
+extern const char *dns_response_class_names[DNS_RESPONSE_NB_CLASSES];
+
+/* Encode [qname] (presentation format, with or without trailing dot) in
+   wire format into [buf].  Returns the number of bytes written, or -1 if
+   the name is invalid or does not fit in [buflen] bytes. */
+int dns_encode_name(unsigned char *buf, size_t buflen, const char *qname, size_t qname_len);
+
+/* Build a DNS query with RD bit set and a query ID of 0 into [buf].
+   Returns the length of the message, or -1 in case of error. */
+int dns_encode_query(unsigned char *buf, size_t buflen, const char *qname, size_t qname_len, uint16_t qtype);
+
+/* Append an OPT record to the DNS message of [msg_len] bytes in [buf],
+   and increment its ARCOUNT.  If padding is requested, the padding option
+   is sized so that the whole message is a multiple of the block size.
+   Returns the new length of the message, or -1 if it does not fit. */
+int dns_add_opt(unsigned char *buf, size_t buflen, size_t msg_len, const struct edns_options *opts);
+
+/* Maximum number of bytes that dns_add_opt() can add with [opts]. */
+size_t dns_opt_max_len(const struct edns_options *opts);
+
+/* Look for an edns-tcp-keepalive option in the OPT record of a DNS
+   response.  Returns the timeout in units of 100 milliseconds, or -1 if
+   the option is absent, carries no timeout, or the message is malformed. */
+int dns_edns_keepalive(const unsigned char *msg, size_t len);
+
+/* Classify a response to [query].  Only fixed offsets of the response
+   are read: header flags, where the QR bit must be set (a reflected
+   query is a mismatch), and the question section, which must be an
+   exact copy of the question of the query.  The first [label_len]
+   characters of the query name are random and not compared (see
+   label.h). */
+enum dns_response_class dns_classify_response(const unsigned char *msg, size_t len,
+					      const unsigned char *query, size_t query_len,
+					      unsigned int label_len);
+
+/* Parse a query type, either as a mnemonic ("AAAA"), as a generic type
+   ("TYPE65"), or as a plain number.  Returns -1 if the type is unknown. */
+int dns_parse_qtype(const char *str, size_t len);
+
+#endif
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heatmap.h"
+
+_Static_assert(sizeof(struct heatmap_header) == 24, "heatmap_header layout");
+_Static_assert(sizeof(struct heatmap_row) == 16, "heatmap_row layout");
+
+int heatmap_parse_format(const char *name)
+{
+  if (strcmp(name, "csv") == 0)
+    return HEATMAP_CSV;
+  if (strcmp(name, "binary") == 0)
+    return HEATMAP_BINARY;
+  return -1;
+}
+
+int heatmap_writer_open(struct heatmap_writer *writer, const char *path, enum heatmap_format format,
+			uint32_t interval_ms, uint64_t start_time_ns)
+{
+  struct heatmap_header header;
+  memset(writer, 0, sizeof(struct heatmap_writer));
+  writer->out = fopen(path, "w");
+  if (writer->out == NULL) {
+    perror("Failed to open heatmap");
+    return -1;
+  }
+  writer->format = format;
+  writer->row_time_ns = start_time_ns;
+  if (format == HEATMAP_CSV) {
+    fprintf(writer->out, "time,bucket_lower_us,bucket_upper_us,count\n");
+    return 0;
+  }
+  memset(&header, 0, sizeof(struct heatmap_header));
+  memcpy(header.magic, HEATMAP_MAGIC, sizeof(header.magic));
+  header.start_time_ns = start_time_ns;
+  header.interval_ms = interval_ms;
+  header.sub_bits = HISTOGRAM_SUB_BITS;
+  header.max_bits = HISTOGRAM_MAX_BITS;
+  fwrite(&header, sizeof(struct heatmap_header), 1, writer->out);
+  return 0;
+}
+
+void heatmap_writer_row(struct heatmap_writer *writer, uint64_t time_ns, const struct histogram *latency)
+{
+  unsigned int i, first = HISTOGRAM_NB_BUCKETS, last = 0;
+  uint64_t sec = writer->row_time_ns / 1000000000, nsec = writer->row_time_ns % 1000000000;
+  struct heatmap_row row;
+  uint32_t counts[HISTOGRAM_NB_BUCKETS];
+  for (i = 0; i < HISTOGRAM_NB_BUCKETS; i++) {
+    counts[i] = latency->counts[i] - writer->last.counts[i];
+    if (counts[i] != 0) {
+      if (first == HISTOGRAM_NB_BUCKETS)
+	first = i;
+      last = i;
+    }
+  }
+  if (writer->format == HEATMAP_CSV) {
+    if (first == HISTOGRAM_NB_BUCKETS)
+      fprintf(writer->out, "%lu.%.9lu,,,0\n", sec, nsec);
+    for (i = first; i <= last && first < HISTOGRAM_NB_BUCKETS; i++)
+      if (counts[i] != 0)
+	fprintf(writer->out, "%lu.%.9lu,%lu,%lu,%u\n", sec, nsec,
+		histogram_bucket_lower(i), histogram_bucket_upper(i), counts[i]);
+  } else {
+    memset(&row, 0, sizeof(struct heatmap_row));
+    row.time_ns = writer->row_time_ns;
+    if (first < HISTOGRAM_NB_BUCKETS) {
+      row.first_bucket = first;
+      row.nb_buckets = last - first + 1;
+    }
+    fwrite(&row, sizeof(struct heatmap_row), 1, writer->out);
+    fwrite(counts + row.first_bucket, sizeof(uint32_t), row.nb_buckets, writer->out);
+  }
+  writer->last = *latency;
+  writer->row_time_ns = time_ns;
+  writer->nb_rows++;
+}
+
+int heatmap_writer_close(struct heatmap_writer *writer)
+{
+  int failed;
+  if (writer->out == NULL)
+    return 0;
+  failed = ferror(writer->out);
+  if (fclose(writer->out) != 0 || failed) {
+    perror("Failed to write heatmap");
+    return -1;
+  }
+  writer->out = NULL;
+  return 0;
+}
+
+/* Make room for row [index] of [map] */
+static int _grow(struct heatmap *map, size_t *capacity, size_t index)
+{
+  size_t new_capacity = *capacity;
+  uint64_t *times;
+  uint32_t *counts;
+  if (index < *capacity)
+    return 0;
+  while (new_capacity <= index)
+    new_capacity = new_capacity == 0 ? 1024 : 2 * new_capacity;
+  times = realloc(map->times_ns, new_capacity * sizeof(uint64_t));
+  if (times == NULL)
+    goto nomem;
+  map->times_ns = times;
+  counts = realloc(map->counts, new_capacity * HISTOGRAM_NB_BUCKETS * sizeof(uint32_t));
+  if (counts == NULL)
+    goto nomem;
+  map->counts = counts;
+  memset(counts + *capacity * HISTOGRAM_NB_BUCKETS, 0,
+	 (new_capacity - *capacity) * HISTOGRAM_NB_BUCKETS * sizeof(uint32_t));
+  *capacity = new_capacity;
+  return 0;
+ nomem:
+  perror("realloc");
+  return -1;
+}
+
+static int _read_binary(struct heatmap *map, FILE *in, const char *path)
+{
+  struct heatmap_header header;
+  struct heatmap_row row;
+  size_t capacity = 0;
+  if (fread(&header, sizeof(struct heatmap_header), 1, in) != 1)
+    goto truncated;
+  if (header.sub_bits != HISTOGRAM_SUB_BITS || header.max_bits != HISTOGRAM_MAX_BITS) {
+    fprintf(stderr, "%s: histograms with %u and %u bits, expected %u and %u\n", path,
+	    header.sub_bits, header.max_bits, HISTOGRAM_SUB_BITS, HISTOGRAM_MAX_BITS);
+    return -1;
+  }
+  map->start_time_ns = header.start_time_ns;
+  map->interval_ms = header.interval_ms;
+  while (fread(&row, sizeof(struct heatmap_row), 1, in) == 1) {
+    if (row.first_bucket + row.nb_buckets > HISTOGRAM_NB_BUCKETS) {
+      fprintf(stderr, "%s: corrupted row %lu\n", path, map->nb_rows);
+      return -1;
+    }
+    if (_grow(map, &capacity, map->nb_rows) != 0)
+      return -1;
+    map->times_ns[map->nb_rows] = row.time_ns;
+    if (fread(map->counts + map->nb_rows * HISTOGRAM_NB_BUCKETS + row.first_bucket,
+	      sizeof(uint32_t), row.nb_buckets, in) != row.nb_buckets)
+      goto truncated;
+    map->nb_rows++;
+  }
+  return 0;
+ truncated:
+  fprintf(stderr, "%s: truncated heatmap\n", path);
+  return -1;
+}
+
+static int _read_csv(struct heatmap *map, FILE *in, const char *path)
+{
+  char line[256];
+  unsigned long sec, nsec, count;
+  unsigned long long lower, upper;
+  uint64_t time_ns;
+  size_t capacity = 0, nb_line = 1;
+  int nb;
+  while (fgets(line, sizeof(line), in) != NULL) {
+    nb_line++;
+    nb = sscanf(line, "%lu.%9lu,%llu,%llu,%lu", &sec, &nsec, &lower, &upper, &count);
+    if (nb != 5 && !(nb == 2 && sscanf(line, "%*u.%*u,,,%lu", &count) == 1)) {
+      fprintf(stderr, "%s: invalid line %lu\n", path, nb_line);
+      return -1;
+    }
+    time_ns = sec * 1000000000ULL + nsec;
+    if (map->nb_rows == 0 || time_ns != map->times_ns[map->nb_rows - 1]) {
+      if (_grow(map, &capacity, map->nb_rows) != 0)
+	return -1;
+      map->times_ns[map->nb_rows++] = time_ns;
+    }
+    if (nb == 5)
+      map->counts[(map->nb_rows - 1) * HISTOGRAM_NB_BUCKETS + histogram_bucket(lower)] += count;
+  }
+  /* The interval is not stored in CSV files */
+  if (map->nb_rows > 0)
+    map->start_time_ns = map->times_ns[0];
+  if (map->nb_rows > 1)
+    map->interval_ms = (map->times_ns[1] - map->times_ns[0] + 500000) / 1000000;
+  return 0;
+}
+
+int heatmap_read(struct heatmap *map, const char *path)
+{
+  char magic[8];
+  int ret;
+  FILE *in = fopen(path, "r");
+  memset(map, 0, sizeof(struct heatmap));
+  if (in == NULL) {
+    perror(path);
+    return -1;
+  }
+  if (fread(magic, sizeof(magic), 1, in) == 1 && memcmp(magic, HEATMAP_MAGIC, sizeof(magic)) == 0) {
+    rewind(in);
+    ret = _read_binary(map, in, path);
+  } else {
+    /* Skip the header line */
+    rewind(in);
+    while ((ret = fgetc(in)) != EOF && ret != '\n');
+    ret = _read_csv(map, in, path);
+  }
+  fclose(in);
+  if (ret != 0)
+    heatmap_free(map);
+  return ret;
+}
+
+void heatmap_free(struct heatmap *map)
+{
+  free(map->times_ns);
+  free(map->counts);
+  map->times_ns = NULL;
+  map->counts = NULL;
+  map->nb_rows = 0;
+}
@@ -0,0 +1,95 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "histogram.h"
+
+/* Latency heatmap (--heatmap): one latency histogram per interval of the
+   run, i.e. a matrix of answer counts by time and by bucket of the
+   log-linear histograms of histogram.h.  Unlike percentiles, it shows
+   when latencies split into several modes.
+
+   Rows are not recorded separately: every interval, the client takes
+   the difference between the cumulative latency histogram of its
+   statistics and the one of the previous interval, and appends it to
+   the file, so that recording an answer costs nothing more.
+
+   Binary files start with a struct heatmap_header, followed by one
+   struct heatmap_row per interval, each followed by the counts of its
+   buckets from first_bucket (nb_buckets 32-bit counts, the buckets out
+   of this range being empty).  All integers are in host byte order.
+
+   CSV files have a line "time,bucket_lower_us,bucket_upper_us,count"
+   per non-empty bucket of each interval, where time is the start of the
+   interval, and a line "time,,,0" for intervals without answers. */
+
+#define HEATMAP_MAGIC "TSHEATM1"
+
+/* Default interval between two rows */
+#define HEATMAP_INTERVAL_MSEC 1000
+
+enum heatmap_format {
+  HEATMAP_CSV,
+  HEATMAP_BINARY,
+};
+
+struct heatmap_header {
+  char magic[8];
+  /* CLOCK_REALTIME, in nanoseconds */
+  uint64_t start_time_ns;
+  uint32_t interval_ms;
+  /* HISTOGRAM_SUB_BITS and HISTOGRAM_MAX_BITS of the writer */
+  uint8_t sub_bits;
+  uint8_t max_bits;
+  uint16_t unused;
+};
+
+struct heatmap_row {
+  /* Start of the interval, CLOCK_REALTIME in nanoseconds */
+  uint64_t time_ns;
+  uint16_t first_bucket;
+  uint16_t nb_buckets;
+  uint32_t unused;
+};
+
+struct heatmap_writer {
+  FILE *out;
+  enum heatmap_format format;
+  uint64_t row_time_ns;
+  /* Cumulative histogram at the end of the last row */
+  struct histogram last;
+  uint64_t nb_rows;
+};
+
+/* Returns the enum heatmap_format named [name], or -1 */
+int heatmap_parse_format(const char *name);
+
+/* Create [path] and write its header.  Returns -1 in case of error. */
+int heatmap_writer_open(struct heatmap_writer *writer, const char *path, enum heatmap_format format,
+			uint32_t interval_ms, uint64_t start_time_ns);
+
+/* Append the row of the interval ending at [time_ns], given the
+   cumulative histogram [latency] at that time. */
+void heatmap_writer_row(struct heatmap_writer *writer, uint64_t time_ns, const struct histogram *latency);
+
+/* Returns -1 if a write failed */
+int heatmap_writer_close(struct heatmap_writer *writer);
+
+/* Heatmap read back from a file, with dense rows of
+   HISTOGRAM_NB_BUCKETS counts */
+struct heatmap {
+  uint64_t start_time_ns;
+  uint32_t interval_ms;
+  size_t nb_rows;
+  uint64_t *times_ns;
+  uint32_t *counts;
+};
+
+/* Read the binary or CSV heatmap [path].  Returns -1 in case of error. */
+int heatmap_read(struct heatmap *map, const char *path);
+
+void heatmap_free(struct heatmap *map);
+
+#endif
@@ -0,0 +1,80 @@
+#include "histogram.h"
+
+
+uint64_t histogram_bucket_lower(unsigned int index)
+{
+  unsigned int shift;
+  if (index < (2U << HISTOGRAM_SUB_BITS))
+    return index;
+  shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+  return ((1ULL << HISTOGRAM_SUB_BITS) + (index & ((1U << HISTOGRAM_SUB_BITS) - 1))) << shift;
+}
+
+uint64_t histogram_bucket_upper(unsigned int index)
+{
+  if (index >= HISTOGRAM_NB_BUCKETS - 1)
+    return UINT64_MAX;
+  return histogram_bucket_lower(index + 1) - 1;
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double percentile)
+{
+  uint64_t rank, seen = 0;
+  uint64_t value;
+  if (h->total == 0)
+    return 0;
+  if (percentile >= 100.)
+    return h->max;
+  rank = (uint64_t) (percentile / 100. * h->total);
+  for (unsigned int i = 0; i < HISTOGRAM_NB_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen > rank) {
+      value = histogram_bucket_lower(i) + (histogram_bucket_upper(i) - histogram_bucket_lower(i)) / 2;
+      if (value < h->min)
+	return h->min;
+      if (value > h->max)
+	return h->max;
+      return value;
+    }
+  }
+  return h->max;
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+  if (src->total == 0)
+    return;
+  for (unsigned int i = 0; i < HISTOGRAM_NB_BUCKETS; i++)
+    dst->counts[i] += src->counts[i];
+  if (dst->total == 0 || src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+  dst->total += src->total;
+  dst->sum += src->sum;
+}
+
+void histogram_subtract(struct histogram *dst, const struct histogram *src)
+{
+  unsigned int first = HISTOGRAM_NB_BUCKETS, last = 0;
+  for (unsigned int i = 0; i < HISTOGRAM_NB_BUCKETS; i++) {
+    dst->counts[i] -= src->counts[i];
+    if (dst->counts[i] > 0) {
+      if (first == HISTOGRAM_NB_BUCKETS)
+	first = i;
+      last = i;
+    }
+  }
+  dst->total -= src->total;
+  dst->sum -= src->sum;
+  if (dst->total == 0) {
+    dst->min = 0;
+    dst->max = 0;
+    return;
+  }
+  /* The exact extremes are lost, keep those of the remaining buckets */
+  if (histogram_bucket_lower(first) > dst->min)
+    dst->min = histogram_bucket_lower(first);
+  if (histogram_bucket_upper(last) < dst->max)
+    dst->max = histogram_bucket_upper(last);
+}
@@ -0,0 +1,76 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Log-linear histogram, in the spirit of HdrHistogram: values below
+   2^HISTOGRAM_SUB_BITS have their own bucket, and each further power of
+   two is split into 2^HISTOGRAM_SUB_BITS linear buckets.  Recording is a
+   handful of integer instructions, and the relative error on any value
+   is below 1 / 2^HISTOGRAM_SUB_BITS (about 3%).
+
+   Values are typically latencies in microseconds; values larger than
+   2^HISTOGRAM_MAX_BITS (about 19 hours) end up in the last bucket. */
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_NB_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram {
+  uint64_t counts[HISTOGRAM_NB_BUCKETS];
+  /* Number of recorded values, and their sum (to compute the mean) */
+  uint64_t total;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+};
+
+static inline unsigned int histogram_bucket(uint64_t value)
+{
+  unsigned int msb, shift;
+  if (value < (1ULL << HISTOGRAM_SUB_BITS))
+    return value;
+  msb = 63 - __builtin_clzll(value);
+  if (msb >= HISTOGRAM_MAX_BITS)
+    return HISTOGRAM_NB_BUCKETS - 1;
+  shift = msb - HISTOGRAM_SUB_BITS;
+  return (shift << HISTOGRAM_SUB_BITS) + (value >> shift);
+}
+
+static inline void histogram_record(struct histogram *h, uint64_t value)
+{
+  h->counts[histogram_bucket(value)]++;
+  h->total++;
+  h->sum += value;
+  if (value < h->min || h->total == 1)
+    h->min = value;
+  if (value > h->max)
+    h->max = value;
+}
+
+static inline void histogram_reset(struct histogram *h)
+{
+  memset(h, 0, sizeof(struct histogram));
+}
+
+/* Smallest value that falls in bucket [index]. */
+uint64_t histogram_bucket_lower(unsigned int index);
+
+/* Largest value that falls in bucket [index]. */
+uint64_t histogram_bucket_upper(unsigned int index);
+
+/* Returns an estimate of the given percentile (between 0 and 100), or 0
+   if the histogram is empty.  The estimate is the middle of the bucket
+   containing the percentile, clamped to the observed min and max. */
+uint64_t histogram_percentile(const struct histogram *h, double percentile);
+
+/* Add all values from [src] to [dst]. */
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+
+/* Remove from [dst] the values of [src], which must all have been
+   recorded in [dst] too (e.g. an earlier copy of [dst]).  The min and
+   max of [dst] are only narrowed to the remaining buckets. */
+void histogram_subtract(struct histogram *dst, const struct histogram *src);
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "label.h"
+
+
+/* Number of characters we extract from each 64-bit random word. */
+#define HEX_CHARS_PER_WORD 16
+#define BASE32_CHARS_PER_WORD 12
+
+int label_gen_init(struct label_gen *gen, unsigned int len, const char *encoding, char unique, uint64_t seed)
+{
+  unsigned int chars_per_word;
+  unsigned int bits_per_char;
+  if (len == 0 || len > LABEL_MAX_LEN) {
+    fprintf(stderr, "Error: random label length must be between 1 and %d\n", LABEL_MAX_LEN);
+    return -1;
+  }
+  if (encoding == NULL || strcmp(encoding, "hex") == 0) {
+    gen->encoding = LABEL_ENCODING_HEX;
+    chars_per_word = HEX_CHARS_PER_WORD;
+    bits_per_char = 4;
+  } else if (strcmp(encoding, "base32") == 0) {
+    gen->encoding = LABEL_ENCODING_BASE32;
+    chars_per_word = BASE32_CHARS_PER_WORD;
+    bits_per_char = 5;
+  } else {
+    fprintf(stderr, "Error: unknown label encoding '%s'\n", encoding);
+    return -1;
+  }
+  gen->len = len;
+  gen->unique = unique;
+  gen->unique_bits = (len < chars_per_word ? len : chars_per_word) * bits_per_char;
+  gen->counter = 0;
+  gen->key = rng_mix64(seed ^ 0x6c6162656c73ULL);
+  rng_seed(&gen->rng, seed);
+  return 0;
+}
+
+/* Bijective mixing of the low [bits] bits of [x]: xor with a key,
+   multiplications by odd constants and xorshifts are all invertible
+   modulo 2^bits. */
+static uint64_t _permute(uint64_t x, uint64_t key, unsigned int bits)
+{
+  uint64_t mask = (bits == 64) ? ~0ULL : (1ULL << bits) - 1;
+  unsigned int shift = (bits + 1) / 2;
+  x = (x ^ key) & mask;
+  x = (x * 0xbf58476d1ce4e5b9ULL) & mask;
+  x ^= x >> shift;
+  x = (x * 0x94d049bb133111ebULL) & mask;
+  x ^= x >> shift;
+  return x;
+}
+
+/* Extract 4-bit or 5-bit digits from [word] into [out].  Only the
+   least significant bits are used when the label is short. */
+static void _extract_digits(unsigned char *out, uint64_t word, enum label_encoding encoding)
+{
+#ifdef __SSE2__
+  if (encoding == LABEL_ENCODING_HEX) {
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
+    __m128i v = _mm_cvtsi64_si128(word);
+    __m128i lo = _mm_and_si128(v, low_nibble);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low_nibble);
+    _mm_storeu_si128((__m128i*) out, _mm_unpacklo_epi8(lo, hi));
+    return;
+  }
+#endif
+  if (encoding == LABEL_ENCODING_HEX) {
+    for (int i = 0; i < HEX_CHARS_PER_WORD; i++)
+      out[i] = (word >> (4 * i)) & 0x0f;
+  } else {
+    for (int i = 0; i < BASE32_CHARS_PER_WORD; i++)
+      out[i] = (word >> (5 * i)) & 0x1f;
+  }
+}
+
+/* Map digits to characters in place.  Both alphabets are "0-9" followed
+   by lowercase letters, so a single comparison per byte is enough. */
+static void _digits_to_chars(unsigned char *buf, unsigned int len)
+{
+#ifdef __SSE2__
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i letter_offset = _mm_set1_epi8('a' - '0' - 10);
+  for (unsigned int i = 0; i < len; i += 16) {
+    __m128i d = _mm_loadu_si128((__m128i*) (buf + i));
+    __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(d, nine), letter_offset);
+    _mm_storeu_si128((__m128i*) (buf + i), _mm_add_epi8(_mm_add_epi8(d, zero), letters));
+  }
+#else
+  for (unsigned int i = 0; i < len; i++)
+    buf[i] = (buf[i] < 10) ? '0' + buf[i] : 'a' + buf[i] - 10;
+#endif
+}
+
+void label_gen_fill(struct label_gen *gen, unsigned char *dst)
+{
+  /* Room for the longest label, rounded up to whole vectors, plus one
+     vector of slack for the last extraction. */
+  unsigned char buf[LABEL_MAX_LEN + 1 + 16];
+  unsigned int chars_per_word = (gen->encoding == LABEL_ENCODING_HEX) ?
+    HEX_CHARS_PER_WORD : BASE32_CHARS_PER_WORD;
+  unsigned int pos = 0;
+  uint64_t word;
+  if (gen->unique) {
+    word = _permute(gen->counter++, gen->key, gen->unique_bits);
+    _extract_digits(buf, word, gen->encoding);
+    pos = chars_per_word;
+  }
+  for (; pos < gen->len; pos += chars_per_word) {
+    word = rng_next(&gen->rng);
+    _extract_digits(buf + pos, word, gen->encoding);
+  }
+  _digits_to_chars(buf, gen->len);
+  memcpy(dst, buf, gen->len);
+}
@@ -0,0 +1,44 @@
+#ifndef LABEL_H
+#define LABEL_H
+
+#include <stdint.h>
+
+#include "rng.h"
+
+/* Maximum length of a DNS label */
+#define LABEL_MAX_LEN 63
+
+enum label_encoding {
+  /* Lowercase hexadecimal, 4 bits per character */
+  LABEL_ENCODING_HEX,
+  /* Lowercase base32 with the "extended hex" alphabet of RFC 4648,
+     5 bits per character */
+  LABEL_ENCODING_BASE32,
+};
+
+/* Generator of random fixed-width labels, used to defeat resolver
+   caches.  Labels are written in place into query templates, so that
+   generating a query never allocates memory. */
+struct label_gen {
+  /* Length of the label, in characters */
+  unsigned int len;
+  enum label_encoding encoding;
+  /* If set, labels never repeat until [unique_bits] bits of counter
+     wrap around: the first characters of the label encode a bijective
+     permutation of a counter, and the remaining ones are random. */
+  char unique;
+  unsigned int unique_bits;
+  uint64_t counter;
+  /* Per-run key of the permutation, derived from the seed */
+  uint64_t key;
+  struct rng rng;
+};
+
+/* Initialise a generator of labels of [len] characters.  [encoding] is
+   "hex" or "base32".  Returns -1 in case of invalid parameters. */
+int label_gen_init(struct label_gen *gen, unsigned int len, const char *encoding, char unique, uint64_t seed);
+
+/* Write a new random label of gen->len characters at [dst]. */
+void label_gen_fill(struct label_gen *gen, unsigned char *dst);
+
+#endif
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#include "metrics.h"
+
+/* Upper bounds of the histogram buckets exposed to Prometheus, as powers
+   of two microseconds: from 16 µs to about 67 s.  The internal histogram
+   is much finer, but scrapers want a small and fixed set of buckets. */
+#define METRICS_MIN_BUCKET_BITS 4
+#define METRICS_MAX_BUCKET_BITS 26
+
+struct metrics_exporter {
+  struct event_base *base;
+  struct evhttp *http;
+  const struct shm_stats *shm;
+  struct shm_stats_data snapshot;
+  pthread_t thread;
+};
+
+static void _counter(struct evbuffer *out, const char *program, const char *name,
+		     const char *help, uint64_t value)
+{
+  evbuffer_add_printf(out, "# TYPE %s_%s counter\n# HELP %s_%s %s\n%s_%s_total %lu\n",
+		      program, name, program, name, help, program, name, value);
+}
+
+static void _gauge(struct evbuffer *out, const char *program, const char *name,
+		   const char *help, double value)
+{
+  evbuffer_add_printf(out, "# TYPE %s_%s gauge\n# HELP %s_%s %s\n%s_%s %.17g\n",
+		      program, name, program, name, help, program, name, value);
+}
+
+/* Histograms are recorded in microseconds, and exposed in seconds.  A
+   bucket of the internal histogram is counted below the first bound
+   that is not smaller than its upper end, so counts are never
+   overestimated. */
+static void _histogram(struct evbuffer *out, const char *program, const char *name,
+		       const char *help, const struct histogram *h)
+{
+  uint64_t cumulative = 0;
+  unsigned int index = 0;
+  evbuffer_add_printf(out, "# TYPE %s_%s histogram\n# HELP %s_%s %s\n",
+		      program, name, program, name, help);
+  for (unsigned int bits = METRICS_MIN_BUCKET_BITS; bits <= METRICS_MAX_BUCKET_BITS; bits++) {
+    uint64_t bound = 1ULL << bits;
+    while (index < HISTOGRAM_NB_BUCKETS && histogram_bucket_upper(index) <= bound)
+      cumulative += h->counts[index++];
+    evbuffer_add_printf(out, "%s_%s_bucket{le=\"%.9g\"} %lu\n", program, name, bound / 1e6, cumulative);
+  }
+  evbuffer_add_printf(out, "%s_%s_bucket{le=\"+Inf\"} %lu\n%s_%s_count %lu\n%s_%s_sum %.6f\n",
+		      program, name, h->total, program, name, h->total,
+		      program, name, h->sum / 1e6);
+}
+
+static void metrics_cb(struct evhttp_request *req, void *ctx)
+{
+  struct metrics_exporter *exporter = ctx;
+  const struct shm_stats *shm = exporter->shm;
+  struct shm_stats_data *data = &exporter->snapshot;
+  struct evbuffer *out = evbuffer_new();
+  const char *program = shm->program;
+  shm_stats_read(shm, data);
+  _gauge(out, program, "start_time_seconds", "Start time of the process since the epoch.",
+	 shm->start_time_ns / 1e9);
+  _counter(out, program, "connections_opened", "Connections opened.", data->connections_opened);
+  _gauge(out, program, "connections", "Connections currently open.", data->live_connections);
+  _counter(out, program, "bytes_out", "Bytes sent.", data->bytes_out);
+  _counter(out, program, "bytes_in", "Bytes received.", data->bytes_in);
+  if (shm->role == SHM_STATS_CLIENT) {
+    _counter(out, program, "queries_sent", "Queries sent.", data->queries_sent);
+    _counter(out, program, "answers_received", "Answers received.", data->answers_received);
+    _counter(out, program, "timeouts", "Queries not answered in time.", data->timeouts);
+    _gauge(out, program, "target_rate", "Target query rate, in queries per second.", data->target_rate);
+    _histogram(out, program, "latency_seconds", "Time between a query and its answer.", &data->latency);
+    _histogram(out, program, "lag_seconds", "Delay of the query scheduler behind its plan.", &data->lag);
+  }
+  evbuffer_add_printf(out, "# EOF\n");
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+		    "application/openmetrics-text; version=1.0.0; charset=utf-8");
+  evhttp_send_reply(req, HTTP_OK, "OK", out);
+  evbuffer_free(out);
+}
+
+static void *metrics_thread(void *arg)
+{
+  struct metrics_exporter *exporter = arg;
+  event_base_dispatch(exporter->base);
+  return NULL;
+}
+
+int metrics_start(const char *addr_port, const struct shm_stats *shm)
+{
+  struct metrics_exporter *exporter;
+  char addr[256] = "0.0.0.0";
+  const char *sep = strrchr(addr_port, ':');
+  int port;
+  if (sep != NULL) {
+    if (sep - addr_port >= sizeof(addr)) {
+      fprintf(stderr, "Invalid metrics address: %s\n", addr_port);
+      return -1;
+    }
+    memcpy(addr, addr_port, sep - addr_port);
+    addr[sep - addr_port] = '\0';
+    port = atoi(sep + 1);
+  } else {
+    port = atoi(addr_port);
+  }
+  if (port <= 0 || port > 65535) {
+    fprintf(stderr, "Invalid metrics port: %s\n", addr_port);
+    return -1;
+  }
+  exporter = malloc(sizeof(struct metrics_exporter));
+  exporter->shm = shm;
+  exporter->base = event_base_new();
+  if (exporter->base == NULL) {
+    fprintf(stderr, "Couldn't create event base for metrics\n");
+    return -1;
+  }
+  exporter->http = evhttp_new(exporter->base);
+  if (evhttp_bind_socket(exporter->http, addr, port) != 0) {
+    fprintf(stderr, "Couldn't listen for metrics on %s port %d\n", addr, port);
+    return -1;
+  }
+  evhttp_set_allowed_methods(exporter->http, EVHTTP_REQ_GET | EVHTTP_REQ_HEAD);
+  evhttp_set_gencb(exporter->http, metrics_cb, exporter);
+  if (pthread_create(&exporter->thread, NULL, metrics_thread, exporter) != 0) {
+    perror("Failed to start metrics thread");
+    return -1;
+  }
+  pthread_detach(exporter->thread);
+  return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "shmstats.h"
+
+/* Prometheus / OpenMetrics exporter.
+
+   The exporter runs an HTTP server in its own thread, with its own event
+   base, and serves the statistics snapshot published in [shm] (see
+   shmstats.h) on any path.  It only ever reads the snapshot through the
+   seqlock, so a scrape costs nothing to the event loop of the writer
+   beyond its periodic snapshot.
+
+   Metrics are prefixed with the program name, e.g.
+   tcpclient_queries_sent_total or tcpserver_connections. */
+
+/* Start serving on [addr_port], either "port" (all IPv4 addresses) or
+   "address:port".  Returns -1 in case of error. */
+int metrics_start(const char *addr_port, const struct shm_stats *shm);
+
+#endif
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perfcount.h"
+
+struct perf_counters *perf_counters;
+
+static const struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} _counters[PERF_NB_COUNTERS] = {
+  [PERF_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  [PERF_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  [PERF_CACHE_MISSES] = {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  [PERF_CONTEXT_SWITCHES] = {"context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+static const char *_section_names[PERF_NB_SECTIONS] = {
+  [PERF_SECTION_POISSON] = "poisson_event",
+  [PERF_SECTION_SEND] = "send_query",
+  [PERF_SECTION_READ] = "readcb",
+};
+
+static int _open(enum perf_counter counter, int group_fd)
+{
+  struct perf_event_attr attr;
+  int fd;
+  memset(&attr, 0, sizeof(struct perf_event_attr));
+  attr.size = sizeof(struct perf_event_attr);
+  attr.type = _counters[counter].type;
+  attr.config = _counters[counter].config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.disabled = group_fd == -1;
+  attr.exclude_hv = 1;
+  fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+  if (fd == -1 && (errno == EACCES || errno == EPERM)) {
+    /* perf_event_paranoid may only allow counting in user space, which
+       leaves nothing to count for context switches */
+    attr.exclude_kernel = 1;
+    if (counter != PERF_CONTEXT_SWITCHES)
+      fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+  }
+  return fd;
+}
+
+static void _read(struct perf_counters *perf, struct perf_values *values)
+{
+  uint64_t buf[1 + PERF_NB_COUNTERS];
+  int i;
+  if (read(perf->leader, buf, sizeof(buf)) < (ssize_t) sizeof(uint64_t)) {
+    memset(values, 0, sizeof(struct perf_values));
+    return;
+  }
+  for (i = 0; i < PERF_NB_COUNTERS; i++)
+    values->counts[i] = perf->positions[i] >= 0 ? buf[1 + perf->positions[i]] : 0;
+}
+
+int perf_counters_start()
+{
+  struct perf_counters *perf = calloc(1, sizeof(struct perf_counters));
+  int i;
+  if (perf == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  perf->leader = -1;
+  for (i = 0; i < PERF_NB_COUNTERS; i++) {
+    perf->fds[i] = _open(i, perf->leader);
+    perf->positions[i] = -1;
+    if (perf->fds[i] == -1) {
+      fprintf(stderr, "Warning: %s counter not available: %s\n", _counters[i].name, strerror(errno));
+      continue;
+    }
+    if (perf->leader == -1)
+      perf->leader = perf->fds[i];
+    perf->positions[i] = perf->nb_open++;
+  }
+  if (perf->leader == -1) {
+    fprintf(stderr, "Error: no performance counter available (see /proc/sys/kernel/perf_event_paranoid)\n");
+    free(perf);
+    return -1;
+  }
+  ioctl(perf->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  _read(perf, &perf->start);
+  perf->last = perf->start;
+  perf_counters = perf;
+  return 0;
+}
+
+void perf_counters_stop()
+{
+  int i;
+  if (perf_counters == NULL)
+    return;
+  for (i = 0; i < PERF_NB_COUNTERS; i++)
+    if (perf_counters->fds[i] != -1)
+      close(perf_counters->fds[i]);
+  free(perf_counters);
+  perf_counters = NULL;
+}
+
+void _perf_section_begin(struct perf_counters *perf, enum perf_section section)
+{
+  struct perf_section_stats *stats = &perf->sections[section];
+  if ((stats->calls++ & (PERF_SAMPLE_PERIOD - 1)) != 0)
+    return;
+  stats->running = 1;
+  _read(perf, &stats->begin);
+}
+
+void _perf_section_end(struct perf_counters *perf, enum perf_section section)
+{
+  struct perf_section_stats *stats = &perf->sections[section];
+  struct perf_values end;
+  int i;
+  if (!stats->running)
+    return;
+  _read(perf, &end);
+  for (i = 0; i < PERF_NB_COUNTERS; i++)
+    stats->sum.counts[i] += end.counts[i] - stats->begin.counts[i];
+  stats->sampled++;
+  stats->running = 0;
+}
+
+/* Write the value of [counter] in [values], divided by [div], or null if
+   the counter is not available */
+static void _print_value(FILE *out, const struct perf_counters *perf, const struct perf_values *values,
+			 enum perf_counter counter, double div)
+{
+  if (perf->positions[counter] < 0)
+    fprintf(out, "null");
+  else
+    fprintf(out, "%.1f", div > 0. ? values->counts[counter] / div : 0.);
+}
+
+void perf_counters_report(FILE *out, uint64_t queries)
+{
+  struct perf_counters *perf = perf_counters;
+  struct perf_values now, delta;
+  struct perf_section_stats *stats;
+  int i, s;
+  _read(perf, &now);
+  for (i = 0; i < PERF_NB_COUNTERS; i++)
+    delta.counts[i] = now.counts[i] - perf->last.counts[i];
+  perf->last = now;
+  fprintf(out, ",\"perf\":{");
+  for (i = 0; i < PERF_NB_COUNTERS; i++) {
+    fprintf(out, "\"%s\":", _counters[i].name);
+    _print_value(out, perf, &delta, i, 1.);
+    fprintf(out, ",");
+  }
+  fprintf(out, "\"cycles_per_query\":");
+  _print_value(out, perf, &delta, PERF_CYCLES, queries);
+  fprintf(out, ",\"instructions_per_query\":");
+  _print_value(out, perf, &delta, PERF_INSTRUCTIONS, queries);
+  fprintf(out, ",\"cache_misses_per_query\":");
+  _print_value(out, perf, &delta, PERF_CACHE_MISSES, queries);
+  /* Sections: average of the measured calls */
+  for (s = 0; s < PERF_NB_SECTIONS; s++) {
+    stats = &perf->sections[s];
+    fprintf(out, ",\"%s\":{\"calls\":%lu,\"sampled\":%lu", _section_names[s], stats->calls, stats->sampled);
+    for (i = 0; i < PERF_NB_COUNTERS; i++) {
+      fprintf(out, ",\"%s\":", _counters[i].name);
+      _print_value(out, perf, &stats->sum, i, stats->sampled);
+    }
+    fprintf(out, "}");
+    /* A call being measured ends in the next interval */
+    stats->calls = stats->running;
+    stats->sampled = 0;
+    memset(&stats->sum, 0, sizeof(struct perf_values));
+  }
+  fprintf(out, "}");
+}
+
+void perf_counters_print_summary(FILE *out, uint64_t queries)
+{
+  struct perf_counters *perf = perf_counters;
+  struct perf_values now;
+  int i;
+  if (perf == NULL)
+    return;
+  _read(perf, &now);
+  fprintf(out, "Performance counters of the event loop:");
+  for (i = 0; i < PERF_NB_COUNTERS; i++) {
+    if (perf->positions[i] < 0)
+      continue;
+    fprintf(out, " %lu %s", now.counts[i] - perf->start.counts[i], _counters[i].name);
+    if (i != PERF_CONTEXT_SWITCHES && queries > 0)
+      fprintf(out, " (%.0f/query)", (double) (now.counts[i] - perf->start.counts[i]) / queries);
+  }
+  fprintf(out, "\n");
+}
@@ -0,0 +1,97 @@
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Hardware and software performance counters of the event loop thread
+   (--perf-counters), read with perf_event_open(2).
+
+   The counters of the whole thread give the cost of each query in the
+   periodic statistics.  The hot sections of the client (the timer of
+   the Poisson processes, the sending of a query and the reading of
+   answers) are also measured, but only 1 call in PERF_SAMPLE_PERIOD,
+   since each read of the counters is a system call.  Sections nest: the
+   Poisson timer includes the sending of its query.
+
+   Without --perf-counters, perf_counters is NULL and each section only
+   costs a predictable branch. */
+
+/* 1 call in this many of each section is measured (a power of two) */
+#define PERF_SAMPLE_PERIOD 64
+
+enum perf_section {
+  PERF_SECTION_POISSON,
+  PERF_SECTION_SEND,
+  PERF_SECTION_READ,
+  PERF_NB_SECTIONS,
+};
+
+enum perf_counter {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_CACHE_MISSES,
+  PERF_CONTEXT_SWITCHES,
+  PERF_NB_COUNTERS,
+};
+
+struct perf_values {
+  uint64_t counts[PERF_NB_COUNTERS];
+};
+
+struct perf_section_stats {
+  /* Since the last report */
+  uint64_t calls;
+  uint64_t sampled;
+  struct perf_values sum;
+  /* Values at the start of the measured call, if any */
+  struct perf_values begin;
+  short running;
+};
+
+struct perf_counters {
+  /* Group leader, and file descriptor of each counter (-1 if the
+     counter is not available) */
+  int leader;
+  int fds[PERF_NB_COUNTERS];
+  /* Position of each counter in the values read from the group */
+  int positions[PERF_NB_COUNTERS];
+  unsigned int nb_open;
+  struct perf_section_stats sections[PERF_NB_SECTIONS];
+  /* Values at the start and at the last report */
+  struct perf_values start;
+  struct perf_values last;
+};
+
+extern struct perf_counters *perf_counters;
+
+/* Open the counters of the calling thread and start counting.  Returns
+   -1 if none of them is available. */
+int perf_counters_start();
+
+void perf_counters_stop();
+
+void _perf_section_begin(struct perf_counters *perf, enum perf_section section);
+void _perf_section_end(struct perf_counters *perf, enum perf_section section);
+
+static inline void perf_section_begin(enum perf_section section)
+{
+  if (__builtin_expect(perf_counters != NULL, 0))
+    _perf_section_begin(perf_counters, section);
+}
+
+static inline void perf_section_end(enum perf_section section)
+{
+  if (__builtin_expect(perf_counters != NULL, 0))
+    _perf_section_end(perf_counters, section);
+}
+
+/* Write the counters since the last report, as a "perf" member of the
+   JSON object of a periodic report, for [queries] queries sent, and
+   start a new interval. */
+void perf_counters_report(FILE *out, uint64_t queries);
+
+/* Print the counters since the start, for [queries] queries sent */
+void perf_counters_print_summary(FILE *out, uint64_t queries);
+
+#endif
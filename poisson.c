@@ -1,5 +1,6 @@
 #include "poisson.h"
 #include "utils.h"
+#include "perfcount.h"
 
 
 /* Array of all poisson processes.  Each process is allocated separately
@@ -8,6 +9,14 @@ static struct poisson_process* *_processes;
 static size_t _processes_size;
 /* Next process ID available */
 static unsigned int _next_process_id;
+/* Where to record scheduling lag, if not NULL */
+static struct histogram *_lag_histogram;
+/* Where to record the time of each event, if not NULL */
+static struct arrival_ring *_arrivals;
+/* Seed of the random streams, and number of processes created so far,
+   which numbers the streams */
+static uint64_t _seed = 42;
+static uint64_t _nb_streams;
 
 
 static struct poisson_process* _get_process(unsigned int process_id)
@@ -33,12 +42,38 @@ static int _increase_processes(size_t new_size)
   return 0;
 }
 
+/* Remember when an event scheduled [delay] after [now] should fire. */
+static void _set_deadline(struct poisson_process *proc, const struct timespec *now, const struct timeval *delay)
+{
+  proc->deadline.tv_sec = now->tv_sec + delay->tv_sec;
+  proc->deadline.tv_nsec = now->tv_nsec + delay->tv_usec * 1000;
+  if (proc->deadline.tv_nsec >= 1000000000L) {
+    proc->deadline.tv_sec += 1;
+    proc->deadline.tv_nsec -= 1000000000L;
+  }
+}
+
 static void poisson_event(evutil_socket_t fd, short events, void *ctx)
 {
   struct poisson_process *proc = ctx;
   static struct timeval interval;
+  struct timespec now, lag;
+  perf_section_begin(PERF_SECTION_POISSON);
+  if (_lag_histogram != NULL || _arrivals != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  }
+  if (_lag_histogram != NULL) {
+    subtract_timespec(&lag, &now, &proc->deadline);
+    histogram_record(_lag_histogram, lag.tv_sec * 1000000 + lag.tv_nsec / 1000);
+  }
+  if (_arrivals != NULL) {
+    arrival_ring_record(_arrivals, &now);
+  }
   /* Schedule next query */
-  generate_poisson_interarrival(&interval, proc->rate);
+  generate_poisson_interarrival(&interval, proc->rate, &proc->rng);
+  if (_lag_histogram != NULL) {
+    _set_deadline(proc, &now, &interval);
+  }
   int ret = event_add(proc->event, &interval);
   if (ret != 0) {
     fprintf(stderr, "Failed to schedule next query (Poisson process %u)\n", proc->process_id);
@@ -47,6 +82,7 @@ static void poisson_event(evutil_socket_t fd, short events, void *ctx)
   if (proc->callback != NULL) {
     proc->callback(proc->callback_arg);
   }
+  perf_section_end(PERF_SECTION_POISSON);
 }
 
 
@@ -68,6 +104,11 @@ void poisson_destroy(char free_callback_args)
   free(_processes);
 }
 
+void poisson_set_seed(uint64_t seed)
+{
+  _seed = seed;
+}
+
 /* Returns a newly created Poisson process, or NULL in case of failure. */
 struct poisson_process* poisson_new(struct event_base *base)
 {
@@ -84,8 +125,14 @@ struct poisson_process* poisson_new(struct event_base *base)
   proc->process_id = process_id;
   proc->evbase = base;
   proc->rate = 1.;
+  proc->paused = 0;
   proc->callback = NULL;
   proc->callback_arg = NULL;
+  /* Streams are numbered by creation order rather than by process ID,
+     because IDs are reused when processes are removed and added again. */
+  rng_seed(&proc->rng, _seed ^ rng_mix64(2 * _nb_streams));
+  rng_seed(&proc->choice_rng, _seed ^ rng_mix64(2 * _nb_streams + 1));
+  _nb_streams++;
   proc->event = event_new(proc->evbase, -1, 0, poisson_event, proc);
   _next_process_id++;
   return proc;
@@ -135,25 +182,82 @@ int poisson_set_rate(struct poisson_process* proc, double poisson_rate)
   return 0;
 }
 
-/* Starts the process.  If [initial_delay] is NULL, generate an initial
-   delay according to the poisson process. */
-int poisson_start_process(struct poisson_process* proc, struct timeval* initial_delay)
+/* Starts the process: its first event fires after an interarrival of the
+   process, further delayed by [offset] if not NULL. */
+int poisson_start_process(struct poisson_process* proc, const struct timeval* offset)
 {
-  struct timeval poisson_delay;
+  struct timeval initial_delay;
+  struct timespec now;
   if (proc == NULL) {
     return -1;
   }
-  if (initial_delay != NULL) {
-    return event_add(proc->event, initial_delay);
-  } else {
-    generate_poisson_interarrival(&poisson_delay, proc->rate);
-    return event_add(proc->event, &poisson_delay);
+  if (proc->rate <= 0.) {
+    proc->paused = 1;
+    return 0;
+  }
+  generate_poisson_interarrival(&initial_delay, proc->rate, &proc->rng);
+  if (offset != NULL) {
+    initial_delay.tv_sec += offset->tv_sec;
+    timeval_add_us(&initial_delay, offset->tv_usec);
+  }
+  if (_lag_histogram != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    _set_deadline(proc, &now, &initial_delay);
   }
+  return event_add(proc->event, &initial_delay);
 }
 
 unsigned int poisson_nb_processes()
 {
-  if (_next_process_id == 0)
-    return 0;
-  return _next_process_id - 1;
+  return _next_process_id;
+}
+
+void poisson_set_rate_all(double poisson_rate)
+{
+  struct poisson_process *proc;
+  struct timeval interval;
+  struct timespec now;
+  if (_lag_histogram != NULL)
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  for (unsigned int i = 0; i < _next_process_id; i++) {
+    proc = _processes[i];
+    proc->rate = poisson_rate;
+    /* A zero rate would mean an infinite interarrival */
+    if (poisson_rate <= 0.) {
+      if (event_pending(proc->event, EV_TIMEOUT, NULL)) {
+	event_del(proc->event);
+	proc->paused = 1;
+      }
+      continue;
+    }
+    /* Thanks to the memoryless property, drawing a new interarrival at
+       the new rate is equivalent to the process having had this rate
+       all along.  Otherwise, the change would only take effect after
+       one interarrival at the old rate. */
+    if (!proc->paused && !event_pending(proc->event, EV_TIMEOUT, NULL))
+      continue;
+    proc->paused = 0;
+    generate_poisson_interarrival(&interval, proc->rate, &proc->rng);
+    if (_lag_histogram != NULL)
+      _set_deadline(proc, &now, &interval);
+    event_add(proc->event, &interval);
+  }
+}
+
+void poisson_stop_all()
+{
+  for (unsigned int i = 0; i < _next_process_id; i++) {
+    event_del(_processes[i]->event);
+    _processes[i]->paused = 0;
+  }
+}
+
+void poisson_set_lag_histogram(struct histogram *lag)
+{
+  _lag_histogram = lag;
+}
+
+void poisson_set_arrival_ring(struct arrival_ring *arrivals)
+{
+  _arrivals = arrivals;
 }
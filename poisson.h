@@ -2,6 +2,10 @@
 #include <event2/event.h>
 #include <event2/bufferevent.h>
 
+#include "histogram.h"
+#include "arrivals.h"
+#include "rng.h"
+
 typedef void (*callback_fn)(void *);
 
 struct poisson_process {
@@ -14,8 +18,21 @@ struct poisson_process {
   struct event* event;
   /* Rate of the Poisson process, in events/second */
   double rate;
+  /* Whether the process was stopped by a rate of 0, and starts again
+     with the next non-zero rate */
+  char paused;
   /* libevent base */
   struct event_base* evbase;
+  /* When the next event is expected to fire (monotonic clock), to
+     measure scheduling lag. */
+  struct timespec deadline;
+  /* Random streams of the process, derived from the seed and from the
+     creation order of the process only: one for interarrivals, and one
+     for the random choices of the callback (e.g. the connection).  The
+     sequence of events of a process is thus the same whatever the
+     other processes do. */
+  struct rng rng;
+  struct rng choice_rng;
 };
 
 
@@ -27,6 +44,10 @@ int poisson_init(size_t nb_poisson_processes);
 /* Stop all events, and optionally free all callback arguments. */
 void poisson_destroy(char free_callback_args);
 
+/* Set the seed of the random streams of the processes created from now
+   on (42 by default). */
+void poisson_set_seed(uint64_t seed);
+
 /* Returns a newly created Poisson process, or NULL in case of failure. */
 struct poisson_process* poisson_new(struct event_base *base);
 
@@ -39,8 +60,27 @@ int poisson_set_callback(struct poisson_process* process, callback_fn callback,
 
 int poisson_set_rate(struct poisson_process* process, double poisson_rate);
 
-/* Starts the process.  If [initial_delay] is NULL, generate an initial
-   delay according to the poisson process. */
-int poisson_start_process(struct poisson_process* process, struct timeval* initial_delay);
+/* Starts the process: its first event fires after an interarrival of the
+   process, further delayed by [offset] if not NULL.  A process with a
+   rate of 0 only starts when its rate is changed with
+   poisson_set_rate_all(). */
+int poisson_start_process(struct poisson_process* process, const struct timeval* offset);
 
 unsigned int poisson_nb_processes();
+
+/* Change the rate of all existing processes, and reschedule their next
+   event according to the new rate.  A rate of 0 pauses the processes,
+   until the next non-zero rate. */
+void poisson_set_rate_all(double poisson_rate);
+
+/* Stop all processes, without removing them. */
+void poisson_stop_all();
+
+/* Record the lag of every Poisson event (difference between the actual
+   and the scheduled time, in microseconds) into [lag].  NULL disables
+   lag measurement, which is the default. */
+void poisson_set_lag_histogram(struct histogram *lag);
+
+/* Record the time of every Poisson event into [arrivals] (see
+   arrivals.h).  NULL disables recording, which is the default. */
+void poisson_set_arrival_ring(struct arrival_ring *arrivals);
@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "query.h"
+#include "dns.h"
+#include "utils.h"
+
+
+/* Default corpus, matching the query historically sent by the clients. */
+static const char default_corpus[] = "example.com A\n";
+
+static int _is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Layout header, offsets and arena inside the region [map]. */
+static void _setup_pointers(struct query_corpus *corpus)
+{
+  corpus->header = corpus->map;
+  corpus->nb_queries = corpus->header->nb_queries;
+  corpus->offsets = (uint32_t*) (corpus->header + 1);
+  corpus->arena = (unsigned char*) (corpus->offsets + corpus->nb_queries);
+  corpus->policy = QUERY_POLICY_UNIFORM;
+  corpus->next = 0;
+  corpus->label_len = 0;
+}
+
+/* Check that every query of a pre-encoded corpus lies within its arena,
+   and is at least as long as a DNS header.  Returns -1 otherwise. */
+static int _check_entries(const struct query_corpus_header *header)
+{
+  const uint32_t *offsets = (const uint32_t*) (header + 1);
+  const unsigned char *arena = (const unsigned char*) (offsets + header->nb_queries);
+  uint16_t len;
+  uint32_t i;
+  for (i = 0; i < header->nb_queries; i++) {
+    if ((uint64_t) offsets[i] + 2 > header->arena_len)
+      return -1;
+    DO_NTOHS(len, arena + offsets[i]);
+    if (len < 12 || (uint64_t) offsets[i] + 2 + len > header->arena_len)
+      return -1;
+  }
+  return 0;
+}
+
+/* Parse a text corpus and encode all queries into a new anonymous
+   memory region. */
+static int _build_from_text(struct query_corpus *corpus, const char *text, size_t len)
+{
+  size_t nb_lines = 0;
+  size_t arena_max, arena_pos = 0;
+  size_t line_no = 0;
+  uint32_t nb_queries = 0;
+  const char *line, *end = text + len;
+  struct query_corpus_header *header;
+  uint32_t *offsets;
+  unsigned char *arena;
+  for (const char *p = text; p < end; p++)
+    if (*p == '\n')
+      nb_lines++;
+  if (len > 0 && text[len - 1] != '\n')
+    nb_lines++;
+  /* Upper bound on the size of the arena: each query takes at most the
+     length of its line, plus length prefix, header, root label, type and
+     class. */
+  arena_max = len + nb_lines * (2 + DNS_HEADER_LEN + 2 + 4);
+  if (arena_max > UINT32_MAX) {
+    fprintf(stderr, "Error: query corpus is too large\n");
+    return -1;
+  }
+  corpus->map_len = sizeof(struct query_corpus_header) + nb_lines * sizeof(uint32_t) + arena_max;
+  corpus->map = mmap(NULL, corpus->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (corpus->map == MAP_FAILED) {
+    perror("Failed to allocate query arena");
+    return -1;
+  }
+  header = corpus->map;
+  offsets = (uint32_t*) (header + 1);
+  arena = (unsigned char*) (offsets + nb_lines);
+  for (line = text; line < end; ) {
+    const char *eol = memchr(line, '\n', end - line);
+    const char *name, *name_end, *type, *type_end;
+    int qtype = 1;
+    int msg_len;
+    if (eol == NULL)
+      eol = end;
+    line_no++;
+    name = line;
+    line = eol + 1;
+    while (name < eol && _is_space(*name))
+      name++;
+    if (name == eol || *name == '#')
+      continue;
+    for (name_end = name; name_end < eol && !_is_space(*name_end); name_end++);
+    for (type = name_end; type < eol && _is_space(*type); type++);
+    for (type_end = type; type_end < eol && !_is_space(*type_end); type_end++);
+    if (type != type_end) {
+      qtype = dns_parse_qtype(type, type_end - type);
+      if (qtype < 0) {
+	fprintf(stderr, "Warning: unknown query type on line %zu, skipping\n", line_no);
+	continue;
+      }
+    }
+    msg_len = dns_encode_query(arena + arena_pos + 2, arena_max - arena_pos - 2,
+			       name, name_end - name, qtype);
+    if (msg_len < 0) {
+      fprintf(stderr, "Warning: invalid query name on line %zu, skipping\n", line_no);
+      continue;
+    }
+    DO_HTONS(arena + arena_pos, msg_len);
+    offsets[nb_queries++] = arena_pos;
+    arena_pos += msg_len + 2;
+  }
+  if (nb_queries == 0) {
+    fprintf(stderr, "Error: query corpus does not contain any valid query\n");
+    munmap(corpus->map, corpus->map_len);
+    return -1;
+  }
+  /* Close the gap between offsets and arena, if we skipped lines. */
+  if (nb_queries < nb_lines)
+    memmove(offsets + nb_queries, arena, arena_pos);
+  memcpy(header->magic, QUERY_CORPUS_MAGIC, sizeof(header->magic));
+  header->version = QUERY_CORPUS_VERSION;
+  header->nb_queries = nb_queries;
+  header->arena_len = arena_pos;
+  _setup_pointers(corpus);
+  return 0;
+}
+
+int query_corpus_init_default(struct query_corpus *corpus)
+{
+  return _build_from_text(corpus, default_corpus, sizeof(default_corpus) - 1);
+}
+
+int query_corpus_load(struct query_corpus *corpus, const char *path)
+{
+  struct stat st;
+  struct query_corpus_header *header;
+  void *map;
+  int ret;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror("Failed to open query corpus");
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    fprintf(stderr, "Error: query corpus %s is empty or unreadable\n", path);
+    close(fd);
+    return -1;
+  }
+  /* Private writable mapping: query IDs are patched in place, but the
+     changes never reach the file. */
+  map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("Failed to map query corpus");
+    return -1;
+  }
+  header = map;
+  if (st.st_size >= sizeof(struct query_corpus_header) &&
+      memcmp(header->magic, QUERY_CORPUS_MAGIC, sizeof(header->magic)) == 0) {
+    /* Pre-encoded corpus: use the mapping directly. */
+    if (header->version != QUERY_CORPUS_VERSION ||
+	header->nb_queries == 0 ||
+	sizeof(struct query_corpus_header) + (uint64_t) header->nb_queries * sizeof(uint32_t)
+	+ header->arena_len > st.st_size ||
+	_check_entries(header) != 0) {
+      fprintf(stderr, "Error: invalid or truncated query corpus file %s\n", path);
+      munmap(map, st.st_size);
+      return -1;
+    }
+    corpus->map = map;
+    corpus->map_len = st.st_size;
+    _setup_pointers(corpus);
+    return 0;
+  }
+  /* Text corpus: encode it, then drop the text. */
+  ret = _build_from_text(corpus, map, st.st_size);
+  munmap(map, st.st_size);
+  return ret;
+}
+
+/* Returns the length of the wire-format name at [name], or -1 if it is
+   malformed or uses compression. */
+static int _name_len(const unsigned char *name, size_t max_len)
+{
+  size_t pos = 0;
+  while (pos < max_len) {
+    if (name[pos] == 0)
+      return pos + 1;
+    if (name[pos] > 63)
+      return -1;
+    pos += name[pos] + 1;
+  }
+  return -1;
+}
+
+/* Rebuild the corpus into a new arena, by calling [transform] on each
+   DNS message.  [transform] writes the new message at [dst] and returns
+   its length, or -1 in case of error.  Each message can grow by at most
+   [max_growth] bytes.  This resets the selection policy. */
+static int _transform(struct query_corpus *corpus, size_t max_growth,
+		      int (*transform)(unsigned char *dst, size_t dst_len, const unsigned char *msg, uint16_t msg_len, void *arg),
+		      void *arg)
+{
+  void *map;
+  size_t map_len;
+  struct query_corpus_header *header;
+  uint32_t *offsets;
+  unsigned char *arena;
+  size_t arena_pos = 0;
+  uint32_t nb_queries = corpus->nb_queries;
+  uint64_t arena_max = corpus->header->arena_len + (uint64_t) nb_queries * max_growth;
+  if (arena_max > UINT32_MAX) {
+    fprintf(stderr, "Error: query corpus is too large\n");
+    return -1;
+  }
+  map_len = sizeof(struct query_corpus_header) + nb_queries * sizeof(uint32_t) + arena_max;
+  map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    perror("Failed to allocate query arena");
+    return -1;
+  }
+  header = map;
+  offsets = (uint32_t*) (header + 1);
+  arena = (unsigned char*) (offsets + nb_queries);
+  for (uint32_t i = 0; i < nb_queries; i++) {
+    const unsigned char *query = query_corpus_get(corpus, i);
+    uint16_t msg_len;
+    int new_len;
+    DO_NTOHS(msg_len, query);
+    new_len = transform(arena + arena_pos + 2, arena_max - arena_pos - 2, query + 2, msg_len, arg);
+    if (new_len < 0 || new_len > 65535) {
+      fprintf(stderr, "Error: failed to rebuild query %u\n", i);
+      munmap(map, map_len);
+      return -1;
+    }
+    offsets[i] = arena_pos;
+    DO_HTONS(arena + arena_pos, new_len);
+    arena_pos += new_len + 2;
+  }
+  memcpy(header, corpus->header, sizeof(struct query_corpus_header));
+  header->arena_len = arena_pos;
+  query_corpus_free(corpus);
+  corpus->map = map;
+  corpus->map_len = map_len;
+  _setup_pointers(corpus);
+  return 0;
+}
+
+static int _prepend_label(unsigned char *dst, size_t dst_len, const unsigned char *msg, uint16_t msg_len, void *arg)
+{
+  unsigned int label_len = *(unsigned int*) arg;
+  int name_len = _name_len(msg + DNS_HEADER_LEN, msg_len - DNS_HEADER_LEN);
+  if (name_len < 0 || name_len + label_len + 1 > DNS_MAX_NAME_LEN) {
+    fprintf(stderr, "Error: query name too long to prepend a %u-characters label\n", label_len);
+    return -1;
+  }
+  memcpy(dst, msg, DNS_HEADER_LEN);
+  dst[DNS_HEADER_LEN] = label_len;
+  memset(dst + DNS_HEADER_LEN + 1, '0', label_len);
+  memcpy(dst + DNS_HEADER_LEN + 1 + label_len, msg + DNS_HEADER_LEN, msg_len - DNS_HEADER_LEN);
+  return msg_len + label_len + 1;
+}
+
+int query_corpus_add_label(struct query_corpus *corpus, unsigned int label_len)
+{
+  if (_transform(corpus, label_len + 1, _prepend_label, &label_len) != 0)
+    return -1;
+  corpus->label_len = label_len;
+  return 0;
+}
+
+static int _append_opt(unsigned char *dst, size_t dst_len, const unsigned char *msg, uint16_t msg_len, void *arg)
+{
+  if (msg_len > dst_len)
+    return -1;
+  memcpy(dst, msg, msg_len);
+  return dns_add_opt(dst, dst_len, msg_len, arg);
+}
+
+int query_corpus_add_edns(struct query_corpus *corpus, const struct edns_options *opts)
+{
+  unsigned int label_len = corpus->label_len;
+  if (_transform(corpus, dns_opt_max_len(opts), _append_opt, (void*) opts) != 0)
+    return -1;
+  corpus->label_len = label_len;
+  return 0;
+}
+
+double query_corpus_avg_len(const struct query_corpus *corpus)
+{
+  /* Each entry carries a 2-bytes length prefix */
+  return (double) corpus->header->arena_len / corpus->nb_queries;
+}
+
+int query_corpus_save(const struct query_corpus *corpus, const char *path)
+{
+  size_t len = (corpus->arena - (unsigned char*) corpus->map) + corpus->header->arena_len;
+  const char *p = corpus->map;
+  ssize_t ret;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror("Failed to create query corpus file");
+    return -1;
+  }
+  while (len > 0) {
+    ret = write(fd, p, len);
+    if (ret == -1) {
+      if (errno == EINTR)
+	continue;
+      perror("Failed to write query corpus file");
+      close(fd);
+      return -1;
+    }
+    p += ret;
+    len -= ret;
+  }
+  return close(fd);
+}
+
+/* Zipf sampling by rejection-inversion, see W. Hörmann and G. Derflinger,
+   "Rejection-inversion to generate variates from monotone discrete
+   distributions" (1996).  It runs in constant time and memory,
+   regardless of the number of queries in the corpus. */
+static double _zipf_helper1(double x)
+{
+  if (fabs(x) > 1e-8)
+    return log1p(x) / x;
+  return 1. - x * (0.5 - x * (1. / 3. - 0.25 * x));
+}
+
+static double _zipf_helper2(double x)
+{
+  if (fabs(x) > 1e-8)
+    return expm1(x) / x;
+  return 1. + x * 0.5 * (1. + x * (1. / 3.) * (1. + 0.25 * x));
+}
+
+static double _zipf_h(const struct query_corpus *corpus, double x)
+{
+  return exp(-corpus->zipf_s * log(x));
+}
+
+static double _zipf_hintegral(const struct query_corpus *corpus, double x)
+{
+  double log_x = log(x);
+  return _zipf_helper2((1. - corpus->zipf_s) * log_x) * log_x;
+}
+
+static double _zipf_hintegral_inverse(const struct query_corpus *corpus, double x)
+{
+  double t = x * (1. - corpus->zipf_s);
+  if (t < -1.)
+    t = -1.;
+  return exp(_zipf_helper1(t) * x);
+}
+
+static void _zipf_init(struct query_corpus *corpus, double s)
+{
+  corpus->zipf_s = s;
+  corpus->zipf_hx1 = _zipf_hintegral(corpus, 1.5) - 1.;
+  corpus->zipf_hn = _zipf_hintegral(corpus, corpus->nb_queries + 0.5);
+  corpus->zipf_sc = 2. - _zipf_hintegral_inverse(corpus, _zipf_hintegral(corpus, 2.5) - _zipf_h(corpus, 2.));
+}
+
+/* Returns a rank between 1 and nb_queries */
+static uint32_t _zipf_sample(const struct query_corpus *corpus)
+{
+  while (1) {
+    double u = corpus->zipf_hn + drand48() * (corpus->zipf_hx1 - corpus->zipf_hn);
+    double x = _zipf_hintegral_inverse(corpus, u);
+    double k = floor(x + 0.5);
+    if (k < 1.)
+      k = 1.;
+    else if (k > corpus->nb_queries)
+      k = corpus->nb_queries;
+    if (k - x <= corpus->zipf_sc || u >= _zipf_hintegral(corpus, k + 0.5) - _zipf_h(corpus, k))
+      return k;
+  }
+}
+
+int query_corpus_set_policy(struct query_corpus *corpus, const char *policy)
+{
+  char *end;
+  double s = 1.;
+  if (strcmp(policy, "uniform") == 0) {
+    corpus->policy = QUERY_POLICY_UNIFORM;
+  } else if (strcmp(policy, "sequential") == 0) {
+    corpus->policy = QUERY_POLICY_SEQUENTIAL;
+    corpus->next = 0;
+  } else if (strncmp(policy, "zipf", 4) == 0) {
+    if (policy[4] == ':') {
+      s = strtod(policy + 5, &end);
+      if (*end != '\0' || end == policy + 5 || s <= 0.) {
+	fprintf(stderr, "Error: invalid Zipf exponent in '%s'\n", policy);
+	return -1;
+      }
+    } else if (policy[4] != '\0') {
+      fprintf(stderr, "Error: unknown query policy '%s'\n", policy);
+      return -1;
+    }
+    corpus->policy = QUERY_POLICY_ZIPF;
+    _zipf_init(corpus, s);
+  } else {
+    fprintf(stderr, "Error: unknown query policy '%s'\n", policy);
+    return -1;
+  }
+  return 0;
+}
+
+uint32_t query_corpus_select(struct query_corpus *corpus)
+{
+  uint32_t index;
+  if (corpus->nb_queries == 1)
+    return 0;
+  switch (corpus->policy) {
+  case QUERY_POLICY_SEQUENTIAL:
+    index = corpus->next++;
+    if (corpus->next >= corpus->nb_queries)
+      corpus->next = 0;
+    return index;
+  case QUERY_POLICY_ZIPF:
+    return _zipf_sample(corpus) - 1;
+  case QUERY_POLICY_UNIFORM:
+  default:
+    return lrand48() % corpus->nb_queries;
+  }
+}
+
+void query_corpus_free(struct query_corpus *corpus)
+{
+  if (corpus->map != NULL && corpus->map != MAP_FAILED)
+    munmap(corpus->map, corpus->map_len);
+  corpus->map = NULL;
+}
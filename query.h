@@ -0,0 +1,113 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dns.h"
+
+/* A query corpus is a set of DNS queries, encoded once at startup in wire
+   format and stored in a single contiguous arena.  Each entry in the
+   arena is a DNS message preceded by its 2-bytes length in network byte
+   order, exactly as sent over TCP (UDP clients skip the length prefix).
+   Only the query ID needs to be patched before sending a query.
+
+   A corpus can be saved to a file and loaded back with mmap(), which
+   avoids parsing millions of names at each run.  The file layout is the
+   in-memory layout, in host byte order:
+
+     struct query_corpus_header
+     uint32_t offsets[nb_queries]   (relative to the start of the arena)
+     unsigned char arena[arena_len]
+*/
+
+#define QUERY_CORPUS_MAGIC "TSQCORP1"
+#define QUERY_CORPUS_VERSION 1
+
+/* Offset of the first character of the random label in a
+   length-prefixed query: length prefix, DNS header and label length. */
+#define QUERY_LABEL_OFFSET (2 + 12 + 1)
+
+struct query_corpus_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nb_queries;
+  uint64_t arena_len;
+};
+
+/* How we select the next query to send from the corpus. */
+enum query_policy {
+  /* Uniformly at random */
+  QUERY_POLICY_UNIFORM,
+  /* Zipf distribution over the rank of the query in the corpus (the
+     first query is the most popular one) */
+  QUERY_POLICY_ZIPF,
+  /* Cycle over the corpus in order */
+  QUERY_POLICY_SEQUENTIAL,
+};
+
+struct query_corpus {
+  /* Memory region holding header, offsets and arena.  It is either
+     anonymous memory or a private mapping of a corpus file, so that we
+     can patch query IDs in place in both cases. */
+  void *map;
+  size_t map_len;
+  struct query_corpus_header *header;
+  uint32_t *offsets;
+  unsigned char *arena;
+  uint32_t nb_queries;
+  enum query_policy policy;
+  /* Next query for the sequential policy */
+  uint32_t next;
+  /* Length of the random label prepended to each query name, or 0 */
+  unsigned int label_len;
+  /* Precomputed parameters of the Zipf sampler */
+  double zipf_s;
+  double zipf_hx1;
+  double zipf_hn;
+  double zipf_sc;
+};
+
+/* Build a corpus containing a single query for "example.com" type A. */
+int query_corpus_init_default(struct query_corpus *corpus);
+
+/* Load a corpus from [path], which is either a corpus file previously
+   written by query_corpus_save(), or a text file with one "qname [qtype]"
+   entry per line (qtype defaults to A, lines starting with '#' are
+   ignored).  Returns 0 on success, -1 on failure. */
+int query_corpus_load(struct query_corpus *corpus, const char *path);
+
+/* Turn every query of the corpus into a template for "<label>.<qname>",
+   where <label> is a placeholder of [label_len] characters starting at
+   offset QUERY_LABEL_OFFSET of each length-prefixed query.  This resets
+   the selection policy.  Returns -1 if a name would become too long. */
+int query_corpus_add_label(struct query_corpus *corpus, unsigned int label_len);
+
+/* Append an OPT record to every query of the corpus.  When combined with
+   random labels, labels must be added first so that padding accounts for
+   them.  This resets the selection policy. */
+int query_corpus_add_edns(struct query_corpus *corpus, const struct edns_options *opts);
+
+/* Average size of a query, including the 2-bytes TCP length prefix. */
+double query_corpus_avg_len(const struct query_corpus *corpus);
+
+/* Save the encoded corpus to [path], for later use with mmap(). */
+int query_corpus_save(const struct query_corpus *corpus, const char *path);
+
+/* Set the selection policy from a string: "uniform", "sequential",
+   "zipf" or "zipf:<exponent>" (default exponent is 1). */
+int query_corpus_set_policy(struct query_corpus *corpus, const char *policy);
+
+/* Returns the index of the next query to send, according to the
+   selection policy. */
+uint32_t query_corpus_select(struct query_corpus *corpus);
+
+/* Returns a pointer to the length-prefixed query with the given index. */
+static inline unsigned char *query_corpus_get(const struct query_corpus *corpus, uint32_t index)
+{
+  return corpus->arena + corpus->offsets[index];
+}
+
+void query_corpus_free(struct query_corpus *corpus);
+
+#endif
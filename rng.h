@@ -0,0 +1,48 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/* Small and fast pseudo-random generator (wyrand, by Wang Yi).  It is not
+   cryptographically secure, but passes BigCrush and only needs one
+   multiplication per 64-bit output, which matters in the send path. */
+struct rng {
+  uint64_t state;
+};
+
+/* splitmix64 finalizer, used to derive well-mixed seeds. */
+static inline uint64_t rng_mix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static inline void rng_seed(struct rng *rng, uint64_t seed)
+{
+  rng->state = rng_mix64(seed);
+}
+
+static inline uint64_t rng_next(struct rng *rng)
+{
+  __uint128_t t;
+  rng->state += 0xa0761d6478bd642fULL;
+  t = (__uint128_t) rng->state * (rng->state ^ 0xe7037ed1a0b428dbULL);
+  return (uint64_t) (t >> 64) ^ (uint64_t) t;
+}
+
+/* Uniform double in [0, 1) */
+static inline double rng_double(struct rng *rng)
+{
+  return (rng_next(rng) >> 11) * (1. / 9007199254740992.);
+}
+
+/* Uniform integer in [0, n), without modulo bias worth caring about
+   (Lemire's multiply-shift reduction). */
+static inline uint32_t rng_below(struct rng *rng, uint32_t n)
+{
+  return ((rng_next(rng) >> 32) * (uint64_t) n) >> 32;
+}
+
+#endif
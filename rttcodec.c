@@ -0,0 +1,555 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "rttcodec.h"
+
+/* Size of the hash tables of a block: a power of two, at least twice
+   the records of a block */
+#define RTT_CODEC_TABLE_BITS 16
+#define RTT_CODEC_TABLE (1 << RTT_CODEC_TABLE_BITS)
+
+_Static_assert(RTT_CODEC_TABLE >= 2 * RTT_LOG_BLOCK_RECORDS, "size of the tables of a block");
+_Static_assert((RTT_LOG_BLOCK_RECORDS & (RTT_LOG_BLOCK_RECORDS - 1)) == 0, "blocks of a power of two records");
+
+/* A Rice quotient this large is followed by the value on 64 bits */
+#define RICE_ESCAPE 32
+
+/* Worst case of a Rice code, in bytes */
+#define RICE_MAX 12
+
+enum {
+  COLUMN_TYPE,
+  COLUMN_TIME,
+  COLUMN_CONN,
+  COLUMN_QUERY_ID,
+  COLUMN_POISSON,
+  COLUMN_MATCH,
+  COLUMN_DELAY,
+  COLUMN_RTT,
+  COLUMN_FIRST_ID,
+};
+
+/* Codes of the match column, followed by the ranks of matched queries */
+enum {
+  MATCH_NONE,
+  MATCH_TCP,
+  MATCH_QUERY,
+};
+
+/* Query IDs expected next on a connection */
+struct expected_ids {
+  uint32_t conn;
+  uint32_t used;
+  uint16_t query;
+  uint16_t answer;
+};
+
+/* Query of the block, by connection and query ID (encoder only) */
+struct query_key {
+  uint64_t key;
+  uint32_t seq;
+};
+
+struct rtt_codec {
+  struct expected_ids *ids;
+  /* Queries of the block, in order, and a Fenwick tree counting those
+     still waiting for an answer */
+  uint64_t *query_time;
+  uint32_t *query_conn;
+  uint16_t *query_id;
+  uint8_t *waiting;
+  uint16_t *fenwick;
+  uint32_t nb_queries;
+  uint32_t nb_waiting;
+  /* Encoder only: queries by key, and values of the columns */
+  struct query_key *keys;
+  uint64_t *values[RTT_LOG_COLUMNS];
+  size_t nb_values[RTT_LOG_COLUMNS];
+};
+
+struct bit_writer {
+  unsigned char *p;
+  uint64_t bits;
+  unsigned int nb;
+};
+
+struct bit_reader {
+  const unsigned char *p;
+  const unsigned char *end;
+  uint64_t bits;
+  unsigned int nb;
+  int overrun;
+};
+
+size_t rtt_codec_max_size(size_t nb)
+{
+  /* Type and fixed-size columns, and Rice codes */
+  return (nb + 7) / 8 + 2 * 4 * nb + 2 * nb + 5 * RICE_MAX * nb + RTT_LOG_COLUMNS;
+}
+
+struct rtt_codec *rtt_codec_new(int encoder)
+{
+  struct rtt_codec *codec = calloc(1, sizeof(struct rtt_codec));
+  int failed = codec == NULL;
+  if (failed)
+    return NULL;
+  failed |= (codec->ids = malloc(RTT_CODEC_TABLE * sizeof(struct expected_ids))) == NULL;
+  failed |= (codec->query_time = malloc(RTT_LOG_BLOCK_RECORDS * sizeof(uint64_t))) == NULL;
+  failed |= (codec->query_conn = malloc(RTT_LOG_BLOCK_RECORDS * sizeof(uint32_t))) == NULL;
+  failed |= (codec->query_id = malloc(RTT_LOG_BLOCK_RECORDS * sizeof(uint16_t))) == NULL;
+  failed |= (codec->waiting = malloc(RTT_LOG_BLOCK_RECORDS)) == NULL;
+  failed |= (codec->fenwick = malloc((RTT_LOG_BLOCK_RECORDS + 1) * sizeof(uint16_t))) == NULL;
+  if (encoder) {
+    failed |= (codec->keys = malloc(RTT_CODEC_TABLE * sizeof(struct query_key))) == NULL;
+    for (int k = 0; k < RTT_LOG_COLUMNS; k++)
+      failed |= (codec->values[k] = malloc(RTT_LOG_BLOCK_RECORDS * sizeof(uint64_t))) == NULL;
+  }
+  if (failed) {
+    rtt_codec_free(codec);
+    return NULL;
+  }
+  return codec;
+}
+
+void rtt_codec_free(struct rtt_codec *codec)
+{
+  free(codec->ids);
+  free(codec->query_time);
+  free(codec->query_conn);
+  free(codec->query_id);
+  free(codec->waiting);
+  free(codec->fenwick);
+  free(codec->keys);
+  for (int k = 0; k < RTT_LOG_COLUMNS; k++)
+    free(codec->values[k]);
+  free(codec);
+}
+
+static void _reset(struct rtt_codec *codec)
+{
+  memset(codec->ids, 0, RTT_CODEC_TABLE * sizeof(struct expected_ids));
+  memset(codec->fenwick, 0, (RTT_LOG_BLOCK_RECORDS + 1) * sizeof(uint16_t));
+  codec->nb_queries = 0;
+  codec->nb_waiting = 0;
+}
+
+static inline uint64_t _zigzag(int64_t value)
+{
+  return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static inline int64_t _unzigzag(uint64_t value)
+{
+  return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static inline unsigned int _width(uint64_t value)
+{
+  return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+/* Expected query IDs of [conn] */
+static inline struct expected_ids *_expected(struct rtt_codec *codec, uint32_t conn)
+{
+  size_t i = (conn * 2654435761U) >> (32 - RTT_CODEC_TABLE_BITS);
+  while (codec->ids[i].used && codec->ids[i].conn != conn)
+    i = (i + 1) & (RTT_CODEC_TABLE - 1);
+  codec->ids[i].conn = conn;
+  return &codec->ids[i];
+}
+
+static inline uint16_t _expected_id(const struct expected_ids *expected, int query)
+{
+  return query ? expected->query : expected->answer;
+}
+
+static inline void _update_expected(struct expected_ids *expected, int query, uint16_t query_id)
+{
+  if (query) {
+    expected->query = query_id + 1;
+    /* The answer to this query comes next */
+    if (!expected->used)
+      expected->answer = query_id;
+  } else {
+    expected->answer = query_id + 1;
+    if (!expected->used)
+      expected->query = query_id + 1;
+  }
+  expected->used = 1;
+}
+
+static inline void _fenwick_add(struct rtt_codec *codec, uint32_t seq, int delta)
+{
+  for (uint32_t i = seq + 1; i <= RTT_LOG_BLOCK_RECORDS; i += i & -i)
+    codec->fenwick[i] += delta;
+  codec->nb_waiting += delta;
+}
+
+/* Queries waiting for an answer, sent before query [seq] */
+static inline uint32_t _waiting_before(const struct rtt_codec *codec, uint32_t seq)
+{
+  uint32_t count = 0;
+  for (uint32_t i = seq; i > 0; i -= i & -i)
+    count += codec->fenwick[i];
+  return count;
+}
+
+/* The [n]-th query waiting for an answer (from 1) */
+static inline uint32_t _waiting_nth(const struct rtt_codec *codec, uint32_t n)
+{
+  uint32_t seq = 0;
+  for (uint32_t step = RTT_LOG_BLOCK_RECORDS; step > 0; step >>= 1) {
+    if (seq + step <= RTT_LOG_BLOCK_RECORDS && codec->fenwick[seq + step] < n) {
+      seq += step;
+      n -= codec->fenwick[seq];
+    }
+  }
+  return seq;
+}
+
+/* Expected rank of the query matched by an answer with an RTT of
+   [rtt_ns], received after [last_ns]: that of the last query sent
+   [rtt_ns] before */
+static inline int64_t _predicted_rank(const struct rtt_codec *codec, uint64_t last_ns, uint64_t rtt_ns)
+{
+  uint64_t sent_ns = last_ns > rtt_ns ? last_ns - rtt_ns : 0;
+  uint32_t low = 0, high = codec->nb_queries, middle;
+  /* First query sent after sent_ns */
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (codec->query_time[middle] <= sent_ns)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (low == 0)
+    return codec->nb_waiting - 1;
+  return codec->nb_waiting - _waiting_before(codec, low);
+}
+
+static inline uint32_t _add_query(struct rtt_codec *codec, uint64_t time_ns, uint32_t conn, uint16_t query_id)
+{
+  uint32_t seq = codec->nb_queries++;
+  codec->query_time[seq] = time_ns;
+  codec->query_conn[seq] = conn;
+  codec->query_id[seq] = query_id;
+  codec->waiting[seq] = 1;
+  _fenwick_add(codec, seq, 1);
+  return seq;
+}
+
+static inline void _answer_query(struct rtt_codec *codec, uint32_t seq)
+{
+  codec->waiting[seq] = 0;
+  _fenwick_add(codec, seq, -1);
+}
+
+/* Slot of the query [conn, query_id] in the keys of the encoder */
+static inline struct query_key *_query_key(struct rtt_codec *codec, uint32_t conn, uint16_t query_id)
+{
+  uint64_t key = ((uint64_t) conn << 16 | query_id) + 1;
+  size_t i = (key * 0x9E3779B97F4A7C15ULL) >> (64 - RTT_CODEC_TABLE_BITS);
+  while (codec->keys[i].key != 0 && codec->keys[i].key != key)
+    i = (i + 1) & (RTT_CODEC_TABLE - 1);
+  codec->keys[i].key = key;
+  return &codec->keys[i];
+}
+
+/* [n] bits of [value], n <= 32 */
+static inline void _put_bits(struct bit_writer *w, uint64_t value, unsigned int n)
+{
+  w->bits |= value << w->nb;
+  for (w->nb += n; w->nb >= 8; w->nb -= 8) {
+    *w->p++ = w->bits;
+    w->bits >>= 8;
+  }
+}
+
+static inline void _put_rice(struct bit_writer *w, uint64_t value, unsigned int k)
+{
+  uint64_t quotient = value >> k;
+  if (quotient >= RICE_ESCAPE) {
+    _put_bits(w, 0xffffffff, RICE_ESCAPE);
+    _put_bits(w, value & 0xffffffff, 32);
+    _put_bits(w, value >> 32, 32);
+    return;
+  }
+  /* Quotient in unary, then the low bits */
+  _put_bits(w, (1ULL << quotient) - 1, quotient + 1);
+  if (k > 32) {
+    _put_bits(w, value & 0xffffffff, 32);
+    _put_bits(w, (value >> 32) & ((1ULL << (k - 32)) - 1), k - 32);
+  } else {
+    _put_bits(w, value & ((1ULL << k) - 1), k);
+  }
+}
+
+static inline void _flush_bits(struct bit_writer *w)
+{
+  if (w->nb > 0)
+    *w->p++ = w->bits;
+  w->bits = 0;
+  w->nb = 0;
+}
+
+static inline void _refill_bits(struct bit_reader *r)
+{
+  while (r->nb <= 56 && r->p < r->end) {
+    r->bits |= (uint64_t) *r->p++ << r->nb;
+    r->nb += 8;
+  }
+}
+
+/* [n] bits, n <= 32 */
+static inline uint64_t _get_bits(struct bit_reader *r, unsigned int n)
+{
+  uint64_t value;
+  if (r->nb < n) {
+    _refill_bits(r);
+    if (r->nb < n) {
+      r->overrun = 1;
+      return 0;
+    }
+  }
+  value = r->bits & ((1ULL << n) - 1);
+  r->bits >>= n;
+  r->nb -= n;
+  return value;
+}
+
+static inline uint64_t _get_rice(struct bit_reader *r, unsigned int k)
+{
+  unsigned int quotient;
+  uint64_t value;
+  if (r->nb <= RICE_ESCAPE)
+    _refill_bits(r);
+  quotient = __builtin_ctzll(~r->bits);
+  if (quotient >= RICE_ESCAPE) {
+    _get_bits(r, RICE_ESCAPE);
+    value = _get_bits(r, 32);
+    return value | _get_bits(r, 32) << 32;
+  }
+  if (quotient >= r->nb) {
+    r->overrun = 1;
+    return 0;
+  }
+  r->bits >>= quotient + 1;
+  r->nb -= quotient + 1;
+  if (k > 32) {
+    value = _get_bits(r, 32);
+    value |= _get_bits(r, k - 32) << 32;
+  } else {
+    value = _get_bits(r, k);
+  }
+  return (uint64_t) quotient << k | value;
+}
+
+/* Rice parameter with the smallest code for [values], estimated from
+   the number of values of each width */
+static unsigned int _rice_k(const uint64_t *values, size_t nb)
+{
+  uint64_t widths[65] = { 0 }, size, best_size = UINT64_MAX, value;
+  unsigned int best = 0;
+  for (size_t i = 0; i < nb; i++)
+    widths[_width(values[i])]++;
+  for (unsigned int k = 0; k < 64; k++) {
+    size = 0;
+    for (unsigned int w = 0; w <= 64; w++) {
+      /* Values of width w are 1.5 * 2^(w - 1) on average */
+      value = w < 2 ? w : 3ULL << (w - 2);
+      size += widths[w] * ((value >> k) >= RICE_ESCAPE ? RICE_ESCAPE + 64 : (value >> k) + 1 + k);
+    }
+    if (size < best_size) {
+      best_size = size;
+      best = k;
+    }
+  }
+  return best;
+}
+
+static inline void _push(struct rtt_codec *codec, int column, uint64_t value)
+{
+  codec->values[column][codec->nb_values[column]++] = value;
+}
+
+/* Subtract the smallest value of the fixed-size [column] from its
+   values, into [base].  Returns the width of the values. */
+static unsigned int _rebase(struct rtt_codec *codec, int column, uint32_t *base)
+{
+  uint64_t min = UINT32_MAX, max = 0;
+  for (size_t i = 0; i < codec->nb_values[column]; i++) {
+    if (codec->values[column][i] < min)
+      min = codec->values[column][i];
+    if (codec->values[column][i] > max)
+      max = codec->values[column][i];
+  }
+  if (min > max)
+    min = max;
+  for (size_t i = 0; i < codec->nb_values[column]; i++)
+    codec->values[column][i] -= min;
+  *base = min;
+  return _width(max - min);
+}
+
+/* Values of the columns of an unmatched answer or a query */
+static inline void _push_key(struct rtt_codec *codec, const struct rtt_record *record, uint64_t last_ns, int query)
+{
+  struct expected_ids *expected = _expected(codec, record->connection_id);
+  _push(codec, COLUMN_TIME, _zigzag((int64_t) (record->time_ns - last_ns)));
+  _push(codec, COLUMN_CONN, record->connection_id);
+  if (expected->used)
+    _push(codec, COLUMN_QUERY_ID, _zigzag((int16_t) (record->query_id - _expected_id(expected, query))));
+  else
+    _push(codec, COLUMN_FIRST_ID, record->query_id);
+}
+
+size_t rtt_codec_encode(struct rtt_codec *codec, const struct rtt_record *records, size_t nb,
+			struct rtt_block_header *header, unsigned char *out)
+{
+  const struct rtt_record *r;
+  struct query_key *key;
+  struct bit_writer w = { out, 0, 0 };
+  uint64_t last_ns = records[0].time_ns, rtt_ns;
+  unsigned int k[RTT_LOG_COLUMNS] = { 0 };
+  unsigned char *start;
+  int64_t rank;
+  uint32_t seq;
+  int query;
+  _reset(codec);
+  memset(codec->keys, 0, RTT_CODEC_TABLE * sizeof(struct query_key));
+  memset(codec->nb_values, 0, sizeof(codec->nb_values));
+  /* Values of the columns */
+  for (size_t i = 0; i < nb; i++) {
+    r = &records[i];
+    query = r->type == RTT_QUERY;
+    _push(codec, COLUMN_TYPE, query);
+    if (query) {
+      _push_key(codec, r, last_ns, query);
+      _push(codec, COLUMN_POISSON, (uint32_t) (r->poisson_id + 1));
+      key = _query_key(codec, r->connection_id, r->query_id);
+      key->seq = _add_query(codec, r->time_ns, r->connection_id, r->query_id);
+    } else {
+      key = r->type == RTT_ANSWER ? _query_key(codec, r->connection_id, r->query_id) : NULL;
+      if (key != NULL && key->seq < codec->nb_queries && codec->waiting[key->seq] &&
+	  codec->query_conn[key->seq] == r->connection_id && codec->query_id[key->seq] == r->query_id) {
+	seq = key->seq;
+	rtt_ns = r->rtt_us == RTT_NONE ? 0 : r->rtt_us * 1000ULL;
+	rank = codec->nb_waiting - 1 - _waiting_before(codec, seq);
+	_push(codec, COLUMN_MATCH, MATCH_QUERY + _zigzag(rank - _predicted_rank(codec, last_ns, rtt_ns)));
+	_push(codec, COLUMN_DELAY, _zigzag((int64_t) (r->time_ns - codec->query_time[seq] - rtt_ns)));
+	_answer_query(codec, seq);
+      } else {
+	_push(codec, COLUMN_MATCH, r->type == RTT_TCP_ANSWER ? MATCH_TCP : MATCH_NONE);
+	_push_key(codec, r, last_ns, query);
+      }
+      _push(codec, COLUMN_RTT, (uint32_t) (r->rtt_us + 1));
+    }
+    _update_expected(_expected(codec, r->connection_id), query, r->query_id);
+    last_ns = r->time_ns;
+  }
+  /* Ranges of the fixed-size columns, and parameters of the Rice codes */
+  memset(header, 0, sizeof(struct rtt_block_header));
+  header->nb_records = nb;
+  header->first_time_ns = records[0].time_ns;
+  header->conn_bits = k[COLUMN_CONN] = _rebase(codec, COLUMN_CONN, &header->conn_base);
+  header->poisson_bits = k[COLUMN_POISSON] = _rebase(codec, COLUMN_POISSON, &header->poisson_base);
+  header->time_k = k[COLUMN_TIME] = _rice_k(codec->values[COLUMN_TIME], codec->nb_values[COLUMN_TIME]);
+  header->query_id_k = k[COLUMN_QUERY_ID] = _rice_k(codec->values[COLUMN_QUERY_ID], codec->nb_values[COLUMN_QUERY_ID]);
+  header->match_k = k[COLUMN_MATCH] = _rice_k(codec->values[COLUMN_MATCH], codec->nb_values[COLUMN_MATCH]);
+  header->delay_k = k[COLUMN_DELAY] = _rice_k(codec->values[COLUMN_DELAY], codec->nb_values[COLUMN_DELAY]);
+  header->rtt_k = k[COLUMN_RTT] = _rice_k(codec->values[COLUMN_RTT], codec->nb_values[COLUMN_RTT]);
+  /* Write the columns */
+  for (int c = 0; c < RTT_LOG_COLUMNS; c++) {
+    start = w.p;
+    for (size_t i = 0; i < codec->nb_values[c]; i++) {
+      if (c == COLUMN_TYPE)
+	_put_bits(&w, codec->values[c][i], 1);
+      else if (c == COLUMN_CONN || c == COLUMN_POISSON)
+	_put_bits(&w, codec->values[c][i], k[c]);
+      else if (c == COLUMN_FIRST_ID)
+	_put_bits(&w, codec->values[c][i], 16);
+      else
+	_put_rice(&w, codec->values[c][i], k[c]);
+    }
+    _flush_bits(&w);
+    header->column_size[c] = w.p - start;
+  }
+  return w.p - out;
+}
+
+/* Connection and query ID of an unmatched answer or a query */
+static inline void _get_key(struct bit_reader *columns, const struct rtt_block_header *header,
+			    struct rtt_codec *codec, struct rtt_record *record, uint64_t *last_ns, int query)
+{
+  struct expected_ids *expected;
+  *last_ns += _unzigzag(_get_rice(&columns[COLUMN_TIME], header->time_k));
+  record->time_ns = *last_ns;
+  record->connection_id = header->conn_base + _get_bits(&columns[COLUMN_CONN], header->conn_bits);
+  expected = _expected(codec, record->connection_id);
+  if (expected->used)
+    record->query_id = _expected_id(expected, query) + _unzigzag(_get_rice(&columns[COLUMN_QUERY_ID], header->query_id_k));
+  else
+    record->query_id = _get_bits(&columns[COLUMN_FIRST_ID], 16);
+}
+
+long rtt_codec_decode(struct rtt_codec *codec, const struct rtt_block_header *header,
+		      const unsigned char *in, struct rtt_record *records)
+{
+  struct bit_reader columns[RTT_LOG_COLUMNS];
+  struct rtt_record *r;
+  uint64_t last_ns = header->first_time_ns, match, rtt_ns;
+  int64_t rank;
+  uint32_t seq;
+  int query;
+  if (header->nb_records > RTT_LOG_BLOCK_RECORDS || header->conn_bits > 32 || header->poisson_bits > 32 ||
+      header->time_k >= 64 || header->query_id_k >= 64 || header->match_k >= 64 ||
+      header->delay_k >= 64 || header->rtt_k >= 64)
+    return -1;
+  for (int c = 0; c < RTT_LOG_COLUMNS; c++) {
+    memset(&columns[c], 0, sizeof(struct bit_reader));
+    columns[c].p = in;
+    in += header->column_size[c];
+    columns[c].end = in;
+  }
+  _reset(codec);
+  for (size_t i = 0; i < header->nb_records; i++) {
+    r = &records[i];
+    r->unused = 0;
+    query = _get_bits(&columns[COLUMN_TYPE], 1);
+    if (query) {
+      r->type = RTT_QUERY;
+      _get_key(columns, header, codec, r, &last_ns, query);
+      r->poisson_id = header->poisson_base + _get_bits(&columns[COLUMN_POISSON], header->poisson_bits) - 1;
+      r->rtt_us = RTT_NONE;
+      if (codec->nb_queries == RTT_LOG_BLOCK_RECORDS)
+	return -1;
+      _add_query(codec, r->time_ns, r->connection_id, r->query_id);
+    } else {
+      match = _get_rice(&columns[COLUMN_MATCH], header->match_k);
+      r->rtt_us = _get_rice(&columns[COLUMN_RTT], header->rtt_k) - 1;
+      r->poisson_id = RTT_NONE;
+      if (match >= MATCH_QUERY) {
+	rtt_ns = r->rtt_us == RTT_NONE ? 0 : r->rtt_us * 1000ULL;
+	rank = _predicted_rank(codec, last_ns, rtt_ns) + _unzigzag(match - MATCH_QUERY);
+	if (rank < 0 || rank >= codec->nb_waiting)
+	  return -1;
+	seq = _waiting_nth(codec, codec->nb_waiting - rank);
+	r->type = RTT_ANSWER;
+	r->connection_id = codec->query_conn[seq];
+	r->query_id = codec->query_id[seq];
+	last_ns = codec->query_time[seq] + rtt_ns + _unzigzag(_get_rice(&columns[COLUMN_DELAY], header->delay_k));
+	r->time_ns = last_ns;
+	_answer_query(codec, seq);
+      } else {
+	r->type = match == MATCH_TCP ? RTT_TCP_ANSWER : RTT_ANSWER;
+	_get_key(columns, header, codec, r, &last_ns, query);
+      }
+    }
+    _update_expected(_expected(codec, r->connection_id), query, r->query_id);
+  }
+  for (int c = 0; c < RTT_LOG_COLUMNS; c++) {
+    if (columns[c].overrun)
+      return -1;
+  }
+  return header->nb_records;
+}
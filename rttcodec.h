@@ -0,0 +1,63 @@
+#ifndef RTTCODEC_H
+#define RTTCODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rttlog.h"
+
+/* Encoding of the columns of a block of a columnar per-query log (see
+   rttlog.h for the file layout).
+
+   Records are split into columns, each a stream of bits:
+
+     type      1 bit, 1 for queries
+     time      timestamp minus the previous one (first_time_ns for the
+               first record), zigzag, Rice code: queries and unmatched
+               answers
+     conn      connection ID minus conn_base, on conn_bits bits: queries
+               and unmatched answers
+     query ID  difference with the ID expected on the connection (after
+               its last query for queries, its last answer for answers),
+               zigzag, Rice code: queries and unmatched answers, but the
+               first record of each connection
+     poisson   Poisson ID + 1 (0 for none) minus poisson_base, on
+               poisson_bits bits: queries
+     match     for answers, Rice code: 0 for an answer (A) and 1 for a
+               TCP answer (T) that do not match a query of the block, or
+               2 + the rank of the matched query among the queries of the
+               block still waiting for an answer, from the latest one
+     delay     for matched answers, timestamp minus that of the query and
+               the RTT, zigzag, Rice code
+     rtt       RTT + 1 (0 for none), Rice code: answers
+     first ID  query ID on 16 bits, for the first query or unmatched
+               answer of each connection
+
+   An answer usually matches one of the last queries sent, so that its
+   connection, query ID and most of its timestamp cost a few bits.  The
+   parameter of each Rice code is chosen for each block, from the mean of
+   its values.  A query and its answer take about 8 bytes at 20k qps. */
+
+/* Worst-case size of the columns of [nb] records */
+size_t rtt_codec_max_size(size_t nb);
+
+struct rtt_codec;
+
+/* Tables of an encoder (or a decoder if [encoder] is 0).  Returns NULL
+   in case of error. */
+struct rtt_codec *rtt_codec_new(int encoder);
+
+void rtt_codec_free(struct rtt_codec *codec);
+
+/* Encode [nb] records (at most RTT_LOG_BLOCK_RECORDS) into [out], fill
+   [header] but for its magic, compression and stored size, and return
+   the size of the columns. */
+size_t rtt_codec_encode(struct rtt_codec *codec, const struct rtt_record *records, size_t nb,
+			struct rtt_block_header *header, unsigned char *out);
+
+/* Decode the columns [in] of the block of [header] into [records].
+   Returns the number of records, or -1 if the columns are corrupted. */
+long rtt_codec_decode(struct rtt_codec *codec, const struct rtt_block_header *header,
+		      const unsigned char *in, struct rtt_record *records);
+
+#endif
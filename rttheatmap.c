@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+#include "heatmap.h"
+
+/* Renders a latency heatmap written by tcpclient or udpclient with
+   --heatmap (see heatmap.h), as text on stdout, with one line per row
+   (or per '-a' rows) and one character per range of latencies, or as a
+   PPM image with time on the horizontal axis.
+
+   Latencies are on a logarithmic scale, from the smallest to the largest
+   non-empty bucket of the heatmap unless '-l' and '-u' are given.  The
+   count of a histogram bucket is spread over the columns that it covers,
+   in proportion of their overlap on that scale.  Shades follow the
+   logarithm of the counts, relative to the largest cell of each line
+   (or of the whole heatmap with '-g'), so that a small second mode is
+   still visible. */
+
+/* Default number of latency columns of the text output */
+#define RTTHEATMAP_WIDTH 64
+
+/* Default height of the image, and its target width */
+#define RTTHEATMAP_IMAGE_HEIGHT 256
+#define RTTHEATMAP_IMAGE_WIDTH 1024
+
+/* From empty to the largest cell */
+static const char shades[] = " .:-=+*#%@";
+#define NB_SHADES (sizeof(shades) - 1)
+
+/* Range of values of bucket [index], as [lower, upper) */
+static void bucket_range(unsigned int index, double *lower, double *upper)
+{
+  *lower = histogram_bucket_lower(index);
+  *upper = histogram_bucket_upper(index) + 1.;
+  /* Latencies of 0 us are drawn as if they were 0.5 us */
+  if (*lower < .5)
+    *lower = .5;
+}
+
+/* Spread the counts of rows [first, first + nb) of [map] over the [nb_bins]
+   cells of [cells], on a log scale from [lo] to [hi]. */
+static void render_line(const struct heatmap *map, size_t first, size_t nb, double lo, double hi,
+			double *cells, unsigned int nb_bins)
+{
+  double step = (log(hi) - log(lo)) / nb_bins, lower, upper, a, b;
+  const uint32_t *counts;
+  unsigned int i;
+  int c;
+  memset(cells, 0, nb_bins * sizeof(double));
+  for (; nb > 0 && first < map->nb_rows; first++, nb--) {
+    counts = map->counts + first * HISTOGRAM_NB_BUCKETS;
+    for (i = 0; i < HISTOGRAM_NB_BUCKETS; i++) {
+      if (counts[i] == 0)
+	continue;
+      bucket_range(i, &lower, &upper);
+      /* Position of the bucket, in columns */
+      a = (log(lower) - log(lo)) / step;
+      b = (log(upper) - log(lo)) / step;
+      if (a < 0.)
+	a = 0.;
+      if (b > nb_bins)
+	b = nb_bins;
+      if (b <= a) {
+	/* Entirely out of the range: clamp to the edge */
+	cells[a >= nb_bins ? nb_bins - 1 : 0] += counts[i];
+	continue;
+      }
+      for (c = a; c < b; c++)
+	cells[c] += counts[i] * (fmin(b, c + 1) - fmax(a, c)) / (b - a);
+    }
+  }
+}
+
+/* Shade of [value] between 0 (empty) and 1 (as large as [max]) */
+static double shade(double value, double max)
+{
+  if (value <= 0. || max <= 0.)
+    return 0.;
+  return log1p(value) / log1p(max);
+}
+
+static double line_max(const double *cells, unsigned int nb_bins)
+{
+  double max = 0.;
+  for (unsigned int c = 0; c < nb_bins; c++)
+    max = fmax(max, cells[c]);
+  return max;
+}
+
+static void print_text(const struct heatmap *map, size_t rows_per_line, double lo, double hi,
+		       unsigned int width, short global)
+{
+  double *cells = malloc(width * sizeof(double)), max = 0., line_total, s;
+  size_t row;
+  unsigned int c;
+  if (global) {
+    for (row = 0; row < map->nb_rows; row += rows_per_line) {
+      render_line(map, row, rows_per_line, lo, hi, cells, width);
+      max = fmax(max, line_max(cells, width));
+    }
+  }
+  printf("%10s %10s  latency from %.0f to %.0f us (log scale)\n", "time_s", "answers", lo, hi);
+  for (row = 0; row < map->nb_rows; row += rows_per_line) {
+    render_line(map, row, rows_per_line, lo, hi, cells, width);
+    if (!global)
+      max = line_max(cells, width);
+    line_total = 0.;
+    for (c = 0; c < width; c++)
+      line_total += cells[c];
+    printf("%10.3f %10.0f |", (map->times_ns[row] - map->start_time_ns) / 1e9, line_total);
+    for (c = 0; c < width; c++) {
+      s = shade(cells[c], max);
+      putchar(s == 0. ? shades[0] : shades[1 + (int) (s * (NB_SHADES - 2) + .5)]);
+    }
+    printf("|\n");
+  }
+  /* Latency axis: one tick per quarter */
+  printf("%21s  ", "");
+  for (c = 0; c <= 4; c++) {
+    char label[32];
+    snprintf(label, sizeof(label), "%.0f", lo * pow(hi / lo, c / 4.));
+    printf("%-*s", c < 4 ? (int) (width / 4) : 0, label);
+  }
+  printf(" us\n");
+  free(cells);
+}
+
+/* Black, blue, red, yellow, white */
+static void color(double s, unsigned char *rgb)
+{
+  static const double stops[5][3] = {{0, 0, 0}, {0, 0, 160}, {220, 0, 0}, {255, 220, 0}, {255, 255, 255}};
+  double x = s * 4.;
+  int i = x >= 4. ? 3 : (int) x;
+  for (int k = 0; k < 3; k++)
+    rgb[k] = stops[i][k] + (x - i) * (stops[i + 1][k] - stops[i][k]);
+}
+
+static int write_image(const struct heatmap *map, const char *path, size_t rows_per_line, double lo, double hi,
+		       unsigned int height, short global)
+{
+  size_t nb_lines = (map->nb_rows + rows_per_line - 1) / rows_per_line, line;
+  unsigned int scale = nb_lines < RTTHEATMAP_IMAGE_WIDTH ? RTTHEATMAP_IMAGE_WIDTH / nb_lines : 1;
+  unsigned int width = nb_lines * scale, x, y;
+  double *cells = malloc((size_t) nb_lines * height * sizeof(double)), max = 0., line_max_value;
+  unsigned char *pixels = malloc((size_t) width * height * 3);
+  FILE *out;
+  int ret = 0;
+  if (cells == NULL || pixels == NULL) {
+    perror("malloc");
+    ret = -1;
+    goto out;
+  }
+  for (line = 0; line < nb_lines; line++) {
+    render_line(map, line * rows_per_line, rows_per_line, lo, hi, cells + line * height, height);
+    max = fmax(max, line_max(cells + line * height, height));
+  }
+  for (line = 0; line < nb_lines; line++) {
+    line_max_value = global ? max : line_max(cells + line * height, height);
+    /* Largest latencies at the top */
+    for (y = 0; y < height; y++)
+      for (x = line * scale; x < (line + 1) * scale; x++)
+	color(shade(cells[line * height + y], line_max_value), pixels + 3 * ((size_t) (height - 1 - y) * width + x));
+  }
+  out = fopen(path, "w");
+  if (out == NULL) {
+    perror(path);
+    ret = -1;
+    goto out;
+  }
+  fprintf(out, "P6\n%u %u\n255\n", width, height);
+  fwrite(pixels, 3, (size_t) width * height, out);
+  if (fclose(out) != 0) {
+    perror(path);
+    ret = -1;
+  }
+ out:
+  free(cells);
+  free(pixels);
+  return ret;
+}
+
+void usage(char *progname)
+{
+  fprintf(stderr, "usage: %s [-h] [-g] [-a rows] [-w width] [-l min_us] [-u max_us] [-o image.ppm] [-H height] <heatmap>\n", progname);
+  fprintf(stderr, "Renders a latency heatmap written by tcpclient or udpclient with --heatmap (binary or CSV).\n");
+  fprintf(stderr, "By default, prints one line per interval, with '-w' columns (default %d) of latencies on a log scale,\n", RTTHEATMAP_WIDTH);
+  fprintf(stderr, "from '-l' to '-u' microseconds (by default, the range of the heatmap).  Option '-a' merges\n");
+  fprintf(stderr, "the given number of intervals into each line.  Shades are relative to the largest cell of each\n");
+  fprintf(stderr, "line, or of the whole heatmap with '-g'.\n");
+  fprintf(stderr, "With option '-o', write a PPM image instead, with time from left to right and latencies\n");
+  fprintf(stderr, "from bottom to top, '-H' pixels high (default %d).\n", RTTHEATMAP_IMAGE_HEIGHT);
+}
+
+int main(int argc, char **argv)
+{
+  struct heatmap map;
+  const char *image = NULL;
+  unsigned int width = RTTHEATMAP_WIDTH, height = RTTHEATMAP_IMAGE_HEIGHT;
+  size_t rows_per_line = 1, row;
+  double lo = 0., hi = 0., lower, upper;
+  unsigned int i, first = HISTOGRAM_NB_BUCKETS, last = 0;
+  short global = 0;
+  int opt, ret;
+
+  while ((opt = getopt(argc, argv, "hga:w:l:u:o:H:")) != -1) {
+    switch (opt) {
+    case 'g':
+      global = 1;
+      break;
+    case 'a':
+      rows_per_line = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      width = strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+      lo = strtod(optarg, NULL);
+      break;
+    case 'u':
+      hi = strtod(optarg, NULL);
+      break;
+    case 'o':
+      image = optarg;
+      break;
+    case 'H':
+      height = strtoul(optarg, NULL, 10);
+      break;
+    case 'h':
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || rows_per_line == 0 || width == 0 || height == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (heatmap_read(&map, argv[optind]) != 0)
+    return 1;
+  if (map.nb_rows == 0) {
+    fprintf(stderr, "%s: empty heatmap\n", argv[optind]);
+    return 1;
+  }
+  /* Default range: all non-empty buckets */
+  for (row = 0; row < map.nb_rows; row++)
+    for (i = 0; i < HISTOGRAM_NB_BUCKETS; i++)
+      if (map.counts[row * HISTOGRAM_NB_BUCKETS + i] != 0) {
+	first = i < first ? i : first;
+	last = i > last ? i : last;
+      }
+  if (first == HISTOGRAM_NB_BUCKETS)
+    first = last = 0;
+  bucket_range(first, &lower, &upper);
+  if (lo <= 0.)
+    lo = lower;
+  bucket_range(last, &lower, &upper);
+  if (hi <= 0.)
+    hi = upper;
+  if (hi <= lo) {
+    fprintf(stderr, "Error: empty latency range [%.0f, %.0f]\n", lo, hi);
+    return 1;
+  }
+  if (image != NULL)
+    ret = write_image(&map, image, rows_per_line, lo, hi, height, global);
+  else {
+    print_text(&map, rows_per_line, lo, hi, width, global);
+    ret = 0;
+  }
+  heatmap_free(&map);
+  return ret != 0 ? 1 : 0;
+}
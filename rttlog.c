@@ -0,0 +1,768 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "rttlog.h"
+#include "rttcodec.h"
+
+_Static_assert(sizeof(struct rtt_record) == 24, "rtt_record layout");
+_Static_assert(sizeof(struct rtt_block_header) == 80, "rtt_block_header layout");
+
+struct rtt_log_encoder {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  /* Blocks of records: [count] of them submitted from [first], and the
+     next one filled by the client */
+  unsigned char *slots[RTT_LOG_SLOTS];
+  size_t used[RTT_LOG_SLOTS];
+  unsigned int first;
+  unsigned int count;
+  int done;
+  int failed;
+  /* Owned by the thread */
+  int fd;
+  struct rtt_codec *codec;
+  unsigned char *block;
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx *zstd;
+  unsigned char *compressed;
+  size_t compressed_size;
+#endif
+  uint64_t offset;
+  struct rtt_block_index *index;
+  size_t nb_blocks;
+  size_t index_size;
+};
+
+static int _write_all(int fd, const void *buf, size_t len)
+{
+  size_t done = 0;
+  ssize_t ret;
+  while (done < len) {
+    ret = write(fd, (const char *) buf + done, len - done);
+    if (ret <= 0) {
+      perror("Failed to write RTT log");
+      return -1;
+    }
+    done += ret;
+  }
+  return 0;
+}
+
+/* Encode, compress and write a block of [nb] records, and index it. */
+static int _write_block(struct rtt_log_encoder *enc, const struct rtt_record *records, size_t nb)
+{
+  struct rtt_block_header header;
+  struct rtt_block_index *index;
+  unsigned char *block = enc->block, *raw = enc->block + sizeof(header);
+  size_t raw_size = rtt_codec_encode(enc->codec, records, nb, &header, raw);
+  header.magic = RTT_LOG_BLOCK_MAGIC;
+  header.compression = RTT_LOG_RAW;
+  header.stored_size = raw_size;
+#ifdef HAVE_ZSTD
+  size_t ret = ZSTD_compressCCtx(enc->zstd, enc->compressed + sizeof(header), enc->compressed_size - sizeof(header),
+				 raw, raw_size, RTT_LOG_ZSTD_LEVEL);
+  if (!ZSTD_isError(ret) && ret < raw_size) {
+    header.compression = RTT_LOG_ZSTD;
+    header.stored_size = ret;
+    block = enc->compressed;
+  }
+#endif
+  memcpy(block, &header, sizeof(header));
+  if (enc->nb_blocks == enc->index_size) {
+    enc->index_size = enc->index_size == 0 ? 256 : 2 * enc->index_size;
+    index = realloc(enc->index, enc->index_size * sizeof(struct rtt_block_index));
+    if (index == NULL) {
+      perror("Failed to index RTT log");
+      return -1;
+    }
+    enc->index = index;
+  }
+  index = &enc->index[enc->nb_blocks++];
+  memset(index, 0, sizeof(struct rtt_block_index));
+  index->offset = enc->offset;
+  index->first_time_ns = header.first_time_ns;
+  index->nb_records = nb;
+  enc->offset += sizeof(header) + header.stored_size;
+  return _write_all(enc->fd, block, sizeof(header) + header.stored_size);
+}
+
+/* Thread writing the blocks submitted by rtt_log_flush */
+static void *_encoder_main(void *arg)
+{
+  struct rtt_log_encoder *enc = arg;
+  unsigned int slot;
+  int failed = 0;
+  pthread_mutex_lock(&enc->lock);
+  while (1) {
+    while (enc->count == 0 && !enc->done)
+      pthread_cond_wait(&enc->cond, &enc->lock);
+    if (enc->count == 0)
+      break;
+    slot = enc->first;
+    pthread_mutex_unlock(&enc->lock);
+    if (!failed)
+      failed = _write_block(enc, (const struct rtt_record *) enc->slots[slot],
+			    enc->used[slot] / sizeof(struct rtt_record)) != 0;
+    pthread_mutex_lock(&enc->lock);
+    enc->failed = failed;
+    enc->first = (enc->first + 1) % RTT_LOG_SLOTS;
+    enc->count--;
+    pthread_cond_broadcast(&enc->cond);
+  }
+  pthread_mutex_unlock(&enc->lock);
+  return NULL;
+}
+
+static void _free_encoder(struct rtt_log_encoder *enc)
+{
+  for (int i = 0; i < RTT_LOG_SLOTS; i++)
+    free(enc->slots[i]);
+  if (enc->codec != NULL)
+    rtt_codec_free(enc->codec);
+  free(enc->block);
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(enc->zstd);
+  free(enc->compressed);
+#endif
+  free(enc->index);
+  free(enc);
+}
+
+static struct rtt_log_encoder *_start_encoder(int fd)
+{
+  struct rtt_log_encoder *enc = calloc(1, sizeof(struct rtt_log_encoder));
+  size_t block_size;
+  int failed = enc == NULL;
+  if (failed) {
+    perror("Failed to create RTT log");
+    return NULL;
+  }
+  enc->fd = fd;
+  enc->offset = RTT_LOG_HEADER_SIZE;
+  for (int i = 0; i < RTT_LOG_SLOTS; i++)
+    failed |= (enc->slots[i] = malloc(RTT_LOG_BLOCK_RECORDS * sizeof(struct rtt_record))) == NULL;
+  block_size = sizeof(struct rtt_block_header) + rtt_codec_max_size(RTT_LOG_BLOCK_RECORDS);
+  failed |= (enc->block = malloc(block_size)) == NULL;
+  failed |= (enc->codec = rtt_codec_new(1)) == NULL;
+#ifdef HAVE_ZSTD
+  enc->compressed_size = sizeof(struct rtt_block_header) + ZSTD_compressBound(block_size);
+  failed |= (enc->compressed = malloc(enc->compressed_size)) == NULL;
+  failed |= (enc->zstd = ZSTD_createCCtx()) == NULL;
+#endif
+  if (failed) {
+    perror("Failed to create RTT log");
+    _free_encoder(enc);
+    return NULL;
+  }
+  pthread_mutex_init(&enc->lock, NULL);
+  pthread_cond_init(&enc->cond, NULL);
+  if (pthread_create(&enc->thread, NULL, _encoder_main, enc) != 0) {
+    fprintf(stderr, "Failed to start the RTT log thread\n");
+    _free_encoder(enc);
+    return NULL;
+  }
+  return enc;
+}
+
+int rtt_log_parse_format(const char *name)
+{
+  if (strcmp(name, "binary") == 0)
+    return RTT_LOG_BINARY;
+  if (strcmp(name, "columnar") == 0)
+    return RTT_LOG_COLUMNAR;
+  return -1;
+}
+
+struct rtt_log_writer *rtt_log_create(const char *path, enum rtt_log_format format)
+{
+  struct rtt_log_writer *writer;
+  unsigned char file_header[RTT_LOG_HEADER_SIZE];
+  uint32_t header[2] = { RTT_LOG_VERSION, sizeof(struct rtt_record) };
+  writer = calloc(1, sizeof(struct rtt_log_writer));
+  if (writer == NULL) {
+    perror("Failed to create RTT log");
+    return NULL;
+  }
+  writer->format = format;
+  writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer->fd == -1) {
+    perror("Failed to create RTT log");
+    free(writer);
+    return NULL;
+  }
+  if (format == RTT_LOG_COLUMNAR) {
+    header[1] = RTT_LOG_BLOCK_RECORDS;
+    memcpy(file_header, RTT_LOG_COLUMNAR_MAGIC, 8);
+    memcpy(file_header + 8, header, sizeof(header));
+    if (_write_all(writer->fd, file_header, sizeof(file_header)) != 0 ||
+	(writer->encoder = _start_encoder(writer->fd)) == NULL) {
+      close(writer->fd);
+      free(writer);
+      return NULL;
+    }
+    writer->buf = writer->encoder->slots[0];
+    writer->size = RTT_LOG_BLOCK_RECORDS * sizeof(struct rtt_record);
+    return writer;
+  }
+  writer->size = RTT_LOG_BUFFER_SIZE;
+  writer->buf = malloc(writer->size);
+  if (writer->buf == NULL) {
+    perror("Failed to create RTT log");
+    close(writer->fd);
+    free(writer);
+    return NULL;
+  }
+  memcpy(writer->buf, RTT_LOG_MAGIC, 8);
+  memcpy(writer->buf + 8, header, sizeof(header));
+  writer->used = RTT_LOG_HEADER_SIZE;
+  return writer;
+}
+
+int rtt_log_flush(struct rtt_log_writer *writer)
+{
+  struct rtt_log_encoder *enc = writer->encoder;
+  unsigned int slot;
+  int failed;
+  if (enc == NULL) {
+    if (!writer->failed && _write_all(writer->fd, writer->buf, writer->used) != 0)
+      writer->failed = 1;
+    writer->used = 0;
+    return writer->failed ? -1 : 0;
+  }
+  if (writer->used == 0)
+    return writer->failed ? -1 : 0;
+  /* Pass the block to the thread, and wait for a free one if it lags */
+  pthread_mutex_lock(&enc->lock);
+  slot = (enc->first + enc->count) % RTT_LOG_SLOTS;
+  enc->used[slot] = writer->used;
+  enc->count++;
+  pthread_cond_broadcast(&enc->cond);
+  while (enc->count == RTT_LOG_SLOTS)
+    pthread_cond_wait(&enc->cond, &enc->lock);
+  writer->buf = enc->slots[(enc->first + enc->count) % RTT_LOG_SLOTS];
+  failed = enc->failed;
+  pthread_mutex_unlock(&enc->lock);
+  writer->used = 0;
+  writer->failed |= failed;
+  return writer->failed ? -1 : 0;
+}
+
+void rtt_log_close(struct rtt_log_writer *writer)
+{
+  struct rtt_log_encoder *enc = writer->encoder;
+  struct rtt_log_trailer trailer;
+  rtt_log_flush(writer);
+  if (enc != NULL) {
+    pthread_mutex_lock(&enc->lock);
+    enc->done = 1;
+    pthread_cond_broadcast(&enc->cond);
+    pthread_mutex_unlock(&enc->lock);
+    pthread_join(enc->thread, NULL);
+    /* The index, then the trailer to find it */
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.index_offset = enc->offset;
+    trailer.nb_blocks = enc->nb_blocks;
+    memcpy(trailer.magic, RTT_LOG_INDEX_MAGIC, 8);
+    if (!enc->failed && _write_all(writer->fd, enc->index, enc->nb_blocks * sizeof(struct rtt_block_index)) == 0)
+      _write_all(writer->fd, &trailer, sizeof(trailer));
+    _free_encoder(enc);
+  } else {
+    free(writer->buf);
+  }
+  close(writer->fd);
+  free(writer);
+}
+
+/* Find the blocks of a columnar log, from its index or, without index,
+   by walking the block headers.  The log ends after its last complete
+   block. */
+static int _index_blocks(struct rtt_log_file *file)
+{
+  struct rtt_log_trailer trailer;
+  struct rtt_block_index entry;
+  struct rtt_block_header header;
+  uint64_t *blocks;
+  size_t offset, size = 0;
+  if (file->size >= file->start + sizeof(trailer)) {
+    memcpy(&trailer, file->data + file->size - sizeof(trailer), sizeof(trailer));
+    if (memcmp(trailer.magic, RTT_LOG_INDEX_MAGIC, 8) == 0 && trailer.index_offset >= file->start &&
+	trailer.nb_blocks <= file->size / sizeof(entry) &&
+	trailer.index_offset + trailer.nb_blocks * sizeof(entry) + sizeof(trailer) == file->size) {
+      file->blocks = malloc((trailer.nb_blocks + 1) * sizeof(uint64_t));
+      if (file->blocks == NULL) {
+	perror(file->path);
+	return -1;
+      }
+      for (size_t i = 0; i < trailer.nb_blocks; i++) {
+	memcpy(&entry, file->data + trailer.index_offset + i * sizeof(entry), sizeof(entry));
+	file->blocks[i] = entry.offset;
+      }
+      file->nb_blocks = trailer.nb_blocks;
+      file->size = trailer.index_offset;
+      return 0;
+    }
+  }
+  for (offset = file->start; offset + sizeof(header) <= file->size; offset += sizeof(header) + header.stored_size) {
+    memcpy(&header, file->data + offset, sizeof(header));
+    if (header.magic != RTT_LOG_BLOCK_MAGIC || header.stored_size > file->size - offset - sizeof(header))
+      break;
+    if (file->nb_blocks == size) {
+      size = size == 0 ? 256 : 2 * size;
+      blocks = realloc(file->blocks, size * sizeof(uint64_t));
+      if (blocks == NULL) {
+	perror(file->path);
+	return -1;
+      }
+      file->blocks = blocks;
+    }
+    file->blocks[file->nb_blocks++] = offset;
+  }
+  file->size = offset;
+  return 0;
+}
+
+int rtt_log_map(struct rtt_log_file *file, const char *path)
+{
+  struct stat st;
+  void *map = NULL;
+  int fd;
+  memset(file, 0, sizeof(struct rtt_log_file));
+  file->path = path;
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror(path);
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  if (st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      perror(path);
+      close(fd);
+      return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  file->data = map;
+  file->size = st.st_size;
+  file->map_size = st.st_size;
+  if (file->size >= RTT_LOG_HEADER_SIZE && memcmp(file->data, RTT_LOG_MAGIC, 8) == 0) {
+    uint32_t header[2];
+    memcpy(header, file->data + 8, sizeof(header));
+    if (header[0] != RTT_LOG_VERSION || header[1] != sizeof(struct rtt_record)) {
+      fprintf(stderr, "%s: unsupported RTT log version\n", path);
+      rtt_log_unmap(file);
+      return -1;
+    }
+    file->format = RTT_LOG_BINARY;
+    file->start = RTT_LOG_HEADER_SIZE;
+    /* Ignore a partial last record, e.g. of a client still running */
+    file->size -= (file->size - file->start) % sizeof(struct rtt_record);
+  } else if (file->size >= RTT_LOG_HEADER_SIZE && memcmp(file->data, RTT_LOG_COLUMNAR_MAGIC, 8) == 0) {
+    uint32_t header[2];
+    memcpy(header, file->data + 8, sizeof(header));
+    if (header[0] != RTT_LOG_VERSION || header[1] > RTT_LOG_BLOCK_RECORDS) {
+      fprintf(stderr, "%s: unsupported RTT log version\n", path);
+      rtt_log_unmap(file);
+      return -1;
+    }
+    file->format = RTT_LOG_COLUMNAR;
+    file->start = RTT_LOG_HEADER_SIZE;
+    if (_index_blocks(file) != 0) {
+      rtt_log_unmap(file);
+      return -1;
+    }
+  } else {
+    file->format = RTT_LOG_CSV;
+    file->start = 0;
+  }
+  return 0;
+}
+
+void rtt_log_unmap(struct rtt_log_file *file)
+{
+  if (file->data != NULL)
+    munmap((void *) file->data, file->map_size);
+  file->data = NULL;
+  free(file->blocks);
+  file->blocks = NULL;
+}
+
+size_t rtt_log_align(const struct rtt_log_file *file, size_t offset)
+{
+  const char *newline;
+  if (offset <= file->start)
+    return file->start;
+  if (offset >= file->size)
+    return file->size;
+  if (file->format == RTT_LOG_BINARY) {
+    offset -= (offset - file->start) % sizeof(struct rtt_record);
+    return offset;
+  }
+  if (file->format == RTT_LOG_COLUMNAR) {
+    size_t low = 0, high = file->nb_blocks;
+    while (low < high) {
+      size_t middle = (low + high) / 2;
+      if (file->blocks[middle] < offset)
+	low = middle + 1;
+      else
+	high = middle;
+    }
+    return low < file->nb_blocks ? file->blocks[low] : file->size;
+  }
+  /* A line starts after the previous newline */
+  if (file->data[offset - 1] == '\n')
+    return offset;
+  newline = memchr(file->data + offset, '\n', file->size - offset);
+  return newline == NULL ? file->size : newline - file->data + 1;
+}
+
+/* Parse a decimal number ending at [sep] (or at the end of the line, for
+   the last field).  Empty fields are RTT_NONE.  Returns the position
+   after the separator, or NULL if the field is invalid. */
+static inline const char *_field(const char *p, const char *end, char sep, uint64_t *value)
+{
+  uint64_t v = 0;
+  const char *start = p;
+  while (p < end && *p >= '0' && *p <= '9')
+    v = v * 10 + (*p++ - '0');
+  *value = p == start ? RTT_NONE : v;
+  if (p < end && *p == sep)
+    return p + 1;
+  if (sep == '\n' && (p == end || *p == '\r'))
+    return p;
+  return NULL;
+}
+
+/* Parse one CSV line from [p], ending at [eol].  Returns 0 if it is not
+   a record. */
+static int _parse_csv(const char *p, const char *eol, struct rtt_record *record)
+{
+  uint64_t sec, value;
+  uint64_t nsec = 0, scale = 1000000000;
+  if (eol - p < 2 || (p[0] != RTT_QUERY && p[0] != RTT_ANSWER && p[0] != RTT_TCP_ANSWER) || p[1] != ',')
+    return 0;
+  record->type = p[0];
+  record->unused = 0;
+  p += 2;
+  /* Timestamp, with up to 9 decimals */
+  if ((p = _field(p, eol, '.', &sec)) == NULL || sec == RTT_NONE)
+    return 0;
+  for (; p < eol && *p >= '0' && *p <= '9'; p++) {
+    if (scale > 1) {
+      scale /= 10;
+      nsec += (*p - '0') * scale;
+    }
+  }
+  if (p == eol || *p++ != ',')
+    return 0;
+  record->time_ns = sec * 1000000000 + nsec;
+  if ((p = _field(p, eol, ',', &value)) == NULL || value == RTT_NONE)
+    return 0;
+  record->connection_id = value;
+  if ((p = _field(p, eol, ',', &value)) == NULL || value > UINT16_MAX)
+    return 0;
+  record->query_id = value;
+  if ((p = _field(p, eol, ',', &value)) == NULL)
+    return 0;
+  record->poisson_id = value;
+  /* Poisson interval, unused */
+  if ((p = _field(p, eol, ',', &value)) == NULL)
+    return 0;
+  if (_field(p, eol, '\n', &value) == NULL)
+    return 0;
+  record->rtt_us = value > RTT_NONE ? RTT_NONE : value;
+  return 1;
+}
+
+/* Decode the block [stored] of [file] into [records].  Returns -1 in
+   case of error, reported. */
+static long _decode_block(const struct rtt_log_file *file, const struct rtt_block_header *header,
+			  const unsigned char *stored, struct rtt_record *records)
+{
+  static _Thread_local struct rtt_codec *decoder;
+  unsigned char *raw = NULL;
+  size_t raw_size = 0;
+  long nb;
+  for (int k = 0; k < RTT_LOG_COLUMNS; k++)
+    raw_size += header->column_size[k];
+  if (header->compression == RTT_LOG_ZSTD) {
+#ifdef HAVE_ZSTD
+    raw = malloc(raw_size);
+    if (raw == NULL) {
+      perror(file->path);
+      return -1;
+    }
+    if (ZSTD_decompress(raw, raw_size, stored, header->stored_size) != raw_size) {
+      fprintf(stderr, "%s: corrupted block of %u records\n", file->path, header->nb_records);
+      free(raw);
+      return -1;
+    }
+    stored = raw;
+#else
+    static int zstd_reported;
+    if (!zstd_reported)
+      fprintf(stderr, "%s: compressed with zstd, rebuild with 'make ZSTD=1' to read it\n", file->path);
+    zstd_reported = 1;
+    return -1;
+#endif
+  } else if (header->compression != RTT_LOG_RAW || header->stored_size != raw_size) {
+    fprintf(stderr, "%s: corrupted block of %u records\n", file->path, header->nb_records);
+    return -1;
+  }
+  /* Tables of the decoder, kept for the next blocks of the thread */
+  if (decoder == NULL && (decoder = rtt_codec_new(0)) == NULL) {
+    perror(file->path);
+    free(raw);
+    return -1;
+  }
+  nb = rtt_codec_decode(decoder, header, stored, records);
+  if (nb < 0)
+    fprintf(stderr, "%s: corrupted block of %u records\n", file->path, header->nb_records);
+  free(raw);
+  return nb;
+}
+
+/* Read the next block with records from [*offset] to [end], skipping
+   the blocks that cannot be decoded */
+static size_t _read_blocks(const struct rtt_log_file *file, size_t *offset, size_t end,
+			   struct rtt_record *records, size_t max)
+{
+  struct rtt_block_header header;
+  const unsigned char *stored;
+  long nb;
+  while (*offset + sizeof(header) <= end) {
+    memcpy(&header, file->data + *offset, sizeof(header));
+    if (header.magic != RTT_LOG_BLOCK_MAGIC || header.stored_size > end - *offset - sizeof(header)) {
+      fprintf(stderr, "%s: invalid block at offset %zu\n", file->path, *offset);
+      break;
+    }
+    stored = (const unsigned char *) file->data + *offset + sizeof(header);
+    *offset += sizeof(header) + header.stored_size;
+    if (header.nb_records > max) {
+      fprintf(stderr, "%s: block of %u records, more than %zu\n", file->path, header.nb_records, max);
+      continue;
+    }
+    nb = _decode_block(file, &header, stored, records);
+    if (nb > 0)
+      return nb;
+  }
+  *offset = end;
+  return 0;
+}
+
+size_t rtt_log_read(const struct rtt_log_file *file, size_t *offset, size_t end,
+		    struct rtt_record *records, size_t max)
+{
+  const char *p, *eol, *stop;
+  size_t nb = 0;
+  if (file->format == RTT_LOG_COLUMNAR)
+    return _read_blocks(file, offset, end, records, max);
+  if (file->format == RTT_LOG_BINARY) {
+    nb = (end - *offset) / sizeof(struct rtt_record);
+    if (nb > max)
+      nb = max;
+    memcpy(records, file->data + *offset, nb * sizeof(struct rtt_record));
+    *offset += nb * sizeof(struct rtt_record);
+    return nb;
+  }
+  p = file->data + *offset;
+  stop = file->data + end;
+  while (p < stop && nb < max) {
+    eol = memchr(p, '\n', stop - p);
+    if (eol == NULL)
+      eol = stop;
+    nb += _parse_csv(p, eol, &records[nb]);
+    p = eol < stop ? eol + 1 : stop;
+  }
+  *offset = p - file->data;
+  return nb;
+}
+
+int rtt_log_reader_open(struct rtt_log_reader *reader, const char *path, size_t buf_size)
+{
+  memset(reader, 0, sizeof(struct rtt_log_reader));
+  reader->view.path = path;
+  reader->fd = open(path, O_RDONLY);
+  if (reader->fd == -1) {
+    perror(path);
+    return -1;
+  }
+  reader->limit = UINT64_MAX;
+  reader->buf_size = buf_size < 4096 ? 4096 : buf_size;
+  reader->buf = malloc(reader->buf_size);
+  if (reader->buf == NULL) {
+    perror(path);
+    close(reader->fd);
+    return -1;
+  }
+  reader->view.data = reader->buf;
+  posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  return 0;
+}
+
+/* Keep the records not read yet, and fill the rest of the buffer. */
+static int _refill(struct rtt_log_reader *reader)
+{
+  size_t left = reader->view.size - reader->pos, size;
+  ssize_t ret;
+  memmove(reader->buf, reader->buf + reader->pos, left);
+  reader->view.size = left;
+  reader->pos = 0;
+  while (reader->view.size < reader->buf_size) {
+    size = reader->buf_size - reader->view.size;
+    if (size > reader->limit - reader->offset)
+      size = reader->limit - reader->offset;
+    ret = size == 0 ? 0 : read(reader->fd, reader->buf + reader->view.size, size);
+    if (ret == -1) {
+      perror(reader->view.path);
+      return -1;
+    }
+    if (ret == 0) {
+      reader->eof = 1;
+      break;
+    }
+    reader->view.size += ret;
+    reader->offset += ret;
+  }
+  return 0;
+}
+
+/* Stop reading a columnar log at its index, if any */
+static void _find_index(struct rtt_log_reader *reader)
+{
+  struct rtt_log_trailer trailer;
+  struct stat st;
+  if (fstat(reader->fd, &st) != 0 || (size_t) st.st_size < RTT_LOG_HEADER_SIZE + sizeof(trailer) ||
+      pread(reader->fd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer)) != sizeof(trailer) ||
+      memcmp(trailer.magic, RTT_LOG_INDEX_MAGIC, 8) != 0 || trailer.index_offset < RTT_LOG_HEADER_SIZE ||
+      trailer.index_offset > st.st_size - sizeof(trailer))
+    return;
+  reader->limit = trailer.index_offset;
+  if (reader->offset >= reader->limit) {
+    reader->view.size -= reader->offset - reader->limit;
+    reader->offset = reader->limit;
+    reader->eof = 1;
+  }
+}
+
+/* Make room for a block larger than the buffer */
+static int _grow(struct rtt_log_reader *reader)
+{
+  char *buf = realloc(reader->buf, 2 * reader->buf_size);
+  if (buf == NULL) {
+    perror(reader->view.path);
+    return -1;
+  }
+  reader->buf = buf;
+  reader->buf_size *= 2;
+  reader->view.data = buf;
+  return 0;
+}
+
+/* End of the last complete record (or block) of the buffer */
+static size_t _complete(const struct rtt_log_reader *reader)
+{
+  const struct rtt_log_file *view = &reader->view;
+  const char *p;
+  struct rtt_block_header header;
+  size_t offset;
+  if (view->format == RTT_LOG_BINARY)
+    return view->size - (view->size - reader->pos) % sizeof(struct rtt_record);
+  if (view->format == RTT_LOG_COLUMNAR) {
+    for (offset = reader->pos; offset + sizeof(header) <= view->size; offset += sizeof(header) + header.stored_size) {
+      memcpy(&header, view->data + offset, sizeof(header));
+      /* Reported by rtt_log_read */
+      if (header.magic != RTT_LOG_BLOCK_MAGIC)
+	return view->size;
+      if (header.stored_size > view->size - offset - sizeof(header))
+	break;
+    }
+    return offset;
+  }
+  if (reader->eof)
+    return view->size;
+  for (p = view->data + view->size; p > view->data + reader->pos && p[-1] != '\n'; p--)
+    ;
+  /* A line longer than the whole buffer is not a record, skip it */
+  if (p == view->data + reader->pos)
+    return reader->pos == 0 && view->size == reader->buf_size ? view->size : reader->pos;
+  return p - view->data;
+}
+
+long rtt_log_reader_next(struct rtt_log_reader *reader, struct rtt_record *records, size_t max)
+{
+  uint32_t header[2];
+  size_t nb, end;
+  int first = reader->view.size == 0 && !reader->eof;
+  while (1) {
+    end = _complete(reader);
+    if (reader->pos < end) {
+      nb = rtt_log_read(&reader->view, &reader->pos, end, records, max);
+      if (nb > 0)
+	return nb;
+      continue;
+    }
+    if (reader->eof)
+      return 0;
+    if (reader->view.format == RTT_LOG_COLUMNAR && reader->pos == 0 && reader->view.size == reader->buf_size &&
+	_grow(reader) != 0)
+      return -1;
+    if (_refill(reader) != 0)
+      return -1;
+    if (first) {
+      first = 0;
+      if (reader->view.size >= RTT_LOG_HEADER_SIZE && memcmp(reader->buf, RTT_LOG_MAGIC, 8) == 0) {
+	memcpy(header, reader->buf + 8, sizeof(header));
+	if (header[0] != RTT_LOG_VERSION || header[1] != sizeof(struct rtt_record)) {
+	  fprintf(stderr, "%s: unsupported RTT log version\n", reader->view.path);
+	  return -1;
+	}
+	reader->view.format = RTT_LOG_BINARY;
+	reader->pos = RTT_LOG_HEADER_SIZE;
+      } else if (reader->view.size >= RTT_LOG_HEADER_SIZE && memcmp(reader->buf, RTT_LOG_COLUMNAR_MAGIC, 8) == 0) {
+	memcpy(header, reader->buf + 8, sizeof(header));
+	if (header[0] != RTT_LOG_VERSION || header[1] > RTT_LOG_BLOCK_RECORDS) {
+	  fprintf(stderr, "%s: unsupported RTT log version\n", reader->view.path);
+	  return -1;
+	}
+	reader->view.format = RTT_LOG_COLUMNAR;
+	reader->pos = RTT_LOG_HEADER_SIZE;
+	_find_index(reader);
+      }
+    }
+  }
+}
+
+void rtt_log_reader_close(struct rtt_log_reader *reader)
+{
+  close(reader->fd);
+  free(reader->buf);
+}
+
+int rtt_log_format_csv(char *buf, const struct rtt_record *record)
+{
+  char poisson[16] = "", rtt[16] = "";
+  if (record->type == RTT_QUERY && record->poisson_id != RTT_NONE)
+    snprintf(poisson, sizeof(poisson), "%u", record->poisson_id);
+  if (record->type != RTT_QUERY && record->rtt_us != RTT_NONE)
+    snprintf(rtt, sizeof(rtt), "%u", record->rtt_us);
+  return sprintf(buf, "%c,%lu.%.9lu,%u,%u,%s,,%s\n", record->type,
+		 record->time_ns / 1000000000, record->time_ns % 1000000000,
+		 record->connection_id, record->query_id, poisson, rtt);
+}
@@ -0,0 +1,231 @@
+#ifndef RTTLOG_H
+#define RTTLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* Per-query log of the clients: one record per query sent and per
+   answer received, with -R (CSV lines on stdout) or --rtt-log (binary
+   records in a file).
+
+   CSV format, one record per line (a header line and any other line are
+   ignored by the readers):
+
+     type,timestamp,connection_id,query_id,poisson_id,poisson_interval_us,rtt_us
+
+   where type is Q (query), A (answer) or T (answer over the TCP
+   fallback of udpclient, to a query already answered with TC), and the
+   timestamp is CLOCK_REALTIME in seconds, with 9 decimals.
+
+   Binary format: a header of 16 bytes, magic "TSRTTLG1", version and
+   record size (uint32), followed by struct rtt_record, all in host byte
+   order.  Records are 24 bytes instead of about 60 for CSV, and cost
+   no formatting in the client.
+
+   Columnar format (--rtt-log-format columnar): a header of 16 bytes,
+   magic "TSRTTLC1", version and records per block (uint32), followed by
+   independent blocks of up to RTT_LOG_BLOCK_RECORDS records, each a
+   struct rtt_block_header and its columns (see rttcodec.h), and by an
+   index of the blocks (struct rtt_block_index, then struct
+   rtt_log_trailer) written when the log is closed.  A log without
+   index, e.g. of a client that crashed, is read by walking the block
+   headers.  Blocks are encoded by a thread of the client, and also
+   compressed with zstd when built with ZSTD=1 and it makes them smaller
+   (compression in the block header).  Readers decode the blocks
+   independently, e.g. in parallel. */
+
+#define RTT_LOG_MAGIC "TSRTTLG1"
+#define RTT_LOG_COLUMNAR_MAGIC "TSRTTLC1"
+#define RTT_LOG_INDEX_MAGIC "TSRTTLCI"
+#define RTT_LOG_BLOCK_MAGIC 0x4b4c4252
+#define RTT_LOG_VERSION 1
+#define RTT_LOG_HEADER_SIZE 16
+
+/* Size of the write buffer of the binary log */
+#define RTT_LOG_BUFFER_SIZE (256 * 1024)
+
+/* Records per block of the columnar log */
+#define RTT_LOG_BLOCK_RECORDS 32768
+
+/* Blocks of the columnar log buffered for its thread */
+#define RTT_LOG_SLOTS 4
+
+/* zstd level of the columnar log */
+#define RTT_LOG_ZSTD_LEVEL 3
+
+/* Poisson ID of queries not sent by a Poisson process, and RTT of
+   queries and of late answers (whose query slot was reused) */
+#define RTT_NONE UINT32_MAX
+
+enum rtt_record_type {
+  RTT_QUERY = 'Q',
+  RTT_ANSWER = 'A',
+  RTT_TCP_ANSWER = 'T',
+};
+
+struct rtt_record {
+  /* CLOCK_REALTIME, in nanoseconds */
+  uint64_t time_ns;
+  uint32_t connection_id;
+  uint16_t query_id;
+  /* enum rtt_record_type */
+  uint8_t type;
+  uint8_t unused;
+  /* Answers only, in microseconds */
+  uint32_t rtt_us;
+  /* Queries only */
+  uint32_t poisson_id;
+};
+
+enum rtt_log_format {
+  RTT_LOG_CSV,
+  RTT_LOG_BINARY,
+  RTT_LOG_COLUMNAR,
+};
+
+enum rtt_log_compression {
+  RTT_LOG_RAW,
+  RTT_LOG_ZSTD,
+};
+
+#define RTT_LOG_COLUMNS 9
+
+struct rtt_block_header {
+  uint32_t magic;
+  uint32_t nb_records;
+  uint64_t first_time_ns;
+  /* enum rtt_log_compression */
+  uint32_t compression;
+  /* Size of the block after this header */
+  uint32_t stored_size;
+  uint32_t conn_base;
+  uint32_t poisson_base;
+  /* Widths of the fixed-size columns, and parameters of the Rice codes */
+  uint8_t conn_bits;
+  uint8_t poisson_bits;
+  uint8_t time_k;
+  uint8_t query_id_k;
+  uint8_t match_k;
+  uint8_t delay_k;
+  uint8_t rtt_k;
+  uint8_t unused;
+  /* Size of each column, before compression */
+  uint32_t column_size[RTT_LOG_COLUMNS];
+  uint32_t reserved;
+};
+
+struct rtt_block_index {
+  uint64_t offset;
+  uint64_t first_time_ns;
+  uint32_t nb_records;
+  uint32_t unused;
+};
+
+struct rtt_log_trailer {
+  uint64_t index_offset;
+  uint64_t nb_blocks;
+  char magic[8];
+};
+
+struct rtt_log_encoder;
+
+struct rtt_log_writer {
+  int fd;
+  int failed;
+  enum rtt_log_format format;
+  /* Records buffered, in a block of the columnar log */
+  size_t used;
+  size_t size;
+  unsigned char *buf;
+  /* Thread encoding the columnar log */
+  struct rtt_log_encoder *encoder;
+};
+
+/* Create the log [path] (RTT_LOG_BINARY or RTT_LOG_COLUMNAR) and write
+   its header.  Returns NULL in case of error. */
+struct rtt_log_writer *rtt_log_create(const char *path, enum rtt_log_format format);
+
+/* Write the buffered records, or pass them to the encoding thread.
+   Returns -1 in case of error, reported once. */
+int rtt_log_flush(struct rtt_log_writer *writer);
+
+/* Flush and close the log. */
+void rtt_log_close(struct rtt_log_writer *writer);
+
+static inline void rtt_log_append(struct rtt_log_writer *writer, const struct rtt_record *record)
+{
+  if (writer->used + sizeof(struct rtt_record) > writer->size)
+    rtt_log_flush(writer);
+  memcpy(writer->buf + writer->used, record, sizeof(struct rtt_record));
+  writer->used += sizeof(struct rtt_record);
+}
+
+/* Log format named [name] ("binary" or "columnar"), or -1. */
+int rtt_log_parse_format(const char *name);
+
+/* Log mapped in memory for reading. */
+struct rtt_log_file {
+  const char *path;
+  enum rtt_log_format format;
+  const char *data;
+  /* End of the records */
+  size_t size;
+  size_t map_size;
+  /* Offset of the first record */
+  size_t start;
+  /* Offsets of the blocks of a columnar log */
+  uint64_t *blocks;
+  size_t nb_blocks;
+};
+
+/* Map the log [path] (CSV, binary or columnar, detected from its
+   content).  Returns -1 in case of error. */
+int rtt_log_map(struct rtt_log_file *file, const char *path);
+
+void rtt_log_unmap(struct rtt_log_file *file);
+
+/* First offset at or after [offset] where a record starts (a line in
+   CSV, a block in columnar logs), to split a log in chunks that can be
+   read in parallel. */
+size_t rtt_log_align(const struct rtt_log_file *file, size_t offset);
+
+/* Read up to [max] records from [*offset] to [end] (aligned offsets),
+   and advance [*offset] past them.  Lines that are not records are
+   skipped.  Columnar logs are read a block at a time: [max] must be at
+   least RTT_LOG_BLOCK_RECORDS.  Returns the number of records read, 0
+   at [end]. */
+size_t rtt_log_read(const struct rtt_log_file *file, size_t *offset, size_t end,
+		    struct rtt_record *records, size_t max);
+
+/* Log read sequentially through a buffer, e.g. to merge many logs
+   without mapping them all. */
+struct rtt_log_reader {
+  int fd;
+  int eof;
+  /* Bytes read from the log, and where its records end */
+  uint64_t offset;
+  uint64_t limit;
+  char *buf;
+  size_t buf_size;
+  /* The buffered part of the log, and the next record in it */
+  struct rtt_log_file view;
+  size_t pos;
+};
+
+/* Open the log [path] (CSV, binary or columnar), to read it [buf_size]
+   bytes at a time (or a whole block, if larger).  Returns -1 in case of
+   error. */
+int rtt_log_reader_open(struct rtt_log_reader *reader, const char *path, size_t buf_size);
+
+/* Read up to [max] records.  Returns the number of records read, 0 at
+   the end of the log, or -1 in case of error. */
+long rtt_log_reader_next(struct rtt_log_reader *reader, struct rtt_record *records, size_t max);
+
+void rtt_log_reader_close(struct rtt_log_reader *reader);
+
+/* Write [record] as a CSV line into [buf] (at least 96 bytes).  Returns
+   the length of the line. */
+int rtt_log_format_csv(char *buf, const struct rtt_record *record);
+
+#endif
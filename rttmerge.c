@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "rttlog.h"
+
+/* Merges the per-query logs of several clients (-R or --rtt-log, see
+   rttlog.h) into a single log ordered by timestamp, e.g. to see the
+   load that the server actually received from a fleet of clients.
+
+   Each log is read sequentially through its own buffer, and the logs
+   are merged with a binary heap keyed by the timestamp of their next
+   record, so that memory only depends on the number of logs.  Logs are
+   expected to be ordered by time, as written by the clients: the merge
+   does not reorder records within a log.
+
+   Connection IDs are rewritten into a global namespace: the connection
+   of client i (the i-th log, from 0) becomes i << conn_bits | id. */
+
+/* Default size of the read buffer of each log */
+#define RTTMERGE_BUFFER_SIZE (1 << 20)
+
+/* Records decoded at once from each log, at least a block of a
+   columnar log */
+#define RTTMERGE_BATCH RTT_LOG_BLOCK_RECORDS
+
+/* Default number of bits of connection IDs in the global IDs */
+#define RTTMERGE_CONN_BITS 20
+
+/* Size of the output buffer, for CSV */
+#define RTTMERGE_OUTPUT_SIZE (1 << 20)
+
+struct input {
+  struct rtt_log_reader reader;
+  struct rtt_record *records;
+  size_t nb;
+  size_t next;
+  uint32_t client_id;
+  uint64_t merged;
+};
+
+static struct input *inputs;
+static unsigned int conn_bits = RTTMERGE_CONN_BITS;
+
+/* Decode the next records of [input].  Returns 0 at its end, -1 in case
+   of error. */
+static int input_fill(struct input *input)
+{
+  long nb = rtt_log_reader_next(&input->reader, input->records, RTTMERGE_BATCH);
+  if (nb < 0)
+    return -1;
+  input->nb = nb;
+  input->next = 0;
+  return nb > 0 ? 1 : 0;
+}
+
+/* Order of the heap: timestamp, then log, for a stable merge */
+static inline int _before(const struct input *a, const struct input *b)
+{
+  uint64_t ta = a->records[a->next].time_ns, tb = b->records[b->next].time_ns;
+  return ta < tb || (ta == tb && a->client_id < b->client_id);
+}
+
+static void sift_down(struct input **heap, unsigned int size, unsigned int i)
+{
+  struct input *top = heap[i];
+  unsigned int child;
+  while ((child = 2 * i + 1) < size) {
+    if (child + 1 < size && _before(heap[child + 1], heap[child]))
+      child++;
+    if (!_before(heap[child], top))
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = top;
+}
+
+void usage(char *progname)
+{
+  fprintf(stderr, "usage: %s [-h] [-b] [-C] [-o output] [-B buffer_kb] [-n conn_bits] <log>...\n", progname);
+  fprintf(stderr, "Merges per-query logs written by tcpclient or udpclient with -R (CSV) or --rtt-log into\n");
+  fprintf(stderr, "a single log ordered by timestamp, written as CSV on stdout, or to the given file with '-o'.\n");
+  fprintf(stderr, "Connection IDs become global: connection c of the i-th log (from 0) becomes (i << conn_bits) | c,\n");
+  fprintf(stderr, "with '-n' bits (default %d).  Option '-b' writes a binary log (see rttlog.h), and '-C' a columnar one;\n", RTTMERGE_CONN_BITS);
+  fprintf(stderr, "both need '-o'.\n");
+  fprintf(stderr, "Each log is read through a buffer of '-B' KiB (default %d).\n", RTTMERGE_BUFFER_SIZE / 1024);
+}
+
+int main(int argc, char **argv)
+{
+  struct input **heap, *top;
+  struct rtt_log_writer *writer = NULL;
+  struct rtt_record record;
+  FILE *out = stdout;
+  const char *output = NULL;
+  char *line, *outbuf;
+  size_t buffer_size = RTTMERGE_BUFFER_SIZE;
+  unsigned int nb_inputs, size = 0;
+  uint64_t total = 0, first_ns = 0, last_ns = 0, unordered = 0;
+  int format = RTT_LOG_CSV;
+  int opt, ret;
+
+  while ((opt = getopt(argc, argv, "hbCo:B:n:")) != -1) {
+    switch (opt) {
+    case 'b':
+      format = RTT_LOG_BINARY;
+      break;
+    case 'C':
+      format = RTT_LOG_COLUMNAR;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'B':
+      buffer_size = strtoul(optarg, NULL, 10) * 1024;
+      break;
+    case 'n':
+      conn_bits = strtoul(optarg, NULL, 10);
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc || conn_bits == 0 || conn_bits >= 32 || (format != RTT_LOG_CSV && output == NULL)) {
+    usage(argv[0]);
+    return 1;
+  }
+  nb_inputs = argc - optind;
+  if (nb_inputs > (1ULL << (32 - conn_bits))) {
+    fprintf(stderr, "Error: at most %llu logs with %u bits of connection IDs\n", 1ULL << (32 - conn_bits), conn_bits);
+    return 1;
+  }
+  inputs = calloc(nb_inputs, sizeof(struct input));
+  heap = calloc(nb_inputs, sizeof(struct input *));
+  line = malloc(128);
+  outbuf = malloc(RTTMERGE_OUTPUT_SIZE);
+  if (inputs == NULL || heap == NULL || line == NULL || outbuf == NULL) {
+    perror("Failed to allocate buffers");
+    return 1;
+  }
+  for (unsigned int i = 0; i < nb_inputs; i++) {
+    inputs[i].client_id = i;
+    inputs[i].records = malloc(RTTMERGE_BATCH * sizeof(struct rtt_record));
+    if (inputs[i].records == NULL || rtt_log_reader_open(&inputs[i].reader, argv[optind + i], buffer_size) != 0)
+      return 1;
+    ret = input_fill(&inputs[i]);
+    if (ret < 0)
+      return 1;
+    if (ret > 0)
+      heap[size++] = &inputs[i];
+  }
+  for (int i = size / 2 - 1; i >= 0; i--)
+    sift_down(heap, size, i);
+
+  if (format != RTT_LOG_CSV) {
+    writer = rtt_log_create(output, format);
+    if (writer == NULL)
+      return 1;
+  } else {
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+      perror(output);
+      return 1;
+    }
+    setvbuf(out, outbuf, _IOFBF, RTTMERGE_OUTPUT_SIZE);
+    fprintf(out, "type,timestamp,connection_id,query_id,poisson_id,poisson_interval_us,rtt_us\n");
+  }
+
+  while (size > 0) {
+    top = heap[0];
+    record = top->records[top->next];
+    if (record.connection_id >> conn_bits != 0) {
+      fprintf(stderr, "Error: connection ID %u of %s does not fit in %u bits\n",
+	      record.connection_id, top->reader.view.path, conn_bits);
+      return 1;
+    }
+    record.connection_id |= top->client_id << conn_bits;
+    if (record.time_ns < last_ns)
+      unordered++;
+    else
+      last_ns = record.time_ns;
+    if (total++ == 0)
+      first_ns = record.time_ns;
+    top->merged++;
+    if (writer != NULL)
+      rtt_log_append(writer, &record);
+    else
+      fwrite(line, rtt_log_format_csv(line, &record), 1, out);
+    /* Next record of the same log */
+    if (++top->next == top->nb) {
+      ret = input_fill(top);
+      if (ret < 0)
+	return 1;
+      if (ret == 0)
+	heap[0] = heap[--size];
+    }
+    if (size > 0)
+      sift_down(heap, size, 0);
+  }
+
+  if (writer != NULL) {
+    ret = rtt_log_flush(writer) != 0;
+    rtt_log_close(writer);
+  } else {
+    ret = fflush(out) != 0 || ferror(out);
+    if (ret)
+      perror("Failed to write merged log");
+    if (out != stdout)
+      fclose(out);
+  }
+  for (unsigned int i = 0; i < nb_inputs; i++) {
+    fprintf(stderr, "Client %u: %s, %lu records\n", i, inputs[i].reader.view.path, inputs[i].merged);
+    rtt_log_reader_close(&inputs[i].reader);
+  }
+  fprintf(stderr, "Merged %lu records of %u logs over %.3f s", total, nb_inputs, (last_ns - first_ns) / 1e9);
+  if (unordered > 0)
+    fprintf(stderr, ", %lu of them earlier than a previous record (unordered logs)", unordered);
+  fprintf(stderr, "\n");
+  return ret ? 1 : 0;
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rttsample.h"
+
+int rtt_sampler_parse(struct rtt_sampler *sampler, const char *spec)
+{
+  char *end;
+  unsigned long value, interval_ms = RTT_SAMPLE_INTERVAL_MSEC;
+  memset(sampler, 0, sizeof(struct rtt_sampler));
+  if (strncmp(spec, "hash:", 5) == 0) {
+    value = strtoul(spec + 5, &end, 10);
+    if (end == spec + 5 || *end != '\0' || value == 0 || value > UINT32_MAX)
+      goto invalid;
+    sampler->mode = RTT_SAMPLE_HASH;
+    sampler->modulo = value;
+    return 0;
+  }
+  if (strncmp(spec, "reservoir:", 10) == 0) {
+    value = strtoul(spec + 10, &end, 10);
+    if (end == spec + 10 || value == 0 || value > (1 << 24))
+      goto invalid;
+    if (*end == ':') {
+      const char *p = end + 1;
+      interval_ms = strtoul(p, &end, 10);
+      if (end == p || interval_ms == 0)
+	goto invalid;
+    }
+    if (*end != '\0')
+      goto invalid;
+    sampler->mode = RTT_SAMPLE_RESERVOIR;
+    sampler->capacity = value;
+    sampler->interval_ns = interval_ms * 1000000ULL;
+    return 0;
+  }
+ invalid:
+  fprintf(stderr, "Error: invalid RTT sampling '%s', expected 'hash:<N>' or 'reservoir:<K>[:<interval_ms>]'\n", spec);
+  return -1;
+}
+
+int rtt_sampler_start(struct rtt_sampler *sampler, uint64_t seed)
+{
+  rng_seed(&sampler->rng, seed);
+  if (sampler->mode != RTT_SAMPLE_RESERVOIR)
+    return 0;
+  sampler->samples = malloc(sampler->capacity * sizeof(struct rtt_record));
+  if (sampler->samples == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  return 0;
+}
+
+/* Number of answers to skip before the next one to keep, with the
+   current weight */
+static uint64_t _skip(struct rtt_sampler *sampler)
+{
+  double u = 1. - rng_double(&sampler->rng);
+  double skip = floor(log(u) / log1p(-sampler->weight));
+  /* The weight may underflow after many answers in a long interval */
+  return skip < 1e18 ? skip : 1e18;
+}
+
+static void _update_weight(struct rtt_sampler *sampler)
+{
+  double u = 1. - rng_double(&sampler->rng);
+  sampler->weight *= exp(log(u) / sampler->capacity);
+}
+
+static int _compare_time(const void *a, const void *b)
+{
+  const struct rtt_record *ra = a, *rb = b;
+  return (ra->time_ns > rb->time_ns) - (ra->time_ns < rb->time_ns);
+}
+
+void rtt_sampler_flush(struct rtt_sampler *sampler, void (*emit)(const struct rtt_record *record))
+{
+  uint32_t i;
+  qsort(sampler->samples, sampler->nb_samples, sizeof(struct rtt_record), _compare_time);
+  for (i = 0; i < sampler->nb_samples; i++)
+    emit(&sampler->samples[i]);
+  sampler->total_kept += sampler->nb_samples;
+  sampler->nb_samples = 0;
+  sampler->nb_seen = 0;
+}
+
+void rtt_sampler_offer(struct rtt_sampler *sampler, const struct rtt_record *record,
+		       void (*emit)(const struct rtt_record *record))
+{
+  if (record->time_ns >= sampler->interval_end_ns) {
+    rtt_sampler_flush(sampler, emit);
+    sampler->interval_end_ns = (record->time_ns / sampler->interval_ns + 1) * sampler->interval_ns;
+  }
+  sampler->total_seen++;
+  if (sampler->nb_seen < sampler->capacity) {
+    sampler->samples[sampler->nb_samples++] = *record;
+    if (++sampler->nb_seen == sampler->capacity) {
+      sampler->weight = 1.;
+      _update_weight(sampler);
+      sampler->next_index = sampler->nb_seen + _skip(sampler);
+    }
+    return;
+  }
+  if (sampler->nb_seen++ != sampler->next_index)
+    return;
+  sampler->samples[rng_below(&sampler->rng, sampler->capacity)] = *record;
+  _update_weight(sampler);
+  sampler->next_index += _skip(sampler) + 1;
+}
+
+void rtt_sampler_free(struct rtt_sampler *sampler)
+{
+  free(sampler->samples);
+  sampler->samples = NULL;
+}
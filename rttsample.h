@@ -0,0 +1,90 @@
+#ifndef RTTSAMPLE_H
+#define RTTSAMPLE_H
+
+#include <stdint.h>
+
+#include "rng.h"
+#include "rttlog.h"
+
+/* Sampling of the per-query log (--rtt-sample).
+
+   With "hash:N", a query and its answers are logged if a hash of their
+   connection ID and query ID is 0 modulo N, so that about 1 query in N
+   is logged, always with its answers, and the same queries are sampled
+   from one run to the next.
+
+   With "reservoir:K[:interval_ms]", up to K answers are drawn uniformly
+   among those received in each interval of the realtime clock, and
+   logged, in order, at the end of the interval.  Queries are not kept:
+   the client logs each sampled answer after a query rebuilt from its
+   timestamp and RTT.
+   Answers are skipped in batches (Li's Algorithm L), so that the cost of
+   sampling is proportional to the number of samples, not to the rate.
+
+   Histograms and statistics are never sampled. */
+
+/* Default interval of the reservoir sampling */
+#define RTT_SAMPLE_INTERVAL_MSEC 1000
+
+enum rtt_sample_mode {
+  RTT_SAMPLE_ALL,
+  RTT_SAMPLE_HASH,
+  RTT_SAMPLE_RESERVOIR,
+};
+
+struct rtt_sampler {
+  enum rtt_sample_mode mode;
+  /* 1 in [modulo] queries (hash) */
+  uint32_t modulo;
+  /* Answers of the current interval (reservoir), of which [nb_samples]
+     are kept in [samples] */
+  struct rtt_record *samples;
+  uint32_t capacity;
+  uint32_t nb_samples;
+  uint64_t interval_ns;
+  uint64_t interval_end_ns;
+  uint64_t nb_seen;
+  /* Index of the next answer to keep once the reservoir is full, and
+     the current weight of Algorithm L */
+  uint64_t next_index;
+  double weight;
+  struct rng rng;
+  /* Total number of answers offered and kept */
+  uint64_t total_seen;
+  uint64_t total_kept;
+};
+
+/* Parse [spec] ("hash:N" or "reservoir:K[:interval_ms]").  Returns -1 if
+   it is invalid. */
+int rtt_sampler_parse(struct rtt_sampler *sampler, const char *spec);
+
+/* Allocate the reservoir and seed its generator.  Returns -1 in case of
+   error. */
+int rtt_sampler_start(struct rtt_sampler *sampler, uint64_t seed);
+
+/* Whether the query [query_id] of connection [conn_id] and its answers
+   should be logged.  Always false with reservoir sampling. */
+static inline int rtt_sampler_keep(const struct rtt_sampler *sampler, uint32_t conn_id, uint16_t query_id)
+{
+  switch (sampler->mode) {
+  case RTT_SAMPLE_HASH:
+    return rng_mix64(((uint64_t) conn_id << 16) | query_id) % sampler->modulo == 0;
+  case RTT_SAMPLE_RESERVOIR:
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+/* Offer an answer to the reservoir.  If it ends the current interval,
+   the samples of that interval are first passed to [emit], sorted by
+   time. */
+void rtt_sampler_offer(struct rtt_sampler *sampler, const struct rtt_record *record,
+		       void (*emit)(const struct rtt_record *record));
+
+/* Pass the samples of the current interval to [emit] */
+void rtt_sampler_flush(struct rtt_sampler *sampler, void (*emit)(const struct rtt_record *record));
+
+void rtt_sampler_free(struct rtt_sampler *sampler);
+
+#endif
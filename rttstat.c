@@ -0,0 +1,749 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "rttlog.h"
+#include "histogram.h"
+
+/* Analyzer of the per-query logs of the clients (-R or --rtt-log, see
+   rttlog.h): joins each answer with its query by (connection ID, query
+   ID), and computes losses, latency percentiles per time window and
+   statistics per connection.
+
+   The log is mapped in memory and processed in rounds, so that memory
+   does not grow with its size.  In each round, every thread parses its
+   own chunk of the log and sorts the records by connection into one
+   bucket per thread; then every thread joins the records of its
+   connections, from all buckets in log order, with its own hash table.
+   Threads thus never share a table, and the log is read once.
+
+   Each thread only keeps the windows that its records touched during
+   the round; they are merged into a single array after the round.  A
+   window is printed, and freed, once the log has gone past it and all
+   its queries are answered or lost.  Queries without an answer for
+   longer than the timeout ('-t') are lost, so that memory follows the
+   timeout rather than the duration of the log. */
+
+/* Default width of the time windows */
+#define RTTSTAT_WINDOW_MSEC 1000
+
+/* Default time after which a query without answer is lost */
+#define RTTSTAT_TIMEOUT_MSEC 10000
+
+/* Bytes of log parsed by each thread in a round */
+#define RTTSTAT_CHUNK_SIZE (32 << 20)
+
+/* Records parsed at once, at least a block of a columnar log */
+#define RTTSTAT_BATCH RTT_LOG_BLOCK_RECORDS
+
+/* Maximum number of windows, to fail early on logs spanning a much
+   longer time than expected (e.g. merged logs of unrelated runs) */
+#define RTTSTAT_MAX_WINDOWS (1 << 18)
+
+/* Initial size of the join tables (power of two) */
+#define RTTSTAT_TABLE_SIZE 4096
+
+/* Query waiting for its answer.  Keys are offset by one, so that 0 marks
+   empty entries. */
+struct join_entry {
+  uint64_t key;
+  uint64_t time_ns;
+  uint32_t window;
+  /* Index of the connection in the partition */
+  uint32_t conn;
+};
+
+/* Open addressing hash table with linear probing, for the queries
+   waiting for their answer, and for the index of connections */
+struct join_table {
+  struct join_entry *entries;
+  size_t mask;
+  size_t used;
+};
+
+struct window {
+  uint64_t queries;
+  uint64_t answers;
+  uint64_t lost;
+  struct histogram latency;
+};
+
+struct conn_stats {
+  uint32_t connection_id;
+  uint64_t queries;
+  uint64_t answers;
+  uint64_t lost;
+  uint64_t rtt_sum;
+  uint32_t rtt_max;
+};
+
+struct bucket {
+  struct rtt_record *records;
+  size_t nb;
+  size_t size;
+};
+
+struct worker {
+  pthread_t thread;
+  unsigned int id;
+  /* Chunk of the log of the current round */
+  size_t begin;
+  size_t end;
+  /* Records of the chunk, by partition */
+  struct bucket *buckets;
+  /* Partition: the connections with id % nb_threads == id */
+  struct join_table table;
+  /* Windows [windows_first, windows_first + nb_windows) touched during
+     the round, merged and cleared after it */
+  struct window *windows;
+  uint32_t windows_first;
+  size_t nb_windows;
+  size_t windows_size;
+  /* Connections of the partition, in order of appearance, and their
+     index by connection ID.  IDs can be sparse, e.g. after rttmerge. */
+  struct conn_stats *conns;
+  size_t nb_conns;
+  size_t conns_size;
+  struct join_table conn_index;
+  uint64_t records;
+  uint64_t unmatched;
+  uint64_t tcp_answers;
+  /* Queries logged in a window that was already printed */
+  uint64_t out_of_order;
+  /* Latest timestamp parsed */
+  uint64_t last_ns;
+  int failed;
+  /* A record is more than RTTSTAT_MAX_WINDOWS after the first one */
+  int too_long;
+};
+
+static struct rtt_log_file log_file;
+static unsigned int nb_threads;
+static uint64_t window_ns = RTTSTAT_WINDOW_MSEC * 1000000ULL;
+static uint64_t timeout_ns = RTTSTAT_TIMEOUT_MSEC * 1000000ULL;
+static uint64_t first_ns;
+/* Windows not printed yet, from index windows_printed on, merged from
+   the workers after each round */
+static struct window *windows;
+static uint32_t windows_printed;
+static size_t nb_windows;
+static size_t windows_size;
+static struct worker *workers;
+static pthread_barrier_t round_start, round_parsed, round_joined;
+static volatile int finished;
+
+static inline uint64_t _hash(uint64_t key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+static int table_init(struct join_table *table, size_t size)
+{
+  table->entries = calloc(size, sizeof(struct join_entry));
+  table->mask = size - 1;
+  table->used = 0;
+  return table->entries == NULL ? -1 : 0;
+}
+
+/* Slot of [key], or the empty slot where it would be inserted */
+static inline size_t table_find(const struct join_table *table, uint64_t key)
+{
+  size_t i = _hash(key) & table->mask;
+  while (table->entries[i].key != 0 && table->entries[i].key != key)
+    i = (i + 1) & table->mask;
+  return i;
+}
+
+static int table_grow(struct join_table *table)
+{
+  struct join_table bigger;
+  if (table_init(&bigger, 2 * (table->mask + 1)) != 0)
+    return -1;
+  for (size_t i = 0; i <= table->mask; i++) {
+    if (table->entries[i].key != 0)
+      bigger.entries[table_find(&bigger, table->entries[i].key)] = table->entries[i];
+  }
+  bigger.used = table->used;
+  free(table->entries);
+  *table = bigger;
+  return 0;
+}
+
+/* Remove the entry at [i], shifting back the following entries of the
+   same cluster, so that lookups need no tombstones. */
+static inline void table_remove(struct join_table *table, size_t i)
+{
+  size_t j = i, home;
+  table->used--;
+  while (1) {
+    j = (j + 1) & table->mask;
+    if (table->entries[j].key == 0)
+      break;
+    home = _hash(table->entries[j].key) & table->mask;
+    /* Move the entry back if its home slot is not in (i, j] */
+    if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+      table->entries[i] = table->entries[j];
+      i = j;
+    }
+  }
+  table->entries[i].key = 0;
+}
+
+/* Extend the range of [nb] windows from [*first] in [*array] to
+   [index], growing it downwards if needed.  Returns NULL if out of
+   memory. */
+static struct window *window_range_get(struct window **array, uint32_t *first, size_t *nb, size_t *size,
+				       uint32_t index)
+{
+  size_t needed, shift = 0, new_size;
+  struct window *resized;
+  if (*nb == 0)
+    *first = index;
+  if (index < *first)
+    shift = *first - index;
+  needed = index >= *first ? (index - *first + 1 > *nb ? index - *first + 1 : *nb) : *nb + shift;
+  if (needed > *size) {
+    new_size = *size == 0 ? 64 : *size;
+    while (new_size < needed)
+      new_size *= 2;
+    resized = realloc(*array, new_size * sizeof(struct window));
+    if (resized == NULL)
+      return NULL;
+    *array = resized;
+    *size = new_size;
+  }
+  if (shift > 0) {
+    memmove(*array + shift, *array, *nb * sizeof(struct window));
+    memset(*array, 0, shift * sizeof(struct window));
+    *first = index;
+  } else if (needed > *nb)
+    memset(*array + *nb, 0, (needed - *nb) * sizeof(struct window));
+  *nb = needed;
+  return &(*array)[index - *first];
+}
+
+static inline struct window *get_window(struct worker *w, uint32_t index)
+{
+  if (w->nb_windows > 0 && index >= w->windows_first && index - w->windows_first < w->nb_windows)
+    return &w->windows[index - w->windows_first];
+  return window_range_get(&w->windows, &w->windows_first, &w->nb_windows, &w->windows_size, index);
+}
+
+/* Queries of [window] still waiting for their answer */
+static inline uint64_t window_pending(const struct window *window)
+{
+  return window->queries - window->answers - window->lost;
+}
+
+static inline struct conn_stats *get_conn(struct worker *w, uint32_t conn_id, uint32_t *index)
+{
+  uint64_t key = (uint64_t) conn_id + 1;
+  struct join_entry *entry = &w->conn_index.entries[table_find(&w->conn_index, key)];
+  struct conn_stats *conns;
+  if (entry->key == key) {
+    *index = entry->conn;
+    return &w->conns[entry->conn];
+  }
+  if (w->nb_conns == w->conns_size) {
+    w->conns_size = w->conns_size == 0 ? 64 : 2 * w->conns_size;
+    conns = realloc(w->conns, w->conns_size * sizeof(struct conn_stats));
+    if (conns == NULL)
+      return NULL;
+    w->conns = conns;
+  }
+  entry->key = key;
+  entry->conn = w->nb_conns;
+  w->conn_index.used++;
+  if (2 * w->conn_index.used > w->conn_index.mask && table_grow(&w->conn_index) != 0)
+    return NULL;
+  *index = w->nb_conns;
+  memset(&w->conns[w->nb_conns], 0, sizeof(struct conn_stats));
+  w->conns[w->nb_conns].connection_id = conn_id;
+  return &w->conns[w->nb_conns++];
+}
+
+/* Account for a query that never got its answer */
+static inline int count_lost(struct worker *w, const struct join_entry *entry)
+{
+  struct window *window = get_window(w, entry->window);
+  if (window == NULL)
+    return -1;
+  window->lost++;
+  w->conns[entry->conn].lost++;
+  return 0;
+}
+
+static int join_record(struct worker *w, const struct rtt_record *record)
+{
+  uint64_t key = ((uint64_t) record->connection_id << 16 | record->query_id) + 1;
+  struct join_entry *entry;
+  struct window *window;
+  struct conn_stats *conn;
+  uint32_t index, conn_index;
+  uint64_t rtt_us;
+  size_t i;
+  if (record->type == RTT_TCP_ANSWER) {
+    w->tcp_answers++;
+    return 0;
+  }
+  conn = get_conn(w, record->connection_id, &conn_index);
+  if (conn == NULL)
+    return -1;
+  if (record->type == RTT_QUERY) {
+    index = record->time_ns > first_ns ? (record->time_ns - first_ns) / window_ns : 0;
+    if (index >= RTTSTAT_MAX_WINDOWS) {
+      w->too_long = 1;
+      return -1;
+    }
+    if (index < windows_printed) {
+      w->out_of_order++;
+      index = windows_printed;
+    }
+    if ((window = get_window(w, index)) == NULL)
+      return -1;
+    window->queries++;
+    conn->queries++;
+    i = table_find(&w->table, key);
+    entry = &w->table.entries[i];
+    if (entry->key == key) {
+      /* The query ID wrapped around: the previous query was lost */
+      if (count_lost(w, entry) != 0)
+	return -1;
+    } else {
+      entry->key = key;
+      w->table.used++;
+    }
+    entry->time_ns = record->time_ns;
+    entry->window = index;
+    entry->conn = conn_index;
+    if (2 * w->table.used > w->table.mask)
+      return table_grow(&w->table);
+    return 0;
+  }
+  i = table_find(&w->table, key);
+  entry = &w->table.entries[i];
+  if (entry->key != key) {
+    w->unmatched++;
+    return 0;
+  }
+  /* Whether the query has already been expired depends on the rounds:
+     check its age again */
+  if (timeout_ns > 0 && record->time_ns > entry->time_ns + timeout_ns) {
+    if (count_lost(w, entry) != 0)
+      return -1;
+    table_remove(&w->table, i);
+    w->unmatched++;
+    return 0;
+  }
+  /* The RTT measured by the client on the monotonic clock is more
+     accurate than the difference of the logged timestamps */
+  if (record->rtt_us != RTT_NONE)
+    rtt_us = record->rtt_us;
+  else
+    rtt_us = record->time_ns > entry->time_ns ? (record->time_ns - entry->time_ns) / 1000 : 0;
+  if ((window = get_window(w, entry->window)) == NULL)
+    return -1;
+  window->answers++;
+  histogram_record(&window->latency, rtt_us);
+  conn->answers++;
+  conn->rtt_sum += rtt_us;
+  if (rtt_us > conn->rtt_max)
+    conn->rtt_max = rtt_us;
+  table_remove(&w->table, i);
+  return 0;
+}
+
+static inline int bucket_push(struct bucket *bucket, const struct rtt_record *record)
+{
+  struct rtt_record *records;
+  if (bucket->nb == bucket->size) {
+    bucket->size = bucket->size == 0 ? RTTSTAT_BATCH : 2 * bucket->size;
+    records = realloc(bucket->records, bucket->size * sizeof(struct rtt_record));
+    if (records == NULL)
+      return -1;
+    bucket->records = records;
+  }
+  bucket->records[bucket->nb++] = *record;
+  return 0;
+}
+
+/* Count the queries of the partition that have waited for more than
+   the timeout at [now_ns] as lost */
+static int expire_queries(struct worker *w, uint64_t now_ns)
+{
+  struct join_entry *entry;
+  size_t i = 0;
+  while (i <= w->table.mask) {
+    entry = &w->table.entries[i];
+    if (entry->key != 0 && entry->time_ns + timeout_ns < now_ns) {
+      if (count_lost(w, entry) != 0)
+	return -1;
+      /* The next entry of the cluster may move to this slot */
+      table_remove(&w->table, i);
+    } else
+      i++;
+  }
+  return 0;
+}
+
+/* Latest timestamp parsed by all threads */
+static uint64_t log_front()
+{
+  uint64_t front = 0;
+  for (unsigned int t = 0; t < nb_threads; t++)
+    if (workers[t].last_ns > front)
+      front = workers[t].last_ns;
+  return front;
+}
+
+static void *worker_main(void *arg)
+{
+  struct worker *w = arg;
+  struct rtt_record *batch = malloc(RTTSTAT_BATCH * sizeof(struct rtt_record));
+  struct bucket *bucket;
+  size_t offset, nb;
+  if (batch == NULL)
+    w->failed = 1;
+  while (1) {
+    pthread_barrier_wait(&round_start);
+    if (finished)
+      break;
+    /* Parse the chunk, and sort its records by partition */
+    offset = w->begin;
+    while (!w->failed && (nb = rtt_log_read(&log_file, &offset, w->end, batch, RTTSTAT_BATCH)) > 0) {
+      w->records += nb;
+      for (size_t i = 0; i < nb; i++) {
+	if (batch[i].time_ns > w->last_ns)
+	  w->last_ns = batch[i].time_ns;
+	if (bucket_push(&w->buckets[batch[i].connection_id % nb_threads], &batch[i]) != 0)
+	  w->failed = 1;
+      }
+    }
+    pthread_barrier_wait(&round_parsed);
+    /* Join the records of the partition, in log order */
+    for (unsigned int t = 0; t < nb_threads; t++) {
+      bucket = &workers[t].buckets[w->id];
+      for (size_t i = 0; i < bucket->nb && !w->failed; i++) {
+	if (join_record(w, &bucket->records[i]) != 0)
+	  w->failed = 1;
+      }
+      bucket->nb = 0;
+    }
+    if (timeout_ns > 0 && !w->failed && expire_queries(w, log_front()) != 0)
+      w->failed = 1;
+    pthread_barrier_wait(&round_joined);
+  }
+  /* Queries still waiting at the end of the log were lost */
+  for (size_t i = 0; i <= w->table.mask && !w->failed; i++) {
+    if (w->table.entries[i].key != 0 && count_lost(w, &w->table.entries[i]) != 0)
+      w->failed = 1;
+  }
+  free(batch);
+  return NULL;
+}
+
+/* Time of the first record, origin of the windows */
+static uint64_t _first_time()
+{
+  struct rtt_record *batch = malloc(RTTSTAT_BATCH * sizeof(struct rtt_record));
+  size_t offset = log_file.start;
+  uint64_t time_ns = 0;
+  if (batch != NULL && rtt_log_read(&log_file, &offset, log_file.size, batch, RTTSTAT_BATCH) > 0)
+    time_ns = batch[0].time_ns;
+  free(batch);
+  return time_ns;
+}
+
+static double _elapsed(const struct timespec *since)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static int _compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Merge the windows of the workers, touched during the last round, into
+   [windows] */
+static int merge_windows()
+{
+  struct worker *w;
+  struct window *window;
+  for (unsigned int t = 0; t < nb_threads; t++) {
+    w = &workers[t];
+    for (size_t i = 0; i < w->nb_windows; i++) {
+      window = window_range_get(&windows, &windows_printed, &nb_windows, &windows_size, w->windows_first + i);
+      if (window == NULL)
+	return -1;
+      window->queries += w->windows[i].queries;
+      window->answers += w->windows[i].answers;
+      window->lost += w->windows[i].lost;
+      histogram_merge(&window->latency, &w->windows[i].latency);
+    }
+    w->nb_windows = 0;
+  }
+  return 0;
+}
+
+/* Print the first [nb] windows not printed yet, add them to the totals,
+   and free them */
+static void print_windows(FILE *out, size_t nb, uint64_t *queries, uint64_t *answers, uint64_t *lost,
+			  struct histogram *latency)
+{
+  const struct window *w;
+  for (size_t i = 0; i < nb; i++) {
+    w = &windows[i];
+    *queries += w->queries;
+    *answers += w->answers;
+    *lost += w->lost;
+    histogram_merge(latency, &w->latency);
+    fprintf(out, "%.3f,%lu,%lu,%lu,%.3f,%lu,%lu,%lu,%lu,%lu\n",
+	    (first_ns + (windows_printed + i) * window_ns) / 1e9, w->queries, w->answers, w->lost,
+	    w->queries > 0 ? 100. * w->lost / w->queries : 0.,
+	    histogram_percentile(&w->latency, 50.), histogram_percentile(&w->latency, 90.),
+	    histogram_percentile(&w->latency, 99.), histogram_percentile(&w->latency, 99.9),
+	    w->latency.max);
+  }
+  memmove(windows, windows + nb, (nb_windows - nb) * sizeof(struct window));
+  nb_windows -= nb;
+  windows_printed += nb;
+}
+
+/* Number of windows that no later record can change: the log has gone
+   past them by a window, and all their queries are answered or lost */
+static size_t complete_windows()
+{
+  uint64_t front = log_front();
+  size_t nb = 0;
+  while (nb < nb_windows && window_pending(&windows[nb]) == 0 &&
+	 first_ns + (windows_printed + nb + 2) * window_ns <= front)
+    nb++;
+  return nb;
+}
+
+static int _compare_conns(const void *a, const void *b)
+{
+  uint32_t x = (*(const struct conn_stats **) a)->connection_id, y = (*(const struct conn_stats **) b)->connection_id;
+  return x < y ? -1 : x > y;
+}
+
+/* Write the statistics of each connection as CSV to [path], and print
+   their distribution. */
+static int print_connections(const char *path)
+{
+  FILE *out = NULL;
+  const struct conn_stats *c, **conns;
+  uint64_t *queries, with_losses = 0;
+  size_t nb = 0;
+  for (unsigned int t = 0; t < nb_threads; t++)
+    nb += workers[t].nb_conns;
+  conns = malloc((nb + 1) * sizeof(struct conn_stats *));
+  queries = malloc((nb + 1) * sizeof(uint64_t));
+  if (conns == NULL || queries == NULL) {
+    perror("Failed to sort connections");
+    return -1;
+  }
+  nb = 0;
+  for (unsigned int t = 0; t < nb_threads; t++) {
+    for (size_t i = 0; i < workers[t].nb_conns; i++) {
+      c = &workers[t].conns[i];
+      conns[nb] = c;
+      queries[nb++] = c->queries;
+      if (c->lost > 0)
+	with_losses++;
+    }
+  }
+  if (path != NULL) {
+    out = fopen(path, "w");
+    if (out == NULL) {
+      perror(path);
+      return -1;
+    }
+    qsort(conns, nb, sizeof(struct conn_stats *), _compare_conns);
+    fprintf(out, "connection_id,queries,answers,lost,mean_us,max_us\n");
+    for (size_t i = 0; i < nb; i++) {
+      c = conns[i];
+      fprintf(out, "%u,%lu,%lu,%lu,%.1f,%u\n", c->connection_id, c->queries, c->answers, c->lost,
+	      c->answers > 0 ? (double) c->rtt_sum / c->answers : 0., c->rtt_max);
+    }
+    if (fclose(out) != 0) {
+      perror(path);
+      return -1;
+    }
+  }
+  if (nb > 0) {
+    qsort(queries, nb, sizeof(uint64_t), _compare_u64);
+    fprintf(stderr, "Connections: %zu, queries per connection min %lu, median %lu, max %lu, %lu with losses\n",
+	    nb, queries[0], queries[nb / 2], queries[nb - 1], with_losses);
+  }
+  free(conns);
+  free(queries);
+  return 0;
+}
+
+/* Merge the windows of the last round, and report a failure of a
+   worker.  Returns -1 in case of failure. */
+static int check_workers()
+{
+  int failed = 0, too_long = 0;
+  for (unsigned int t = 0; t < nb_threads; t++) {
+    failed |= workers[t].failed;
+    too_long |= workers[t].too_long;
+  }
+  if (too_long) {
+    fprintf(stderr, "Error: %s spans more than %d windows of %.3f s, use wider windows (-w)"
+	    " or check that its timestamps belong to the same run\n", log_file.path,
+	    RTTSTAT_MAX_WINDOWS, window_ns / 1e9);
+    return -1;
+  }
+  if (failed || merge_windows() != 0) {
+    fprintf(stderr, "Error: out of memory while analyzing %s\n", log_file.path);
+    return -1;
+  }
+  return 0;
+}
+
+void usage(char *progname)
+{
+  fprintf(stderr, "usage: %s [-h] [-j threads] [-w window_ms] [-t timeout_ms] [-c conn_file] <log>\n", progname);
+  fprintf(stderr, "Analyzes a per-query log written by tcpclient or udpclient with -R (CSV) or --rtt-log (binary or columnar).\n");
+  fprintf(stderr, "Answers are joined with their query by connection and query ID, to count lost queries.\n");
+  fprintf(stderr, "Prints, as CSV, the queries, answers, losses and latency percentiles (in µs) of the queries sent\n");
+  fprintf(stderr, "in each window of '-w' milliseconds (default %d), and a summary on stderr.\n", RTTSTAT_WINDOW_MSEC);
+  fprintf(stderr, "Queries without an answer '-t' milliseconds (default %d) after them are lost, and their late\n", RTTSTAT_TIMEOUT_MSEC);
+  fprintf(stderr, "answers are counted without query; with '-t 0', queries wait until the end of the log, and so\n");
+  fprintf(stderr, "do their windows, in memory.\n");
+  fprintf(stderr, "Option '-c' writes the statistics of each connection to the given CSV file.\n");
+  fprintf(stderr, "Option '-j' sets the number of threads (default: number of CPUs, at most 16).\n");
+}
+
+int main(int argc, char **argv)
+{
+  const char *conn_path = NULL;
+  struct histogram *latency;
+  struct timespec start;
+  size_t chunk_start, offset;
+  uint64_t records = 0, queries = 0, answers = 0, lost = 0, unmatched = 0, tcp_answers = 0, out_of_order = 0;
+  long nb_cpus;
+  int opt;
+  double seconds;
+
+  nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  nb_threads = nb_cpus < 1 ? 1 : nb_cpus > 16 ? 16 : nb_cpus;
+  while ((opt = getopt(argc, argv, "hj:w:t:c:")) != -1) {
+    switch (opt) {
+    case 'j':
+      nb_threads = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      window_ns = strtoul(optarg, NULL, 10) * 1000000ULL;
+      break;
+    case 't':
+      timeout_ns = strtoul(optarg, NULL, 10) * 1000000ULL;
+      break;
+    case 'c':
+      conn_path = optarg;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || nb_threads == 0 || window_ns == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (rtt_log_map(&log_file, argv[optind]) != 0)
+    return 1;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  first_ns = _first_time();
+
+  workers = calloc(nb_threads, sizeof(struct worker));
+  if (workers == NULL) {
+    perror("Failed to start threads");
+    return 1;
+  }
+  pthread_barrier_init(&round_start, NULL, nb_threads + 1);
+  pthread_barrier_init(&round_parsed, NULL, nb_threads + 1);
+  pthread_barrier_init(&round_joined, NULL, nb_threads + 1);
+  for (unsigned int t = 0; t < nb_threads; t++) {
+    workers[t].id = t;
+    workers[t].buckets = calloc(nb_threads, sizeof(struct bucket));
+    if (workers[t].buckets == NULL || table_init(&workers[t].table, RTTSTAT_TABLE_SIZE) != 0 ||
+	table_init(&workers[t].conn_index, RTTSTAT_TABLE_SIZE) != 0 ||
+	pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]) != 0) {
+      perror("Failed to start threads");
+      return 1;
+    }
+  }
+
+  latency = calloc(1, sizeof(struct histogram));
+  if (latency == NULL) {
+    perror("Failed to merge results");
+    return 1;
+  }
+  fprintf(stdout, "time,queries,answers,lost,loss_pct,p50_us,p90_us,p99_us,p999_us,max_us\n");
+  /* One round per nb_threads chunks */
+  offset = log_file.start;
+  while (offset < log_file.size) {
+    for (unsigned int t = 0; t < nb_threads; t++) {
+      chunk_start = offset;
+      offset = rtt_log_align(&log_file, offset + RTTSTAT_CHUNK_SIZE);
+      workers[t].begin = chunk_start;
+      workers[t].end = offset;
+    }
+    pthread_barrier_wait(&round_start);
+    pthread_barrier_wait(&round_parsed);
+    pthread_barrier_wait(&round_joined);
+    if (check_workers() != 0)
+      return 1;
+    print_windows(stdout, complete_windows(), &queries, &answers, &lost, latency);
+  }
+  finished = 1;
+  pthread_barrier_wait(&round_start);
+  for (unsigned int t = 0; t < nb_threads; t++) {
+    pthread_join(workers[t].thread, NULL);
+    records += workers[t].records;
+    unmatched += workers[t].unmatched;
+    tcp_answers += workers[t].tcp_answers;
+    out_of_order += workers[t].out_of_order;
+  }
+  if (check_workers() != 0)
+    return 1;
+  print_windows(stdout, nb_windows, &queries, &answers, &lost, latency);
+  seconds = _elapsed(&start);
+
+  fprintf(stderr, "Log %s: %lu records, %.1f MB analyzed in %.3f s (%.2f GB/s, %.1f M records/s) with %u threads\n",
+	  log_file.path, records, log_file.size / 1e6, seconds,
+	  seconds > 0. ? log_file.size / seconds / 1e9 : 0., seconds > 0. ? records / seconds / 1e6 : 0., nb_threads);
+  fprintf(stderr, "Queries: %lu sent, %lu answered, %lu lost (%.3f%%), %lu answers without query, %lu TCP fallback answers\n",
+	  queries, answers, lost, queries > 0 ? 100. * lost / queries : 0., unmatched, tcp_answers);
+  if (out_of_order > 0)
+    fprintf(stderr, "Warning: %lu queries logged after their window was printed, counted in the next one\n",
+	    out_of_order);
+  fprintf(stderr, "Duration: %.3f s, %u windows of %.3f s\n",
+	  windows_printed * window_ns / 1e9, windows_printed, window_ns / 1e9);
+  if (latency->total > 0)
+    fprintf(stderr, "Latency (ms): p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f\n",
+	    histogram_percentile(latency, 50.) / 1000., histogram_percentile(latency, 90.) / 1000.,
+	    histogram_percentile(latency, 99.) / 1000., histogram_percentile(latency, 99.9) / 1000.,
+	    latency->max / 1000.);
+  if (print_connections(conn_path) != 0)
+    return 1;
+  rtt_log_unmap(&log_file);
+  return 0;
+}
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+
+#include "scenario.h"
+
+
+/* Parse a non-negative number ending at [end_char] (or at the end of the
+   string), and return where it ends, or NULL if it is invalid. */
+static const char *_parse_number(const char *s, char end_char, double *value)
+{
+  char *end;
+  *value = strtod(s, &end);
+  if (end == s || *value < 0. || !isfinite(*value) || (*end != end_char && *end != '\0'))
+    return NULL;
+  return end;
+}
+
+/* Parse the value of a "rate" key: "<qps>", "<a>:<b>" or
+   "sin:<mean>:<amplitude>:<period_ms>". */
+static int _parse_rate(struct scenario_phase *phase, const char *value)
+{
+  const char *p;
+  double period;
+  if (strncmp(value, "sin:", 4) == 0) {
+    phase->rate_function = SCENARIO_RATE_SINE;
+    if ((p = _parse_number(value + 4, ':', &phase->rate_start)) == NULL || *p != ':' ||
+	(p = _parse_number(p + 1, ':', &phase->amplitude)) == NULL || *p != ':' ||
+	(p = _parse_number(p + 1, '\0', &period)) == NULL || period < 1.)
+      return -1;
+    phase->period_ms = period;
+    phase->rate_end = phase->rate_start + phase->amplitude * sin(2 * M_PI * phase->duration_ms / phase->period_ms);
+    if (phase->rate_end < 0.)
+      phase->rate_end = 0.;
+    return 0;
+  }
+  phase->rate_function = SCENARIO_RATE_LINEAR;
+  if ((p = _parse_number(value, ':', &phase->rate_start)) == NULL)
+    return -1;
+  phase->rate_end = phase->rate_start;
+  if (*p == ':' && _parse_number(p + 1, '\0', &phase->rate_end) == NULL)
+    return -1;
+  return 0;
+}
+
+/* Parse one "key=value" or flag of a phase.  Returns -1 if it is
+   invalid. */
+static int _parse_key(struct scenario_phase *phase, const char *word, short *has_rate)
+{
+  const char *value = strchr(word, '=');
+  size_t key_len;
+  double number;
+  if (strcmp(word, "measure") == 0) {
+    phase->measure = 1;
+    return 0;
+  }
+  if (value == NULL)
+    return -1;
+  key_len = value++ - word;
+  if (key_len == 4 && strncmp(word, "rate", 4) == 0) {
+    *has_rate = 1;
+    return _parse_rate(phase, value);
+  }
+  if (key_len == 7 && strncmp(word, "queries", 7) == 0) {
+    if (strlen(value) >= SCENARIO_MAX_POLICY)
+      return -1;
+    strcpy(phase->policy, value);
+    return 0;
+  }
+  if (_parse_number(value, '\0', &number) == NULL)
+    return -1;
+  if (key_len == 5 && strncmp(word, "conns", 5) == 0 && number >= 1. && number <= UINT32_MAX)
+    phase->conns = number;
+  else if (key_len == 9 && strncmp(word, "conn-rate", 9) == 0)
+    phase->conn_rate = number;
+  else if (key_len == 5 && strncmp(word, "churn", 5) == 0)
+    phase->churn = number;
+  else
+    return -1;
+  return 0;
+}
+
+int scenario_load(struct scenario *scenario, const char *path)
+{
+  struct scenario_phase *phase;
+  FILE *in;
+  char *line = NULL, *word, *saveptr, *end;
+  size_t line_len = 0;
+  unsigned long line_no = 0;
+  /* Rate at the end of the previous phase */
+  double rate = 0.;
+  short has_rate;
+  memset(scenario, 0, sizeof(struct scenario));
+  in = fopen(path, "r");
+  if (in == NULL) {
+    perror("Failed to open scenario");
+    return -1;
+  }
+  while (getline(&line, &line_len, in) != -1) {
+    line_no++;
+    word = strtok_r(line, " \t\r\n", &saveptr);
+    if (word == NULL || word[0] == '#')
+      continue;
+    if (scenario->nb_phases == SCENARIO_MAX_PHASES) {
+      fprintf(stderr, "Error: scenario %s has more than %d phases\n", path, SCENARIO_MAX_PHASES);
+      goto error;
+    }
+    phase = realloc(scenario->phases, (scenario->nb_phases + 1) * sizeof(struct scenario_phase));
+    if (phase == NULL) {
+      perror("Failed to load scenario");
+      goto error;
+    }
+    scenario->phases = phase;
+    phase = &scenario->phases[scenario->nb_phases++];
+    memset(phase, 0, sizeof(struct scenario_phase));
+    snprintf(phase->name, sizeof(phase->name), "%s", word);
+    word = strtok_r(NULL, " \t\r\n", &saveptr);
+    if (word == NULL || (phase->duration_ms = strtoul(word, &end, 10)) == 0 || *end != '\0') {
+      fprintf(stderr, "Error: expected a duration in milliseconds on line %lu of scenario %s\n", line_no, path);
+      goto error;
+    }
+    has_rate = 0;
+    while ((word = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+      if (_parse_key(phase, word, &has_rate) != 0) {
+	fprintf(stderr, "Error: invalid '%s' on line %lu of scenario %s\n", word, line_no, path);
+	goto error;
+      }
+    }
+    /* Keep the rate of the end of the previous phase */
+    if (!has_rate) {
+      phase->rate_function = SCENARIO_RATE_LINEAR;
+      phase->rate_start = rate;
+      phase->rate_end = rate;
+    }
+    rate = phase->rate_end;
+  }
+  if (scenario->nb_phases == 0) {
+    fprintf(stderr, "Error: scenario %s has no phase\n", path);
+    goto error;
+  }
+  free(line);
+  fclose(in);
+  return 0;
+ error:
+  free(line);
+  fclose(in);
+  scenario_free(scenario);
+  return -1;
+}
+
+double scenario_phase_rate(const struct scenario_phase *phase, unsigned int elapsed_ms)
+{
+  double rate;
+  if (elapsed_ms >= phase->duration_ms)
+    return phase->rate_end;
+  if (phase->rate_function == SCENARIO_RATE_SINE)
+    rate = phase->rate_start + phase->amplitude * sin(2 * M_PI * elapsed_ms / phase->period_ms);
+  else
+    rate = phase->rate_start + (phase->rate_end - phase->rate_start) * elapsed_ms / phase->duration_ms;
+  return rate > 0. ? rate : 0.;
+}
+
+void scenario_range(const struct scenario *scenario, double *min_rate, double *max_rate, uint32_t *max_conns)
+{
+  const struct scenario_phase *phase;
+  double low, high;
+  *min_rate = 0.;
+  *max_rate = 0.;
+  *max_conns = 0;
+  for (unsigned int i = 0; i < scenario->nb_phases; i++) {
+    phase = &scenario->phases[i];
+    if (phase->rate_function == SCENARIO_RATE_SINE) {
+      low = phase->rate_start - phase->amplitude;
+      high = phase->rate_start + phase->amplitude;
+    } else {
+      low = fmin(phase->rate_start, phase->rate_end);
+      high = fmax(phase->rate_start, phase->rate_end);
+    }
+    /* Phases that send nothing at some point do not lower the
+       smallest rate */
+    if (low <= 0.)
+      low = high;
+    if (low > 0. && (*min_rate == 0. || low < *min_rate))
+      *min_rate = low;
+    if (high > *max_rate)
+      *max_rate = high;
+    if (phase->conns > *max_conns)
+      *max_conns = phase->conns;
+  }
+  if (*min_rate < 1.)
+    *min_rate = 1.;
+  if (*max_rate < *min_rate)
+    *max_rate = *min_rate;
+}
+
+double scenario_max_conn_rate(const struct scenario *scenario, uint32_t nb_conn)
+{
+  const struct scenario_phase *phase;
+  double high, max = 0.;
+  uint32_t fewest;
+  for (unsigned int i = 0; i < scenario->nb_phases; i++) {
+    phase = &scenario->phases[i];
+    high = phase->rate_function == SCENARIO_RATE_SINE ? phase->rate_start + phase->amplitude :
+      fmax(phase->rate_start, phase->rate_end);
+    /* Ramps go through all numbers of connections in between */
+    fewest = nb_conn;
+    if (phase->conns > 0) {
+      if (phase->conn_rate == 0. || phase->conns < nb_conn)
+	fewest = phase->conns;
+      nb_conn = phase->conns;
+    }
+    if (high / fewest > max)
+      max = high / fewest;
+  }
+  return max;
+}
+
+static void _print_result(FILE *out, const char *mark, const char *name, const struct scenario_result *r, short validated)
+{
+  double loss = 0.;
+  if (r->sent > r->answered)
+    loss = 100. * (r->sent - r->answered) / r->sent;
+  fprintf(out, "%s%-15s %9.1f %7u %11.1f %11.1f %12lu %12lu %8.3f ",
+	  mark, name, r->seconds, r->conns_end, r->seconds > 0. ? r->expected / r->seconds : 0.,
+	  r->seconds > 0. ? r->sent / r->seconds : 0., r->sent, r->answered, loss);
+  if (!validated)
+    fprintf(out, "%8s ", "-");
+  else
+    fprintf(out, "%8.3f ", r->responses > 0 ? 100. * r->errors / r->responses : 0.);
+  fprintf(out, "%9.3f %9.3f %9.3f %8lu\n",
+	  histogram_percentile(&r->latency, 50.) / 1000., histogram_percentile(&r->latency, 99.) / 1000.,
+	  histogram_percentile(&r->lag, 99.) / 1000., r->churned);
+}
+
+void scenario_print(FILE *out, const struct scenario *scenario, short validated)
+{
+  const struct scenario_phase *phase;
+  struct scenario_result *total;
+  short all = 1;
+  unsigned int nb_measured = 0;
+  for (unsigned int i = 0; i < scenario->nb_phases; i++) {
+    if (scenario->phases[i].measure)
+      all = 0;
+  }
+  total = calloc(1, sizeof(struct scenario_result));
+  if (total == NULL)
+    return;
+  fprintf(out, "Scenario (* measured phases):\n");
+  fprintf(out, " %-15s %9s %7s %11s %11s %12s %12s %8s %8s %9s %9s %9s %8s\n",
+	  "phase", "seconds", "conns", "target_qps", "achieved", "sent", "answered", "loss%",
+	  "errors%", "p50_ms", "p99_ms", "lag_ms", "churned");
+  /* Phases not reached because the scenario was stopped are not shown */
+  for (unsigned int i = 0; i < scenario->current; i++) {
+    phase = &scenario->phases[i];
+    _print_result(out, all || phase->measure ? "*" : " ", phase->name, &phase->result, validated);
+    if (!all && !phase->measure)
+      continue;
+    nb_measured++;
+    total->seconds += phase->result.seconds;
+    total->expected += phase->result.expected;
+    total->sent += phase->result.sent;
+    total->answered += phase->result.answered;
+    total->responses += phase->result.responses;
+    total->errors += phase->result.errors;
+    total->churned += phase->result.churned;
+    total->conns_end = phase->result.conns_end;
+    histogram_merge(&total->latency, &phase->result.latency);
+    histogram_merge(&total->lag, &phase->result.lag);
+  }
+  if (nb_measured > 0)
+    _print_result(out, " ", "measured", total, validated);
+  free(total);
+}
+
+void scenario_free(struct scenario *scenario)
+{
+  free(scenario->phases);
+  scenario->phases = NULL;
+  scenario->nb_phases = 0;
+}
@@ -0,0 +1,112 @@
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "histogram.h"
+
+/* Scenario of a run (--scenario): a timeline of named phases, run one
+   after the other in the same process and on the same connections.
+
+   Each line of a scenario file describes a phase:
+
+     <name> <duration_ms> [key=value]... [measure]
+
+   with the following keys, all optional:
+
+     conns=<n>         number of connections to use during the phase
+     conn-rate=<n/s>   how fast to open or close connections to reach
+                       [conns] (at once by default)
+     rate=<qps>        constant query rate
+     rate=<a>:<b>      query rate growing (or decreasing) linearly from
+                       a to b over the phase
+     rate=sin:<mean>:<amplitude>:<period_ms>
+                       sinusoidal query rate
+     queries=<policy>  query selection policy from this phase on, see
+                       query_corpus_set_policy()
+     churn=<n/s>       connections closed and opened again per second
+
+   Phases without [conns] or [rate] keep the connections and the rate
+   that the previous phase ended with; the run starts with the
+   connections opened by the client and no query.  The [measure] flag
+   marks the phases that count toward the aggregated statistics, e.g. to
+   leave out a ramp and a warm-up; if no phase has it, all phases count.
+   Empty lines and lines starting with '#' are ignored. */
+
+#define SCENARIO_MAX_PHASES 256
+#define SCENARIO_MAX_NAME 32
+#define SCENARIO_MAX_POLICY 32
+
+enum scenario_rate_function {
+  SCENARIO_RATE_LINEAR,
+  SCENARIO_RATE_SINE,
+};
+
+/* What happened during a phase */
+struct scenario_result {
+  double seconds;
+  /* Integral of the target rate over the phase */
+  double expected;
+  uint64_t sent;
+  uint64_t answered;
+  /* Responses and error responses, with --validate */
+  uint64_t responses;
+  uint64_t errors;
+  /* Connections closed and opened again by churn, and connections in
+     use at the end of the phase */
+  uint64_t churned;
+  uint32_t conns_end;
+  struct histogram latency;
+  struct histogram lag;
+};
+
+struct scenario_phase {
+  char name[SCENARIO_MAX_NAME];
+  unsigned int duration_ms;
+  /* Target number of connections (0 to keep them), reached at
+     conn_rate connections per second, or at once if conn_rate is 0 */
+  uint32_t conns;
+  double conn_rate;
+  /* Query rate: linear from rate_start to rate_end, or sine around
+     rate_start */
+  enum scenario_rate_function rate_function;
+  double rate_start;
+  double rate_end;
+  double amplitude;
+  unsigned int period_ms;
+  /* Query selection policy, empty to keep the current one */
+  char policy[SCENARIO_MAX_POLICY];
+  double churn;
+  short measure;
+  struct scenario_result result;
+};
+
+struct scenario {
+  struct scenario_phase *phases;
+  unsigned int nb_phases;
+  /* Index of the current phase */
+  unsigned int current;
+};
+
+/* Read the scenario file [path].  Returns -1 in case of error. */
+int scenario_load(struct scenario *scenario, const char *path);
+
+/* Target query rate of [phase], [elapsed_ms] after its start. */
+double scenario_phase_rate(const struct scenario_phase *phase, unsigned int elapsed_ms);
+
+/* Smallest non-zero and largest query rate of the scenario (1 if it
+   never sends), and largest number of connections. */
+void scenario_range(const struct scenario *scenario, double *min_rate, double *max_rate, uint32_t *max_conns);
+
+/* Largest query rate per connection over the scenario, when it starts
+   with [nb_conn] connections, to size the tables of queries in flight. */
+double scenario_max_conn_rate(const struct scenario *scenario, uint32_t nb_conn);
+
+/* Print the results of all phases, and their aggregate over the
+   measured phases.  Error responses are only shown if [validated]. */
+void scenario_print(FILE *out, const struct scenario *scenario, short validated);
+
+void scenario_free(struct scenario *scenario);
+
+#endif
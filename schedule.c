@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "schedule.h"
+
+
+int schedule_writer_open(struct schedule_writer *writer, const char *path,
+			 uint32_t nb_conn, uint32_t nb_templates)
+{
+  memset(writer, 0, sizeof(struct schedule_writer));
+  writer->out = fopen(path, "w");
+  if (writer->out == NULL) {
+    perror("Failed to create schedule file");
+    return -1;
+  }
+  memcpy(writer->header.magic, SCHEDULE_MAGIC, sizeof(writer->header.magic));
+  writer->header.version = SCHEDULE_VERSION;
+  writer->header.nb_conn = nb_conn;
+  writer->header.nb_templates = nb_templates;
+  /* The header is rewritten once the counts are known */
+  if (fwrite(&writer->header, sizeof(struct schedule_header), 1, writer->out) != 1) {
+    perror("Failed to write schedule file");
+    fclose(writer->out);
+    return -1;
+  }
+  return 0;
+}
+
+int schedule_writer_close(struct schedule_writer *writer, const struct schedule_phase *phases,
+			  uint32_t nb_phases, uint64_t end_ns)
+{
+  writer->header.nb_phases = nb_phases;
+  writer->header.end_ns = end_ns;
+  /* Keep the phases aligned */
+  while (writer->header.entries_len % sizeof(uint64_t) != 0) {
+    putc(0, writer->out);
+    writer->header.entries_len++;
+  }
+  if (fwrite(phases, sizeof(struct schedule_phase), nb_phases, writer->out) != nb_phases ||
+      fseek(writer->out, 0, SEEK_SET) != 0 ||
+      fwrite(&writer->header, sizeof(struct schedule_header), 1, writer->out) != 1) {
+    perror("Failed to write schedule file");
+    fclose(writer->out);
+    return -1;
+  }
+  if (fclose(writer->out) != 0) {
+    perror("Failed to write schedule file");
+    return -1;
+  }
+  return 0;
+}
+
+int schedule_open(struct schedule *schedule, const char *path)
+{
+  struct stat st;
+  const struct schedule_header *header;
+  void *map;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror("Failed to open schedule");
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct schedule_header)) {
+    fprintf(stderr, "Error: schedule %s is too short or unreadable\n", path);
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("Failed to map schedule");
+    return -1;
+  }
+  header = map;
+  if (memcmp(header->magic, SCHEDULE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SCHEDULE_VERSION ||
+      sizeof(struct schedule_header) + header->entries_len
+      + (uint64_t) header->nb_phases * sizeof(struct schedule_phase) > st.st_size) {
+    fprintf(stderr, "Error: invalid or truncated schedule file %s\n", path);
+    munmap(map, st.st_size);
+    return -1;
+  }
+  /* Entries are only read once, in order */
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  memset(schedule, 0, sizeof(struct schedule));
+  schedule->map = map;
+  schedule->map_len = st.st_size;
+  schedule->header = header;
+  schedule->next = (const unsigned char *) map + sizeof(struct schedule_header);
+  schedule->end = schedule->next + header->entries_len;
+  schedule->phases = (const struct schedule_phase *) schedule->end;
+  return 0;
+}
+
+void schedule_close(struct schedule *schedule)
+{
+  munmap(schedule->map, schedule->map_len);
+  schedule->map = NULL;
+}
+
+double schedule_target_rate(const struct schedule *schedule, uint64_t t_ns)
+{
+  const struct schedule_phase *phase = NULL;
+  /* Last phase started at [t_ns], whose final target holds after its end */
+  for (uint32_t i = 0; i < schedule->header->nb_phases; i++)
+    if (schedule->phases[i].start_ns <= t_ns)
+      phase = &schedule->phases[i];
+  if (phase == NULL)
+    return 0.;
+  if (t_ns >= phase->end_ns)
+    return phase->target_end;
+  return phase->target_start + (phase->target_end - phase->target_start)
+    * (t_ns - phase->start_ns) / (phase->end_ns - phase->start_ns);
+}
+
+double schedule_max_rate(const struct schedule *schedule)
+{
+  double max = 0.;
+  for (uint32_t i = 0; i < schedule->header->nb_phases; i++) {
+    if (schedule->phases[i].target_start > max)
+      max = schedule->phases[i].target_start;
+    if (schedule->phases[i].target_end > max)
+      max = schedule->phases[i].target_end;
+  }
+  return max;
+}
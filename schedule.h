@@ -0,0 +1,146 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A precomputed send schedule: the list of all queries of a run, each
+   with its send time, connection and template (index in the query
+   corpus).  It is generated offline by simclient (--save-schedule), and
+   played back by the clients (--schedule), which then only have to send
+   queries at the listed times: no random number is drawn and no Poisson
+   process runs in the event loop, and every run of the same schedule,
+   on any host, sends exactly the same queries at the same times.
+
+   File layout, in host byte order:
+
+     struct schedule_header
+     unsigned char entries[entries_len]   (padded to 8 bytes)
+     struct schedule_phase phases[nb_phases]
+
+   Each entry is three unsigned LEB128 varints: the delay since the
+   previous entry (since the start of the run for the first one) in
+   nanoseconds, the connection ID, and the template ID.  At 100k qps,
+   an entry takes about 5 bytes. */
+
+#define SCHEDULE_MAGIC "TSSCHED1"
+#define SCHEDULE_VERSION 1
+
+struct schedule_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nb_conn;
+  /* Size of the query corpus the templates refer to */
+  uint32_t nb_templates;
+  uint32_t nb_phases;
+  uint64_t nb_entries;
+  uint64_t entries_len;
+  /* End of the run, relative to its start */
+  uint64_t end_ns;
+};
+
+/* Phase of the run, with its target rate, for the run summary */
+struct schedule_phase {
+  uint64_t start_ns;
+  uint64_t end_ns;
+  double target_start;
+  double target_end;
+};
+
+struct schedule_entry {
+  /* Send time, relative to the start of the run */
+  uint64_t time_ns;
+  uint32_t conn_id;
+  uint32_t template_id;
+};
+
+struct schedule_writer {
+  FILE *out;
+  struct schedule_header header;
+  uint64_t last_ns;
+};
+
+/* Read-only mapping of a schedule file, and position of the playback. */
+struct schedule {
+  void *map;
+  size_t map_len;
+  const struct schedule_header *header;
+  const struct schedule_phase *phases;
+  const unsigned char *next;
+  const unsigned char *end;
+  /* Entries already read */
+  uint64_t nb_read;
+  uint64_t last_ns;
+};
+
+/* Create the schedule file [path].  Returns -1 in case of error. */
+int schedule_writer_open(struct schedule_writer *writer, const char *path,
+			 uint32_t nb_conn, uint32_t nb_templates);
+
+static inline void _schedule_put_varint(FILE *out, uint64_t value, uint64_t *len)
+{
+  while (value >= 0x80) {
+    putc_unlocked((value & 0x7f) | 0x80, out);
+    value >>= 7;
+    (*len)++;
+  }
+  putc_unlocked(value, out);
+  (*len)++;
+}
+
+/* Append an entry.  Entries must be appended in chronological order. */
+static inline void schedule_write(struct schedule_writer *writer, const struct schedule_entry *entry)
+{
+  _schedule_put_varint(writer->out, entry->time_ns - writer->last_ns, &writer->header.entries_len);
+  _schedule_put_varint(writer->out, entry->conn_id, &writer->header.entries_len);
+  _schedule_put_varint(writer->out, entry->template_id, &writer->header.entries_len);
+  writer->last_ns = entry->time_ns;
+  writer->header.nb_entries++;
+}
+
+/* Write the [nb_phases] phases and the end of the run, and close the
+   file.  Returns -1 in case of error. */
+int schedule_writer_close(struct schedule_writer *writer, const struct schedule_phase *phases,
+			  uint32_t nb_phases, uint64_t end_ns);
+
+/* Map the schedule file [path] and check its header.  Returns -1 in case
+   of error. */
+int schedule_open(struct schedule *schedule, const char *path);
+
+void schedule_close(struct schedule *schedule);
+
+static inline uint64_t _schedule_get_varint(struct schedule *schedule)
+{
+  uint64_t value = 0;
+  unsigned int shift = 0;
+  while (schedule->next < schedule->end && (*schedule->next & 0x80)) {
+    value |= (uint64_t) (*schedule->next++ & 0x7f) << shift;
+    shift += 7;
+  }
+  if (schedule->next < schedule->end)
+    value |= (uint64_t) *schedule->next++ << shift;
+  return value;
+}
+
+/* Read the next entry into [entry].  Returns 0 at the end of the
+   schedule. */
+static inline int schedule_next(struct schedule *schedule, struct schedule_entry *entry)
+{
+  if (schedule->nb_read == schedule->header->nb_entries)
+    return 0;
+  schedule->last_ns += _schedule_get_varint(schedule);
+  entry->time_ns = schedule->last_ns;
+  entry->conn_id = _schedule_get_varint(schedule);
+  entry->template_id = _schedule_get_varint(schedule);
+  schedule->nb_read++;
+  return 1;
+}
+
+/* Target rate of the schedule at [t_ns] after the start of the run. */
+double schedule_target_rate(const struct schedule *schedule, uint64_t t_ns);
+
+/* Largest target rate of the schedule. */
+double schedule_max_rate(const struct schedule *schedule);
+
+#endif
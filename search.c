@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "search.h"
+
+
+int slo_parse(struct slo *slo, const char *spec)
+{
+  const char *p = spec;
+  char *end;
+  double value;
+  slo->p99_ms = SLO_P99_MSEC;
+  slo->loss_pct = SLO_LOSS_PCT;
+  slo->errors_pct = SLO_ERRORS_PCT;
+  slo->lag_ms = SLO_LAG_MSEC;
+  while (p != NULL && *p != '\0') {
+    const char *eq = strchr(p, '=');
+    if (eq == NULL)
+      goto invalid;
+    value = strtod(eq + 1, &end);
+    if (end == eq + 1 || (*end != ',' && *end != '\0') || value < 0.)
+      goto invalid;
+    if (eq - p == 3 && strncmp(p, "p99", 3) == 0)
+      slo->p99_ms = value;
+    else if (eq - p == 4 && strncmp(p, "loss", 4) == 0)
+      slo->loss_pct = value;
+    else if (eq - p == 6 && strncmp(p, "errors", 6) == 0)
+      slo->errors_pct = value;
+    else if (eq - p == 3 && strncmp(p, "lag", 3) == 0)
+      slo->lag_ms = value;
+    else
+      goto invalid;
+    p = *end == ',' ? end + 1 : end;
+  }
+  return 0;
+ invalid:
+  fprintf(stderr, "Error: invalid SLO '%s', expected e.g. 'p99=50,loss=1,errors=1,lag=10'\n", spec);
+  return -1;
+}
+
+int search_parse(struct search *search, const char *spec)
+{
+  char *end;
+  memset(search, 0, sizeof(struct search));
+  search->precision = SEARCH_PRECISION;
+  search->start_rate = strtod(spec, &end);
+  if (*end != ':')
+    goto invalid;
+  search->max_rate = strtod(end + 1, &end);
+  if (*end == ':')
+    search->increment = strtod(end + 1, &end);
+  if (*end != '\0' || search->start_rate < 1. || search->max_rate < search->start_rate || search->increment < 0.)
+    goto invalid;
+  search->rate = search->start_rate;
+  return 0;
+ invalid:
+  fprintf(stderr, "Error: invalid search '%s', expected '<start>:<max>[:<increment>]'\n", spec);
+  return -1;
+}
+
+void slo_check(const struct slo *slo, struct search_step *step)
+{
+  step->pass = step->p99_ms <= slo->p99_ms &&
+    step->loss_pct <= slo->loss_pct &&
+    step->errors_pct <= slo->errors_pct &&
+    step->lag_ms <= slo->lag_ms;
+}
+
+double search_next(struct search *search, const struct search_step *step)
+{
+  struct search_step *steps = realloc(search->steps, (search->nb_steps + 1) * sizeof(struct search_step));
+  if (steps == NULL)
+    return 0.;
+  search->steps = steps;
+  search->steps[search->nb_steps++] = *step;
+  if (step->pass && step->rate > search->lo)
+    search->lo = step->rate;
+  if (!step->pass && (search->hi == 0. || step->rate < search->hi))
+    search->hi = step->rate;
+  if (search->hi == 0.) {
+    /* Still searching upwards */
+    if (search->rate >= search->max_rate)
+      return 0.;
+    if (search->increment > 0.)
+      search->rate += search->increment;
+    else
+      search->rate *= 2;
+    if (search->rate > search->max_rate)
+      search->rate = search->max_rate;
+    return search->rate;
+  }
+  /* Nothing passes, or the bracket is narrow enough */
+  if (search->lo == 0. || search->hi - search->lo <= search->precision * search->lo)
+    return 0.;
+  search->rate = (search->lo + search->hi) / 2.;
+  return search->rate;
+}
+
+void search_print(FILE *out, const struct search *search, const struct slo *slo)
+{
+  const struct search_step *step;
+  fprintf(out, "Saturation search (SLO: p99 <= %g ms, loss <= %g%%, errors <= %g%%, lag p99 <= %g ms):\n",
+	  slo->p99_ms, slo->loss_pct, slo->errors_pct, slo->lag_ms);
+  fprintf(out, "%5s %12s %12s %10s %8s %8s %10s %6s\n",
+	  "step", "target_qps", "achieved", "p99_ms", "loss%", "errors%", "lag_ms", "slo");
+  for (unsigned int i = 0; i < search->nb_steps; i++) {
+    step = &search->steps[i];
+    fprintf(out, "%5u %12.1f %12.1f %10.3f %8.3f ", i + 1, step->rate, step->achieved, step->p99_ms, step->loss_pct);
+    if (step->errors_pct < 0.)
+      fprintf(out, "%8s ", "-");
+    else
+      fprintf(out, "%8.3f ", step->errors_pct);
+    fprintf(out, "%10.3f %6s\n", step->lag_ms, step->pass ? "pass" : "FAIL");
+  }
+  if (search->lo == 0.)
+    fprintf(out, "No rate passes the SLO (lowest tried: %.1f qps)\n", search->hi);
+  else if (search->hi == 0.)
+    fprintf(out, "Highest passing rate: %.1f qps (maximum of the search, the server may sustain more)\n", search->lo);
+  else
+    fprintf(out, "Highest passing rate: %.1f qps (lowest failing rate: %.1f qps)\n", search->lo, search->hi);
+}
+
+void search_free(struct search *search)
+{
+  free(search->steps);
+  search->steps = NULL;
+}
@@ -0,0 +1,87 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdio.h>
+
+/* Saturation search: find the highest query rate that a server sustains
+   within a service level objective.
+
+   The run is a sequence of steps at different rates, on the same
+   connections.  The rate first increases (doubling, or by a fixed
+   increment) until a step fails the SLO or the maximum rate is reached,
+   and is then bisected between the highest passing rate and the lowest
+   failing rate, until they are within the requested precision.  Each
+   step starts with a settling time, to let queues from the previous
+   step drain, and only the rest of the step is measured. */
+
+/* Default duration of the measurement and of the settling time of each
+   step, and precision of the bisection (relative) */
+#define SEARCH_STEP_MSEC 10000
+#define SEARCH_SETTLE_MSEC 2000
+#define SEARCH_PRECISION 0.05
+
+/* Default SLO: p99 latency, share of unanswered queries, share of
+   error responses (SERVFAIL, REFUSED, other error rcodes, malformed or
+   mismatched, only checked with --validate) and p99 scheduling lag of
+   the client itself. */
+#define SLO_P99_MSEC 100.
+#define SLO_LOSS_PCT 1.
+#define SLO_ERRORS_PCT 1.
+#define SLO_LAG_MSEC 10.
+
+struct slo {
+  double p99_ms;
+  double loss_pct;
+  double errors_pct;
+  double lag_ms;
+};
+
+/* Measurements of one step */
+struct search_step {
+  double rate;
+  double achieved;
+  double p99_ms;
+  double loss_pct;
+  /* Negative if responses are not validated */
+  double errors_pct;
+  double lag_ms;
+  short pass;
+};
+
+struct search {
+  double start_rate;
+  double max_rate;
+  /* Increment of the rate while searching upwards, 0 to double it */
+  double increment;
+  double precision;
+  /* Highest passing and lowest failing rates so far, 0 if none */
+  double lo;
+  double hi;
+  /* Rate of the current step */
+  double rate;
+  struct search_step *steps;
+  unsigned int nb_steps;
+};
+
+/* Set the SLO to the defaults, then apply [spec], a comma-separated list
+   of "p99=<ms>", "loss=<%>", "errors=<%>" and "lag=<ms>" (NULL for the
+   defaults only).  Returns -1 if [spec] is invalid. */
+int slo_parse(struct slo *slo, const char *spec);
+
+/* Initialise a search from [spec], "<start>:<max>[:<increment>]" in
+   queries per second.  Returns -1 if [spec] is invalid. */
+int search_parse(struct search *search, const char *spec);
+
+/* Check [step] against [slo] and set step->pass. */
+void slo_check(const struct slo *slo, struct search_step *step);
+
+/* Record the result of the current step, and return the rate of the
+   next step, or 0 if the search is over. */
+double search_next(struct search *search, const struct search_step *step);
+
+/* Print all steps and the result of the search. */
+void search_print(FILE *out, const struct search *search, const struct slo *slo);
+
+void search_free(struct search *search);
+
+#endif
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "shmstats.h"
+
+/* Reader of the live statistics published by tcpclient, udpclient and
+   tcpserver with --shm-stats.  Segments are mapped read-only, so reading
+   them has no effect on the writers. */
+
+struct segment {
+  const char *name;
+  const struct shm_stats *shm;
+  struct shm_stats_data last;
+  int has_last;
+};
+
+static const char *_state(const struct shm_stats *shm, const struct shm_stats_data *data)
+{
+  if (data->finished)
+    return "finished";
+  if (kill(shm->pid, 0) == -1 && errno == ESRCH)
+    return "dead";
+  return "running";
+}
+
+static void print_text(struct segment *seg, const struct shm_stats_data *data)
+{
+  const struct shm_stats *shm = seg->shm;
+  double uptime = (data->update_time_ns - shm->start_time_ns) / 1e9;
+  printf("%s: %s pid %u (%s), up %.1f s\n", seg->name, shm->program, shm->pid,
+	 _state(shm, data), data->update_time_ns ? uptime : 0.);
+  printf("  connections %lu live, %lu opened\n", data->live_connections, data->connections_opened);
+  if (shm->role == SHM_STATS_CLIENT) {
+    printf("  queries %lu sent, %lu answered, %lu timeouts, target rate %.1f qps\n",
+	   data->queries_sent, data->answers_received, data->timeouts, data->target_rate);
+  }
+  printf("  bytes %lu out, %lu in\n", data->bytes_out, data->bytes_in);
+  if (seg->has_last && data->update_time_ns > seg->last.update_time_ns) {
+    double interval = (data->update_time_ns - seg->last.update_time_ns) / 1e9;
+    if (shm->role == SHM_STATS_CLIENT)
+      printf("  rates %.1f qps sent, %.1f qps answered\n",
+	     (data->queries_sent - seg->last.queries_sent) / interval,
+	     (data->answers_received - seg->last.answers_received) / interval);
+    printf("  throughput %.0f B/s out, %.0f B/s in\n",
+	   (data->bytes_out - seg->last.bytes_out) / interval,
+	   (data->bytes_in - seg->last.bytes_in) / interval);
+  }
+  if (data->latency.total > 0) {
+    printf("  latency (µs) p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %lu\n",
+	   histogram_percentile(&data->latency, 50.), histogram_percentile(&data->latency, 90.),
+	   histogram_percentile(&data->latency, 99.), histogram_percentile(&data->latency, 99.9),
+	   data->latency.max);
+  }
+  if (data->lag.total > 0) {
+    printf("  scheduling lag (µs) p50 %lu, p99 %lu, max %lu\n",
+	   histogram_percentile(&data->lag, 50.), histogram_percentile(&data->lag, 99.),
+	   data->lag.max);
+  }
+}
+
+static void print_json(struct segment *seg, const struct shm_stats_data *data)
+{
+  const struct shm_stats *shm = seg->shm;
+  printf("{\"name\":\"%s\",\"program\":\"%s\",\"pid\":%u,\"state\":\"%s\","
+	 "\"start_time\":%.6f,\"time\":%.6f,"
+	 "\"sent\":%lu,\"answered\":%lu,\"timeouts\":%lu,\"bytes_out\":%lu,\"bytes_in\":%lu,"
+	 "\"connections_opened\":%lu,\"connections\":%lu,\"target_rate\":%.1f,"
+	 "\"latency_us\":{\"count\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu},"
+	 "\"lag_us\":{\"count\":%lu,\"p50\":%lu,\"p99\":%lu,\"max\":%lu}}\n",
+	 seg->name, shm->program, shm->pid, _state(shm, data),
+	 shm->start_time_ns / 1e9, data->update_time_ns / 1e9,
+	 data->queries_sent, data->answers_received, data->timeouts,
+	 data->bytes_out, data->bytes_in,
+	 data->connections_opened, data->live_connections, data->target_rate,
+	 data->latency.total,
+	 histogram_percentile(&data->latency, 50.), histogram_percentile(&data->latency, 90.),
+	 histogram_percentile(&data->latency, 99.), histogram_percentile(&data->latency, 99.9),
+	 data->latency.max,
+	 data->lag.total, histogram_percentile(&data->lag, 50.),
+	 histogram_percentile(&data->lag, 99.), data->lag.max);
+}
+
+void usage(char *progname)
+{
+  fprintf(stderr, "usage: %s [-h] [-j] [-w interval_ms] <name>...\n", progname);
+  fprintf(stderr, "Prints the live statistics published with '--shm-stats <name>' by tcpclient, udpclient or tcpserver.\n");
+  fprintf(stderr, "Names without a slash are relative to /dev/shm.\n");
+  fprintf(stderr, "Option -j prints one JSON object per segment instead of text.\n");
+  fprintf(stderr, "Option -w prints the statistics again every interval, until interrupted.\n");
+}
+
+int main(int argc, char **argv)
+{
+  struct segment *segments;
+  struct shm_stats_data data;
+  struct timespec interval;
+  unsigned int nb_segments;
+  unsigned int watch_ms = 0;
+  short json = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hjw:")) != -1) {
+    switch (opt) {
+    case 'j':
+      json = 1;
+      break;
+    case 'w':
+      watch_ms = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  nb_segments = argc - optind;
+  segments = calloc(nb_segments, sizeof(struct segment));
+  for (unsigned int i = 0; i < nb_segments; i++) {
+    segments[i].name = argv[optind + i];
+    segments[i].shm = shm_stats_open(segments[i].name);
+    if (segments[i].shm == NULL)
+      return 1;
+  }
+  interval.tv_sec = watch_ms / 1000;
+  interval.tv_nsec = (watch_ms % 1000) * 1000000L;
+  while (1) {
+    for (unsigned int i = 0; i < nb_segments; i++) {
+      shm_stats_read(segments[i].shm, &data);
+      if (json)
+	print_json(&segments[i], &data);
+      else
+	print_text(&segments[i], &data);
+      segments[i].last = data;
+      segments[i].has_last = 1;
+    }
+    fflush(stdout);
+    if (watch_ms == 0)
+      break;
+    nanosleep(&interval, NULL);
+  }
+  free(segments);
+  return 0;
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+
+#include "shmstats.h"
+
+/* The layout is documented in shmstats.h, make sure it does not drift. */
+_Static_assert(offsetof(struct shm_stats, start_time_ns) == 64, "shm_stats layout");
+_Static_assert(offsetof(struct shm_stats, seq) == 128, "shm_stats layout");
+_Static_assert(offsetof(struct shm_stats, data) == 192, "shm_stats layout");
+
+
+static void _path(char *buf, size_t buflen, const char *name)
+{
+  if (strchr(name, '/') != NULL)
+    snprintf(buf, buflen, "%s", name);
+  else
+    snprintf(buf, buflen, "/dev/shm/%s", name);
+}
+
+struct shm_stats *shm_stats_create(const char *name, enum shm_stats_role role, const char *program)
+{
+  char path[4096];
+  struct shm_stats *shm;
+  struct timespec now;
+  int fd;
+  if (name == NULL) {
+    shm = mmap(NULL, sizeof(struct shm_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  } else {
+    _path(path, sizeof(path), name);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      perror("Failed to create shared memory statistics");
+      return NULL;
+    }
+    if (ftruncate(fd, sizeof(struct shm_stats)) == -1) {
+      perror("Failed to size shared memory statistics");
+      close(fd);
+      return NULL;
+    }
+    shm = mmap(NULL, sizeof(struct shm_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+  }
+  if (shm == MAP_FAILED) {
+    perror("Failed to map shared memory statistics");
+    return NULL;
+  }
+  /* The mapping is freshly truncated or anonymous, hence already zero.  Write the magic
+     last, so that readers never see a partial header. */
+  shm->version = SHM_STATS_VERSION;
+  shm->size = sizeof(struct shm_stats);
+  shm->role = role;
+  shm->pid = getpid();
+  snprintf(shm->program, sizeof(shm->program), "%s", program);
+  shm->sub_bits = HISTOGRAM_SUB_BITS;
+  shm->max_bits = HISTOGRAM_MAX_BITS;
+  clock_gettime(CLOCK_REALTIME, &now);
+  shm->start_time_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(shm->magic, SHM_STATS_MAGIC, sizeof(shm->magic));
+  return shm;
+}
+
+void shm_stats_close(struct shm_stats *shm)
+{
+  munmap(shm, sizeof(struct shm_stats));
+}
+
+const struct shm_stats *shm_stats_open(const char *name)
+{
+  char path[4096];
+  struct shm_stats *shm;
+  struct stat st;
+  int fd;
+  _path(path, sizeof(path), name);
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror(path);
+    return NULL;
+  }
+  if (fstat(fd, &st) == -1 || st.st_size < sizeof(struct shm_stats)) {
+    fprintf(stderr, "%s: not a statistics segment\n", path);
+    close(fd);
+    return NULL;
+  }
+  shm = mmap(NULL, sizeof(struct shm_stats), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) {
+    perror(path);
+    return NULL;
+  }
+  if (memcmp(shm->magic, SHM_STATS_MAGIC, sizeof(shm->magic)) != 0 ||
+      shm->version != SHM_STATS_VERSION || shm->size != sizeof(struct shm_stats) ||
+      shm->sub_bits != HISTOGRAM_SUB_BITS || shm->max_bits != HISTOGRAM_MAX_BITS) {
+    fprintf(stderr, "%s: unsupported statistics segment\n", path);
+    munmap(shm, sizeof(struct shm_stats));
+    return NULL;
+  }
+  return shm;
+}
+
+void shm_stats_read(const struct shm_stats *shm, struct shm_stats_data *data)
+{
+  uint32_t seq1, seq2;
+  do {
+    seq1 = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+    if (seq1 & 1) {
+      /* Update in progress, the writer only needs a few microseconds */
+      sched_yield();
+      continue;
+    }
+    memcpy(data, &shm->data, sizeof(struct shm_stats_data));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    seq2 = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+  } while ((seq1 & 1) || seq1 != seq2);
+}
+
+void shm_stats_merge(struct shm_stats_data *dst, const struct shm_stats_data *src)
+{
+  if (src->update_time_ns > dst->update_time_ns)
+    dst->update_time_ns = src->update_time_ns;
+  dst->finished = dst->finished && src->finished;
+  dst->queries_sent += src->queries_sent;
+  dst->answers_received += src->answers_received;
+  dst->timeouts += src->timeouts;
+  dst->bytes_out += src->bytes_out;
+  dst->bytes_in += src->bytes_in;
+  dst->connections_opened += src->connections_opened;
+  dst->live_connections += src->live_connections;
+  dst->target_rate += src->target_rate;
+  histogram_merge(&dst->latency, &src->latency);
+  histogram_merge(&dst->lag, &src->lag);
+}
@@ -0,0 +1,121 @@
+#ifndef SHMSTATS_H
+#define SHMSTATS_H
+
+#include <stdint.h>
+
+#include "histogram.h"
+
+/* Live statistics published in a shared memory segment, for external
+   monitors (see shmstat.c).
+
+   The segment is a regular file under /dev/shm, mapped by the writer
+   (tcpclient, udpclient or tcpserver) and by any number of readers.  It
+   contains a fixed header, written once at creation, followed by a
+   snapshot of the statistics protected by a seqlock: the writer makes
+   the sequence number odd, updates the snapshot, and makes it even
+   again.  Readers copy the snapshot and retry if the sequence number was
+   odd or changed in the meantime.  Readers never write to the segment,
+   so they cannot slow down the writer; the writer only publishes from a
+   timer event, never from the data path.
+
+   Layout (version 1), all integers in host byte order:
+
+     offset  size  field
+          0     8  magic "TSSHMST1"
+          8     4  version
+         12     4  total size of the segment
+         16     4  role (enum shm_stats_role)
+         20     4  pid of the writer
+         24    32  program name, NUL-terminated
+         56     4  HISTOGRAM_SUB_BITS of the writer
+         60     4  HISTOGRAM_MAX_BITS of the writer
+         64     8  start time (CLOCK_REALTIME, in nanoseconds)
+        128     4  sequence number (own cache line)
+        192        snapshot (struct shm_stats_data)
+
+   Histograms are struct histogram (see histogram.h), cumulative since
+   the start, with values in microseconds. */
+
+#define SHM_STATS_MAGIC "TSSHMST1"
+#define SHM_STATS_VERSION 1
+
+/* Default interval between two snapshots (in milliseconds) */
+#define SHM_STATS_INTERVAL_MSEC 100
+
+enum shm_stats_role {
+  SHM_STATS_CLIENT = 1,
+  SHM_STATS_SERVER = 2,
+};
+
+struct shm_stats_data {
+  /* Time of the snapshot (CLOCK_REALTIME, in nanoseconds) */
+  uint64_t update_time_ns;
+  /* Set in the last snapshot, written when the writer exits */
+  uint64_t finished;
+  /* Cumulative counters.  The server only fills the byte and connection
+     counters. */
+  uint64_t queries_sent;
+  uint64_t answers_received;
+  uint64_t timeouts;
+  uint64_t bytes_out;
+  uint64_t bytes_in;
+  uint64_t connections_opened;
+  uint64_t live_connections;
+  /* Target query rate of the client, in queries per second */
+  double target_rate;
+  /* Answer latency and scheduler lag of the client */
+  struct histogram latency;
+  struct histogram lag;
+};
+
+struct shm_stats {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;
+  uint32_t role;
+  uint32_t pid;
+  char program[32];
+  uint32_t sub_bits;
+  uint32_t max_bits;
+  uint64_t start_time_ns;
+  uint32_t seq __attribute__((aligned(64)));
+  struct shm_stats_data data __attribute__((aligned(64)));
+};
+
+/* Create (or truncate) the segment [name], either a path or a name
+   relative to /dev/shm, and map it.  If [name] is NULL, the segment is
+   anonymous and only visible to the threads of the process (see
+   metrics.h).  Returns NULL in case of error. */
+struct shm_stats *shm_stats_create(const char *name, enum shm_stats_role role, const char *program);
+
+/* Unmap the segment.  The file is not removed, so that monitors can read
+   the final snapshot. */
+void shm_stats_close(struct shm_stats *shm);
+
+/* Start and finish an update of the snapshot: between both calls, the
+   writer may modify shm->data freely. */
+static inline void shm_stats_write_begin(struct shm_stats *shm)
+{
+  __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void shm_stats_write_end(struct shm_stats *shm)
+{
+  __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Map an existing segment read-only, and check its header.  Returns NULL
+   in case of error. */
+const struct shm_stats *shm_stats_open(const char *name);
+
+/* Copy a consistent snapshot of [shm] into [data]. */
+void shm_stats_read(const struct shm_stats *shm, struct shm_stats_data *data);
+
+/* Add the counters, target rate and histograms of [src] to [dst], to
+   aggregate the snapshots of several writers (see coordinator.c): copy
+   the first snapshot, and merge the others into it.  [dst] keeps the
+   latest update time, and is only finished if all snapshots are. */
+void shm_stats_merge(struct shm_stats_data *dst, const struct shm_stats_data *src);
+
+#endif
@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <time.h>
+
+#include "common.h"
+#include "simevent.h"
+
+/* Simulation of a client in virtual time.
+
+   This runs the Poisson framework, the schedule of the run (-r/-t,
+   --stdin, --stdin-rateslope) and the selection of connections exactly
+   like udpclient and tcpclient, but it is linked with simevent.c instead
+   of libevent: time jumps from one timer to the next, and queries are
+   counted in memory instead of being sent.  At the end, the achieved
+   rate and the arrival process of each phase, and the distribution of
+   queries over connections, are checked against their targets. */
+
+/* Critical value of the checks on counts, in standard deviations */
+#define SIM_MAX_Z 4.
+
+/* In-memory sink standing for the connections */
+static uint64_t *conn_queries;
+/* Where the schedule is saved (--save-schedule), and its origin */
+static struct schedule_writer *schedule_writer;
+static struct timespec schedule_origin;
+
+struct callback_data {
+  struct poisson_process* process;
+};
+
+static uint64_t _timespec_ns(const struct timespec *ts)
+{
+  return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static void send_query_callback(void *ctx)
+{
+  static struct timespec now_realtime;
+  struct callback_data *data = ctx;
+  uint32_t conn_id, query_index;
+  unsigned char *query;
+  uint16_t query_len;
+  /* Select a connection uniformly at random, like the clients. */
+  conn_id = rng_below(&data->process->choice_rng, nb_conn);
+  query = next_query(&query_index);
+  DO_NTOHS(query_len, query);
+  if (print_rtt) {
+    clock_gettime(CLOCK_REALTIME, &now_realtime);
+    printf("Q,%lu.%.9lu,%u,%lu,%u,,\n",
+	   now_realtime.tv_sec, now_realtime.tv_nsec,
+	   conn_id, conn_queries[conn_id], data->process->process_id);
+  }
+  if (schedule_writer != NULL) {
+    struct schedule_entry entry = {
+      .time_ns = sim_now() - _timespec_ns(&schedule_origin),
+      .conn_id = conn_id,
+      .template_id = query_index,
+    };
+    schedule_write(schedule_writer, &entry);
+  }
+  conn_queries[conn_id]++;
+  stats.queries_sent++;
+  stats.bytes_out += query_len;
+}
+
+static void add_poisson_sender()
+{
+  struct poisson_process *process = poisson_new(base);
+  struct callback_data *callback_arg = malloc(sizeof(struct callback_data));
+  callback_arg->process = process;
+  poisson_set_callback(process, send_query_callback, callback_arg);
+  poisson_set_rate(process, poisson_rate);
+  int ret = poisson_start_process(process, NULL);
+  if (ret != 0) {
+    fprintf(stderr, "Failed to start Poisson process %u\n", process->process_id);
+  }
+}
+
+/* Never called: simclient generates schedules, it does not play them */
+static void send_scheduled_query(uint32_t conn_id, uint32_t query_index)
+{
+}
+
+/* Never called: simclient has no control socket and no scenario */
+static int set_nb_connections(uint32_t n)
+{
+  return -1;
+}
+
+static int reopen_connection(uint32_t conn_id)
+{
+  return -1;
+}
+
+/* Write the phases and the end of the run, and close the schedule. */
+static int save_schedule()
+{
+  struct schedule_phase *phases = calloc(run_summary.nb_phases, sizeof(struct schedule_phase));
+  uint64_t origin = _timespec_ns(&schedule_origin);
+  int ret;
+  if (phases == NULL && run_summary.nb_phases > 0) {
+    perror("Failed to save schedule");
+    return -1;
+  }
+  for (unsigned int i = 0; i < run_summary.nb_phases; i++) {
+    phases[i].start_ns = _timespec_ns(&run_summary.phases[i].start) - origin;
+    phases[i].end_ns = _timespec_ns(&run_summary.phases[i].end) - origin;
+    phases[i].target_start = run_summary.phases[i].target_start;
+    phases[i].target_end = run_summary.phases[i].target_end;
+  }
+  ret = schedule_writer_close(schedule_writer, phases, run_summary.nb_phases,
+			      _timespec_ns(&run_summary.drain_start) - origin);
+  if (ret == 0)
+    info("Saved schedule of %lu queries (%lu bytes)\n", schedule_writer->header.nb_entries,
+	 schedule_writer->header.entries_len);
+  free(phases);
+  free(schedule_writer);
+  return ret;
+}
+
+/* Check the number of queries of each phase against its target, and its
+   arrival process.  Returns the number of failed checks. */
+static int check_phases(FILE *out)
+{
+  struct run_phase *phase;
+  struct arrival_check check;
+  struct timespec duration;
+  double seconds, expected, z;
+  uint64_t sent;
+  int failed = 0;
+  for (unsigned int i = 0; i < run_summary.nb_phases; i++) {
+    phase = &run_summary.phases[i];
+    subtract_timespec(&duration, &phase->end, &phase->start);
+    seconds = duration.tv_sec + duration.tv_nsec / 1e9;
+    sent = phase->sent_end - phase->sent_start;
+    expected = phase->expected;
+    z = expected > 0. ? (sent - expected) / sqrt(expected) : 0.;
+    fprintf(out, "Phase %u: %.3f s, target %.1f -> %.1f qps, %lu queries (expected %.0f, z %+.2f): %s\n",
+	    i + 1, seconds, phase->target_start, phase->target_end, sent, expected, z,
+	    fabs(z) < SIM_MAX_Z ? "pass" : "FAIL");
+    if (fabs(z) >= SIM_MAX_Z)
+      failed++;
+    if (arrival_check(&phase->arrivals, &check) == 0) {
+      fprintf(out, "  Arrivals: ");
+      arrival_check_print(out, &phase->arrivals, &check);
+      if (!check.pass)
+	failed++;
+    }
+  }
+  return failed;
+}
+
+/* Chi-square test of the uniform selection of connections.  Returns 1 if
+   the check failed. */
+static int check_connections(FILE *out)
+{
+  double expected = (double) stats.queries_sent / nb_conn;
+  double chi2 = 0., max_ratio;
+  unsigned int dof = nb_conn - 1;
+  if (dof == 0 || expected < 5.) {
+    fprintf(out, "Connections: too few queries per connection to check their selection\n");
+    return 0;
+  }
+  for (uint32_t i = 0; i < nb_conn; i++)
+    chi2 += (conn_queries[i] - expected) * (conn_queries[i] - expected) / expected;
+  /* chi2 / dof has mean 1 and standard deviation sqrt(2 / dof) */
+  max_ratio = 1. + SIM_MAX_Z * sqrt(2. / dof);
+  fprintf(out, "Connections: %u, %.1f queries each on average, chi2/dof %.3f (max %.3f): %s\n",
+	  nb_conn, expected, chi2 / dof, max_ratio, chi2 / dof < max_ratio ? "pass" : "FAIL");
+  return chi2 / dof >= max_ratio;
+}
+
+void usage(char* progname) {
+  fprintf(stderr, "usage: %s [-h] [-v] [-R] [-s random_seed] [-t duration]  [--queries file]  [--query-policy policy]  [--save-schedule file]  [--event-cost ns]  [--check-arrivals]  [--stdin]  [--stdin-max-rate qps]  [--stdin-rateslope]  -r <rate>  -c <nb_conn>\n",
+	  progname);
+  fprintf(stderr, "Simulates the query schedule of udpclient and tcpclient in virtual time, without network.\n");
+  fprintf(stderr, "Queries are counted per connection instead of being sent, and the achieved rate of each\n");
+  fprintf(stderr, "phase and the selection of connections are checked.  Option '--check-arrivals' also checks\n");
+  fprintf(stderr, "the arrival process of each phase.  Option '--event-cost' advances the virtual clock by\n");
+  fprintf(stderr, "the given number of nanoseconds after each timer callback, to model a slow event loop.\n");
+  fprintf(stderr, "Options -s, -r, -c, -t, -R, --stdin, --stdin-max-rate and --stdin-rateslope are the same as for the clients.\n");
+  fprintf(stderr, "Option '--save-schedule' writes the simulated queries (send time, connection and query) to a\n");
+  fprintf(stderr, "binary schedule, which udpclient and tcpclient play back with '--schedule'.  The query corpus\n");
+  fprintf(stderr, "and policy ('--queries', '--query-policy') must then be the same as for the clients.\n");
+  fprintf(stderr, "The exit status is 1 if any check failed.\n");
+}
+
+int main(int argc, char** argv)
+{
+  /* Same delay of the first queries as the clients, so that the
+     schedules are identical */
+  struct timeval start_offset;
+  struct timespec real_start, real_end, real_elapsed;
+  unsigned int min_query_rate = 0xffffffff;
+  unsigned int max_query_rate = 0;
+  unsigned long int duration = 0, random_seed = 42;
+  unsigned long int event_cost_ns = 0;
+  char *schedule_path = NULL;
+  unsigned int nb_poisson_processes;
+  struct poisson_process *process;
+  struct callback_data *callback_arg;
+  uint64_t start_ns;
+  double virtual_s, real_s;
+  int failed;
+  int ret;
+  int opt;
+
+  verbose = 0;
+  print_rtt = 0;
+  /* There are no responses to validate */
+  validate_responses = 0;
+  /* The virtual event loop has no file descriptors: the simulation
+     waits for the stdin commands instead */
+  commands_blocking = 1;
+
+  /* Start with options */
+  int option_index = -1;
+  static struct option long_options[] = {
+    {"stdin",            no_argument, NULL, 0},
+    {"stdin-rateslope",  no_argument, NULL, 0},
+    {"event-cost",       required_argument, NULL, 0},
+    {"check-arrivals",   no_argument, NULL, 0},
+    {"queries",          required_argument, NULL, 0},
+    {"query-policy",     required_argument, NULL, 0},
+    {"save-schedule",    required_argument, NULL, 0},
+    {"stdin-max-rate",   required_argument, NULL, 0},
+    {NULL,    0,         NULL, 0}
+  };
+  while ((opt = getopt_long(argc, argv, "r:c:vRs:t:h", long_options, &option_index)) != -1) {
+    switch (opt) {
+    case 0: /* long option */
+      if (option_index == 0) { /* --stdin */
+	stdin_commands = 1;
+      }
+      if (option_index == 1) { /* --stdin-rateslope */
+	stdin_rateslope_commands = 1;
+      }
+      if (option_index == 2) { /* --event-cost */
+	event_cost_ns = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 3) { /* --check-arrivals */
+	check_arrivals = 1;
+      }
+      if (option_index == 4) { /* --queries */
+	query_opts.corpus_file = optarg;
+      }
+      if (option_index == 5) { /* --query-policy */
+	query_opts.policy = optarg;
+      }
+      if (option_index == 6) { /* --save-schedule */
+	schedule_path = optarg;
+      }
+      if (option_index == 7) { /* --stdin-max-rate */
+	stdin_max_rate = strtoul(optarg, NULL, 10);
+      }
+      break;
+    case 'r': /* Sending rate */
+      min_query_rate = strtoul(optarg, NULL, 10);
+      max_query_rate = min_query_rate;
+      break;
+    case 'c': /* Number of connections */
+      nb_conn = strtoul(optarg, NULL, 10);
+      break;
+    case 'v': /* verbose */
+      verbose += 1;
+      break;
+    case 'R': /* Print the schedule */
+      print_rtt = 1;
+      break;
+    case 's': /* Random seed */
+      random_seed = strtoul(optarg, NULL, 10);
+      break;
+    case 't': /* Duration */
+      duration = strtoul(optarg, NULL, 10);
+      break;
+    case 'h': /* help */
+      usage(argv[0]);
+      return 0;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if ((max_query_rate == 0 && stdin_commands == 0) || nb_conn == 0) {
+    fprintf(stderr, "Error: missing mandatory arguments\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (stdin_commands == 1 && (duration != 0 || max_query_rate != 0 || stdin_rateslope_commands != 0)) {
+    fprintf(stderr, "Error: --stdin is not compatible with -t, -r, or --stdin-rateslope\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (stdin_rateslope_commands == 1 && (duration != 0 || stdin_commands != 0)) {
+    fprintf(stderr, "Error: --stdin-rateslope is not compatible with -t or --stdin\n");
+    usage(argv[0]);
+    return 1;
+  }
+  /* A simulation without end would never stop */
+  if (stdin_commands == 0 && stdin_rateslope_commands == 0 && duration == 0) {
+    fprintf(stderr, "Error: a duration (-t) is needed with a constant rate\n");
+    usage(argv[0]);
+    return 1;
+  }
+
+  /* Optional stdin-based commands, read as the run goes */
+  if (stdin_commands == 1 || stdin_rateslope_commands == 1) {
+    if (open_commands(&min_query_rate, &max_query_rate) != 0)
+      return 1;
+  }
+
+  srand48(random_seed);
+  poisson_set_seed(random_seed);
+
+  ret = setup_query_corpus(&query_opts, random_seed);
+  if (ret != 0)
+    return 1;
+
+  /* Same in-flight window as the clients, for information */
+  max_queries_in_flight = fmin(fmax(ceil(8 * (double) MAX_RTT_MSEC * (double) max_query_rate / (double) nb_conn / 1000.), 20), 65535);
+  debug("max queries in flight (per conn): %hu\n", max_queries_in_flight);
+
+  /* How many Poisson processes do we need. */
+  nb_poisson_processes = POISSON_PROCESS_PERIOD_MSEC * min_query_rate / 1000;
+  debug("Will spawn %d independent Poisson processes\n", nb_poisson_processes);
+  if (stdin_commands == 1) {
+    poisson_rate = (double) command_stream_peek(&command_stream)->value / (double) nb_poisson_processes;
+    info("Initial Poisson rate: %f\n", poisson_rate);
+  }
+
+  if (print_rtt) {
+    printf("type,timestamp,connection_id,query_id,poisson_id,poisson_interval_us,rtt_us\n");
+  }
+
+  base = event_base_new();
+  sim_set_event_cost(event_cost_ns);
+  conn_queries = calloc(nb_conn, sizeof(uint64_t));
+  if (base == NULL || conn_queries == NULL) {
+    fprintf(stderr, "Failed to allocate the simulation\n");
+    return 1;
+  }
+  stats.live_connections = nb_conn;
+  stats.connections_opened = nb_conn;
+  /* The checks need the phases of the run */
+  print_summary = 1;
+  start_run_summary();
+  /* Arrivals fall on the microseconds of the virtual clock */
+  arrival_ring.resolution_ns = SIM_RESOLUTION_NS;
+  if (schedule_path != NULL) {
+    schedule_writer = malloc(sizeof(struct schedule_writer));
+    if (schedule_writer == NULL ||
+	schedule_writer_open(schedule_writer, schedule_path, nb_conn, corpus.nb_queries) != 0)
+      return 1;
+    clock_gettime(CLOCK_MONOTONIC, &schedule_origin);
+  }
+
+  set_run_start(START_DELAY_MSEC);
+  info("Starting %u Poisson processes generating queries...\n", nb_poisson_processes);
+  for (int i = 0; i < nb_poisson_processes; i++) {
+    process = poisson_new(base);
+    callback_arg = malloc(sizeof(struct callback_data));
+    callback_arg->process = process;
+    poisson_set_callback(process, send_query_callback, callback_arg);
+    poisson_set_rate(process, poisson_rate);
+    delay_until(&start_offset, &run_start);
+    ret = poisson_start_process(process, &start_offset);
+    if (ret != 0) {
+      fprintf(stderr, "Failed to start Poisson process %u\n", process->process_id);
+    }
+  }
+
+  schedule_run(duration);
+
+  info("Starting simulation\n");
+  start_ns = sim_now();
+  syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &real_start);
+  event_base_dispatch(base);
+  syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &real_end);
+  subtract_timespec(&real_elapsed, &real_end, &real_start);
+  virtual_s = (sim_now() - start_ns) / 1e9;
+  real_s = real_elapsed.tv_sec + real_elapsed.tv_nsec / 1e9;
+
+  fprintf(stderr, "Simulated %.3f s in %.3f s: %lu queries, %lu timer callbacks (%.0f per second)\n",
+	  virtual_s, real_s, stats.queries_sent, sim_nb_callbacks(),
+	  real_s > 0. ? sim_nb_callbacks() / real_s : 0.);
+  if (schedule_writer != NULL && save_schedule() != 0)
+    return 1;
+  failed = check_phases(stderr);
+  failed += check_connections(stderr);
+  fprintf(stderr, "Scheduling lag (us): p50 %lu, p99 %lu, p99.9 %lu, max %lu\n",
+	  histogram_percentile(&stats.lag, 50.), histogram_percentile(&stats.lag, 99.),
+	  histogram_percentile(&stats.lag, 99.9), stats.lag.max);
+  fprintf(stderr, "%s\n", failed ? "Some checks FAILED" : "All checks passed");
+
+  /* Free all the things */
+  for (unsigned int i = 0; i < run_summary.nb_phases; i++)
+    arrival_sample_free(&run_summary.phases[i].arrivals);
+  free(run_summary.phases);
+  if (run_summary.arrivals != NULL)
+    arrival_ring_free(&arrival_ring);
+  close_commands();
+  free(conn_queries);
+  poisson_destroy(1);
+  query_corpus_free(&corpus);
+  event_base_free(base);
+  return failed ? 1 : 0;
+}
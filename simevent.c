@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <event2/event.h>
+
+#include "simevent.h"
+
+/* Discrete-event implementation of the subset of libevent used by the
+   Poisson framework and common.h, running in virtual time.
+
+   Binaries linked with this file instead of libevent (see simclient.c)
+   run the exact same scheduling code, but time only advances from one
+   timer to the next, so that hours of traffic are simulated in seconds.
+   clock_gettime() is also overridden, so that all timestamps taken by
+   the code under test (lag, arrivals, phases, statistics) are virtual.
+
+   Only timers are supported: events on file descriptors are accepted but
+   never fire. */
+
+/* Arbitrary origin of the virtual monotonic clock */
+#define SIM_CLOCK_ORIGIN_NS (1000 * 1000000000ULL)
+
+/* Pending timers are kept in a 4-ary min-heap, ordered by deadline and
+   then by insertion order, so that simulations are deterministic.  Keys
+   are stored in the heap itself, which keeps sifting within a few cache
+   lines even with millions of Poisson processes. */
+#define SIM_HEAP_ARITY 4
+
+struct heap_entry {
+  uint64_t deadline;
+  uint64_t seq;
+  struct event *ev;
+};
+
+struct event_base {
+  struct heap_entry *heap;
+  size_t heap_len;
+  size_t heap_size;
+  uint64_t next_seq;
+  short exit;
+  short exit_scheduled;
+  uint64_t exit_at;
+};
+
+struct event {
+  struct event_base *base;
+  evutil_socket_t fd;
+  short events;
+  event_callback_fn callback;
+  void *arg;
+  uint64_t deadline;
+  /* Position in the heap, or -1 if the timer is not pending */
+  ssize_t heap_index;
+  /* Interval of persistent timers */
+  uint64_t interval;
+  /* Freed after its callback (event_base_once) */
+  short once;
+};
+
+static uint64_t _now = SIM_CLOCK_ORIGIN_NS;
+static uint64_t _realtime_offset;
+static uint64_t _event_cost;
+static uint64_t _nb_callbacks;
+
+static uint64_t _timeval_to_ns(const struct timeval *tv)
+{
+  return tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+}
+
+static inline int _before(const struct heap_entry *a, const struct heap_entry *b)
+{
+  return a->deadline < b->deadline || (a->deadline == b->deadline && a->seq < b->seq);
+}
+
+static inline void _heap_set(struct event_base *base, size_t index, const struct heap_entry *entry)
+{
+  base->heap[index] = *entry;
+  entry->ev->heap_index = index;
+}
+
+static void _heap_up(struct event_base *base, size_t index, struct heap_entry entry)
+{
+  while (index > 0) {
+    size_t parent = (index - 1) / SIM_HEAP_ARITY;
+    if (!_before(&entry, &base->heap[parent]))
+      break;
+    _heap_set(base, index, &base->heap[parent]);
+    index = parent;
+  }
+  _heap_set(base, index, &entry);
+}
+
+static void _heap_down(struct event_base *base, size_t index, struct heap_entry entry)
+{
+  while (1) {
+    size_t first = SIM_HEAP_ARITY * index + 1, min = first;
+    if (first >= base->heap_len)
+      break;
+    for (size_t child = first + 1; child < first + SIM_HEAP_ARITY && child < base->heap_len; child++)
+      if (_before(&base->heap[child], &base->heap[min]))
+	min = child;
+    if (!_before(&base->heap[min], &entry))
+      break;
+    _heap_set(base, index, &base->heap[min]);
+    index = min;
+  }
+  _heap_set(base, index, &entry);
+}
+
+static void _heap_remove(struct event_base *base, struct event *ev)
+{
+  size_t index = ev->heap_index;
+  struct heap_entry last = base->heap[--base->heap_len];
+  ev->heap_index = -1;
+  if (last.ev == ev)
+    return;
+  if (index > 0 && _before(&last, &base->heap[(index - 1) / SIM_HEAP_ARITY]))
+    _heap_up(base, index, last);
+  else
+    _heap_down(base, index, last);
+}
+
+static int _heap_push(struct event_base *base, struct event *ev)
+{
+  struct heap_entry entry;
+  if (base->heap_len == base->heap_size) {
+    size_t size = base->heap_size ? 2 * base->heap_size : 1024;
+    struct heap_entry *heap = realloc(base->heap, size * sizeof(struct heap_entry));
+    if (heap == NULL)
+      return -1;
+    base->heap = heap;
+    base->heap_size = size;
+  }
+  entry.deadline = ev->deadline;
+  entry.seq = base->next_seq++;
+  entry.ev = ev;
+  _heap_up(base, base->heap_len++, entry);
+  return 0;
+}
+
+struct event_base *event_base_new(void)
+{
+  struct event_base *base = calloc(1, sizeof(struct event_base));
+  struct timespec realtime;
+  /* The real clock_gettime() is overridden below */
+  syscall(SYS_clock_gettime, CLOCK_REALTIME, &realtime);
+  _realtime_offset = realtime.tv_sec * 1000000000ULL + realtime.tv_nsec - _now;
+  return base;
+}
+
+void event_base_free(struct event_base *base)
+{
+  free(base->heap);
+  free(base);
+}
+
+struct event *event_new(struct event_base *base, evutil_socket_t fd, short events,
+			event_callback_fn callback, void *arg)
+{
+  struct event *ev = calloc(1, sizeof(struct event));
+  if (ev == NULL)
+    return NULL;
+  ev->base = base;
+  ev->fd = fd;
+  ev->events = events;
+  ev->callback = callback;
+  ev->arg = arg;
+  ev->heap_index = -1;
+  return ev;
+}
+
+int event_add(struct event *ev, const struct timeval *timeout)
+{
+  if (ev->heap_index >= 0)
+    _heap_remove(ev->base, ev);
+  if (timeout == NULL)
+    return 0;
+  ev->deadline = _now + _timeval_to_ns(timeout);
+  if (ev->events & EV_PERSIST)
+    ev->interval = _timeval_to_ns(timeout);
+  return _heap_push(ev->base, ev);
+}
+
+int event_del(struct event *ev)
+{
+  if (ev->heap_index >= 0)
+    _heap_remove(ev->base, ev);
+  return 0;
+}
+
+void event_free(struct event *ev)
+{
+  event_del(ev);
+  free(ev);
+}
+
+int event_pending(const struct event *ev, short events, struct timeval *tv)
+{
+  if (ev->heap_index < 0 || !(events & EV_TIMEOUT))
+    return 0;
+  if (tv != NULL) {
+    uint64_t deadline = ev->deadline + _realtime_offset;
+    tv->tv_sec = deadline / 1000000000ULL;
+    tv->tv_usec = (deadline % 1000000000ULL) / 1000;
+  }
+  return EV_TIMEOUT;
+}
+
+int event_base_once(struct event_base *base, evutil_socket_t fd, short events,
+		    event_callback_fn callback, void *arg, const struct timeval *timeout)
+{
+  struct event *ev = event_new(base, fd, events & ~EV_PERSIST, callback, arg);
+  struct timeval zero = {0, 0};
+  if (ev == NULL)
+    return -1;
+  ev->once = 1;
+  return event_add(ev, timeout != NULL ? timeout : &zero);
+}
+
+int event_base_loopexit(struct event_base *base, const struct timeval *timeout)
+{
+  if (timeout == NULL) {
+    base->exit = 1;
+  } else {
+    base->exit_scheduled = 1;
+    base->exit_at = _now + _timeval_to_ns(timeout);
+  }
+  return 0;
+}
+
+int event_base_dispatch(struct event_base *base)
+{
+  struct event *ev;
+  short once;
+  base->exit = 0;
+  while (!base->exit && base->heap_len > 0) {
+    ev = base->heap[0].ev;
+    if (base->exit_scheduled && base->exit_at < ev->deadline) {
+      _now = base->exit_at;
+      break;
+    }
+    _heap_remove(base, ev);
+    /* Late events fire as soon as possible, like in a real event loop */
+    if (ev->deadline > _now)
+      _now = ev->deadline;
+    if (ev->events & EV_PERSIST) {
+      ev->deadline += ev->interval;
+      if (ev->deadline < _now)
+	ev->deadline = _now;
+      _heap_push(base, ev);
+    }
+    /* The callback may free its own event */
+    once = ev->once;
+    ev->callback(ev->fd, EV_TIMEOUT, ev->arg);
+    if (once)
+      free(ev);
+    _now += _event_cost;
+    _nb_callbacks++;
+  }
+  base->exit_scheduled = 0;
+  return base->heap_len > 0 ? 0 : 1;
+}
+
+int clock_gettime(clockid_t clock_id, struct timespec *tp)
+{
+  uint64_t t;
+  switch (clock_id) {
+  case CLOCK_MONOTONIC:
+  case CLOCK_MONOTONIC_RAW:
+  case CLOCK_MONOTONIC_COARSE:
+  case CLOCK_BOOTTIME:
+    t = _now;
+    break;
+  case CLOCK_REALTIME:
+  case CLOCK_REALTIME_COARSE:
+    t = _now + _realtime_offset;
+    break;
+  default:
+    /* CPU time clocks stay real */
+    return syscall(SYS_clock_gettime, clock_id, tp);
+  }
+  tp->tv_sec = t / 1000000000ULL;
+  tp->tv_nsec = t % 1000000000ULL;
+  return 0;
+}
+
+void sim_set_event_cost(uint64_t cost_ns)
+{
+  _event_cost = cost_ns;
+}
+
+uint64_t sim_now()
+{
+  return _now;
+}
+
+uint64_t sim_nb_callbacks()
+{
+  return _nb_callbacks;
+}
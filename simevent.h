@@ -0,0 +1,22 @@
+#ifndef SIMEVENT_H
+#define SIMEVENT_H
+
+#include <stdint.h>
+
+/* Virtual-time replacement for libevent timers, see simevent.c. */
+
+/* Resolution of the virtual clock at which timers fire: they are set
+   with a struct timeval */
+#define SIM_RESOLUTION_NS 1000
+
+/* Advance the virtual clock by [cost_ns] after each callback, to model
+   the processing time of the event loop (0 by default). */
+void sim_set_event_cost(uint64_t cost_ns);
+
+/* Current virtual monotonic time, in nanoseconds. */
+uint64_t sim_now();
+
+/* Number of callbacks run so far. */
+uint64_t sim_nb_callbacks();
+
+#endif
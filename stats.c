@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+#include "utils.h"
+#include "perfcount.h"
+
+
+static double _timespec_to_double(const struct timespec *ts)
+{
+  return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static double _timeval_to_double(const struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void stats_reporter_init(struct stats_reporter *reporter, FILE *out)
+{
+  memset(reporter, 0, sizeof(struct stats_reporter));
+  reporter->out = out;
+  clock_gettime(CLOCK_MONOTONIC, &reporter->start);
+  reporter->last = reporter->start;
+  getrusage(RUSAGE_SELF, &reporter->last_usage);
+}
+
+void stats_report(struct stats_reporter *reporter, struct client_stats *stats)
+{
+  struct timespec now, now_realtime, elapsed, interval;
+  struct rusage usage;
+  double interval_s, cpu_user_s, cpu_sys_s;
+  uint64_t sent, answered;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  clock_gettime(CLOCK_REALTIME, &now_realtime);
+  getrusage(RUSAGE_SELF, &usage);
+  subtract_timespec(&elapsed, &now, &reporter->start);
+  subtract_timespec(&interval, &now, &reporter->last);
+  interval_s = _timespec_to_double(&interval);
+  if (interval_s <= 0.)
+    interval_s = 1e-9;
+  cpu_user_s = _timeval_to_double(&usage.ru_utime) - _timeval_to_double(&reporter->last_usage.ru_utime);
+  cpu_sys_s = _timeval_to_double(&usage.ru_stime) - _timeval_to_double(&reporter->last_usage.ru_stime);
+  sent = stats->queries_sent - reporter->last_queries_sent;
+  answered = stats->answers_received - reporter->last_answers_received;
+  if (reporter->out != NULL) {
+    fprintf(reporter->out,
+	    "{\"time\":%.6f,\"elapsed\":%.6f,\"interval\":%.6f,"
+	    "\"sent\":%lu,\"answered\":%lu,\"timeouts\":%lu,\"in_flight\":%lu,"
+	    "\"bytes_out\":%lu,\"bytes_in\":%lu,"
+	    "\"qps_sent\":%.1f,\"qps_answered\":%.1f,"
+	    "\"total_sent\":%lu,\"total_answered\":%lu,\"total_timeouts\":%lu,"
+	    "\"latency_us\":{\"count\":%lu,\"min\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu},"
+	    "\"lag_us\":{\"count\":%lu,\"p50\":%lu,\"p99\":%lu,\"max\":%lu},"
+	    "\"connections\":%u,\"cpu_user\":%.6f,\"cpu_sys\":%.6f,\"cpu_util\":%.4f",
+	    _timespec_to_double(&now_realtime), _timespec_to_double(&elapsed), interval_s,
+	    sent, answered,
+	    stats->timeouts - reporter->last_timeouts, stats_in_flight(stats),
+	    stats->bytes_out - reporter->last_bytes_out,
+	    stats->bytes_in - reporter->last_bytes_in,
+	    sent / interval_s, answered / interval_s,
+	    stats->queries_sent, stats->answers_received, stats->timeouts,
+	    stats->latency.total, stats->latency.min,
+	    histogram_percentile(&stats->latency, 50.),
+	    histogram_percentile(&stats->latency, 90.),
+	    histogram_percentile(&stats->latency, 99.),
+	    histogram_percentile(&stats->latency, 99.9),
+	    stats->latency.max,
+	    stats->lag.total,
+	    histogram_percentile(&stats->lag, 50.),
+	    histogram_percentile(&stats->lag, 99.),
+	    stats->lag.max,
+	    stats->live_connections, cpu_user_s, cpu_sys_s,
+	    (cpu_user_s + cpu_sys_s) / interval_s);
+    if (perf_counters != NULL)
+      perf_counters_report(reporter->out, sent);
+    fprintf(reporter->out, "}\n");
+    fflush(reporter->out);
+  }
+  histogram_merge(&reporter->latency_total, &stats->latency);
+  histogram_merge(&reporter->lag_total, &stats->lag);
+  histogram_reset(&stats->latency);
+  histogram_reset(&stats->lag);
+  reporter->last = now;
+  reporter->last_usage = usage;
+  reporter->last_queries_sent = stats->queries_sent;
+  reporter->last_answers_received = stats->answers_received;
+  reporter->last_timeouts = stats->timeouts;
+  reporter->last_bytes_out = stats->bytes_out;
+  reporter->last_bytes_in = stats->bytes_in;
+}
+
+void run_summary_init(struct run_summary *summary)
+{
+  memset(summary, 0, sizeof(struct run_summary));
+  clock_gettime(CLOCK_MONOTONIC, &summary->start);
+  getrusage(RUSAGE_SELF, &summary->start_usage);
+}
+
+void run_summary_begin_phase(struct run_summary *summary, const struct client_stats *stats, double target_rate)
+{
+  struct run_phase *phase;
+  run_summary_end_phase(summary, stats, target_rate);
+  if (summary->nb_phases == RUN_SUMMARY_MAX_PHASES) {
+    /* Extend the last phase */
+    phase = &summary->phases[summary->nb_phases - 1];
+    phase->nb_merged++;
+  } else {
+    summary->phases = realloc(summary->phases, (summary->nb_phases + 1) * sizeof(struct run_phase));
+    phase = &summary->phases[summary->nb_phases++];
+    clock_gettime(CLOCK_MONOTONIC, &phase->start);
+    phase->target_start = target_rate;
+    phase->sent_start = stats->queries_sent;
+    phase->answered_start = stats->answers_received;
+    memset(&phase->arrivals, 0, sizeof(struct arrival_sample));
+    if (summary->arrivals != NULL)
+      phase->arrivals_start = summary->arrivals->count;
+    phase->nb_merged = 1;
+    phase->expected = 0.;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &phase->part_start);
+  phase->part_target = target_rate;
+  summary->in_phase = 1;
+}
+
+void run_summary_end_phase(struct run_summary *summary, const struct client_stats *stats, double target_rate)
+{
+  struct run_phase *phase;
+  struct timespec part;
+  if (!summary->in_phase)
+    return;
+  phase = &summary->phases[summary->nb_phases - 1];
+  clock_gettime(CLOCK_MONOTONIC, &phase->end);
+  /* Exact for constant rates and linear slopes */
+  subtract_timespec(&part, &phase->end, &phase->part_start);
+  phase->expected += (phase->part_target + target_rate) / 2 * _timespec_to_double(&part);
+  phase->target_end = target_rate;
+  phase->sent_end = stats->queries_sent;
+  phase->answered_end = stats->answers_received;
+  /* Only copy the arrivals here: the analysis is too slow to run from
+     the event loop, and waits for the end of the run.  Merged phases
+     keep the arrivals of their first part only, and are not checked. */
+  if (summary->arrivals != NULL && phase->nb_merged == 1)
+    arrival_sample_take(&phase->arrivals, summary->arrivals, phase->arrivals_start,
+			&phase->start, &phase->end, phase->target_start, target_rate);
+  summary->in_phase = 0;
+}
+
+void run_summary_set_target(struct run_summary *summary, double target_rate)
+{
+  struct run_phase *phase;
+  struct timespec now, part;
+  if (!summary->in_phase)
+    return;
+  phase = &summary->phases[summary->nb_phases - 1];
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  subtract_timespec(&part, &now, &phase->part_start);
+  phase->expected += phase->part_target * _timespec_to_double(&part);
+  phase->part_start = now;
+  phase->part_target = target_rate;
+}
+
+static void _print_percentiles(FILE *out, const char *name, const struct histogram *h)
+{
+  if (h->total == 0) {
+    fprintf(out, "  %s: no samples\n", name);
+    return;
+  }
+  fprintf(out, "  %s (µs): min %lu, mean %.0f, p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %lu\n",
+	  name, h->min, (double) h->sum / h->total,
+	  histogram_percentile(h, 50.), histogram_percentile(h, 90.),
+	  histogram_percentile(h, 99.), histogram_percentile(h, 99.9), h->max);
+}
+
+void run_summary_print(FILE *out, const struct run_summary *summary, const struct client_stats *stats,
+		       const struct histogram *latency, const struct histogram *lag, uint32_t nb_conn)
+{
+  struct timespec now, duration;
+  struct rusage usage;
+  double duration_s, cpu_user_s, cpu_sys_s;
+  uint64_t lost = stats->queries_sent - stats->answers_received;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  getrusage(RUSAGE_SELF, &usage);
+  subtract_timespec(&duration, &now, &summary->start);
+  duration_s = _timespec_to_double(&duration);
+  fprintf(out, "Summary:\n");
+  for (unsigned int i = 0; i < summary->nb_phases; i++) {
+    const struct run_phase *phase = &summary->phases[i];
+    double phase_s, target, achieved;
+    subtract_timespec(&duration, &phase->end, &phase->start);
+    phase_s = _timespec_to_double(&duration);
+    if (phase_s <= 0.)
+      continue;
+    target = phase->expected / phase_s;
+    achieved = (phase->sent_end - phase->sent_start) / phase_s;
+    if (phase->nb_merged > 1)
+      fprintf(out, "  phases %u-%u: %.3f s, mean target %.1f qps", i + 1, i + phase->nb_merged, phase_s, target);
+    else
+      fprintf(out, "  phase %u: %.3f s, target %.1f qps", i + 1, phase_s, target);
+    if (phase->nb_merged == 1 && phase->target_start != phase->target_end)
+      fprintf(out, " (%.1f to %.1f)", phase->target_start, phase->target_end);
+    fprintf(out, ", achieved %.1f qps", achieved);
+    if (target > 0.)
+      fprintf(out, " (%+.2f%%)", 100. * (achieved - target) / target);
+    fprintf(out, ", answered %.1f qps\n", (phase->answered_end - phase->answered_start) / phase_s);
+    if (summary->arrivals != NULL && phase->nb_merged == 1) {
+      struct arrival_check check;
+      fprintf(out, "    arrivals: ");
+      if (arrival_check(&phase->arrivals, &check) == 0)
+	arrival_check_print(out, &phase->arrivals, &check);
+      else
+	fprintf(out, "too few to check\n");
+    }
+  }
+  fprintf(out, "  queries: %lu sent, %lu answered, %lu lost (%.3f%%), %lu late\n",
+	  stats->queries_sent, stats->answers_received, lost,
+	  stats->queries_sent ? 100. * lost / stats->queries_sent : 0.,
+	  stats->late_answers);
+  if (summary->drain_start.tv_sec != 0) {
+    subtract_timespec(&duration, &summary->drain_end, &summary->drain_start);
+    fprintf(out, "  drain: %lu of %lu queries in flight answered in %.3f s\n",
+	    stats->answers_received - summary->drain_answered_start,
+	    summary->drain_in_flight_start, _timespec_to_double(&duration));
+  }
+  _print_percentiles(out, "latency", latency);
+  _print_percentiles(out, "scheduler lag", lag);
+  /* More connections than in use at the end: some were closed during the
+     run (--control) */
+  if (stats->connections_opened > nb_conn)
+    fprintf(out, "  connections: %lu opened, %u in use at the end, %lu lost during the run\n",
+	    stats->connections_opened, nb_conn, stats->connections_lost);
+  else
+    fprintf(out, "  connections: %lu of %u opened, %lu lost during the run\n",
+	    stats->connections_opened, nb_conn, stats->connections_lost);
+  cpu_user_s = _timeval_to_double(&usage.ru_utime) - _timeval_to_double(&summary->start_usage.ru_utime);
+  cpu_sys_s = _timeval_to_double(&usage.ru_stime) - _timeval_to_double(&summary->start_usage.ru_stime);
+  fprintf(out, "  CPU: %.3f s user, %.3f s system, %.1f%% of one core over %.3f s\n",
+	  cpu_user_s, cpu_sys_s, duration_s > 0. ? 100. * (cpu_user_s + cpu_sys_s) / duration_s : 0.,
+	  duration_s);
+}
@@ -0,0 +1,136 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "histogram.h"
+#include "arrivals.h"
+
+/* Counters of a client.  The clients are single-threaded: counters are
+   only updated from the event loop, and reports are generated from a
+   timer event of the same loop, so no locking is ever needed. */
+struct client_stats {
+  /* Cumulative counters since the start */
+  uint64_t queries_sent;
+  uint64_t answers_received;
+  /* Queries whose slot was reused before any answer was received, i.e.
+     that were not answered within the in-flight window (see
+     MAX_RTT_MSEC) */
+  uint64_t timeouts;
+  /* Answers to a query that was no longer pending: the query had timed
+     out, or this is a duplicate answer */
+  uint64_t late_answers;
+  uint64_t bytes_out;
+  uint64_t bytes_in;
+  uint64_t connections_opened;
+  /* Connections closed by the server or failed during the run */
+  uint64_t connections_lost;
+  uint32_t live_connections;
+  /* Latency of answers and lag of the Poisson scheduler, both in
+     microseconds, since the last report */
+  struct histogram latency;
+  struct histogram lag;
+};
+
+/* Periodic report of client statistics, as one JSON object per line. */
+struct stats_reporter {
+  FILE *out;
+  struct timespec start;
+  struct timespec last;
+  struct rusage last_usage;
+  /* Counters at the time of the last report, to compute deltas */
+  uint64_t last_queries_sent;
+  uint64_t last_answers_received;
+  uint64_t last_timeouts;
+  uint64_t last_bytes_out;
+  uint64_t last_bytes_in;
+  /* Histograms accumulated over all reports */
+  struct histogram latency_total;
+  struct histogram lag_total;
+};
+
+void stats_reporter_init(struct stats_reporter *reporter, FILE *out);
+
+/* Write one line of statistics covering the interval since the last
+   report, fold the interval histograms of [stats] into the totals of
+   [reporter], and reset them. */
+void stats_report(struct stats_reporter *reporter, struct client_stats *stats);
+
+/* A phase of a run during which the target rate is either constant (-r,
+   --stdin), varies linearly (--stdin-rateslope), or follows a rate
+   function of a scenario (--scenario). */
+struct run_phase {
+  struct timespec start;
+  struct timespec end;
+  /* Target rate at the start and at the end of the phase, in queries per
+     second */
+  double target_start;
+  double target_end;
+  /* Counters at the start and at the end of the phase */
+  uint64_t sent_start;
+  uint64_t sent_end;
+  uint64_t answered_start;
+  uint64_t answered_end;
+  /* Arrivals recorded during the phase, when they are checked */
+  uint64_t arrivals_start;
+  struct arrival_sample arrivals;
+  /* Number of phases of the run covered by this one (see
+     RUN_SUMMARY_MAX_PHASES), start and initial target rate of the last
+     of them, and expected number of queries over all of them */
+  unsigned int nb_merged;
+  struct timespec part_start;
+  double part_target;
+  double expected;
+};
+
+/* Number of phases kept in the summary: further phases are merged into
+   the last one, so that schedules of any length (see commands.h) run in
+   constant memory. */
+#define RUN_SUMMARY_MAX_PHASES 1024
+
+/* Summary of a whole run, printed when the client exits. */
+struct run_summary {
+  struct timespec start;
+  struct rusage start_usage;
+  struct run_phase *phases;
+  unsigned int nb_phases;
+  /* Whether the last phase is still running */
+  short in_phase;
+  /* Times of the Poisson events, to check the arrival process of each
+     phase, or NULL */
+  const struct arrival_ring *arrivals;
+  /* Drain phase: time when sending stopped, answers received and queries
+     in flight at that time */
+  struct timespec drain_start;
+  struct timespec drain_end;
+  uint64_t drain_answered_start;
+  uint64_t drain_in_flight_start;
+};
+
+void run_summary_init(struct run_summary *summary);
+
+/* End the current phase, if any, and start a new one. */
+void run_summary_begin_phase(struct run_summary *summary, const struct client_stats *stats, double target_rate);
+
+void run_summary_end_phase(struct run_summary *summary, const struct client_stats *stats, double target_rate);
+
+/* Record a change of the target rate to [target_rate] within the current
+   phase, which then accounts for the previous target up to now. */
+void run_summary_set_target(struct run_summary *summary, double target_rate);
+
+/* Print the summary to [out].  [latency] and [lag] are the histograms
+   of the whole run, and [nb_conn] the number of requested connections. */
+void run_summary_print(FILE *out, const struct run_summary *summary, const struct client_stats *stats,
+		       const struct histogram *latency, const struct histogram *lag, uint32_t nb_conn);
+
+/* Number of queries sent but not yet answered nor timed out. */
+static inline uint64_t stats_in_flight(const struct client_stats *stats)
+{
+  uint64_t done = stats->answers_received + stats->timeouts;
+  return stats->queries_sent > done ? stats->queries_sent - done : 0;
+}
+
+#endif
@@ -36,6 +36,17 @@ struct tcp_connection {
   /* Used to remember when we sent the last [max_queries_in_flight]
      queries, to compute a RTT. */
   struct timespec* query_timestamps;
+  /* Whether each of the last [max_queries_in_flight] queries is still
+     waiting for an answer, to detect timeouts. */
+  unsigned char* query_pending;
+  /* Index in the corpus of the last [max_queries_in_flight] queries, to
+     validate responses (only allocated with --validate). */
+  uint32_t* query_templates;
+  /* Whether the connection is still open, as far as we know */
+  char alive;
+  /* Idle timeout advertised by the server with edns-tcp-keepalive, in
+     milliseconds, or 0 if unknown. */
+  uint32_t keepalive_ms;
 };
 
 struct callback_data {
@@ -43,9 +54,19 @@ struct callback_data {
   struct tcp_connection* connections;
 };
 
-/* Array of all TCP connections */
+/* Array of all TCP connections, of size max_conn: only the first nb_conn
+   are in use. */
 struct tcp_connection *connections;
 
+/* Where and how to open connections, also during the run (--control) */
+static struct sockaddr_storage *server;
+static int server_len;
+static short use_tls;
+static SSL_CTX *ssl_ctx;
+
+/* Number of queries sent only to keep idle connections open */
+static unsigned long int nb_keepalive_queries;
+
 /* Like sleep(), blocks for the given number of seconds, but run the event
    loop in the meantime. */
 static void event_sleep(unsigned int seconds)
@@ -66,7 +87,7 @@ static void event_usleep(unsigned int usec)
   event_base_dispatch(base);
 }
 
-static void readcb(struct bufferevent *bev, void *ctx)
+static void read_answers(struct bufferevent *bev, void *ctx)
 {
   struct tcp_connection *params = ctx;
   unsigned char* input_ptr;
@@ -74,6 +95,9 @@ static void readcb(struct bufferevent *bev, void *ctx)
   uint16_t query_id;
   struct timespec* query_timestamp;
   struct timespec now, rtt;
+  unsigned long int rtt_us = 0;
+  /* Whether the query was no longer pending */
+  short late;
   /* Used for logging, because "now" uses a monotonic clock. */
   struct timespec now_realtime;
   /* Retrieve response (or mirrored message), and make sure it is a
@@ -83,8 +107,10 @@ static void readcb(struct bufferevent *bev, void *ctx)
   debug("Entering readcb\n");
   /* Loop until we cannot read a complete DNS message. */
   while (1) {
-    if (print_rtt) {
+    if (print_rtt || validate_responses || report_stats) {
       clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    if (print_rtt) {
       clock_gettime(CLOCK_REALTIME, &now_realtime);
     }
     size_t input_len = evbuffer_get_length(input);
@@ -106,42 +132,85 @@ static void readcb(struct bufferevent *bev, void *ctx)
       return;
     }
     /* We are now certain to have a complete DNS message. */
+    stats.bytes_in += dns_len + 2;
+    late = !params->query_pending[query_id % max_queries_in_flight];
+    if (late) {
+      stats.late_answers++;
+    } else {
+      params->query_pending[query_id % max_queries_in_flight] = 0;
+      stats.answers_received++;
+    }
     /* Compute RTT, in microseconds */
-    if (print_rtt) {
+    if (print_rtt || validate_responses || report_stats) {
       query_timestamp = &params->query_timestamps[query_id % max_queries_in_flight];
       subtract_timespec(&rtt, &now, query_timestamp);
-      /* CSV format: type (Answer), timestamp at the time of reception
-	 (answer), connection ID, query ID, unused, unused, computed RTT in µs */
-      printf("A,%lu.%.9lu,%u,%u,,,%lu\n",
-	     now_realtime.tv_sec, now_realtime.tv_nsec,
-	     params->connection_id,
-	     query_id,
-	     (rtt.tv_nsec / 1000) + (1000000 * rtt.tv_sec));
+      rtt_us = (rtt.tv_nsec / 1000) + (1000000 * rtt.tv_sec);
+      /* The timestamp of a late answer belongs to another query */
+      if (!late)
+	histogram_record(&stats.latency, rtt_us);
+    }
+    if (print_rtt) {
+      log_answer(&now_realtime, RTT_ANSWER, params->connection_id, query_id, late ? RTT_NONE : rtt_us);
+    }
+    if (validate_responses || query_opts.edns_opts.keepalive) {
+      /* Make the whole message contiguous */
+      input_ptr = evbuffer_pullup(input, dns_len + 2);
+    }
+    if (validate_responses) {
+      record_response(input_ptr + 2, dns_len,
+		      params->query_templates[query_id % max_queries_in_flight], rtt_us);
+    }
+    /* Learn the idle timeout of the server (RFC 7828) */
+    if (query_opts.edns_opts.keepalive) {
+      int timeout = dns_edns_keepalive(input_ptr + 2, dns_len);
+      if (timeout >= 0 && timeout * 100 != params->keepalive_ms) {
+	debug("Server idle timeout on connection %u: %d ms\n", params->connection_id, timeout * 100);
+	params->keepalive_ms = timeout * 100;
+      }
     }
     /* Discard the DNS message (including the 2-bytes length prefix) */
     evbuffer_drain(input, dns_len + 2);
   }
 }
 
-static void send_query(struct tcp_connection* conn)
+static void readcb(struct bufferevent *bev, void *ctx)
+{
+  perf_section_begin(PERF_SECTION_READ);
+  read_answers(bev, ctx);
+  perf_section_end(PERF_SECTION_READ);
+}
+
+/* Send the query with the given index in the corpus on [conn]. */
+static void send_query_template(struct tcp_connection* conn, uint32_t query_index)
 {
-  /* DNS query for example.com (with type A) */
-  static char data[] = {
-    0x00, 0x1d, /* Size */
-    0xff, 0xff, /* Query ID */
-    0x01, 0x00, 0x00, 0x01, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x07, 0x65, 0x78, 0x61,
-    0x6d, 0x70, 0x6c, 0x65, 0x03, 0x63, 0x6f, 0x6d,
-    0x00, 0x00, 0x01, 0x00, 0x01
-  };
   struct bufferevent *bev = conn->bev;
   struct evbuffer *output = bufferevent_get_output(bev);
+  unsigned char *query;
+  uint16_t query_len;
+  perf_section_begin(PERF_SECTION_SEND);
+  /* Length-prefixed query, ready to be sent on the wire */
+  query = prepare_query(query_index);
+  DO_NTOHS(query_len, query);
   /* Copy query ID */
-  DO_HTONS(data + 2, conn->query_id);
+  DO_HTONS(query + 2, conn->query_id);
+  if (validate_responses)
+    conn->query_templates[conn->query_id % max_queries_in_flight] = query_index;
+  /* The previous query using this slot never got an answer */
+  if (conn->query_pending[conn->query_id % max_queries_in_flight])
+    stats.timeouts++;
+  conn->query_pending[conn->query_id % max_queries_in_flight] = 1;
   /* Record timestamp */
   clock_gettime(CLOCK_MONOTONIC, &conn->query_timestamps[conn->query_id % max_queries_in_flight]);
-  evbuffer_add(output, data, sizeof(data));
+  evbuffer_add(output, query, query_len + 2);
+  stats.queries_sent++;
+  stats.bytes_out += query_len + 2;
   conn->query_id += 1;
+  perf_section_end(PERF_SECTION_SEND);
+}
+
+static void send_query(struct tcp_connection* conn)
+{
+  send_query_template(conn, query_corpus_select(&corpus));
 }
 
 static void send_query_callback(void *ctx)
@@ -150,19 +219,26 @@ static void send_query_callback(void *ctx)
   struct tcp_connection *connection;
   struct callback_data *data = ctx;
   /* Select a TCP connection uniformly at random and send a query on it. */
-  connection = &data->connections[lrand48() % nb_conn];
-  if (print_rtt) {
+  connection = &data->connections[rng_below(&data->process->choice_rng, nb_conn)];
+  if (print_rtt && rtt_sampled(connection->connection_id, connection->query_id)) {
     clock_gettime(CLOCK_REALTIME, &now_realtime);
-    /* CSV format: type (Query), timestamp, connection ID, query ID, Poisson ID, poisson interval (in µs), unused. */
-    printf("Q,%lu.%.9lu,%u,%u,%u,,\n",
-	   now_realtime.tv_sec, now_realtime.tv_nsec,
-	   connection->connection_id,
-	   connection->query_id,
-	   data->process->process_id);
+    log_query(&now_realtime, connection->connection_id, connection->query_id, data->process->process_id);
   }
   send_query(connection);
 }
 
+/* Send a query of the schedule (--schedule) */
+static void send_scheduled_query(uint32_t conn_id, uint32_t query_index)
+{
+  static struct timespec now_realtime;
+  struct tcp_connection *connection = &connections[conn_id];
+  if (print_rtt && rtt_sampled(connection->connection_id, connection->query_id)) {
+    clock_gettime(CLOCK_REALTIME, &now_realtime);
+    log_query(&now_realtime, connection->connection_id, connection->query_id, RTT_NONE);
+  }
+  send_query_template(connection, query_index);
+}
+
 static void add_poisson_sender()
 {
   struct poisson_process *process = poisson_new(base);
@@ -177,55 +253,275 @@ static void add_poisson_sender()
   }
 }
 
+/* Periodically sends a query on connections that have been idle for too
+   long compared to the idle timeout advertised by the server, so that
+   the server does not close them. */
+static void keepalive_sweep(evutil_socket_t fd, short events, void *ctx)
+{
+  struct timespec now, idle, now_realtime;
+  struct tcp_connection *conn;
+  unsigned long int idle_ms;
+  /* No new query while waiting for the last answers (--drain) */
+  if (draining)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (uint32_t i = 0; i < nb_conn; i++) {
+    conn = &connections[i];
+    if (conn->keepalive_ms == 0 || conn->bev == NULL)
+      continue;
+    subtract_timespec(&idle, &now, &conn->query_timestamps[(uint16_t) (conn->query_id - 1) % max_queries_in_flight]);
+    idle_ms = idle.tv_sec * 1000 + idle.tv_nsec / 1000000;
+    /* Keep a safety margin of one sweep interval, plus 25% of the timeout */
+    if (idle_ms + KEEPALIVE_SWEEP_INTERVAL_MSEC >= conn->keepalive_ms * 3 / 4) {
+      debug("Sending keepalive query on connection %u (idle for %lu ms)\n", conn->connection_id, idle_ms);
+      if (print_rtt && rtt_sampled(conn->connection_id, conn->query_id)) {
+	clock_gettime(CLOCK_REALTIME, &now_realtime);
+	log_query(&now_realtime, conn->connection_id, conn->query_id, RTT_NONE);
+      }
+      send_query(conn);
+      nb_keepalive_queries++;
+    }
+  }
+}
+
+static void eventcb(struct bufferevent *bev, short events, void *ptr);
+
+/* Set up connection [conn_id] around the connected (or connecting) [bev]
+   and its optional [ssl] object, and start reading from it.  The
+   buffers of a connection are kept when it is closed, and reused if it
+   is opened again. */
+static void init_connection(uint32_t conn_id, struct bufferevent *bev, SSL *ssl)
+{
+  struct tcp_connection *conn = &connections[conn_id];
+  int bufev_fd;
+  int on = 1;
+  /* Disable Nagle */
+  bufev_fd = bufferevent_getfd(bev);
+  if (bufev_fd == -1) {
+    info("Failed to disable Nagle on connection %u (can't get file descriptor)\n", conn_id);
+  } else {
+    setsockopt(bufev_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  conn->connection_id = conn_id;
+  conn->ssl = ssl;
+  conn->query_id = 0;
+  conn->bev = bev;
+  if (conn->query_timestamps == NULL)
+    conn->query_timestamps = malloc(max_queries_in_flight * sizeof(struct timespec));
+  conn->keepalive_ms = 0;
+  conn->alive = 1;
+  stats.live_connections++;
+  stats.connections_opened++;
+  if (conn->query_pending == NULL)
+    conn->query_pending = calloc(max_queries_in_flight, sizeof(unsigned char));
+  if (validate_responses && conn->query_templates == NULL)
+    conn->query_templates = malloc(max_queries_in_flight * sizeof(uint32_t));
+  bufferevent_setcb(bev, readcb, NULL, eventcb, conn);
+  bufferevent_enable(bev, EV_READ|EV_WRITE);
+}
+
+/* Open connection [conn_id] without blocking the event loop: queries
+   sent before the connection is established are buffered.  Returns -1
+   in case of error. */
+static int open_connection(uint32_t conn_id)
+{
+  struct bufferevent *bev;
+  SSL *ssl = NULL;
+  int sock = -1;
+  /* libevent creates the socket itself, unless it must be bound first */
+  if (source_len > 0) {
+    sock = socket(server->ss_family, SOCK_STREAM, 0);
+    if (sock == -1) {
+      perror("Failed to create socket");
+      return -1;
+    }
+    if (bind_source(sock) != 0 || evutil_make_socket_nonblocking(sock) != 0) {
+      close(sock);
+      return -1;
+    }
+  }
+  if (use_tls) {
+    ssl = SSL_new(ssl_ctx);
+    if (ssl == NULL) {
+      perror("Failed to initialise openssl object");
+      if (sock != -1)
+	close(sock);
+      return -1;
+    }
+    bev = bufferevent_openssl_socket_new(base, sock, ssl, BUFFEREVENT_SSL_CONNECTING,
+					 BEV_OPT_DEFER_CALLBACKS | BEV_OPT_CLOSE_ON_FREE);
+  } else {
+    bev = bufferevent_socket_new(base, sock, BEV_OPT_CLOSE_ON_FREE);
+  }
+  if (bev == NULL) {
+    perror("Failed to create socket-based bufferevent");
+    if (sock != -1)
+      close(sock);
+    return -1;
+  }
+  if (bufferevent_socket_connect(bev, (struct sockaddr*)server, server_len) != 0) {
+    perror("Failed to connect to host");
+    bufferevent_free(bev);
+    return -1;
+  }
+  init_connection(conn_id, bev, ssl);
+  return 0;
+}
+
+/* Close [conn]: the queries it still waits for count as timeouts. */
+static void close_connection(struct tcp_connection *conn)
+{
+  for (unsigned int i = 0; i < max_queries_in_flight; i++) {
+    if (conn->query_pending[i]) {
+      conn->query_pending[i] = 0;
+      stats.timeouts++;
+    }
+  }
+  /* Also frees the SSL object */
+  bufferevent_free(conn->bev);
+  conn->bev = NULL;
+  conn->ssl = NULL;
+  if (conn->alive) {
+    conn->alive = 0;
+    stats.live_connections--;
+  }
+}
+
+static int set_nb_connections(uint32_t n)
+{
+  while (nb_conn > n)
+    close_connection(&connections[--nb_conn]);
+  while (nb_conn < n) {
+    if (open_connection(nb_conn) != 0)
+      return -1;
+    nb_conn++;
+  }
+  info("Now using %u connections\n", nb_conn);
+  return 0;
+}
+
+static int reopen_connection(uint32_t conn_id)
+{
+  close_connection(&connections[conn_id]);
+  return open_connection(conn_id);
+}
+
 static void eventcb(struct bufferevent *bev, short events, void *ptr)
 {
+  struct tcp_connection *conn = ptr;
   if (events & BEV_EVENT_ERROR) {
     perror("Connection error");
   }
+  if ((events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) && conn->alive) {
+    info("Connection %u closed\n", conn->connection_id);
+    conn->alive = 0;
+    stats.live_connections--;
+    stats.connections_lost++;
+  }
 }
 
 void usage(char* progname) {
-  fprintf(stderr, "usage: %s [-h] [-v] [-R] [-s random_seed] [-t duration]  [--stdin]  [--stdin-rateslope]  [--tls]  [-n new_conn_rate]  -p <port>  -r <rate>  -c <nb_conn>  <host>\n",
+  fprintf(stderr, "usage: %s [-h] [-v] [-R] [-s random_seed] [-t duration]  [--queries file]  [--query-policy policy]  [--save-queries file]  [--random-label len]  [--label-encoding enc]  [--label-unique]  [--edns]  [--edns-bufsize size]  [--edns-do]  [--edns-padding block]  [--edns-keepalive]  [--validate]  [--stats file]  [--stats-fd fd]  [--stats-interval ms]  [--shm-stats name]  [--metrics [addr:]port]  [--drain ms]  [--no-summary]  [--check-arrivals]  [--schedule file]  [--search start:max[:increment]]  [--search-step ms]  [--search-settle ms]  [--slo spec]  [--control path]  [--control-max-conn n]  [--control-max-rate qps]  [--scenario file]  [--start-at time]  [--source addr]  [--rtt-log file]  [--rtt-log-format format]  [--rtt-sample spec]  [--heatmap file]  [--heatmap-format format]  [--heatmap-interval ms]  [--perf-counters]  [--stdin]  [--stdin-max-rate qps]  [--stdin-rateslope]  [--tls]  [-n new_conn_rate]  -p <port>  -r <rate>  -c <nb_conn>  <host>\n",
 	  progname);
   fprintf(stderr, "Connects to the specified host and port, with the chosen number of TCP or TLS connections.\n");
   fprintf(stderr, "[rate] is the total number of writes per second towards the server, accross all TCP connections.\n");
-  fprintf(stderr, "Each write is 31 bytes.\n");
+  fprintf(stderr, "By default, each query is for 'example.com' with type A (31 bytes including the TCP length prefix).\n");
+  fprintf(stderr, "With option '--queries', load queries from a file with one '<qname> [qtype]' per line,\n");
+  fprintf(stderr, "or from a corpus file previously written with '--save-queries'.\n");
+  fprintf(stderr, "With option '--random-label', each query name is prefixed by a random label of the given length\n");
+  fprintf(stderr, "(the corpus then gives the list of suffixes), encoded as 'hex' (default) or 'base32' with '--label-encoding'.\n");
+  fprintf(stderr, "With option '--label-unique', random labels are guaranteed not to repeat.\n");
+  fprintf(stderr, "Option '--edns' adds an EDNS0 OPT record to queries, with UDP payload size given by '--edns-bufsize' (default 1232).\n");
+  fprintf(stderr, "Option '--edns-do' sets the DNSSEC OK bit, and '--edns-padding' pads queries to a multiple of the given block size (RFC 8467).\n");
+  fprintf(stderr, "Option '--edns-keepalive' requests the server idle timeout (RFC 7828); idle connections are then kept open with additional queries.\n");
+  fprintf(stderr, "With option '--validate', responses are classified by rcode, TC bit and question match (echoed queries are mismatches), and a summary is printed at the end.\n");
+  fprintf(stderr, "With option '--stats' (or '--stats-fd'), statistics are written to the given file (or file descriptor) as one JSON\n");
+  fprintf(stderr, "object per interval of '--stats-interval' milliseconds (default %d): queries, answers, timeouts, bytes, latency\n", STATS_INTERVAL_MSEC);
+  fprintf(stderr, "and scheduling lag percentiles, connections and CPU usage.\n");
+  fprintf(stderr, "Option '--shm-stats' publishes live statistics in /dev/shm/<name> for external monitors (see shmstat).\n");
+  fprintf(stderr, "Option '--metrics' serves the same statistics over HTTP in OpenMetrics format, for Prometheus.\n");
+  fprintf(stderr, "At the end of the run, sending stops and the client waits up to '--drain' milliseconds (default %d) for\n", DRAIN_TIMEOUT_MSEC);
+  fprintf(stderr, "the answers still in flight, and then prints a summary: target and achieved rate per phase, losses, latency,\n");
+  fprintf(stderr, "scheduling lag, connections and CPU usage.  Option '--no-summary' disables it and the latency measurement it needs.\n");
+  fprintf(stderr, "With '--check-arrivals', the summary also tests whether the actual send times of each phase follow the\n");
+  fprintf(stderr, "target Poisson process: rate per %d ms window, coefficient of variation, Kolmogorov-Smirnov and Anderson-Darling.\n", ARRIVALS_WINDOW_MSEC);
+  fprintf(stderr, "With option '--schedule', the program plays back a schedule generated by 'simclient --save-schedule' instead of\n");
+  fprintf(stderr, "running Poisson processes: rates, duration, connections and queries all come from the schedule.\n");
+  fprintf(stderr, "With option '--search', the program searches the highest rate between 'start' and 'max' that meets the SLO\n");
+  fprintf(stderr, "given by '--slo' (default 'p99=%g,loss=%g,errors=%g,lag=%g': milliseconds and percents, errors need '--validate').\n",
+	  SLO_P99_MSEC, SLO_LOSS_PCT, SLO_ERRORS_PCT, SLO_LAG_MSEC);
+  fprintf(stderr, "The rate doubles (or grows by 'increment') until a step fails, and is then bisected.  Each step lasts\n");
+  fprintf(stderr, "'--search-settle' (default %d) plus '--search-step' (default %d) milliseconds, and only the latter is measured.\n",
+	  SEARCH_SETTLE_MSEC, SEARCH_STEP_MSEC);
+  fprintf(stderr, "With option '--control', the program accepts commands on the given Unix socket during the run: 'rate <qps>',\n");
+  fprintf(stderr, "'slope <qps/s>', 'conns <nb_conn>', 'queries <policy>', 'stats', 'stop' and 'help', one per line.  Connections can\n");
+  fprintf(stderr, "be added up to '--control-max-conn' and the rate raised up to '--control-max-rate' (default: '-c' and '-r').\n");
+  fprintf(stderr, "With option '--scenario', the program runs the phases of the given file on the same connections, one\n");
+  fprintf(stderr, "'<name> <duration_ms> [key=value]... [measure]' per line, with keys 'conns', 'conn-rate' (conn/s), 'rate' ('<qps>',\n");
+  fprintf(stderr, "'<from>:<to>' or 'sin:<mean>:<amplitude>:<period_ms>'), 'queries' (policy) and 'churn' (conn/s), and prints\n");
+  fprintf(stderr, "statistics for each phase and for the phases flagged 'measure' (see scenario.h).  '-c' defaults to the first phase.\n");
+  fprintf(stderr, "With option '--start-at', the run starts at the given time in seconds since the Epoch (e.g. '1700000000.5')\n");
+  fprintf(stderr, "instead of %d ms after the setup, and its skew from this time is reported: several clients with synchronised\n", START_DELAY_MSEC);
+  fprintf(stderr, "clocks then start their schedules together.\n");
+  fprintf(stderr, "With option '--source', all connections are opened from the given local address (see coordinator).\n");
+  fprintf(stderr, "Option '--query-policy' selects queries from the corpus: 'uniform' (default), 'sequential', 'zipf' or 'zipf:<exponent>'.\n");
   fprintf(stderr, "[new_conn_rate] is the number of new connections to open per second when starting the client.\n");
-  fprintf(stderr, "With option '-R', print RTT samples as CSV: connection ID, reception timestamp, RTT in microseconds.\n");
+  fprintf(stderr, "With option '-R', print RTT samples as CSV: connection ID, reception timestamp, RTT in microseconds\n");
+  fprintf(stderr, "(empty for late answers, whose RTT is only known from the timestamp of their query).\n");
+  fprintf(stderr, "With option '--rtt-log', the same samples are written to the given file as binary records (see rttlog.h and rttstat).\n");
+  fprintf(stderr, "Option '--rtt-log-format' selects 'binary' (24 bytes per record, default) or 'columnar' (compressed blocks).\n");
+  fprintf(stderr, "Option '--rtt-sample' logs part of the queries of '-R' or '--rtt-log': 'hash:N' logs 1 query in N with its answers,\n");
+  fprintf(stderr, "'reservoir:K[:interval_ms]' logs K answers drawn at random in each interval, with their queries, (default %d ms).  Statistics still cover all queries.\n", RTT_SAMPLE_INTERVAL_MSEC);
+  fprintf(stderr, "With option '--heatmap', write the latency histogram of every interval of '--heatmap-interval' ms (default %d)\n", HEATMAP_INTERVAL_MSEC);
+  fprintf(stderr, "to the given file, as 'binary' (default) or 'csv' with '--heatmap-format' (see heatmap.h and rttheatmap).\n");
+  fprintf(stderr, "With option '--perf-counters', count cycles, instructions, cache misses and context switches of the event loop\n");
+  fprintf(stderr, "with perf_event_open, and report them per query in '--stats' and in the summary, and per call of its hot sections.\n");
   fprintf(stderr, "With option '-t', only send queries for the given amount of seconds.\n");
   fprintf(stderr, "With option '--stdin', the program ignores 'rate' and 'duration' and expects them\n");
-  fprintf(stderr, "to be given on stdin as a sequence of '<duration_ms> <rate>' lines, with a first line giving the number of subsequent lines.\n");
+  fprintf(stderr, "to be given on stdin as a sequence of '<duration_ms> <rate>' lines, optionally preceded by a line giving their number.\n");
+  fprintf(stderr, "Commands are read as the run goes, %d ahead, so stdin can be a pipe and the sequence can have any length.\n", COMMANDS_LOOKAHEAD);
+  fprintf(stderr, "Connections are sized for the rate of '--stdin-max-rate' (default: the highest rate of the first %d commands),\n", COMMANDS_LOOKAHEAD);
+  fprintf(stderr, "and a command above it ends the sequence.\n");
   fprintf(stderr, "With option '--stdin-rateslope', the program starts from 'rate' qps, and expects\n");
   fprintf(stderr, "a sequence of '<duration_ms> <slope>' lines to be given on stdin, where each\n");
-  fprintf(stderr, "'slope' in qps/s indicates how much to increase or decrease the query rate. The first line\n");
-  fprintf(stderr, "must give the number of subsequent lines.\n");
+  fprintf(stderr, "'slope' in qps/s indicates how much to increase or decrease the query rate, read in the same way.\n");
   fprintf(stderr, "Option '-s' allows to choose a random seed (unsigned int) to determine times of transmission.  By default, the seed is set to 42\n");
 }
 
 int main(int argc, char** argv)
 {
   struct event_config *ev_cfg;
-  struct bufferevent **bufevents;
+  struct bufferevent *bev;
   struct addrinfo hints;
   struct addrinfo *res_list, *res;
-  struct sockaddr_storage *server;
-  struct timeval initial_timeout;
-  struct timeval duration_timeval;
-  /* Optional stdin-based commands */
-  unsigned int nb_commands;
-  struct command *commands;
-  struct rateslope_command *rateslope_commands;
+  /* Delay of the first query of each Poisson process, until the start of
+     the run */
+  struct timeval start_offset;
+  struct event *keepalive_ev = NULL;
   unsigned int min_query_rate = 0xffffffff;
   unsigned int max_query_rate = 0;
   /* Used to change the limit of open files */
   struct rlimit limit_openfiles;
-  int server_len;
   int sock;
-  int bufev_fd;
-  int on = 1;
   int ret;
   int opt;
-  short use_tls = 0;
+  /* Periodic statistics */
+  char *stats_path = NULL;
+  int stats_fd = -1;
+  unsigned int stats_interval_ms = STATS_INTERVAL_MSEC;
+  unsigned int heatmap_interval_ms = HEATMAP_INTERVAL_MSEC;
+  short perf_enabled = 0;
+  char *shm_stats_path = NULL;
+  char *metrics_addr = NULL;
+  /* Precomputed send schedule */
+  char *schedule_path = NULL;
+  /* Saturation search */
+  char *search_spec = NULL;
+  char *slo_spec = NULL;
+  /* Runtime control socket */
+  char *control_path = NULL;
+  /* Scenario of phases */
+  char *scenario_path = NULL;
   unsigned long int duration = 0, new_conn_rate = 1000, random_seed = 42;
   unsigned long int new_conn_interval;
   unsigned long int conn_id;
@@ -237,7 +533,6 @@ int main(int argc, char** argv)
   char port_s[NI_MAXSERV];
   /* TLS handling */
   SSL *ssl = NULL;
-  SSL_CTX *ssl_ctx = NULL;
 
   verbose = 0;
   print_rtt = 0;
@@ -248,6 +543,45 @@ int main(int argc, char** argv)
     {"stdin",            no_argument, NULL, 0},
     {"stdin-rateslope",  no_argument, NULL, 0},
     {"tls",              no_argument, NULL, 0},
+    {"queries",          required_argument, NULL, 0},
+    {"query-policy",     required_argument, NULL, 0},
+    {"save-queries",     required_argument, NULL, 0},
+    {"random-label",     required_argument, NULL, 0},
+    {"label-encoding",   required_argument, NULL, 0},
+    {"label-unique",     no_argument, NULL, 0},
+    {"edns",             no_argument, NULL, 0},
+    {"edns-bufsize",     required_argument, NULL, 0},
+    {"edns-do",          no_argument, NULL, 0},
+    {"edns-padding",     required_argument, NULL, 0},
+    {"edns-keepalive",   no_argument, NULL, 0},
+    {"validate",         no_argument, NULL, 0},
+    {"stats",            required_argument, NULL, 0},
+    {"stats-fd",         required_argument, NULL, 0},
+    {"stats-interval",   required_argument, NULL, 0},
+    {"shm-stats",        required_argument, NULL, 0},
+    {"metrics",          required_argument, NULL, 0},
+    {"drain",            required_argument, NULL, 0},
+    {"no-summary",       no_argument, NULL, 0},
+    {"check-arrivals",   no_argument, NULL, 0},
+    {"schedule",         required_argument, NULL, 0},
+    {"search",           required_argument, NULL, 0},
+    {"search-step",      required_argument, NULL, 0},
+    {"search-settle",    required_argument, NULL, 0},
+    {"slo",              required_argument, NULL, 0},
+    {"control",          required_argument, NULL, 0},
+    {"control-max-conn", required_argument, NULL, 0},
+    {"control-max-rate", required_argument, NULL, 0},
+    {"scenario",         required_argument, NULL, 0},
+    {"start-at",         required_argument, NULL, 0},
+    {"source",           required_argument, NULL, 0},
+    {"rtt-log",          required_argument, NULL, 0},
+    {"rtt-log-format",   required_argument, NULL, 0},
+    {"rtt-sample",       required_argument, NULL, 0},
+    {"heatmap",          required_argument, NULL, 0},
+    {"heatmap-format",   required_argument, NULL, 0},
+    {"heatmap-interval", required_argument, NULL, 0},
+    {"perf-counters",    no_argument, NULL, 0},
+    {"stdin-max-rate",   required_argument, NULL, 0},
     {NULL,               0,           NULL, 0}
   };
   while ((opt = getopt_long(argc, argv, "p:r:c:n:vRs:t:h", long_options, &option_index)) != -1) {
@@ -262,6 +596,143 @@ int main(int argc, char** argv)
       if (option_index == 2) { /* --tls */
 	use_tls = 1;
       }
+      if (option_index == 3) { /* --queries */
+	query_opts.corpus_file = optarg;
+      }
+      if (option_index == 4) { /* --query-policy */
+	query_opts.policy = optarg;
+      }
+      if (option_index == 5) { /* --save-queries */
+	query_opts.save_file = optarg;
+      }
+      if (option_index == 6) { /* --random-label */
+	query_opts.label_len = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 7) { /* --label-encoding */
+	query_opts.label_encoding = optarg;
+      }
+      if (option_index == 8) { /* --label-unique */
+	query_opts.label_unique = 1;
+      }
+      if (option_index == 9) { /* --edns */
+	query_opts.edns = 1;
+      }
+      if (option_index == 10) { /* --edns-bufsize */
+	query_opts.edns = 1;
+	query_opts.edns_opts.bufsize = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 11) { /* --edns-do */
+	query_opts.edns = 1;
+	query_opts.edns_opts.do_bit = 1;
+      }
+      if (option_index == 12) { /* --edns-padding */
+	query_opts.edns = 1;
+	char *end;
+	unsigned long block = strtoul(optarg, &end, 10);
+	if (*optarg == '\0' || *end != '\0' || block < 1 || block > 65535) {
+	  fprintf(stderr, "Invalid EDNS padding block size: %s (expected 1 to 65535)\n", optarg);
+	  return 1;
+	}
+	query_opts.edns_opts.padding_block = block;
+      }
+      if (option_index == 13) { /* --edns-keepalive */
+	query_opts.edns = 1;
+	query_opts.edns_opts.keepalive = 1;
+      }
+      if (option_index == 14) { /* --validate */
+	validate_responses = 1;
+      }
+      if (option_index == 15) { /* --stats */
+	stats_path = optarg;
+      }
+      if (option_index == 16) { /* --stats-fd */
+	stats_fd = strtol(optarg, NULL, 10);
+      }
+      if (option_index == 17) { /* --stats-interval */
+	stats_interval_ms = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 18) { /* --shm-stats */
+	shm_stats_path = optarg;
+      }
+      if (option_index == 19) { /* --metrics */
+	metrics_addr = optarg;
+      }
+      if (option_index == 20) { /* --drain */
+	drain_timeout_ms = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 21) { /* --no-summary */
+	print_summary = 0;
+      }
+      if (option_index == 22) { /* --check-arrivals */
+	check_arrivals = 1;
+      }
+      if (option_index == 23) { /* --schedule */
+	schedule_path = optarg;
+      }
+      if (option_index == 24) { /* --search */
+	search_spec = optarg;
+      }
+      if (option_index == 25) { /* --search-step */
+	search_step_ms = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 26) { /* --search-settle */
+	search_settle_ms = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 27) { /* --slo */
+	slo_spec = optarg;
+      }
+      if (option_index == 28) { /* --control */
+	control_path = optarg;
+      }
+      if (option_index == 29) { /* --control-max-conn */
+	max_conn = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 30) { /* --control-max-rate */
+	control_max_rate = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 31) { /* --scenario */
+	scenario_path = optarg;
+      }
+      if (option_index == 32) { /* --start-at */
+	if (parse_start_at(optarg) != 0)
+	  return 1;
+      }
+      if (option_index == 33) { /* --source */
+	if (set_source_address(optarg) != 0)
+	  return 1;
+      }
+      if (option_index == 34) { /* --rtt-log */
+	rtt_log_path = optarg;
+	print_rtt = 1;
+      }
+      if (option_index == 35) { /* --rtt-log-format */
+	if ((rtt_log_format = rtt_log_parse_format(optarg)) < 0) {
+	  fprintf(stderr, "Unknown RTT log format: %s\n", optarg);
+	  return 1;
+	}
+      }
+      if (option_index == 36) { /* --rtt-sample */
+	if (rtt_sampler_parse(&rtt_sampler, optarg) != 0)
+	  return 1;
+      }
+      if (option_index == 37) { /* --heatmap */
+	heatmap_path = optarg;
+      }
+      if (option_index == 38) { /* --heatmap-format */
+	if ((heatmap_format = heatmap_parse_format(optarg)) < 0) {
+	  fprintf(stderr, "Unknown heatmap format: %s\n", optarg);
+	  return 1;
+	}
+      }
+      if (option_index == 39) { /* --heatmap-interval */
+	heatmap_interval_ms = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 40) { /* --perf-counters */
+	perf_enabled = 1;
+      }
+      if (option_index == 41) { /* --stdin-max-rate */
+	stdin_max_rate = strtoul(optarg, NULL, 10);
+      }
       break;
     case 'p': /* TCP port */
       port = optarg;
@@ -298,7 +769,8 @@ int main(int argc, char** argv)
     }
   }
 
-  if (optind >= argc || port == NULL || (max_query_rate == 0 && stdin_commands == 0) || nb_conn == 0) {
+  if (optind >= argc || port == NULL || (schedule_path == NULL && scenario_path == NULL && nb_conn == 0) ||
+      (schedule_path == NULL && search_spec == NULL && scenario_path == NULL && max_query_rate == 0 && stdin_commands == 0)) {
     fprintf(stderr, "Error: missing mandatory arguments\n");
     usage(argv[0]);
     return 1;
@@ -313,31 +785,72 @@ int main(int argc, char** argv)
     usage(argv[0]);
     return 1;
   }
+  if (schedule_path != NULL && (duration != 0 || max_query_rate != 0 || stdin_commands != 0 || stdin_rateslope_commands != 0)) {
+    fprintf(stderr, "Error: --schedule is not compatible with -t, -r, --stdin or --stdin-rateslope\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (search_spec != NULL && (duration != 0 || max_query_rate != 0 || stdin_commands != 0 ||
+			      stdin_rateslope_commands != 0 || schedule_path != NULL)) {
+    fprintf(stderr, "Error: --search is not compatible with -t, -r, --stdin, --stdin-rateslope or --schedule\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (control_path != NULL && (schedule_path != NULL || search_spec != NULL)) {
+    fprintf(stderr, "Error: --control is not compatible with --schedule or --search\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (scenario_path != NULL && (duration != 0 || max_query_rate != 0 || stdin_commands != 0 || stdin_rateslope_commands != 0 ||
+				schedule_path != NULL || search_spec != NULL || control_path != NULL)) {
+    fprintf(stderr, "Error: --scenario is not compatible with -t, -r, --stdin, --stdin-rateslope, --schedule, --search or --control\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (search_spec != NULL) {
+    if (search_parse(&search, search_spec) != 0 || slo_parse(&slo, slo_spec) != 0)
+      return 1;
+    search_mode = 1;
+    min_query_rate = search.start_rate;
+    max_query_rate = search.max_rate;
+  }
   host = argv[optind];
 
-  if (stdin_commands == 1) {
-    ret = read_nb_commands(&nb_commands);
-    if (ret == -1)
-      return ret;
-    /* Read commands */
-    commands = calloc(nb_commands, sizeof(struct command));
-    ret = read_commands(commands, &min_query_rate, &max_query_rate, nb_commands);
-    if (ret == -1)
-      return ret;
-    debug("Minimum query rate: %u\n", min_query_rate);
-    debug("Maximum query rate: %u\n", max_query_rate);
-  } else if (stdin_rateslope_commands == 1) {
-    ret = read_nb_commands(&nb_commands);
-    if (ret == -1)
-      return ret;
-    /* Read "rate slope change" commands */
-    rateslope_commands = calloc(nb_commands, sizeof(struct rateslope_command));
-    ret = read_rateslope_commands(rateslope_commands, nb_commands);
-    if (ret == -1)
-      return ret;
+  /* Optional stdin-based commands, read as the run goes */
+  if (stdin_commands == 1 || stdin_rateslope_commands == 1) {
+    if (open_commands(&min_query_rate, &max_query_rate) != 0)
+      return 1;
   }
 
   srand48(random_seed);
+  poisson_set_seed(random_seed);
+  if (rtt_sampler_start(&rtt_sampler, random_seed) != 0)
+    return 1;
+
+  /* Encode all queries once, before any connection is opened. */
+  ret = setup_query_corpus(&query_opts, random_seed);
+  if (ret != 0)
+    return 1;
+
+  /* The schedule gives the number of connections and the rates */
+  if (schedule_path != NULL) {
+    if (open_playback(schedule_path) != 0)
+      return 1;
+    max_query_rate = ceil(schedule_max_rate(&send_schedule));
+  }
+
+  /* The scenario gives the rates, and the number of connections if -c
+     is not given */
+  if (scenario_path != NULL && open_scenario(scenario_path, random_seed, &min_query_rate, &max_query_rate) != 0)
+    return 1;
+
+  /* Capacity for the changes made through the control socket */
+  if (max_conn < nb_conn)
+    max_conn = nb_conn;
+  if (control_max_rate < max_query_rate)
+    control_max_rate = max_query_rate;
+  if (control_path != NULL)
+    max_query_rate = control_max_rate;
 
   if (use_tls) {
     /* Initialise TLS client */
@@ -347,7 +860,10 @@ int main(int argc, char** argv)
 
   /* Compute maximum number of queries in flight.  Use a "safety factor"
      of 8 to account for the worst case. */
-  double in_flight = 8 * (double) MAX_RTT_MSEC * (double) max_query_rate / (double) nb_conn / 1000.;
+  double conn_rate = (double) max_query_rate / (double) nb_conn;
+  if (scenario_mode)
+    conn_rate = scenario_max_conn_rate(&scenario, nb_conn);
+  double in_flight = 8 * (double) MAX_RTT_MSEC * conn_rate / 1000.;
   if (in_flight > 65534) {
     max_queries_in_flight = 65535;
   } else if (in_flight < 20) {
@@ -358,16 +874,23 @@ int main(int argc, char** argv)
     max_queries_in_flight = ceil(in_flight);
   }
   debug("max queries in flight (per conn): %hu\n", max_queries_in_flight);
+  /* Rate per connection that the control socket must not exceed: the
+     one the tables are sized for, with the same safety factor */
+  control_max_conn_rate = 1000. * max_queries_in_flight / (8 * (double) MAX_RTT_MSEC);
+  if (control_max_conn_rate < conn_rate)
+    control_max_conn_rate = conn_rate;
 
   /* How many Poisson processes do we need. */
-  nb_poisson_processes = POISSON_PROCESS_PERIOD_MSEC * min_query_rate / 1000;
+  nb_poisson_processes = playback ? 0 : POISSON_PROCESS_PERIOD_MSEC * min_query_rate / 1000;
   debug("Will spawn %d independent Poisson processes\n", nb_poisson_processes);
 
   if (stdin_commands == 1) {
     /* Set initial rate for each Poisson process */
-    poisson_rate = (double) commands[0].query_rate / (double) nb_poisson_processes;
+    poisson_rate = (double) command_stream_peek(&command_stream)->value / (double) nb_poisson_processes;
     info("Initial Poisson rate: %f\n", poisson_rate);
   }
+  if (scenario_mode)
+    poisson_rate = scenario_rate / (double) nb_poisson_processes;
 
   /* Interval between two new connections, in microseconds. */
   new_conn_interval = 1000000 / new_conn_rate;
@@ -389,7 +912,9 @@ int main(int argc, char** argv)
 	    nb_conn, limit_openfiles.rlim_cur);
   }
 
-  if (print_rtt) {
+  if (rtt_log_path != NULL && open_rtt_log() != 0)
+    return 1;
+  if (print_rtt && rtt_log == NULL) {
     printf("type,timestamp,connection_id,query_id,poisson_id,poisson_interval_us,rtt_us\n");
   }
 
@@ -407,10 +932,17 @@ int main(int argc, char** argv)
   }
 
   for (res = res_list; res != NULL; res = res->ai_next) {
+    /* The server must have the same address family as --source */
+    if (source_len > 0 && res->ai_family != source_addr.ss_family)
+      continue;
     sock = socket(res->ai_family, res->ai_socktype,
 		  res->ai_protocol);
     if (sock == -1)
       continue;
+    if (bind_source(sock) != 0) {
+      close(sock);
+      continue;
+    }
 
     getnameinfo(res->ai_addr, res->ai_addrlen, host_s, NI_MAXHOST,
 		port_s, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
@@ -465,10 +997,30 @@ int main(int argc, char** argv)
     return 1;
   }
 
+  if (perf_enabled && perf_counters_start() != 0)
+    return 1;
+  start_run_summary();
+  if (stats_path != NULL || stats_fd != -1) {
+    ret = start_stats_reporting(stats_path, stats_fd, stats_interval_ms);
+    if (ret != 0)
+      return 1;
+  }
+  if (heatmap_path != NULL && start_heatmap(heatmap_interval_ms) != 0)
+    return 1;
+  if (shm_stats_path != NULL || metrics_addr != NULL) {
+    ret = start_shm_stats(shm_stats_path, "tcpclient", SHM_STATS_INTERVAL_MSEC);
+    if (ret != 0)
+      return 1;
+  }
+  if (metrics_addr != NULL) {
+    ret = metrics_start(metrics_addr, shm_stats);
+    if (ret != 0)
+      return 1;
+  }
+
   /* Connect again, but using libevent, and multiple times. */
   info("Opening %u connections to host %s port %s...\n", nb_conn, host_s, port_s);
-  bufevents = malloc(nb_conn * sizeof(struct bufferevent*));
-  connections = malloc(nb_conn * sizeof(struct tcp_connection));
+  connections = calloc(max_conn, sizeof(struct tcp_connection));
   for (conn_id = 0; conn_id < nb_conn; conn_id++) {
     errno = 0;
     /* Create and connect socket */
@@ -477,6 +1029,10 @@ int main(int argc, char** argv)
       perror("Failed to create socket");
       break;
     }
+    if (bind_source(sock) != 0) {
+      close(sock);
+      break;
+    }
 
     ret = connect(sock, (struct sockaddr*)server, server_len);
     if (ret != 0) {
@@ -495,32 +1051,18 @@ int main(int argc, char** argv)
 	perror("Failed to initialise openssl object");
 	break;
       }
-      bufevents[conn_id] = bufferevent_openssl_socket_new(base, sock,
-							  ssl, BUFFEREVENT_SSL_CONNECTING,
-							  BEV_OPT_DEFER_CALLBACKS | BEV_OPT_CLOSE_ON_FREE);
+      bev = bufferevent_openssl_socket_new(base, sock,
+					   ssl, BUFFEREVENT_SSL_CONNECTING,
+					   BEV_OPT_DEFER_CALLBACKS | BEV_OPT_CLOSE_ON_FREE);
     } else {
-      bufevents[conn_id] = bufferevent_socket_new(base, sock, 0);
+      bev = bufferevent_socket_new(base, sock, BEV_OPT_CLOSE_ON_FREE);
     }
 
-    if (bufevents[conn_id] == NULL) {
+    if (bev == NULL) {
       perror("Failed to create socket-based bufferevent");
       break;
     }
-
-    /* Disable Nagle */
-    bufev_fd = bufferevent_getfd(bufevents[conn_id]);
-    if (bufev_fd == -1) {
-      info("Failed to disable Nagle on connection %ld (can't get file descriptor)\n", conn_id);
-    } else {
-      setsockopt(bufev_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
-    }
-    connections[conn_id].connection_id = conn_id;
-    connections[conn_id].ssl = ssl;
-    connections[conn_id].query_id = 0;
-    connections[conn_id].bev = bufevents[conn_id];
-    connections[conn_id].query_timestamps = malloc(max_queries_in_flight * sizeof(struct timespec));
-    bufferevent_setcb(bufevents[conn_id], readcb, NULL, eventcb, &connections[conn_id]);
-    bufferevent_enable(bufevents[conn_id], EV_READ|EV_WRITE);
+    init_connection(conn_id, bev, ssl);
 
     /* Progress output, roughly once per second */
     if (conn_id % new_conn_rate == 0)
@@ -531,97 +1073,93 @@ int main(int argc, char** argv)
   }
   info("Opened %ld connections to host %s port %s\n", conn_id, host_s, port_s);
 
-  /* Leave some time for all connections to connect */
-  if (use_tls) {
-    event_sleep(3 + nb_conn / 200);
-  } else {
-    event_sleep(3 + nb_conn / 5000);
-  }
+  /* Leave some time for all connections to connect, unless the run
+     starts at a given time: they then connect until that time. */
+  if (!start_at)
+    event_sleep(use_tls ? 3 + nb_conn / 200 : 3 + nb_conn / 5000);
+
+  /* A schedule is played back at once, unless --start-at is given */
+  set_run_start(playback ? 0 : START_DELAY_MSEC);
 
   info("Starting %u Poisson processes generating queries...\n", nb_poisson_processes);
   for (int i = 0; i < nb_poisson_processes; i++) {
-    generate_poisson_interarrival(&initial_timeout, poisson_rate);
-    /* Add 5 seconds to avoid missing query deadline even before we start
-       the event loop.  Without this, the first queries all go out at the
-       same time, creating a large burst. */
-    initial_timeout.tv_sec += 5;
-    debug("initial timeout %ld s %ld us\n", initial_timeout.tv_sec, initial_timeout.tv_usec);
     process = poisson_new(base);
     callback_arg = malloc(sizeof(struct callback_data));
     callback_arg->process = process;
     callback_arg->connections = connections;
     poisson_set_callback(process, send_query_callback, callback_arg);
     poisson_set_rate(process, poisson_rate);
-    ret = poisson_start_process(process, &initial_timeout);
+    delay_until(&start_offset, &run_start);
+    ret = poisson_start_process(process, &start_offset);
     if (ret != 0) {
       fprintf(stderr, "Failed to start Poisson process %u\n", process->process_id);
     }
   }
 
-  /* Schedule stop event. */
-  if (duration > 0) {
-    info("Scheduling stop event in %ld seconds.\n", duration);
-    /* Account for the 5 seconds delay on all events */
-    duration_timeval.tv_sec = 5 + duration;
-    duration_timeval.tv_usec = 0;
-    event_base_loopexit(base, &duration_timeval);
-  }
+  /* Schedule rate changes and the end of the run. */
+  if (playback)
+    schedule_playback();
+  else if (search_mode)
+    schedule_search();
+  else if (scenario_mode)
+    schedule_scenario();
+  else
+    schedule_run(duration);
 
-  /* Schedule changes of query rate. */
-  if (stdin_commands == 1) {
-    debug("Scheduling query rate changes according to stdin commands.\n");
-    /* Accounts for 5-seconds delay on all events */
-    struct timeval delay_timeval = {5, 0};
-    struct event *change_rate_ev;
-    for (int i = 0; i < nb_commands; ++i) {
-      change_rate_ev = event_new(base, -1, 0, change_query_rate, &commands[i].query_rate);
-      event_add(change_rate_ev, &delay_timeval);
-      timeval_add_ms(&delay_timeval, commands[i].duration_ms);
-    }
-    event_base_loopexit(base, &delay_timeval);
-  }
-
-  /* Schedule changes of query rate slope. */
-  if (stdin_rateslope_commands == 1) {
-    debug("Scheduling query rate slope changes according to stdin commands.\n");
-    /* Accounts for 5-seconds delay on all events */
-    struct timeval delay_timeval = {5, 0};
-    struct event *change_rate_slope_ev;
-    for (int i = 0; i < nb_commands; ++i) {
-      change_rate_slope_ev = event_new(base, -1, 0, change_query_rate_slope, &rateslope_commands[i]);
-      event_add(change_rate_slope_ev, &delay_timeval);
-      timeval_add_ms(&delay_timeval, rateslope_commands[i].duration_ms);
-    }
-    event_base_loopexit(base, &delay_timeval);
+  if (control_path != NULL && start_control(control_path) != 0)
+    return 1;
+
+  /* Keep connections open according to the server idle timeout. */
+  if (query_opts.edns_opts.keepalive) {
+    struct timeval sweep_interval = {0, 0};
+    timeval_add_ms(&sweep_interval, KEEPALIVE_SWEEP_INTERVAL_MSEC);
+    keepalive_ev = event_new(base, -1, EV_PERSIST, keepalive_sweep, NULL);
+    event_add(keepalive_ev, &sweep_interval);
   }
 
   info("Starting event loop\n");
   event_base_dispatch(base);
+  stop_control();
+  stop_stats_reporting();
+  stop_heatmap();
+  stop_shm_stats();
+  close_rtt_log();
+  print_run_summary();
+  if (print_summary)
+    perf_counters_print_summary(stderr, stats.queries_sent);
+  perf_counters_stop();
+  print_search();
+  print_scenario();
 
-  /* Free all the things */
-  if (stdin_commands == 1) {
-    free(commands);
+  if (validate_responses) {
+    print_response_stats();
   }
-  if (stdin_rateslope_commands == 1) {
-    free(rateslope_commands);
+  if (keepalive_ev != NULL) {
+    info("Sent %lu keepalive queries on idle connections\n", nb_keepalive_queries);
+    event_free(keepalive_ev);
   }
-  for (conn_id = 0; conn_id < nb_conn; conn_id++) {
-    if (bufevents[conn_id] == NULL)
-      break;
-    bufferevent_free(bufevents[conn_id]);
+
+  /* Free all the things */
+  close_commands();
+  for (conn_id = 0; conn_id < max_conn; conn_id++) {
+    /* Also closes the socket and frees the SSL object */
+    if (connections[conn_id].bev != NULL)
+      bufferevent_free(connections[conn_id].bev);
     if (connections[conn_id].query_timestamps != NULL) {
       free(connections[conn_id].query_timestamps);
     }
-    if (use_tls) {
-      SSL_free(connections[conn_id].ssl);
+    if (connections[conn_id].query_templates != NULL) {
+      free(connections[conn_id].query_templates);
     }
+    free(connections[conn_id].query_pending);
   }
   if (use_tls) {
     SSL_CTX_free(ssl_ctx);
   }
-  free(bufevents);
   free(connections);
   poisson_destroy(1);
+  close_playback();
+  query_corpus_free(&corpus);
   event_base_free(base);
   return 0;
 }
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <getopt.h>
 #include <arpa/inet.h>
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -10,15 +11,25 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 
+#include "shmstats.h"
+#include "metrics.h"
+
 #define MAX_OPENFILES_DEFAULT 1024 * 1024
 #define MAX_OPENFILES_TARGET  1024 * 1024 * 256
 
+/* Counters of the server, published with --shm-stats */
+static uint64_t bytes_echoed;
+static uint64_t connections_opened;
+static uint64_t live_connections;
+static struct shm_stats *shm_stats;
+
 static void readcb(struct bufferevent *bev, void *ctx)
 {
   /* This callback is invoked when there is data to read on bev. */
   struct evbuffer *input = bufferevent_get_input(bev);
   struct evbuffer *output = bufferevent_get_output(bev);
 
+  bytes_echoed += evbuffer_get_length(input);
   /* Copy all the data from the input buffer to the output buffer. */
   evbuffer_add_buffer(output, input);
 }
@@ -29,6 +40,7 @@ static void eventcb(struct bufferevent *bev, short events, void *ctx)
     perror("Error from bufferevent");
   if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
     bufferevent_free(bev);
+    live_connections--;
   }
 }
 
@@ -46,6 +58,22 @@ static void accept_conn_cb(struct evconnlistener *listener,
   struct bufferevent *bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
   bufferevent_setcb(bev, readcb, NULL, eventcb, NULL);
   bufferevent_enable(bev, EV_READ|EV_WRITE);
+  connections_opened++;
+  live_connections++;
+}
+
+static void publish_shm_stats(evutil_socket_t fd, short events, void *ctx)
+{
+  struct shm_stats_data *data = &shm_stats->data;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  shm_stats_write_begin(shm_stats);
+  data->update_time_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  data->bytes_in = bytes_echoed;
+  data->bytes_out = bytes_echoed;
+  data->connections_opened = connections_opened;
+  data->live_connections = live_connections;
+  shm_stats_write_end(shm_stats);
 }
 
 static void
@@ -68,9 +96,37 @@ int main(int argc, char** argv)
   FILE *nr_open;
   int ret;
   int port = 4242;
+  char *shm_stats_path = NULL;
+  char *metrics_addr = NULL;
+  struct event *shm_stats_ev;
+  struct timeval shm_stats_interval = {0, SHM_STATS_INTERVAL_MSEC * 1000};
+  int opt, option_index;
+  struct option long_options[] = {
+    {"shm-stats", required_argument, NULL, 0},
+    {"metrics",   required_argument, NULL, 0},
+    {NULL,        0,                 NULL, 0}
+  };
 
-  if (argc > 1) {
-    port = atoi(argv[1]);
+  while ((opt = getopt_long(argc, argv, "h", long_options, &option_index)) != -1) {
+    switch (opt) {
+    case 0: /* long option */
+      if (option_index == 0) { /* --shm-stats */
+	shm_stats_path = optarg;
+      }
+      if (option_index == 1) { /* --metrics */
+	metrics_addr = optarg;
+      }
+      break;
+    default:
+      fprintf(stderr, "usage: %s [--shm-stats name] [--metrics [addr:]port] [port]\n", argv[0]);
+      fprintf(stderr, "Echoes back anything sent to it over TCP (default port 4242).\n");
+      fprintf(stderr, "Option '--shm-stats' publishes live statistics in /dev/shm/<name> for external monitors (see shmstat).\n");
+      fprintf(stderr, "Option '--metrics' serves the same statistics over HTTP in OpenMetrics format, for Prometheus.\n");
+      return 1;
+    }
+  }
+  if (optind < argc) {
+    port = atoi(argv[optind]);
   }
   if (port <= 0 || port > 65535) {
     fprintf(stderr, "Invalid port\n");
@@ -144,5 +200,14 @@ int main(int argc, char** argv)
 	      l_port, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
   printf("Listening on %s port %s\n", l_host, l_port);
   evconnlistener_set_error_cb(listener, accept_error_cb);
+  if (shm_stats_path != NULL || metrics_addr != NULL) {
+    shm_stats = shm_stats_create(shm_stats_path, SHM_STATS_SERVER, "tcpserver");
+    if (shm_stats == NULL)
+      return 1;
+    shm_stats_ev = event_new(base, -1, EV_PERSIST, publish_shm_stats, NULL);
+    event_add(shm_stats_ev, &shm_stats_interval);
+  }
+  if (metrics_addr != NULL && metrics_start(metrics_addr, shm_stats) != 0)
+    return 1;
   return event_base_dispatch(base);
 }
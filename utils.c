@@ -41,10 +41,10 @@ void timeval_add_us(struct timeval *a, unsigned long int us)
 }
 
 /* Given a [rate], generate an interarrival sample according to a Poisson
-   process and store it in [tv]. */
-void generate_poisson_interarrival(struct timeval* tv, double rate)
+   process, using the random stream [rng], and store it in [tv]. */
+void generate_poisson_interarrival(struct timeval* tv, double rate, struct rng *rng)
 {
-  double u = drand48();
+  double u = rng_double(rng);
   double interarrival = - log(1. - u) / rate;
   tv->tv_sec = (time_t) floor(interarrival);
   tv->tv_usec = lrint(interarrival * 1000000.) % 1000000;
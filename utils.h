@@ -2,6 +2,8 @@
 #include <math.h>
 #include <stdlib.h>
 
+#include "rng.h"
+
 /* Copied from babeld by Juliusz Chroboczek */
 #define DO_NTOHS(_d, _s) \
     do { unsigned short _dd; \
@@ -46,5 +48,5 @@ void timeval_add_ms(struct timeval *a, unsigned int ms);
 void timeval_add_us(struct timeval *a, unsigned long int us);
 
 /* Given a [rate], generate an interarrival sample according to a Poisson
-   process and store it in [tv]. */
-void generate_poisson_interarrival(struct timeval* tv, double rate);
+   process, using the random stream [rng], and store it in [tv]. */
+void generate_poisson_interarrival(struct timeval* tv, double rate, struct rng *rng);